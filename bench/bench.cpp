@@ -0,0 +1,656 @@
+#include <stdlib.h>
+#include <string.h>
+
+#include <algorithm>
+#include <chrono>
+#include <fstream>
+#include <iostream>
+#include <string>
+
+#include <flv_stream_builder.hpp>
+#if defined(__linux__)
+#include <flv_uring_sink.hpp>
+#endif
+
+namespace bench {
+static std::atomic<uint64_t> allocations(0);
+} // namespace bench
+
+// Counts every heap allocation made by the benchmark program.
+void *operator new(size_t size) {
+  bench::allocations++;
+  if (void *p = malloc(size ? size : 1)) {
+    return p;
+  }
+  throw std::bad_alloc();
+}
+
+void operator delete(void *p) noexcept { free(p); }
+
+namespace bench {
+typedef std::chrono::steady_clock steady_clock;
+
+static double seconds_since(steady_clock::time_point start) {
+  return std::chrono::duration<double>(steady_clock::now() - start).count();
+}
+
+// Discards the data, so only the builder is measured.
+class null_sink : public flv::flv_sink {
+public:
+  null_sink() : bytes_(0) {}
+
+  virtual void write(const flv::io_slice *slices, size_t count) override {
+    for (size_t i = 0; i < count; i++) {
+      bytes_ += slices[i].length;
+    }
+  }
+
+  uint64_t bytes() const { return bytes_; }
+
+private:
+  uint64_t bytes_;
+};
+
+// The measurements of one benchmark.
+struct result {
+  std::string name;
+  uint64_t calls;
+  uint64_t tags;
+  uint64_t bytes;
+  uint64_t allocations;
+  double seconds;
+  uint64_t p50_ns;
+  uint64_t p99_ns;
+};
+
+static std::vector<result> results;
+static std::vector<uint64_t> latencies;
+
+static uint64_t percentile(std::vector<uint64_t> &samples, double p) {
+  if (samples.empty()) {
+    return 0;
+  }
+  size_t n = static_cast<size_t>(p * (samples.size() - 1));
+  std::nth_element(samples.begin(), samples.begin() + n, samples.end());
+  return samples[n];
+}
+
+// Runs fn(i) for every call, timing each call. fn returns the bytes it
+// produced; every call produces tags_per_call tags.
+template <class F>
+static void run(const char *name, size_t calls, uint64_t tags_per_call, F fn) {
+  latencies.assign(calls, 0);
+  uint64_t bytes = 0;
+  uint64_t before = allocations;
+  auto start = steady_clock::now();
+  for (size_t i = 0; i < calls; i++) {
+    auto t0 = steady_clock::now();
+    bytes += fn(i);
+    auto t1 = steady_clock::now();
+    latencies[i] = static_cast<uint64_t>(
+        std::chrono::duration_cast<std::chrono::nanoseconds>(t1 - t0).count());
+  }
+  result r;
+  r.seconds = seconds_since(start);
+  r.allocations = allocations - before;
+  r.name = name;
+  r.calls = calls;
+  r.tags = calls * tags_per_call;
+  r.bytes = bytes;
+  r.p50_ns = percentile(latencies, 0.50);
+  r.p99_ns = percentile(latencies, 0.99);
+  results.push_back(r);
+}
+
+static void print_json(std::ostream &os) {
+  os << "{\n  \"benchmarks\": [";
+  for (size_t i = 0; i < results.size(); i++) {
+    const result &r = results[i];
+    double seconds = r.seconds > 0 ? r.seconds : 1e-9;
+    os << (i ? "," : "") << "\n    {"
+       << "\"name\": \"" << r.name << "\", "
+       << "\"calls\": " << r.calls << ", "
+       << "\"tags\": " << r.tags << ", "
+       << "\"bytes\": " << r.bytes << ", "
+       << "\"seconds\": " << r.seconds << ", "
+       << "\"tags_per_second\": " << r.tags / seconds << ", "
+       << "\"mb_per_second\": " << r.bytes / seconds / (1024 * 1024) << ", "
+       << "\"allocations\": " << r.allocations << ", "
+       << "\"allocations_per_call\": "
+       << (r.calls ? (double)r.allocations / r.calls : 0) << ", "
+       << "\"p50_ns\": " << r.p50_ns << ", "
+       << "\"p99_ns\": " << r.p99_ns << "}";
+  }
+  os << "\n  ]\n}" << std::endl;
+}
+
+// A 1080p30 AVC stream of about 4 Mbit/s with a 2 second GOP, and a
+// 128 kbit/s AAC-LC stream (1024 samples per frame at 44.1 kHz).
+struct workload {
+  static const uint32_t GOP = 60;
+  static const uint32_t IDR_SIZE = 120 * 1024;
+  static const uint32_t P_SIZE = 12 * 1024;
+  static const uint32_t AAC_SIZE = 372;
+
+  workload() {
+    static const uint8_t sps[] = {0x67, 0x64, 0x00, 0x28, 0xac, 0xd9, 0x40,
+                                  0x78, 0x02, 0x27, 0xe5, 0x84, 0x00, 0x00,
+                                  0x03, 0x00, 0x04, 0x00, 0x00, 0x03, 0x00,
+                                  0xf0, 0x3c, 0x60, 0xc6, 0x58};
+    static const uint8_t pps[] = {0x68, 0xeb, 0xe3, 0xcb, 0x22, 0xc0};
+    avcc_idr = avcc_nalu(0x65, IDR_SIZE);
+    avcc_p = avcc_nalu(0x41, P_SIZE);
+
+    // Annex-B access units, the IDR one with the parameter sets
+    annexb_idr = start_code(sps, sizeof(sps));
+    std::vector<uint8_t> nalu = start_code(pps, sizeof(pps));
+    annexb_idr.insert(annexb_idr.end(), nalu.begin(), nalu.end());
+    annexb_idr.insert(annexb_idr.end(), avcc_idr.begin(), avcc_idr.end());
+    annexb_idr[annexb_idr.size() - avcc_idr.size() + 2] = 0;
+    annexb_idr[annexb_idr.size() - avcc_idr.size() + 3] = 1;
+    annexb_p = avcc_p;
+    annexb_p[2] = 0;
+    annexb_p[3] = 1;
+
+    flv::avc::nalu_view sps_view = {sps, sizeof(sps)};
+    flv::avc::nalu_view pps_view = {pps, sizeof(pps)};
+    flv::avc::build_decoder_config(sps_view, pps_view, avc_config);
+
+    // The VIDEODATA and AUDIODATA of the plain append methods
+    video_idr = videodata(0x17, avcc_idr);
+    video_p = videodata(0x27, avcc_p);
+    audio_raw.assign(AAC_SIZE, 0x21);
+    audio_data.assign(2, 0xaf);
+    audio_data[1] = 0x01;
+    audio_data.insert(audio_data.end(), audio_raw.begin(), audio_raw.end());
+
+    // The ADTS framed AAC-LC frame (44.1 kHz, stereo)
+    uint32_t frame_length = flv::aac::ADTS_HEADER_SIZE + AAC_SIZE;
+    const uint8_t header[] = {0xff,
+                              0xf1,
+                              0x50,
+                              static_cast<uint8_t>(0x80 | frame_length >> 11),
+                              static_cast<uint8_t>(frame_length >> 3),
+                              static_cast<uint8_t>(frame_length << 5 | 0x1f),
+                              0xfc};
+    adts.assign(header, header + sizeof(header));
+    adts.insert(adts.end(), audio_raw.begin(), audio_raw.end());
+  }
+
+  static std::vector<uint8_t> avcc_nalu(uint8_t header, uint32_t size) {
+    std::vector<uint8_t> v(4 + size, 0x5a);
+    flv::store_be32(v.data(), size);
+    v[4] = header;
+    return v;
+  }
+
+  static std::vector<uint8_t> start_code(const uint8_t *data, size_t length) {
+    std::vector<uint8_t> v(4, 0);
+    v[3] = 1;
+    v.insert(v.end(), data, data + length);
+    return v;
+  }
+
+  static std::vector<uint8_t> videodata(uint8_t flags,
+                                        const std::vector<uint8_t> &nalu) {
+    std::vector<uint8_t> v(5, 0);
+    v[0] = flags;
+    v[1] = 0x01;
+    v.insert(v.end(), nalu.begin(), nalu.end());
+    return v;
+  }
+
+  static bool is_key(size_t i) { return i % GOP == 0; }
+
+  static uint32_t video_ts(size_t i) {
+    return static_cast<uint32_t>(i * 1000 / 30);
+  }
+
+  static uint32_t audio_ts(size_t i) {
+    return static_cast<uint32_t>(i * 1024 * 1000 / 44100);
+  }
+
+  const std::vector<uint8_t> &avcc(size_t i) const {
+    return is_key(i) ? avcc_idr : avcc_p;
+  }
+
+  std::vector<uint8_t> avcc_idr;
+  std::vector<uint8_t> avcc_p;
+  std::vector<uint8_t> annexb_idr;
+  std::vector<uint8_t> annexb_p;
+  std::vector<uint8_t> avc_config;
+  std::vector<uint8_t> video_idr;
+  std::vector<uint8_t> video_p;
+  std::vector<uint8_t> audio_raw;
+  std::vector<uint8_t> audio_data;
+  std::vector<uint8_t> adts;
+};
+
+static const uint8_t AAC_CONFIG[] = {0x12, 0x10};
+
+static flv::amf::amf_array_ref create_meta() {
+  return flv::amf::amf_array::create()
+      ->with_item("duration", (double)0)
+      ->with_item("width", (double)1920)
+      ->with_item("height", (double)1080)
+      ->with_item("videodatarate", (double)520)
+      ->with_item("framerate", (double)25)
+      ->with_item("videocodecid", (double)7)
+      ->with_item("audiosamplerate", (double)44100)
+      ->with_item("audiosamplesize", (double)16)
+      ->with_item("stereo", true)
+      ->with_item("audiocodecid", (double)10)
+      ->with_item("encoder", "flv-stream-builder")
+      ->with_item("filesize", (double)0);
+}
+
+static void build_meta_tree(flv::amf::amf_tree &tree) {
+  tree.begin_array()
+      .with_property("duration", (double)0)
+      .with_property("width", (double)1920)
+      .with_property("height", (double)1080)
+      .with_property("videodatarate", (double)520)
+      .with_property("framerate", (double)25)
+      .with_property("videocodecid", (double)7)
+      .with_property("audiosamplerate", (double)44100)
+      .with_property("audiosamplesize", (double)16)
+      .with_property("stereo", true)
+      .with_property("audiocodecid", (double)10)
+      .with_property("encoder", "flv-stream-builder")
+      .with_property("filesize", (double)0)
+      .end();
+}
+
+FLV_META_KEY(duration_key, "duration", NumberType);
+FLV_META_KEY(width_key, "width", NumberType);
+FLV_META_KEY(height_key, "height", NumberType);
+FLV_META_KEY(videodatarate_key, "videodatarate", NumberType);
+FLV_META_KEY(framerate_key, "framerate", NumberType);
+FLV_META_KEY(videocodecid_key, "videocodecid", NumberType);
+FLV_META_KEY(audiosamplerate_key, "audiosamplerate", NumberType);
+FLV_META_KEY(audiosamplesize_key, "audiosamplesize", NumberType);
+FLV_META_KEY(stereo_key, "stereo", BooleanType);
+FLV_META_KEY(audiocodecid_key, "audiocodecid", NumberType);
+FLV_META_KEY(filesize_key, "filesize", NumberType);
+typedef flv::meta_template<duration_key, width_key, height_key,
+                           videodatarate_key, framerate_key, videocodecid_key,
+                           audiosamplerate_key, audiosamplesize_key,
+                           stereo_key, audiocodecid_key, filesize_key>
+    meta_schema;
+
+static void append_methods(const workload &w, size_t frames) {
+  const flv::audio_data_sound_rate_t rate =
+      flv::audio_data_sound_rate_t::R44KHZ;
+  const flv::audio_data_sound_size_t size =
+      flv::audio_data_sound_size_t::S16BIT;
+  const flv::audio_data_sound_type_t type =
+      flv::audio_data_sound_type_t::STEREO;
+
+  // Each benchmark gets a fresh builder over a sink that discards the data
+#define BENCH_APPEND(name, tags_per_call, body)                                \
+  do {                                                                         \
+    null_sink sink;                                                            \
+    flv::flv_stream_builder builder(sink);                                     \
+    builder.init_stream_header(true, true);                                    \
+    run(name, frames, tags_per_call, [&](size_t i) -> uint64_t {               \
+      (void)i;                                                                 \
+      uint64_t start = sink.bytes();                                           \
+      body;                                                                    \
+      return sink.bytes() - start;                                             \
+    });                                                                        \
+  } while (0)
+
+  BENCH_APPEND("append_video_tag", 1, {
+    const std::vector<uint8_t> &v =
+        workload::is_key(i) ? w.video_idr : w.video_p;
+    builder.append_video_tag(workload::video_ts(i), v.data(),
+                             static_cast<uint32_t>(v.size()));
+  });
+  BENCH_APPEND("append_video_tag_with_avc_decoder_config", 1, {
+    builder.append_video_tag_with_avc_decoder_config(
+        workload::video_ts(i), w.avc_config.data(),
+        static_cast<uint32_t>(w.avc_config.size()));
+  });
+  BENCH_APPEND("append_video_tag_with_avc_nalu_data", 1, {
+    const std::vector<uint8_t> &v = w.avcc(i);
+    builder.append_video_tag_with_avc_nalu_data(
+        workload::video_ts(i), v.data(), static_cast<uint32_t>(v.size()), 0,
+        workload::is_key(i));
+  });
+  BENCH_APPEND("append_video_tag_with_annexb_data", 1, {
+    const std::vector<uint8_t> &v =
+        workload::is_key(i) ? w.annexb_idr : w.annexb_p;
+    builder.append_video_tag_with_annexb_data(
+        workload::video_ts(i), v.data(), static_cast<uint32_t>(v.size()));
+  });
+  BENCH_APPEND("append_video_tag_with_hevc_nalu_data", 1, {
+    const std::vector<uint8_t> &v = w.avcc(i);
+    builder.append_video_tag_with_hevc_nalu_data(
+        workload::video_ts(i), v.data(), static_cast<uint32_t>(v.size()), 0,
+        workload::is_key(i));
+  });
+  BENCH_APPEND("append_video_tag_with_av1_obu_data", 1, {
+    const std::vector<uint8_t> &v =
+        workload::is_key(i) ? w.video_idr : w.video_p;
+    builder.append_video_tag_with_av1_obu_data(
+        workload::video_ts(i), v.data(), static_cast<uint32_t>(v.size()),
+        workload::is_key(i));
+  });
+  BENCH_APPEND("append_audio_tag", 1, {
+    builder.append_audio_tag(workload::audio_ts(i), w.audio_data.data(),
+                             static_cast<uint32_t>(w.audio_data.size()));
+  });
+  BENCH_APPEND("append_audio_tag_with_aac_specific_config", 1, {
+    builder.append_audio_tag_with_aac_specific_config(
+        workload::audio_ts(i), rate, size, type, AAC_CONFIG,
+        sizeof(AAC_CONFIG));
+  });
+  BENCH_APPEND("append_audio_tag_with_aac_frame_data", 1, {
+    builder.append_audio_tag_with_aac_frame_data(
+        workload::audio_ts(i), rate, size, type, w.audio_raw.data(),
+        static_cast<uint32_t>(w.audio_raw.size()));
+  });
+
+  BENCH_APPEND("append_audio_tag_with_adts_data", 1, {
+    builder.append_audio_tag_with_adts_data(
+        workload::audio_ts(i), w.adts.data(),
+        static_cast<uint32_t>(w.adts.size()));
+  });
+
+  flv::amf::amf_array_ref meta = create_meta();
+  BENCH_APPEND("append_meta_tag(amf_array)", 1,
+               { builder.append_meta_tag(meta); });
+  flv::amf::amf_tree tree;
+  BENCH_APPEND("append_meta_tag(amf_tree)", 1, {
+    tree.clear();
+    build_meta_tree(tree);
+    builder.append_meta_tag(tree);
+  });
+  meta_schema schema;
+  BENCH_APPEND("append_meta_tag(meta_template)", 1, {
+    schema.set<width_key>(1920.0).set<height_key>(1080.0);
+    builder.append_meta_tag(schema);
+  });
+
+  // Interleaved video and audio frames, one call per frame and in batches
+  std::vector<flv::frame_desc> descs(frames);
+  for (size_t i = 0; i < frames; i++) {
+    flv::frame_desc &d = descs[i];
+    d = flv::frame_desc();
+    if (i % 2) {
+      d.track = flv::track_type_t::Audio;
+      d.dts = d.pts = workload::audio_ts(i / 2);
+      d.data = w.audio_raw.data();
+      d.length = static_cast<uint32_t>(w.audio_raw.size());
+    } else {
+      const std::vector<uint8_t> &v = w.avcc(i / 2);
+      d.track = flv::track_type_t::Video;
+      d.dts = workload::video_ts(i / 2);
+      d.pts = d.dts + 66;
+      d.keyframe = workload::is_key(i / 2);
+      d.data = v.data();
+      d.length = static_cast<uint32_t>(v.size());
+    }
+  }
+  BENCH_APPEND("append_frame", 1, { builder.append_frame(descs[i]); });
+  const size_t batch = 32;
+  size_t batches = frames / batch;
+  {
+    null_sink sink;
+    flv::flv_stream_builder builder(sink);
+    builder.init_stream_header(true, true);
+    run("append_frames(32)", batches, batch, [&](size_t i) -> uint64_t {
+      uint64_t start = sink.bytes();
+      builder.append_frames(descs.data() + i * batch, batch);
+      return sink.bytes() - start;
+    });
+  }
+#undef BENCH_APPEND
+}
+
+static void amf_codec(size_t rounds) {
+  flv::amf::amf_array_ref meta = create_meta();
+  std::vector<uint8_t> buf;
+  buf.reserve(1024);
+  run("amf_array serialize", rounds, 0, [&](size_t) -> uint64_t {
+    buf.clear();
+    meta->serialize(buf);
+    return buf.size();
+  });
+  run("amf_array build+serialize", rounds, 0, [&](size_t) -> uint64_t {
+    buf.clear();
+    create_meta()->serialize(buf);
+    return buf.size();
+  });
+
+  flv::amf::amf_tree tree;
+  run("amf_tree build+serialize", rounds, 0, [&](size_t) -> uint64_t {
+    buf.clear();
+    tree.clear();
+    build_meta_tree(tree);
+    tree.serialize(buf);
+    return buf.size();
+  });
+
+  std::vector<uint8_t> data(buf);
+  run("amf_reader", rounds, 0, [&](size_t) -> uint64_t {
+    flv::amf::amf_reader reader(data.data(), data.size());
+    flv::amf::amf_item item;
+    while (reader.next(item) == flv::amf::amf_read_result::Ok) {
+    }
+    return data.size();
+  });
+  run("amf_array deserialize", rounds, 0, [&](size_t) -> uint64_t {
+    auto parsed = flv::amf::amf_array::create();
+    parsed->deserialize(data);
+    return data.size();
+  });
+  run("amf_tree deserialize", rounds, 0, [&](size_t) -> uint64_t {
+    tree.deserialize(data);
+    return data.size();
+  });
+
+  // A keyframe table of 20000 entries, one Number object per item against
+  // one array of doubles
+  std::vector<double> times;
+  for (int i = 0; i < 20000; i++) {
+    times.push_back(i * 2.0);
+  }
+  auto generic = flv::amf::amf_strict_array::create();
+  for (double t : times) {
+    generic->with_item(t);
+  }
+  auto numbers = flv::amf::amf_number_array::create(times.data(), times.size());
+  size_t table_rounds = std::max<size_t>(rounds / 1000, 1);
+  buf.reserve(numbers->serialized_size());
+  run("amf_strict_array serialize (20000 numbers)", table_rounds, 0,
+      [&](size_t) -> uint64_t {
+        buf.clear();
+        generic->serialize(buf);
+        return buf.size();
+      });
+  run("amf_number_array serialize (20000 numbers)", table_rounds, 0,
+      [&](size_t) -> uint64_t {
+        buf.clear();
+        numbers->serialize(buf);
+        return buf.size();
+      });
+}
+
+static void adts_parse(const workload &w, size_t rounds) {
+  // About 23 seconds of audio per call
+  std::vector<uint8_t> stream;
+  for (int i = 0; i < 1000; i++) {
+    stream.insert(stream.end(), w.adts.begin(), w.adts.end());
+  }
+  run("adts parse", rounds, 0, [&](size_t) -> uint64_t {
+    const uint8_t *cursor = stream.data();
+    const uint8_t *end = stream.data() + stream.size();
+    flv::aac::adts_frame frame;
+    uint64_t payload = 0;
+    while (flv::aac::next_adts_frame(cursor, end, frame)) {
+      payload += frame.length;
+    }
+    return payload ? stream.size() : 0;
+  });
+}
+
+static void stream_reader(const workload &w, size_t frames) {
+  std::vector<uint8_t> stream;
+  flv::memory_sink sink(stream);
+  flv::flv_stream_builder builder(sink);
+  builder.init_stream_header(true, true);
+  for (size_t i = 0; i < frames; i++) {
+    const std::vector<uint8_t> &v = w.avcc(i);
+    builder.append_video_tag_with_avc_nalu_data(
+        workload::video_ts(i), v.data(), static_cast<uint32_t>(v.size()), 0,
+        workload::is_key(i));
+    builder.append_audio_tag_with_aac_frame_data(
+        workload::audio_ts(i), flv::audio_data_sound_rate_t::R44KHZ,
+        flv::audio_data_sound_size_t::S16BIT,
+        flv::audio_data_sound_type_t::STEREO, w.audio_raw.data(),
+        static_cast<uint32_t>(w.audio_raw.size()));
+  }
+
+  // One call is one scan of the whole stream
+  run("flv_stream_reader scan", 10, frames * 2, [&](size_t) -> uint64_t {
+    flv::flv_stream_reader reader(stream.data(), stream.size());
+    uint64_t payload = 0;
+    for (auto &tag : reader) {
+      payload += tag.payload_length;
+    }
+    return payload ? stream.size() : 0;
+  });
+}
+
+// Chunks an interleaved A/V stream for RTMP; one call is one video and one
+// audio frame, the bytes are the chunk stream bytes.
+static void rtmp_chunking(const workload &w, size_t frames) {
+  static const uint32_t chunk_sizes[] = {128, 4096, 65536};
+  static const char *names[] = {"rtmp_chunk_sink (chunk size 128)",
+                                "rtmp_chunk_sink (chunk size 4096)",
+                                "rtmp_chunk_sink (chunk size 65536)"};
+  for (int k = 0; k < 3; k++) {
+    null_sink sink;
+    flv::rtmp_chunk_sink rtmp(sink, chunk_sizes[k]);
+    flv::flv_stream_builder builder(rtmp);
+    builder.init_stream_header(true, true)
+        .append_video_tag_with_avc_decoder_config(
+            0, w.avc_config.data(), static_cast<uint32_t>(w.avc_config.size()));
+    run(names[k], frames, 2, [&](size_t i) -> uint64_t {
+      uint64_t start = sink.bytes();
+      const std::vector<uint8_t> &v = w.avcc(i);
+      builder.append_video_tag_with_avc_nalu_data(
+          workload::video_ts(i), v.data(), static_cast<uint32_t>(v.size()), 0,
+          workload::is_key(i));
+      builder.append_audio_tag_with_aac_frame_data(
+          workload::audio_ts(i), flv::audio_data_sound_rate_t::R44KHZ,
+          flv::audio_data_sound_size_t::S16BIT,
+          flv::audio_data_sound_type_t::STEREO, w.audio_raw.data(),
+          static_cast<uint32_t>(w.audio_raw.size()));
+      return sink.bytes() - start;
+    });
+  }
+}
+
+#if defined(__linux__)
+// Records several streams to files at once; one call appends one video and
+// one audio frame to every stream, the last call also flushes them.
+static void record_files(const workload &w, size_t frames) {
+  const size_t streams = 8;
+  const char *tmp = getenv("TMPDIR");
+  std::string dir = tmp && *tmp ? tmp : "/tmp";
+  const char *names[] = {"record 8 streams (ofstream)",
+                         "record 8 streams (fd_sink)",
+                         "record 8 streams (uring_sink)",
+                         "record 8 streams (uring_sink pwrite fallback)"};
+  for (int kind = 0; kind < 4; kind++) {
+    std::vector<std::string> paths;
+    std::vector<int> fds;
+    std::vector<std::unique_ptr<std::ofstream>> files;
+    std::vector<std::unique_ptr<flv::flv_sink>> sinks;
+    std::vector<std::unique_ptr<flv::flv_stream_builder>> builders;
+    std::unique_ptr<flv::uring_ring> ring;
+    if (kind >= 2) {
+      ring.reset(new flv::uring_ring(streams * 2, 256 * 1024, kind == 2));
+    }
+    for (size_t i = 0; i < streams; i++) {
+      paths.push_back(dir + "/flv-builder-bench-" + std::to_string(i) +
+                      ".flv");
+      if (kind == 0) {
+        files.emplace_back(new std::ofstream(
+            paths[i].c_str(), std::ios_base::binary | std::ios_base::trunc));
+        builders.emplace_back(new flv::flv_stream_builder(*files.back()));
+        continue;
+      }
+      fds.push_back(::open(paths[i].c_str(), O_CREAT | O_TRUNC | O_WRONLY,
+                           0644));
+      if (kind == 1) {
+        sinks.emplace_back(new flv::fd_sink(fds.back()));
+      } else {
+        sinks.emplace_back(new flv::uring_sink(*ring, fds.back()));
+      }
+      builders.emplace_back(new flv::flv_stream_builder(*sinks.back()));
+    }
+    for (auto &builder : builders) {
+      builder->init_stream_header(true, true);
+    }
+
+    run(names[kind], frames, streams * 2, [&](size_t i) -> uint64_t {
+      const std::vector<uint8_t> &v = w.avcc(i);
+      for (auto &builder : builders) {
+        builder->append_video_tag_with_avc_nalu_data(
+            workload::video_ts(i), v.data(), static_cast<uint32_t>(v.size()),
+            0, workload::is_key(i));
+        builder->append_audio_tag_with_aac_frame_data(
+            workload::audio_ts(i), flv::audio_data_sound_rate_t::R44KHZ,
+            flv::audio_data_sound_size_t::S16BIT,
+            flv::audio_data_sound_type_t::STEREO, w.audio_raw.data(),
+            static_cast<uint32_t>(w.audio_raw.size()));
+        if (i + 1 == frames) {
+          builder->flush();
+        }
+      }
+      return streams * (v.size() + w.audio_raw.size());
+    });
+
+    builders.clear();
+    sinks.clear();
+    files.clear();
+    ring.reset();
+    for (size_t i = 0; i < streams; i++) {
+      if (kind) {
+        ::close(fds[i]);
+      }
+      ::unlink(paths[i].c_str());
+    }
+  }
+}
+#endif
+} // namespace bench
+
+int main(int argc, char *argv[]) {
+  // flv-builder-bench [frames]
+  size_t frames = 20000;
+  if (argc > 1) {
+    frames = static_cast<size_t>(strtoul(argv[1], nullptr, 10));
+  }
+  if (!frames) {
+    std::cerr << "usage: flv-builder-bench [frames]" << std::endl;
+    return 1;
+  }
+
+  bench::latencies.reserve(frames * 10);
+  bench::results.reserve(32);
+  bench::workload w;
+  bench::append_methods(w, frames);
+  bench::amf_codec(frames * 10);
+  bench::adts_parse(w, std::max<size_t>(frames / 100, 1));
+  bench::stream_reader(w, std::min<size_t>(frames, 5000));
+  bench::rtmp_chunking(w, frames);
+#if defined(__linux__)
+  bench::record_files(w, std::min<size_t>(frames, 1800));
+#endif
+  bench::print_json(std::cout);
+  return 0;
+}
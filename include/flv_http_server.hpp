@@ -0,0 +1,922 @@
+/*
+ * This CPP header-only file implements an HTTP-FLV server for Linux. Live
+ * streams (flv_live_stream) are served over HTTP/1.1 chunked transfer to many
+ * concurrent clients by one non-blocking epoll loop per core. Every tag is
+ * serialized once by the stream and the same shared buffer is handed to all
+ * the sockets with gather writes, never copied per client.
+ *
+ * https://github.com/tishion
+ *
+ */
+
+#pragma once
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <stdio.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+#include <time.h>
+
+#include "flv_stream_builder.hpp"
+
+namespace flv {
+
+/// <summary>
+/// Represents the counters of a http_flv_server.
+/// </summary>
+struct http_server_stats {
+  /// <summary>
+  /// The count of connections accepted.
+  /// </summary>
+  uint64_t accepted;
+
+  /// <summary>
+  /// The count of connections open.
+  /// </summary>
+  uint64_t connections;
+
+  /// <summary>
+  /// The count of requests answered with an error status.
+  /// </summary>
+  uint64_t rejected;
+
+  /// <summary>
+  /// The count of bytes sent, HTTP framing included.
+  /// </summary>
+  uint64_t bytes_sent;
+
+  /// <summary>
+  /// The count of headers and tags sent.
+  /// </summary>
+  uint64_t tags_sent;
+
+  /// <summary>
+  /// The count of tags skipped for clients that fell behind the stream.
+  /// </summary>
+  uint64_t skipped_tags;
+
+  /// <summary>
+  /// The CPU time used by the event loop threads, in nanoseconds.
+  /// </summary>
+  uint64_t cpu_ns;
+};
+
+/// <summary>
+/// Represents an HTTP-FLV server. Each live stream is registered under a
+/// path; a GET of the path gets a "200 OK" chunked response carrying the
+/// stream, starting with the stream prelude and the current GOP, one chunk
+/// per header or tag. Every event loop thread has its own SO_REUSEPORT
+/// listening socket, so the kernel spreads the connections over the loops,
+/// and a connection stays on its loop for its whole life. The stream wakes
+/// the loops up after every published tag. A client that falls behind the
+/// stream cache resumes at the latest keyframe.
+/// </summary>
+class http_flv_server {
+public:
+  /// <summary>
+  /// The maximum size of a request head.
+  /// </summary>
+  static const size_t MAX_REQUEST_SIZE = 8192;
+
+  /// <summary>
+  /// The maximum count of tags per gather write.
+  /// </summary>
+  static const size_t MAX_BATCH = 64;
+
+  /// <summary>
+  /// Constructs an instance of the server.
+  /// </summary>
+  /// <param name="loops">
+  /// The count of event loop threads, 0 for one per core.
+  /// </param>
+  explicit http_flv_server(size_t loops = 0)
+      : loop_count_(loops ? loops
+                          : std::max(std::thread::hardware_concurrency(), 1u)),
+        port_(0), wakeup_(std::make_shared<wakeup_t>()) {}
+
+  /// <summary>
+  /// Destructs the instance, stopping the server.
+  /// </summary>
+  ~http_flv_server() { stop(); }
+
+  /// <summary>
+  /// Registers a live stream under a path. It must be called before
+  /// start(), and the stream must outlive the server. The stream publish
+  /// hook is taken by the server.
+  /// </summary>
+  /// <param name="path">The request path, "/live.flv" for example.</param>
+  /// <param name="stream">The live stream.</param>
+  /// <returns>The self-reference.</returns>
+  http_flv_server &add_stream(const std::string &path,
+                              flv_live_stream &stream) {
+    if (!loops_.empty()) {
+      throw std::logic_error("the server is started");
+    }
+    streams_[path] = &stream;
+    std::shared_ptr<wakeup_t> wakeup = wakeup_;
+    stream.set_publish_hook([wakeup]() { wakeup->notify(); });
+    return *this;
+  }
+
+  /// <summary>
+  /// Starts listening and the event loop threads. A stopped server cannot be
+  /// started again.
+  /// </summary>
+  /// <param name="port">The TCP port, 0 for an ephemeral port.</param>
+  /// <param name="address">The IPv4 address to listen on.</param>
+  /// <returns>The port listened on.</returns>
+  /// <exception cref="std::system_error">If a socket cannot be set
+  /// up.</exception>
+  uint16_t start(uint16_t port = 0, const char *address = "0.0.0.0") {
+    if (!loops_.empty() || port_) {
+      throw std::logic_error("the server is started");
+    }
+    sockaddr_in addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(port);
+    if (::inet_pton(AF_INET, address, &addr.sin_addr) != 1) {
+      throw std::system_error(EINVAL, std::generic_category(), address);
+    }
+
+    try {
+      for (size_t i = 0; i < loop_count_; i++) {
+        loops_.emplace_back(new event_loop(*this));
+        event_loop &loop = *loops_.back();
+        loop.open(addr);
+        if (!i) {
+          // The other loops share the port picked for the first one
+          socklen_t length = sizeof(addr);
+          ::getsockname(loop.listen_fd_, (sockaddr *)&addr, &length);
+          port_ = ntohs(addr.sin_port);
+        }
+        wakeup_->add(loop.event_fd_, &loop.signaled_);
+      }
+    } catch (...) {
+      wakeup_->close();
+      loops_.clear();
+      throw;
+    }
+    for (auto &loop : loops_) {
+      loop->thread_ = std::thread(&event_loop::run, loop.get());
+    }
+    return port_;
+  }
+
+  /// <summary>
+  /// Stops the event loop threads and closes all the connections.
+  /// </summary>
+  void stop() {
+    if (loops_.empty()) {
+      return;
+    }
+    for (auto &loop : loops_) {
+      loop->stopping_.store(true, std::memory_order_relaxed);
+    }
+    wakeup_->notify();
+    for (auto &loop : loops_) {
+      if (loop->thread_.joinable()) {
+        loop->thread_.join();
+      }
+    }
+    wakeup_->close();
+    loops_.clear();
+  }
+
+  /// <summary>
+  /// Gets the port listened on.
+  /// </summary>
+  /// <returns>The port.</returns>
+  uint16_t port() const { return port_; }
+
+  /// <summary>
+  /// Gets the count of event loop threads.
+  /// </summary>
+  /// <returns>The count of event loop threads.</returns>
+  size_t loops() const { return loop_count_; }
+
+  /// <summary>
+  /// Gets the counters of the server, summed over the event loops.
+  /// </summary>
+  /// <returns>The counters.</returns>
+  http_server_stats stats() const {
+    http_server_stats stats;
+    memset(&stats, 0, sizeof(stats));
+    for (auto &loop : loops_) {
+      stats.accepted += loop->accepted_.load(std::memory_order_relaxed);
+      stats.connections += loop->connections_.size_relaxed();
+      stats.rejected += loop->rejected_.load(std::memory_order_relaxed);
+      stats.bytes_sent += loop->bytes_sent_.load(std::memory_order_relaxed);
+      stats.tags_sent += loop->tags_sent_.load(std::memory_order_relaxed);
+      stats.skipped_tags += loop->skipped_.load(std::memory_order_relaxed);
+      stats.cpu_ns += loop->cpu_ns_.load(std::memory_order_relaxed);
+    }
+    return stats;
+  }
+
+private:
+  DISALLOW_COPY_AND_ASSIGN(http_flv_server);
+
+  /// <summary>
+  /// Represents the event fds of the loops, shared with the stream publish
+  /// hooks, which may outlive the server.
+  /// </summary>
+  class wakeup_t {
+  public:
+    wakeup_t() : alive_(true) {}
+
+    ~wakeup_t() { close(); }
+
+    void add(int fd, std::atomic<bool> *signaled) {
+      std::lock_guard<std::mutex> lock(lock_);
+      fds_.push_back(fd);
+      signaled_.push_back(signaled);
+    }
+
+    /// <summary>
+    /// Wakes every loop up, once until the loop handles the wake up.
+    /// </summary>
+    void notify() {
+      std::lock_guard<std::mutex> lock(lock_);
+      if (!alive_) {
+        return;
+      }
+      for (size_t i = 0; i < fds_.size(); i++) {
+        if (!signaled_[i]->exchange(true, std::memory_order_acq_rel)) {
+          uint64_t one = 1;
+          ssize_t r = ::write(fds_[i], &one, sizeof(one));
+          (void)r;
+        }
+      }
+    }
+
+    /// <summary>
+    /// Forgets the event fds, the loops close them.
+    /// </summary>
+    void close() {
+      std::lock_guard<std::mutex> lock(lock_);
+      alive_ = false;
+      fds_.clear();
+      signaled_.clear();
+    }
+
+  private:
+    DISALLOW_COPY_AND_ASSIGN(wakeup_t);
+
+    /// <summary>
+    /// The lock, notify() never races with the loops going away.
+    /// </summary>
+    std::mutex lock_;
+
+    /// <summary>
+    /// Indicates whether the loops are running.
+    /// </summary>
+    bool alive_;
+
+    /// <summary>
+    /// The event fds of the loops.
+    /// </summary>
+    std::vector<int> fds_;
+
+    /// <summary>
+    /// The wake up pending flags of the loops.
+    /// </summary>
+    std::vector<std::atomic<bool> *> signaled_;
+  };
+
+  /// <summary>
+  /// Represents a chunk of the response, one header or tag.
+  /// </summary>
+  struct chunk_t {
+    /// <summary>
+    /// The serialized header or tag.
+    /// </summary>
+    tag_buffer_ref buf;
+
+    /// <summary>
+    /// The chunk size line.
+    /// </summary>
+    char line[12];
+
+    /// <summary>
+    /// The length of the chunk size line.
+    /// </summary>
+    uint8_t line_length;
+  };
+
+  /// <summary>
+  /// Represents a client connection.
+  /// </summary>
+  struct connection_t {
+    /// <summary>
+    /// The socket.
+    /// </summary>
+    int fd;
+
+    /// <summary>
+    /// The position in the connection list of the loop.
+    /// </summary>
+    size_t index;
+
+    /// <summary>
+    /// The request head received so far, until the stream starts.
+    /// </summary>
+    std::string request;
+
+    /// <summary>
+    /// The response head (or the whole error response) not sent yet.
+    /// </summary>
+    std::string response;
+
+    /// <summary>
+    /// The count of bytes of the response head sent.
+    /// </summary>
+    size_t response_sent;
+
+    /// <summary>
+    /// Indicates whether the connection closes once the response is sent.
+    /// </summary>
+    bool closing;
+
+    /// <summary>
+    /// Indicates whether the socket is full and EPOLLOUT is armed.
+    /// </summary>
+    bool blocked;
+
+    /// <summary>
+    /// Indicates whether the connection was closed, its memory being freed
+    /// after the current batch of events.
+    /// </summary>
+    bool closed;
+
+    /// <summary>
+    /// The subscriber of the stream, null until the request is accepted.
+    /// </summary>
+    std::unique_ptr<flv_live_stream::subscriber> subscriber;
+
+    /// <summary>
+    /// The chunks read from the stream and not sent yet, from head.
+    /// </summary>
+    std::vector<chunk_t> chunks;
+
+    /// <summary>
+    /// The first chunk not completely sent.
+    /// </summary>
+    size_t head;
+
+    /// <summary>
+    /// The count of bytes of the head chunk sent.
+    /// </summary>
+    size_t offset;
+
+    /// <summary>
+    /// The count of tags the subscriber had skipped when last read.
+    /// </summary>
+    uint64_t skipped;
+  };
+
+  /// <summary>
+  /// Represents the list of connections of a loop, whose size other threads
+  /// may read.
+  /// </summary>
+  class connection_list {
+  public:
+    connection_list() : size_(0) {}
+
+    void add(connection_t *c) {
+      c->index = items_.size();
+      items_.push_back(c);
+      size_.store(items_.size(), std::memory_order_relaxed);
+    }
+
+    void remove(connection_t *c) {
+      items_[c->index] = items_.back();
+      items_[c->index]->index = c->index;
+      items_.pop_back();
+      size_.store(items_.size(), std::memory_order_relaxed);
+    }
+
+    size_t size() const { return items_.size(); }
+
+    size_t size_relaxed() const {
+      return size_.load(std::memory_order_relaxed);
+    }
+
+    connection_t *operator[](size_t i) const { return items_[i]; }
+
+  private:
+    std::vector<connection_t *> items_;
+    std::atomic<size_t> size_;
+  };
+
+  /// <summary>
+  /// Represents one event loop thread with its listening socket, its epoll
+  /// instance and its connections.
+  /// </summary>
+  class event_loop {
+  public:
+    explicit event_loop(http_flv_server &server)
+        : server_(server), epoll_fd_(-1), listen_fd_(-1), event_fd_(-1),
+          signaled_(false), stopping_(false), accepted_(0), rejected_(0),
+          bytes_sent_(0), tags_sent_(0), skipped_(0), cpu_ns_(0) {}
+
+    ~event_loop() {
+      while (connections_.size()) {
+        close_connection(connections_[0]);
+      }
+      free_closed();
+      for (int fd : {listen_fd_, event_fd_, epoll_fd_}) {
+        if (fd >= 0) {
+          ::close(fd);
+        }
+      }
+    }
+
+    /// <summary>
+    /// Creates the epoll instance, the event fd and the listening socket.
+    /// </summary>
+    /// <param name="addr">The address to listen on.</param>
+    void open(const sockaddr_in &addr) {
+      epoll_fd_ = ::epoll_create1(EPOLL_CLOEXEC);
+      check(epoll_fd_, "epoll_create1");
+      event_fd_ = ::eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+      check(event_fd_, "eventfd");
+      listen_fd_ =
+          ::socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+      check(listen_fd_, "socket");
+      int on = 1;
+      check(::setsockopt(listen_fd_, SOL_SOCKET, SO_REUSEADDR, &on,
+                         sizeof(on)),
+            "SO_REUSEADDR");
+      check(::setsockopt(listen_fd_, SOL_SOCKET, SO_REUSEPORT, &on,
+                         sizeof(on)),
+            "SO_REUSEPORT");
+      check(::bind(listen_fd_, (const sockaddr *)&addr, sizeof(addr)),
+            "bind");
+      check(::listen(listen_fd_, SOMAXCONN), "listen");
+
+      epoll_event ev;
+      ev.events = EPOLLIN;
+      ev.data.ptr = &listen_fd_;
+      check(::epoll_ctl(epoll_fd_, EPOLL_CTL_ADD, listen_fd_, &ev),
+            "epoll_ctl");
+      ev.data.ptr = &event_fd_;
+      check(::epoll_ctl(epoll_fd_, EPOLL_CTL_ADD, event_fd_, &ev), "epoll_ctl");
+    }
+
+    /// <summary>
+    /// The loop thread procedure.
+    /// </summary>
+    void run() {
+      epoll_event events[64];
+      while (!stopping_.load(std::memory_order_relaxed)) {
+        int n = ::epoll_wait(epoll_fd_, events, 64, 1000);
+        for (int i = 0; i < n; i++) {
+          void *ptr = events[i].data.ptr;
+          if (ptr == &listen_fd_) {
+            accept_connections();
+          } else if (ptr == &event_fd_) {
+            uint64_t value;
+            ssize_t r = ::read(event_fd_, &value, sizeof(value));
+            (void)r;
+            signaled_.store(false, std::memory_order_release);
+            pump_all();
+          } else {
+            handle(static_cast<connection_t *>(ptr), events[i].events);
+          }
+        }
+        free_closed();
+        timespec ts;
+        ::clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts);
+        cpu_ns_.store((uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec,
+                      std::memory_order_relaxed);
+      }
+    }
+
+  private:
+    friend class http_flv_server;
+
+    static void check(int r, const char *what) {
+      if (r < 0) {
+        throw std::system_error(errno, std::generic_category(), what);
+      }
+    }
+
+    /// <summary>
+    /// Accepts the pending connections.
+    /// </summary>
+    void accept_connections() {
+      while (true) {
+        int fd = ::accept4(listen_fd_, nullptr, nullptr,
+                           SOCK_NONBLOCK | SOCK_CLOEXEC);
+        if (fd < 0) {
+          return;
+        }
+        int on = 1;
+        ::setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on));
+        connection_t *c = new connection_t();
+        c->fd = fd;
+        c->response_sent = 0;
+        c->closing = false;
+        c->blocked = false;
+        c->closed = false;
+        c->head = 0;
+        c->offset = 0;
+        c->skipped = 0;
+        epoll_event ev;
+        ev.events = EPOLLIN | EPOLLRDHUP;
+        ev.data.ptr = c;
+        if (::epoll_ctl(epoll_fd_, EPOLL_CTL_ADD, fd, &ev) < 0) {
+          ::close(fd);
+          delete c;
+          continue;
+        }
+        connections_.add(c);
+        accepted_.fetch_add(1, std::memory_order_relaxed);
+      }
+    }
+
+    /// <summary>
+    /// Handles the events of a connection.
+    /// </summary>
+    void handle(connection_t *c, uint32_t events) {
+      if (c->closed) {
+        // Closed by an earlier event of the batch
+        return;
+      }
+      if (events & (EPOLLERR | EPOLLHUP)) {
+        close_connection(c);
+        return;
+      }
+      if (events & (EPOLLIN | EPOLLRDHUP)) {
+        char buf[4096];
+        while (true) {
+          ssize_t r = ::recv(c->fd, buf, sizeof(buf), 0);
+          if (r > 0) {
+            if (!c->subscriber && !c->closing) {
+              c->request.append(buf, static_cast<size_t>(r));
+            }
+            continue;
+          }
+          if (r == 0 || (errno != EAGAIN && errno != EINTR)) {
+            close_connection(c);
+            return;
+          }
+          if (errno == EAGAIN) {
+            break;
+          }
+        }
+        if (!c->subscriber && !c->closing && !parse_request(c)) {
+          return;
+        }
+      }
+      if (!pump(c)) {
+        close_connection(c);
+      }
+    }
+
+    /// <summary>
+    /// Answers a complete request head.
+    /// </summary>
+    /// <returns>False if the request head is not complete yet.</returns>
+    bool parse_request(connection_t *c) {
+      size_t end = c->request.find("\r\n\r\n");
+      if (end == std::string::npos) {
+        if (c->request.size() > MAX_REQUEST_SIZE) {
+          reject(c, "431 Request Header Fields Too Large");
+          return true;
+        }
+        return false;
+      }
+
+      // Request line: method, target and version
+      size_t line_end = c->request.find("\r\n");
+      std::string line = c->request.substr(0, line_end);
+      size_t sp1 = line.find(' ');
+      size_t sp2 = line.rfind(' ');
+      if (sp1 == std::string::npos || sp2 == sp1 ||
+          line.compare(sp2 + 1, 5, "HTTP/") != 0) {
+        reject(c, "400 Bad Request");
+        return true;
+      }
+      if (line.compare(0, sp1, "GET") != 0) {
+        reject(c, "405 Method Not Allowed");
+        return true;
+      }
+      std::string path = line.substr(sp1 + 1, sp2 - sp1 - 1);
+      path = path.substr(0, path.find('?'));
+      auto it = server_.streams_.find(path);
+      if (it == server_.streams_.end()) {
+        reject(c, "404 Not Found");
+        return true;
+      }
+
+      c->request.clear();
+      c->request.shrink_to_fit();
+      c->response = "HTTP/1.1 200 OK\r\n"
+                    "Content-Type: video/x-flv\r\n"
+                    "Transfer-Encoding: chunked\r\n"
+                    "Cache-Control: no-cache\r\n"
+                    "Connection: close\r\n\r\n";
+      c->subscriber = it->second->subscribe();
+      return true;
+    }
+
+    /// <summary>
+    /// Queues an error response, the connection closes once it is sent.
+    /// </summary>
+    void reject(connection_t *c, const char *status) {
+      c->request.clear();
+      c->response = std::string("HTTP/1.1 ") + status +
+                    "\r\nContent-Length: 0\r\nConnection: close\r\n\r\n";
+      c->closing = true;
+      rejected_.fetch_add(1, std::memory_order_relaxed);
+    }
+
+    /// <summary>
+    /// Sends the stream to every connection not waiting for EPOLLOUT.
+    /// </summary>
+    void pump_all() {
+      for (size_t i = 0; i < connections_.size();) {
+        connection_t *c = connections_[i];
+        if (c->blocked || !c->subscriber || pump(c)) {
+          i++;
+        } else {
+          // The last connection takes the place of the closed one
+          close_connection(c);
+        }
+      }
+    }
+
+    /// <summary>
+    /// Sends the pending response head and the stream, as much as the socket
+    /// takes.
+    /// </summary>
+    /// <returns>False if the connection is to be closed.</returns>
+    bool pump(connection_t *c) {
+      while (c->response_sent < c->response.size()) {
+        ssize_t r = ::send(c->fd, c->response.data() + c->response_sent,
+                           c->response.size() - c->response_sent,
+                           MSG_NOSIGNAL);
+        if (r < 0) {
+          return sent_would_block(c);
+        }
+        c->response_sent += static_cast<size_t>(r);
+        bytes_sent_.fetch_add(static_cast<uint64_t>(r),
+                              std::memory_order_relaxed);
+      }
+      if (c->closing) {
+        return false;
+      }
+      if (!c->response.empty()) {
+        c->response.clear();
+        c->response.shrink_to_fit();
+        c->response_sent = 0;
+      }
+      if (!c->subscriber) {
+        return true;
+      }
+
+      static const char CRLF[] = "\r\n";
+      iovec iov[MAX_BATCH * 3];
+      while (true) {
+        if (c->head == c->chunks.size() && !read_chunks(c)) {
+          set_blocked(c, false);
+          return true;
+        }
+
+        // Size line, tag and CRLF for every chunk, minus the bytes sent
+        size_t n = 0;
+        size_t skip = c->offset;
+        for (size_t i = c->head; i < c->chunks.size(); i++) {
+          chunk_t &chunk = c->chunks[i];
+          const iovec pieces[3] = {
+              {chunk.line, chunk.line_length},
+              {const_cast<uint8_t *>(chunk.buf->data()), chunk.buf->size()},
+              {const_cast<char *>(CRLF), 2}};
+          for (const iovec &piece : pieces) {
+            if (skip >= piece.iov_len) {
+              skip -= piece.iov_len;
+              continue;
+            }
+            iov[n].iov_base = (char *)piece.iov_base + skip;
+            iov[n].iov_len = piece.iov_len - skip;
+            skip = 0;
+            n++;
+          }
+        }
+
+        msghdr msg;
+        memset(&msg, 0, sizeof(msg));
+        msg.msg_iov = iov;
+        msg.msg_iovlen = n;
+        ssize_t r = ::sendmsg(c->fd, &msg, MSG_NOSIGNAL);
+        if (r < 0) {
+          return sent_would_block(c);
+        }
+        bytes_sent_.fetch_add(static_cast<uint64_t>(r),
+                              std::memory_order_relaxed);
+
+        // Move past the chunks sent completely
+        size_t left = c->offset + static_cast<size_t>(r);
+        while (c->head < c->chunks.size()) {
+          chunk_t &chunk = c->chunks[c->head];
+          size_t size = chunk.line_length + chunk.buf->size() + 2;
+          if (left < size) {
+            break;
+          }
+          left -= size;
+          chunk.buf.reset();
+          c->head++;
+          tags_sent_.fetch_add(1, std::memory_order_relaxed);
+        }
+        c->offset = left;
+      }
+    }
+
+    /// <summary>
+    /// Reads the next tags of the stream into the chunk list.
+    /// </summary>
+    /// <returns>False if the stream has nothing new.</returns>
+    bool read_chunks(connection_t *c) {
+      c->chunks.clear();
+      c->head = 0;
+      c->offset = 0;
+      bufs_.clear();
+      size_t n = c->subscriber->read(bufs_, MAX_BATCH);
+      uint64_t skipped = c->subscriber->skipped();
+      if (skipped != c->skipped) {
+        skipped_.fetch_add(skipped - c->skipped, std::memory_order_relaxed);
+        c->skipped = skipped;
+      }
+      c->chunks.resize(n);
+      for (size_t i = 0; i < n; i++) {
+        chunk_t &chunk = c->chunks[i];
+        chunk.buf = std::move(bufs_[i]);
+        chunk.line_length = static_cast<uint8_t>(
+            snprintf(chunk.line, sizeof(chunk.line), "%zx\r\n",
+                     chunk.buf->size()));
+      }
+      return n != 0;
+    }
+
+    /// <summary>
+    /// Handles a failed send.
+    /// </summary>
+    /// <returns>False if the connection is to be closed.</returns>
+    bool sent_would_block(connection_t *c) {
+      if (errno == EAGAIN || errno == EWOULDBLOCK) {
+        set_blocked(c, true);
+        return true;
+      }
+      return errno == EINTR && pump(c);
+    }
+
+    /// <summary>
+    /// Arms or disarms EPOLLOUT for a connection.
+    /// </summary>
+    void set_blocked(connection_t *c, bool blocked) {
+      if (c->blocked == blocked) {
+        return;
+      }
+      c->blocked = blocked;
+      epoll_event ev;
+      ev.events = EPOLLIN | EPOLLRDHUP |
+                  (blocked ? static_cast<uint32_t>(EPOLLOUT) : 0u);
+      ev.data.ptr = c;
+      ::epoll_ctl(epoll_fd_, EPOLL_CTL_MOD, c->fd, &ev);
+    }
+
+    /// <summary>
+    /// Closes a connection. It is freed by free_closed(), as later events of
+    /// the batch may still point to it.
+    /// </summary>
+    void close_connection(connection_t *c) {
+      connections_.remove(c);
+      ::epoll_ctl(epoll_fd_, EPOLL_CTL_DEL, c->fd, nullptr);
+      ::close(c->fd);
+      c->closed = true;
+      closed_.push_back(c);
+    }
+
+    /// <summary>
+    /// Frees the connections closed during the batch of events.
+    /// </summary>
+    void free_closed() {
+      for (connection_t *c : closed_) {
+        delete c;
+      }
+      closed_.clear();
+    }
+
+  private:
+    /// <summary>
+    /// The server.
+    /// </summary>
+    http_flv_server &server_;
+
+    /// <summary>
+    /// The epoll instance.
+    /// </summary>
+    int epoll_fd_;
+
+    /// <summary>
+    /// The listening socket.
+    /// </summary>
+    int listen_fd_;
+
+    /// <summary>
+    /// The event fd waking the loop up.
+    /// </summary>
+    int event_fd_;
+
+    /// <summary>
+    /// Indicates whether a wake up is pending.
+    /// </summary>
+    std::atomic<bool> signaled_;
+
+    /// <summary>
+    /// Indicates whether the loop is stopping.
+    /// </summary>
+    std::atomic<bool> stopping_;
+
+    /// <summary>
+    /// The connections.
+    /// </summary>
+    connection_list connections_;
+
+    /// <summary>
+    /// The connections closed during the current batch of events.
+    /// </summary>
+    std::vector<connection_t *> closed_;
+
+    /// <summary>
+    /// The reused list of buffers read from a subscriber.
+    /// </summary>
+    std::vector<tag_buffer_ref> bufs_;
+
+    /// <summary>
+    /// The count of connections accepted.
+    /// </summary>
+    std::atomic<uint64_t> accepted_;
+
+    /// <summary>
+    /// The count of requests rejected.
+    /// </summary>
+    std::atomic<uint64_t> rejected_;
+
+    /// <summary>
+    /// The count of bytes sent.
+    /// </summary>
+    std::atomic<uint64_t> bytes_sent_;
+
+    /// <summary>
+    /// The count of headers and tags sent.
+    /// </summary>
+    std::atomic<uint64_t> tags_sent_;
+
+    /// <summary>
+    /// The count of tags skipped by slow clients.
+    /// </summary>
+    std::atomic<uint64_t> skipped_;
+
+    /// <summary>
+    /// The CPU time of the thread.
+    /// </summary>
+    std::atomic<uint64_t> cpu_ns_;
+
+    /// <summary>
+    /// The thread.
+    /// </summary>
+    std::thread thread_;
+  };
+
+private:
+  /// <summary>
+  /// The count of event loop threads.
+  /// </summary>
+  size_t loop_count_;
+
+  /// <summary>
+  /// The port listened on.
+  /// </summary>
+  uint16_t port_;
+
+  /// <summary>
+  /// The streams by path.
+  /// </summary>
+  std::map<std::string, flv_live_stream *> streams_;
+
+  /// <summary>
+  /// The event fds shared with the stream publish hooks.
+  /// </summary>
+  std::shared_ptr<wakeup_t> wakeup_;
+
+  /// <summary>
+  /// The event loops.
+  /// </summary>
+  std::vector<std::unique_ptr<event_loop>> loops_;
+};
+} // namespace flv
@@ -11,18 +11,86 @@
 
 #pragma once
 #include <assert.h>
+#include <errno.h>
+
+#if defined(_WIN32)
+// Keep the min and max macros of windows.h off std::min and std::max
+#ifndef NOMINMAX
+#define NOMINMAX
+#endif
+#ifndef WIN32_LEAN_AND_MEAN
+#define WIN32_LEAN_AND_MEAN
+#endif
+#include <io.h>
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <limits.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <unistd.h>
+#endif
 
 #include <algorithm>
 #include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
 #include <cstring>
+#include <deque>
+#include <exception>
+#include <functional>
 #include <iterator>
 #include <map>
 #include <memory>
+#include <mutex>
 #include <ostream>
 #include <stdexcept>
 #include <string>
+#include <system_error>
+#include <thread>
 #include <vector>
 
+#if !defined(FLV_NO_SIMD)
+#if defined(__AVX2__)
+#include <immintrin.h>
+#define FLV_HAS_AVX2 1
+#endif
+#if defined(__SSE2__) || defined(_M_X64) ||                                    \
+    (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#include <emmintrin.h>
+#define FLV_HAS_SSE2 1
+#endif
+#if defined(__SSSE3__) || defined(__AVX__)
+#include <tmmintrin.h>
+#define FLV_HAS_SSSE3 1
+#endif
+#endif
+#if defined(_MSC_VER)
+#include <intrin.h>
+#endif
+
+#if !defined(FLV_HAS_AVX2)
+#define FLV_HAS_AVX2 0
+#endif
+#if !defined(FLV_HAS_SSE2)
+#define FLV_HAS_SSE2 0
+#endif
+#if !defined(FLV_HAS_SSSE3)
+#define FLV_HAS_SSSE3 0
+#endif
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+#define FLV_BIG_ENDIAN 1
+#else
+#define FLV_BIG_ENDIAN 0
+#endif
+#if defined(FLV_BUILDER_DISABLE_STATS)
+#define FLV_BUILDER_STATS 0
+#else
+#define FLV_BUILDER_STATS 1
+#endif
+
 // @cond PRIVATE_ENTITY
 /// <summary>
 /// Disallows the copy constructor and operator= functions.
@@ -32,7 +100,155 @@
   cls(const cls &) = delete;                                                   \
   cls &operator=(const cls &) = delete
 
+/// <summary>
+/// Declares a key of a meta_template schema: a struct named name for the
+/// property key_string whose value is an AMF NumberType or BooleanType.
+/// </summary>
+#define FLV_META_KEY(name, key_string, value_type)                             \
+  struct name {                                                                \
+    static constexpr const char *key() { return key_string; }                  \
+    static constexpr ::flv::amf::amf_value_type_t type() {                     \
+      return ::flv::amf::value_type;                                           \
+    }                                                                          \
+  }
+
 namespace flv {
+/// <summary>
+/// Swaps the bytes of a 16-bit value.
+/// </summary>
+/// <param name="v">The value.</param>
+/// <returns>The value with the bytes swapped.</returns>
+inline uint16_t bswap16(uint16_t v) {
+#if defined(_MSC_VER)
+  return _byteswap_ushort(v);
+#elif defined(__GNUC__)
+  return __builtin_bswap16(v);
+#else
+  return static_cast<uint16_t>(v << 8 | v >> 8);
+#endif
+}
+
+/// <summary>
+/// Swaps the bytes of a 32-bit value.
+/// </summary>
+/// <param name="v">The value.</param>
+/// <returns>The value with the bytes swapped.</returns>
+inline uint32_t bswap32(uint32_t v) {
+#if defined(_MSC_VER)
+  return _byteswap_ulong(v);
+#elif defined(__GNUC__)
+  return __builtin_bswap32(v);
+#else
+  return (v << 24) | ((v << 8) & 0x00ff0000) | ((v >> 8) & 0x0000ff00) |
+         (v >> 24);
+#endif
+}
+
+/// <summary>
+/// Swaps the bytes of a 64-bit value.
+/// </summary>
+/// <param name="v">The value.</param>
+/// <returns>The value with the bytes swapped.</returns>
+inline uint64_t bswap64(uint64_t v) {
+#if defined(_MSC_VER)
+  return _byteswap_uint64(v);
+#elif defined(__GNUC__)
+  return __builtin_bswap64(v);
+#else
+  return (uint64_t)bswap32(static_cast<uint32_t>(v)) << 32 |
+         bswap32(static_cast<uint32_t>(v >> 32));
+#endif
+}
+
+/// <summary>
+/// Converts a 16-bit value from the host byte order to big-endian.
+/// </summary>
+/// <param name="v">The value.</param>
+/// <returns>The big-endian value.</returns>
+inline uint16_t host_to_be16(uint16_t v) {
+#if FLV_BIG_ENDIAN
+  return v;
+#else
+  return bswap16(v);
+#endif
+}
+
+/// <summary>
+/// Converts a 32-bit value from the host byte order to big-endian.
+/// </summary>
+/// <param name="v">The value.</param>
+/// <returns>The big-endian value.</returns>
+inline uint32_t host_to_be32(uint32_t v) {
+#if FLV_BIG_ENDIAN
+  return v;
+#else
+  return bswap32(v);
+#endif
+}
+
+/// <summary>
+/// Converts a 64-bit value from the host byte order to big-endian.
+/// </summary>
+/// <param name="v">The value.</param>
+/// <returns>The big-endian value.</returns>
+inline uint64_t host_to_be64(uint64_t v) {
+#if FLV_BIG_ENDIAN
+  return v;
+#else
+  return bswap64(v);
+#endif
+}
+
+/// <summary>
+/// Stores a 16-bit value big-endian into unaligned memory.
+/// </summary>
+/// <param name="p">The destination, 2 bytes.</param>
+/// <param name="v">The value.</param>
+/// <returns>The position after the value.</returns>
+inline uint8_t *store_be16(uint8_t *p, uint16_t v) {
+  v = host_to_be16(v);
+  memcpy(p, &v, sizeof(v));
+  return p + sizeof(v);
+}
+
+/// <summary>
+/// Stores the low 24 bits of a value big-endian into unaligned memory.
+/// </summary>
+/// <param name="p">The destination, 3 bytes.</param>
+/// <param name="v">The value.</param>
+/// <returns>The position after the value.</returns>
+inline uint8_t *store_be24(uint8_t *p, uint32_t v) {
+  p[0] = static_cast<uint8_t>(v >> 16);
+  return store_be16(p + 1, static_cast<uint16_t>(v));
+}
+
+/// <summary>
+/// Stores a 32-bit value big-endian into unaligned memory.
+/// </summary>
+/// <param name="p">The destination, 4 bytes.</param>
+/// <param name="v">The value.</param>
+/// <returns>The position after the value.</returns>
+inline uint8_t *store_be32(uint8_t *p, uint32_t v) {
+  v = host_to_be32(v);
+  memcpy(p, &v, sizeof(v));
+  return p + sizeof(v);
+}
+
+/// <summary>
+/// Stores a double as the 8 big-endian bytes of an IEEE 754 value into
+/// unaligned memory.
+/// </summary>
+/// <param name="p">The destination, 8 bytes.</param>
+/// <param name="v">The value.</param>
+/// <returns>The position after the value.</returns>
+inline uint8_t *store_be_f64(uint8_t *p, double v) {
+  uint64_t bits = 0;
+  memcpy(&bits, &v, sizeof(bits));
+  bits = host_to_be64(bits);
+  memcpy(p, &bits, sizeof(bits));
+  return p + sizeof(bits);
+}
+
 namespace amf {
 /// <summary>
 /// The AFM object types.
@@ -47,6 +263,7 @@ enum amf_value_type_e {
   UndefinedType = 6,
   ReferenceType = 7,
   ECMAArrayType = 8,
+  ObjectEndType = 9,
   StrictArrayType = 10,
   DateType = 11,
   LongStringType = 12,
@@ -63,6 +280,339 @@ protected:
   T *get() { return std::shared_ptr<T>::get(); }
 };
 
+/// <summary>
+/// Represents a string inside the source buffer of the AMF reader. The bytes
+/// are not copied and are not null-terminated.
+/// </summary>
+struct amf_string_view {
+  /// <summary>
+  /// The first character.
+  /// </summary>
+  const char *data;
+
+  /// <summary>
+  /// The length in bytes.
+  /// </summary>
+  size_t length;
+
+  /// <summary>
+  /// Compares the string with a null-terminated string.
+  /// </summary>
+  /// <param name="s">The string to compare with.</param>
+  /// <returns>True if equal; otherwise false.</returns>
+  bool equals(const char *s) const {
+    size_t n = strlen(s);
+    return n == length && (!n || memcmp(data, s, n) == 0);
+  }
+
+  /// <summary>
+  /// Copies the string.
+  /// </summary>
+  /// <returns>The string copy.</returns>
+  std::string str() const { return std::string(data, length); }
+};
+
+/// <summary>
+/// Represents one item produced by the AMF reader: a value, the start of a
+/// container (Object, ECMA Array or Strict Array) or the end of the current
+/// container (ObjectEndType).
+/// </summary>
+struct amf_item {
+  /// <summary>
+  /// The item type.
+  /// </summary>
+  amf_value_type_t type;
+
+  /// <summary>
+  /// The offset of the type marker in the source buffer.
+  /// </summary>
+  size_t offset;
+
+  /// <summary>
+  /// The property name for Object and ECMA Array members, empty otherwise.
+  /// </summary>
+  amf_string_view key;
+
+  /// <summary>
+  /// The value of Number, or the milliseconds of Date.
+  /// </summary>
+  double number;
+
+  /// <summary>
+  /// The time zone of Date.
+  /// </summary>
+  int16_t time_zone;
+
+  /// <summary>
+  /// The value of Boolean.
+  /// </summary>
+  bool boolean;
+
+  /// <summary>
+  /// The value of String and Long String.
+  /// </summary>
+  amf_string_view string;
+
+  /// <summary>
+  /// The count of ECMA Array (informative) or Strict Array items.
+  /// </summary>
+  uint32_t count;
+
+  /// <summary>
+  /// The index of Reference.
+  /// </summary>
+  uint16_t reference;
+};
+
+/// <summary>
+/// The results of the AMF reader.
+/// </summary>
+enum class amf_read_result : uint8_t {
+  Ok = 0,
+  End = 1,
+  NeedMoreData = 2,
+  Error = 3,
+};
+
+/// <summary>
+/// Represents the incremental AMF0 pull parser over a pointer/length view.
+/// Each call of next() produces one item; strings point into the source
+/// buffer. Every read is bounds-checked: when the buffer ends in the middle
+/// of an item, NeedMoreData is returned without consuming anything, and
+/// parsing resumes after rebind() with the same stream holding more bytes.
+/// Nesting is tracked in a fixed stack, so the reader never allocates.
+/// </summary>
+class amf_reader {
+public:
+  /// <summary>
+  /// The maximum container nesting depth.
+  /// </summary>
+  static const size_t MAX_DEPTH = 32;
+
+  /// <summary>
+  /// Constructs an instance of the reader.
+  /// </summary>
+  /// <param name="data">The AMF0 encoded data.</param>
+  /// <param name="length">The data length.</param>
+  amf_reader(const uint8_t *data, size_t length)
+      : data_(data), length_(length), pos_(0), depth_(0) {}
+
+  /// <summary>
+  /// Rebinds the reader to the same stream with more bytes available. The
+  /// buffer may have moved, but must start with the bytes already parsed.
+  /// </summary>
+  /// <param name="data">The AMF0 encoded data.</param>
+  /// <param name="length">The data length.</param>
+  void rebind(const uint8_t *data, size_t length) {
+    data_ = data;
+    length_ = length;
+  }
+
+  /// <summary>
+  /// Gets the offset of the next item.
+  /// </summary>
+  /// <returns>The offset.</returns>
+  size_t position() const { return pos_; }
+
+  /// <summary>
+  /// Gets the current container nesting depth.
+  /// </summary>
+  /// <returns>The depth.</returns>
+  size_t depth() const { return depth_; }
+
+  /// <summary>
+  /// Reads the next item.
+  /// </summary>
+  /// <param name="item">The item read.</param>
+  /// <returns>
+  /// Ok if an item was read, End if all the top level values were read,
+  /// NeedMoreData if the buffer ends in the middle of an item, or Error if
+  /// the data is malformed.
+  /// </returns>
+  amf_read_result next(amf_item &item) {
+    size_t p = pos_;
+    item.key.data = "";
+    item.key.length = 0;
+
+    if (depth_) {
+      frame_t &top = stack_[depth_ - 1];
+      if (top.strict) {
+        if (!top.remaining) {
+          item.type = ObjectEndType;
+          item.offset = p;
+          depth_--;
+          return amf_read_result::Ok;
+        }
+      } else {
+        // Property name, or the empty name of the object end marker
+        uint16_t key_length = 0;
+        if (!read_u16(p, key_length) || !has(p, key_length + 1)) {
+          return amf_read_result::NeedMoreData;
+        }
+        if (!key_length && data_[p] == ObjectEndType) {
+          item.type = ObjectEndType;
+          item.offset = p;
+          pos_ = p + 1;
+          depth_--;
+          return amf_read_result::Ok;
+        }
+        item.key.data = (const char *)data_ + p;
+        item.key.length = key_length;
+        p += key_length;
+      }
+    } else if (pos_ == length_) {
+      return amf_read_result::End;
+    }
+
+    amf_read_result r = read_value(p, item);
+    if (r != amf_read_result::Ok) {
+      return r;
+    }
+    if (depth_ && stack_[depth_ - 1].strict) {
+      stack_[depth_ - 1].remaining--;
+    }
+    if (item.type == ObjectType || item.type == ECMAArrayType ||
+        item.type == StrictArrayType) {
+      if (depth_ == MAX_DEPTH) {
+        return amf_read_result::Error;
+      }
+      stack_[depth_].strict = (item.type == StrictArrayType);
+      stack_[depth_].remaining = item.count;
+      depth_++;
+    }
+    pos_ = p;
+    return amf_read_result::Ok;
+  }
+
+  /// <summary>
+  /// Reads and drops items until the nesting depth is back to the specified
+  /// depth, skipping the rest of the containers opened below it.
+  /// </summary>
+  /// <param name="depth">The depth to return to.</param>
+  /// <returns>Ok if successful; otherwise the failed read result.</returns>
+  amf_read_result skip_to_depth(size_t depth) {
+    amf_item item;
+    while (depth_ > depth) {
+      amf_read_result r = next(item);
+      if (r != amf_read_result::Ok) {
+        return r;
+      }
+    }
+    return amf_read_result::Ok;
+  }
+
+private:
+  bool has(size_t p, size_t n) const { return n <= length_ - p; }
+
+  bool read_u16(size_t &p, uint16_t &v) const {
+    if (!has(p, 2)) {
+      return false;
+    }
+    v = static_cast<uint16_t>(data_[p] << 8 | data_[p + 1]);
+    p += 2;
+    return true;
+  }
+
+  bool read_u32(size_t &p, uint32_t &v) const {
+    if (!has(p, 4)) {
+      return false;
+    }
+    v = (uint32_t)data_[p] << 24 | (uint32_t)data_[p + 1] << 16 |
+        (uint32_t)data_[p + 2] << 8 | (uint32_t)data_[p + 3];
+    p += 4;
+    return true;
+  }
+
+  bool read_double(size_t &p, double &v) const {
+    if (!has(p, 8)) {
+      return false;
+    }
+    uint64_t bits = 0;
+    for (int i = 0; i < 8; i++) {
+      bits = (bits << 8) | data_[p + i];
+    }
+    memcpy(&v, &bits, sizeof(v));
+    p += 8;
+    return true;
+  }
+
+  amf_read_result read_value(size_t &p, amf_item &item) const {
+    if (!has(p, 1)) {
+      return amf_read_result::NeedMoreData;
+    }
+    item.offset = p;
+    uint8_t marker = data_[p++];
+
+    // Switch on the raw marker, not every byte is a valid enumerator
+    bool ok = true;
+    uint16_t u16 = 0;
+    uint32_t u32 = 0;
+    switch (marker) {
+    case NumberType:
+      ok = read_double(p, item.number);
+      break;
+    case BooleanType:
+      ok = has(p, 1);
+      if (ok) {
+        item.boolean = data_[p++] != 0;
+      }
+      break;
+    case StringType:
+      ok = read_u16(p, u16) && has(p, u16);
+      if (ok) {
+        item.string.data = (const char *)data_ + p;
+        item.string.length = u16;
+        p += u16;
+      }
+      break;
+    case LongStringType:
+      ok = read_u32(p, u32) && has(p, u32);
+      if (ok) {
+        item.string.data = (const char *)data_ + p;
+        item.string.length = u32;
+        p += u32;
+      }
+      break;
+    case ObjectType:
+      item.count = 0;
+      break;
+    case ECMAArrayType:
+    case StrictArrayType:
+      ok = read_u32(p, item.count);
+      break;
+    case NullType:
+    case UndefinedType:
+      break;
+    case ReferenceType:
+      ok = read_u16(p, item.reference);
+      break;
+    case DateType:
+      ok = read_double(p, item.number) && read_u16(p, u16);
+      if (ok) {
+        item.time_zone = static_cast<int16_t>(u16);
+      }
+      break;
+    default:
+      // MovieClip is reserved and the others are not AMF0 value types
+      return amf_read_result::Error;
+    }
+    item.type = static_cast<amf_value_type_t>(marker);
+    return ok ? amf_read_result::Ok : amf_read_result::NeedMoreData;
+  }
+
+private:
+  struct frame_t {
+    bool strict;
+    uint32_t remaining;
+  };
+
+  const uint8_t *data_;
+  size_t length_;
+  size_t pos_;
+  size_t depth_;
+  frame_t stack_[MAX_DEPTH];
+};
+
 /// <summary>
 /// Represents the AMF object root.
 /// </summary>
@@ -77,18 +627,62 @@ public:
   virtual amf_value_type_t value_type() const = 0;
 
   /// <summary>
-  /// Serializes the AMF object to bytes array.
+  /// Gets the size of the serialized bytes.
+  /// </summary>
+  /// <returns>The size in bytes.</returns>
+  virtual size_t serialized_size() const = 0;
+
+  /// <summary>
+  /// Serializes the AMF object into raw memory.
+  /// </summary>
+  /// <param name="p">The destination, serialized_size() bytes.</param>
+  /// <returns>The position after the serialized bytes.</returns>
+  virtual uint8_t *serialize_to(uint8_t *p) const = 0;
+
+  /// <summary>
+  /// Serializes the AMF object to bytes array. The buffer grows once, by the
+  /// exact serialized size.
   /// </summary>
   /// <param name="buf">The buffer to receive the serialized bytes array
   /// data.</param>
-  virtual void serialize(std::vector<uint8_t> &buf) = 0;
+  void serialize(std::vector<uint8_t> &buf) const {
+    size_t offset = buf.size();
+    buf.resize(offset + serialized_size());
+    uint8_t *end = serialize_to(buf.data() + offset);
+    assert(end == buf.data() + buf.size());
+    (void)end;
+  }
 
   /// <summary>
   /// Deserializes the bytes array to AMF object.
   /// </summary>
   /// <param name="data">The bytes array data to be parsed.</param>
   /// <returns>True if successful; otherwise fale.</returns>
-  virtual bool deserialize(const std::vector<uint8_t> &data) = 0;
+  bool deserialize(const std::vector<uint8_t> &data) {
+    return deserialize(data.data(), data.size());
+  }
+
+  /// <summary>
+  /// Deserializes the bytes to AMF object.
+  /// </summary>
+  /// <param name="data">The bytes to be parsed.</param>
+  /// <param name="length">The length of the bytes.</param>
+  /// <returns>True if successful; otherwise false.</returns>
+  bool deserialize(const uint8_t *data, size_t length) {
+    amf_reader reader(data, length);
+    amf_item item;
+    return reader.next(item) == amf_read_result::Ok &&
+           deserialize_from(reader, item);
+  }
+
+  /// <summary>
+  /// Deserializes the AMF object from the item just read and, for the
+  /// containers, from the items following it.
+  /// </summary>
+  /// <param name="reader">The reader positioned after the item.</param>
+  /// <param name="item">The item read.</param>
+  /// <returns>True if successful; otherwise false.</returns>
+  virtual bool deserialize_from(amf_reader &reader, const amf_item &item) = 0;
 };
 typedef amf_ref<amf_root> amf_root_ref;
 
@@ -106,6 +700,7 @@ protected:
   explicit amf_value(amf_value_type_t t) : type(t){};
   ~amf_value() {}
 
+public:
   /// <summary>
   /// Gets the AMF value type.
   /// </summary>
@@ -114,6 +709,77 @@ protected:
 };
 typedef amf_ref<amf_value> amf_value_ref;
 
+/// <summary>
+/// Creates the AMF value object from the item just read and, for the
+/// containers, from the items following it.
+/// </summary>
+/// <param name="reader">The reader positioned after the item.</param>
+/// <param name="item">The item read.</param>
+/// <returns>The AMF value object, or null if failed.</returns>
+inline amf_value_ref create_value(amf_reader &reader, const amf_item &item);
+
+/// <summary>
+/// Reads the properties of an Object or ECMA Array until its end marker.
+/// </summary>
+/// <param name="reader">
+/// The reader positioned after the container start.
+/// </param>
+/// <param name="props">The collection to receive the properties.</param>
+/// <returns>True if successful; otherwise false.</returns>
+inline bool read_properties(amf_reader &reader,
+                            std::map<std::string, amf_value_ref> &props) {
+  amf_item member;
+  while (reader.next(member) == amf_read_result::Ok) {
+    if (member.type == ObjectEndType) {
+      return true;
+    }
+    amf_value_ref value = create_value(reader, member);
+    if (!value) {
+      return false;
+    }
+    props[member.key.str()] = value;
+  }
+  return false;
+}
+
+/// <summary>
+/// Gets the serialized size of the properties of an Object or ECMA Array,
+/// without the type marker, the count and the end marker.
+/// </summary>
+/// <param name="props">The properties.</param>
+/// <returns>The size in bytes.</returns>
+inline size_t
+properties_size(const std::map<std::string, amf_value_ref> &props) {
+  size_t size = 0;
+  for (auto &kv : props) {
+    assert(kv.first.length() < (size_t)0xffff);
+    size += 2 + kv.first.length() + kv.second->serialized_size();
+  }
+  return size;
+}
+
+/// <summary>
+/// Serializes the properties of an Object or ECMA Array and the end marker
+/// into raw memory.
+/// </summary>
+/// <param name="props">The properties.</param>
+/// <param name="p">The destination.</param>
+/// <returns>The position after the end marker.</returns>
+inline uint8_t *
+serialize_properties(const std::map<std::string, amf_value_ref> &props,
+                     uint8_t *p) {
+  for (auto &kv : props) {
+    p = store_be16(p, static_cast<uint16_t>(kv.first.length()));
+    memcpy(p, kv.first.data(), kv.first.length());
+    p += kv.first.length();
+    p = kv.second->serialize_to(p);
+  }
+  *p++ = 0;
+  *p++ = 0;
+  *p++ = ObjectEndType;
+  return p;
+}
+
 /// <summary>
 /// Represents the AMF Number object.
 /// </summary>
@@ -129,29 +795,43 @@ public:
   }
 
   /// <summary>
-  /// Serializes the AMF object to bytes array.
+  /// Gets the size of the serialized bytes.
   /// </summary>
-  /// <param name="buf">The buffer to receive the serialized bytes array
-  /// data.</param>
-  virtual void serialize(std::vector<uint8_t> &buf) override {
-    buf.reserve(buf.size() + 1 + 8);
-    buf.emplace_back(type);
-    uint8_t *p = (uint8_t *)&v;
-    int i = 8;
-    do {
-      buf.emplace_back(p[--i]);
-    } while (i);
+  /// <returns>The size in bytes.</returns>
+  virtual size_t serialized_size() const override { return 1 + 8; }
+
+  /// <summary>
+  /// Serializes the AMF object into raw memory.
+  /// </summary>
+  /// <param name="p">The destination, serialized_size() bytes.</param>
+  /// <returns>The position after the serialized bytes.</returns>
+  virtual uint8_t *serialize_to(uint8_t *p) const override {
+    *p++ = type;
+    return store_be_f64(p, v);
   }
 
   /// <summary>
-  /// Deserializes the bytes array to AMF object.
+  /// Deserializes the AMF object from the item just read.
   /// </summary>
-  /// <param name="data">The bytes array data to be parsed.</param>
-  /// <returns>True if successful; otherwise fale.</returns>
-  virtual bool deserialize(const std::vector<uint8_t> &data) override {
-    throw std::logic_error("The method or operation is not implemented.");
+  /// <param name="reader">The reader positioned after the item.</param>
+  /// <param name="item">The item read.</param>
+  /// <returns>True if successful; otherwise false.</returns>
+  virtual bool deserialize_from(amf_reader &reader,
+                                const amf_item &item) override {
+    (void)reader;
+    if (item.type != NumberType) {
+      return false;
+    }
+    v = item.number;
+    return true;
   }
 
+  /// <summary>
+  /// Gets the number value.
+  /// </summary>
+  /// <returns>The number value.</returns>
+  double value() const { return v; }
+
 protected:
   explicit amf_number(double value) : amf_value(NumberType), v(value){};
 
@@ -181,25 +861,44 @@ public:
   }
 
   /// <summary>
-  /// Serializes the AMF object to bytes array.
+  /// Gets the size of the serialized bytes.
   /// </summary>
-  /// <param name="buf">The buffer to receive the serialized bytes array
-  /// data.</param>
-  virtual void serialize(std::vector<uint8_t> &buf) override {
-    buf.reserve(buf.size() + 1 + 1);
-    buf.emplace_back(type);
-    buf.emplace_back(v);
+  /// <returns>The size in bytes.</returns>
+  virtual size_t serialized_size() const override { return 1 + 1; }
+
+  /// <summary>
+  /// Serializes the AMF object into raw memory.
+  /// </summary>
+  /// <param name="p">The destination, serialized_size() bytes.</param>
+  /// <returns>The position after the serialized bytes.</returns>
+  virtual uint8_t *serialize_to(uint8_t *p) const override {
+    *p++ = type;
+    *p++ = v ? 1 : 0;
+    return p;
   }
 
   /// <summary>
-  /// Deserializes the bytes array to AMF object.
+  /// Deserializes the AMF object from the item just read.
   /// </summary>
-  /// <param name="data">The bytes array data to be parsed.</param>
-  /// <returns>True if successful; otherwise fale.</returns>
-  virtual bool deserialize(const std::vector<uint8_t> &data) override {
-    throw std::logic_error("The method or operation is not implemented.");
+  /// <param name="reader">The reader positioned after the item.</param>
+  /// <param name="item">The item read.</param>
+  /// <returns>True if successful; otherwise false.</returns>
+  virtual bool deserialize_from(amf_reader &reader,
+                                const amf_item &item) override {
+    (void)reader;
+    if (item.type != BooleanType) {
+      return false;
+    }
+    v = item.boolean;
+    return true;
   }
 
+  /// <summary>
+  /// Gets the boolean value.
+  /// </summary>
+  /// <returns>The boolean value.</returns>
+  bool value() const { return v; }
+
 protected:
   explicit amf_boolean(bool value) : amf_value(BooleanType), v(value){};
 
@@ -215,7 +914,8 @@ private:
 typedef amf_ref<amf_boolean> amf_boolean_ref;
 
 /// <summary>
-/// Represents the AMF String object.
+/// Represents the AMF String object. Strings of 0xffff bytes or more are
+/// Long Strings, with a 32-bit length.
 /// </summary>
 class amf_string : public amf_value {
 public:
@@ -225,36 +925,72 @@ public:
   /// <param name="value">The value of the String object.</param>
   /// <returns>The instance of the AMF String object.</returns>
   static amf_ref<amf_string> create(const char *value) {
-    assert(strlen(value) < (size_t)0xffff);
-    return amf_ref<amf_string>(new amf_string(value));
+    return amf_ref<amf_string>(new amf_string(value, strlen(value)));
   }
 
   /// <summary>
-  /// Serializes the AMF object to bytes array.
+  /// Creates an instance of the AMF String object.
   /// </summary>
-  /// <param name="buf">The buffer to receive the serialized bytes array
-  /// data.</param>
-  virtual void serialize(std::vector<uint8_t> &buf) override {
-    assert(v.length() < (size_t)0xffff);
-    uint16_t length = static_cast<uint16_t>(v.length());
-    buf.reserve(buf.size() + 1 + 2 + length);
-    buf.emplace_back(type);
-    buf.emplace_back(length >> 8);
-    buf.emplace_back(length & 0x00ff);
-    std::copy(v.begin(), v.begin() + length, std::back_inserter(buf));
+  /// <param name="value">The value of the String object.</param>
+  /// <returns>The instance of the AMF String object.</returns>
+  static amf_ref<amf_string> create(const std::string &value) {
+    return amf_ref<amf_string>(new amf_string(value.data(), value.length()));
   }
 
   /// <summary>
-  /// De-serializes the bytes array to AMF object.
+  /// Gets the size of the serialized bytes.
   /// </summary>
-  /// <param name="data">The bytes array data to be parsed.</param>
-  /// <returns>True if successful; otherwise fale.</returns>
-  virtual bool deserialize(const std::vector<uint8_t> &data) override {
-    throw std::logic_error("The method or operation is not implemented.");
+  /// <returns>The size in bytes.</returns>
+  virtual size_t serialized_size() const override {
+    return (type == LongStringType ? 1 + 4 : 1 + 2) + v.length();
+  }
+
+  /// <summary>
+  /// Serializes the AMF object into raw memory.
+  /// </summary>
+  /// <param name="p">The destination, serialized_size() bytes.</param>
+  /// <returns>The position after the serialized bytes.</returns>
+  virtual uint8_t *serialize_to(uint8_t *p) const override {
+    *p++ = type;
+    if (type == LongStringType) {
+      p = store_be32(p, static_cast<uint32_t>(v.length()));
+    } else {
+      p = store_be16(p, static_cast<uint16_t>(v.length()));
+    }
+    memcpy(p, v.data(), v.length());
+    return p + v.length();
+  }
+
+  /// <summary>
+  /// Deserializes the AMF object from the item just read. The string keeps
+  /// the type read, String or Long String.
+  /// </summary>
+  /// <param name="reader">The reader positioned after the item.</param>
+  /// <param name="item">The item read.</param>
+  /// <returns>True if successful; otherwise false.</returns>
+  virtual bool deserialize_from(amf_reader &reader,
+                                const amf_item &item) override {
+    (void)reader;
+    if (item.type != StringType && item.type != LongStringType) {
+      return false;
+    }
+    type = item.type;
+    v.assign(item.string.data, item.string.length);
+    return true;
   }
 
+  /// <summary>
+  /// Gets the string value.
+  /// </summary>
+  /// <returns>The string value.</returns>
+  const std::string &value() const { return v; }
+
 protected:
-  explicit amf_string(const char *value) : amf_value(StringType), v(value){};
+  amf_string(const char *value, size_t length)
+      : amf_value(length >= (size_t)0xffff ? LongStringType : StringType),
+        v(value, length) {
+    assert(length <= (size_t)0xffffffff);
+  };
 
 private:
   DISALLOW_COPY_AND_ASSIGN(amf_string);
@@ -268,55 +1004,189 @@ private:
 typedef amf_ref<amf_string> amf_string_ref;
 
 /// <summary>
-/// Represents the AMF Object object.
+/// Represents the AMF Null object.
 /// </summary>
-class amf_object : public amf_value,
-                   public std::enable_shared_from_this<amf_object> {
+class amf_null : public amf_value {
 public:
   /// <summary>
-  /// Enables the std::make_shared to be able to access
-  /// the protected constructor and destructor.
+  /// Creates an instance of the AMF Null object.
   /// </summary>
-  // friend class std::_Ref_count_obj<amf_object>;
+  /// <returns>The instance of the AMF Null object.</returns>
+  static amf_ref<amf_null> create() {
+    return amf_ref<amf_null>(new amf_null());
+  }
 
   /// <summary>
-  /// Creates an instance of the AMF Object object.
+  /// Gets the size of the serialized bytes.
   /// </summary>
-  /// <param name="value">The value of the Object object.</param>
-  /// <returns>The instance of the AMF Object object.</returns>
-  static amf_ref<amf_object> create() {
-    return amf_ref<amf_object>(new amf_object());
-  }
+  /// <returns>The size in bytes.</returns>
+  virtual size_t serialized_size() const override { return 1; }
 
   /// <summary>
-  /// Adds an AMF Number property for the AMF Object instance.
+  /// Serializes the AMF object into raw memory.
   /// </summary>
-  /// <param name="key">The property name,</param>
-  /// <param name="v">The property value.</param>
-  /// <returns>The self-reference.</returns>
-  amf_ref<amf_object> with_property(const char *key, double v) {
-    assert(strlen(key) < (size_t)0xffff);
-    auto pv = amf_number::create(v);
-    return this->with_property(key, pv);
+  /// <param name="p">The destination, serialized_size() bytes.</param>
+  /// <returns>The position after the serialized bytes.</returns>
+  virtual uint8_t *serialize_to(uint8_t *p) const override {
+    *p++ = type;
+    return p;
   }
 
   /// <summary>
-  /// Adds an AMF Boolean property for the AMF Object instance.
+  /// Deserializes the AMF object from the item just read.
   /// </summary>
-  /// <param name="key">The property name,</param>
-  /// <param name="v">The property value.</param>
-  /// <returns>The self-reference.</returns>
-  amf_ref<amf_object> with_property(const char *key, bool v) {
-    assert(strlen(key) < (size_t)0xffff);
-    auto pv = amf_boolean::create(v);
-    return this->with_property(key, pv);
+  /// <param name="reader">The reader positioned after the item.</param>
+  /// <param name="item">The item read.</param>
+  /// <returns>True if successful; otherwise false.</returns>
+  virtual bool deserialize_from(amf_reader &reader,
+                                const amf_item &item) override {
+    (void)reader;
+    return item.type == NullType;
   }
 
-  /// <summary>
-  /// Adds an AMF String property for the AMF Object instance.
-  /// </summary>
-  /// <param name="key">The property name,</param>
-  /// <param name="v">The property value.</param>
+protected:
+  explicit amf_null() : amf_value(NullType){};
+
+private:
+  DISALLOW_COPY_AND_ASSIGN(amf_null);
+};
+typedef amf_ref<amf_null> amf_null_ref;
+
+/// <summary>
+/// Represents the AMF Date object.
+/// </summary>
+class amf_date : public amf_value {
+public:
+  /// <summary>
+  /// Creates an instance of the AMF Date object.
+  /// </summary>
+  /// <param name="milliseconds">
+  /// The milliseconds since 1970-01-01 00:00:00 UTC.
+  /// </param>
+  /// <param name="time_zone">
+  /// The time zone, reserved and written as 0 by the specification.
+  /// </param>
+  /// <returns>The instance of the AMF Date object.</returns>
+  static amf_ref<amf_date> create(double milliseconds, int16_t time_zone = 0) {
+    return amf_ref<amf_date>(new amf_date(milliseconds, time_zone));
+  }
+
+  /// <summary>
+  /// Gets the size of the serialized bytes.
+  /// </summary>
+  /// <returns>The size in bytes.</returns>
+  virtual size_t serialized_size() const override { return 1 + 8 + 2; }
+
+  /// <summary>
+  /// Serializes the AMF object into raw memory.
+  /// </summary>
+  /// <param name="p">The destination, serialized_size() bytes.</param>
+  /// <returns>The position after the serialized bytes.</returns>
+  virtual uint8_t *serialize_to(uint8_t *p) const override {
+    *p++ = type;
+    p = store_be_f64(p, v);
+    return store_be16(p, static_cast<uint16_t>(tz));
+  }
+
+  /// <summary>
+  /// Deserializes the AMF object from the item just read.
+  /// </summary>
+  /// <param name="reader">The reader positioned after the item.</param>
+  /// <param name="item">The item read.</param>
+  /// <returns>True if successful; otherwise false.</returns>
+  virtual bool deserialize_from(amf_reader &reader,
+                                const amf_item &item) override {
+    (void)reader;
+    if (item.type != DateType) {
+      return false;
+    }
+    v = item.number;
+    tz = item.time_zone;
+    return true;
+  }
+
+  /// <summary>
+  /// Gets the milliseconds since 1970-01-01 00:00:00 UTC.
+  /// </summary>
+  /// <returns>The milliseconds.</returns>
+  double value() const { return v; }
+
+  /// <summary>
+  /// Gets the time zone.
+  /// </summary>
+  /// <returns>The time zone.</returns>
+  int16_t time_zone() const { return tz; }
+
+protected:
+  amf_date(double milliseconds, int16_t time_zone)
+      : amf_value(DateType), v(milliseconds), tz(time_zone){};
+
+private:
+  DISALLOW_COPY_AND_ASSIGN(amf_date);
+
+private:
+  /// <summary>
+  /// The milliseconds since 1970-01-01 00:00:00 UTC.
+  /// </summary>
+  double v;
+
+  /// <summary>
+  /// The time zone.
+  /// </summary>
+  int16_t tz;
+};
+typedef amf_ref<amf_date> amf_date_ref;
+
+/// <summary>
+/// Represents the AMF Object object.
+/// </summary>
+class amf_object : public amf_value,
+                   public std::enable_shared_from_this<amf_object> {
+public:
+  /// <summary>
+  /// Enables the std::make_shared to be able to access
+  /// the protected constructor and destructor.
+  /// </summary>
+  // friend class std::_Ref_count_obj<amf_object>;
+
+  /// <summary>
+  /// Creates an instance of the AMF Object object.
+  /// </summary>
+  /// <param name="value">The value of the Object object.</param>
+  /// <returns>The instance of the AMF Object object.</returns>
+  static amf_ref<amf_object> create() {
+    return amf_ref<amf_object>(new amf_object());
+  }
+
+  /// <summary>
+  /// Adds an AMF Number property for the AMF Object instance.
+  /// </summary>
+  /// <param name="key">The property name,</param>
+  /// <param name="v">The property value.</param>
+  /// <returns>The self-reference.</returns>
+  amf_ref<amf_object> with_property(const char *key, double v) {
+    assert(strlen(key) < (size_t)0xffff);
+    auto pv = amf_number::create(v);
+    return this->with_property(key, pv);
+  }
+
+  /// <summary>
+  /// Adds an AMF Boolean property for the AMF Object instance.
+  /// </summary>
+  /// <param name="key">The property name,</param>
+  /// <param name="v">The property value.</param>
+  /// <returns>The self-reference.</returns>
+  amf_ref<amf_object> with_property(const char *key, bool v) {
+    assert(strlen(key) < (size_t)0xffff);
+    auto pv = amf_boolean::create(v);
+    return this->with_property(key, pv);
+  }
+
+  /// <summary>
+  /// Adds an AMF String property for the AMF Object instance.
+  /// </summary>
+  /// <param name="key">The property name,</param>
+  /// <param name="v">The property value.</param>
   /// <returns>The self-reference.</returns>
   amf_ref<amf_object> with_property(const char *key, const char *v) {
     assert(strlen(key) < (size_t)0xffff);
@@ -336,38 +1206,43 @@ public:
   }
 
   /// <summary>
-  /// Serializes the AMF object to bytes array.
+  /// Gets the size of the serialized bytes.
   /// </summary>
-  /// <param name="buf">The buffer to receive the serialized bytes array
-  /// data.</param>
-  virtual void serialize(std::vector<uint8_t> &buf) override {
-    buf.reserve(buf.size() + 1);
-    buf.emplace_back(type);
+  /// <returns>The size in bytes.</returns>
+  virtual size_t serialized_size() const override {
+    return 1 + properties_size(v) + 3;
+  }
 
-    uint16_t key_length = 0;
-    for (auto &kv : v) {
-      key_length = static_cast<uint16_t>(kv.first.length());
-      buf.emplace_back(key_length >> 8);
-      buf.emplace_back(key_length & 0x0ff);
-      std::copy(kv.first.begin(), kv.first.begin() + key_length,
-                std::back_inserter(buf));
+  /// <summary>
+  /// Serializes the AMF object into raw memory.
+  /// </summary>
+  /// <param name="p">The destination, serialized_size() bytes.</param>
+  /// <returns>The position after the serialized bytes.</returns>
+  virtual uint8_t *serialize_to(uint8_t *p) const override {
+    *p++ = type;
+    return serialize_properties(v, p);
+  }
 
-      kv.second->serialize(buf);
+  /// <summary>
+  /// Deserializes the AMF object from the item just read.
+  /// </summary>
+  /// <param name="reader">The reader positioned after the item.</param>
+  /// <param name="item">The item read.</param>
+  /// <returns>True if successful; otherwise false.</returns>
+  virtual bool deserialize_from(amf_reader &reader,
+                                const amf_item &item) override {
+    if (item.type != ObjectType) {
+      return false;
     }
-
-    buf.emplace_back(0);
-    buf.emplace_back(0);
-    buf.emplace_back(9);
+    v.clear();
+    return read_properties(reader, v);
   }
 
   /// <summary>
-  /// Deserializes the bytes array to AMF object.
+  /// Gets the properties collection.
   /// </summary>
-  /// <param name="data">The bytes array data to be parsed.</param>
-  /// <returns>True if successful; otherwise fale.</returns>
-  virtual bool deserialize(const std::vector<uint8_t> &data) override {
-    throw std::logic_error("The method or operation is not implemented.");
-  }
+  /// <returns>The properties collection.</returns>
+  const std::map<std::string, amf_value_ref> &properties() const { return v; }
 
 protected:
   explicit amf_object() : amf_value(ObjectType){};
@@ -446,43 +1321,44 @@ public:
   }
 
   /// <summary>
-  /// Serializes the AMF object to bytes array.
+  /// Gets the size of the serialized bytes.
   /// </summary>
-  /// <param name="buf">The buffer to receive the serialized bytes array
-  /// data.</param>
-  virtual void serialize(std::vector<uint8_t> &buf) override {
-    buf.reserve(buf.size() + 1);
-    buf.emplace_back(type);
-    uint32_t count = static_cast<uint32_t>(v.size());
-    buf.emplace_back((count & 0xff000000) >> 24);
-    buf.emplace_back((count & 0x00ff0000) >> 16);
-    buf.emplace_back((count & 0x0000ff00) >> 8);
-    buf.emplace_back((count & 0x000000ff));
+  /// <returns>The size in bytes.</returns>
+  virtual size_t serialized_size() const override {
+    return 1 + 4 + properties_size(v) + 3;
+  }
 
-    uint16_t key_length = 0;
-    for (auto &kv : v) {
-      key_length = static_cast<uint16_t>(kv.first.length());
-      buf.emplace_back(key_length >> 8);
-      buf.emplace_back(key_length & 0x0ff);
-      std::copy(kv.first.begin(), kv.first.begin() + key_length,
-                std::back_inserter(buf));
+  /// <summary>
+  /// Serializes the AMF object into raw memory.
+  /// </summary>
+  /// <param name="p">The destination, serialized_size() bytes.</param>
+  /// <returns>The position after the serialized bytes.</returns>
+  virtual uint8_t *serialize_to(uint8_t *p) const override {
+    *p++ = type;
+    p = store_be32(p, static_cast<uint32_t>(v.size()));
+    return serialize_properties(v, p);
+  }
 
-      kv.second->serialize(buf);
+  /// <summary>
+  /// Deserializes the AMF object from the item just read.
+  /// </summary>
+  /// <param name="reader">The reader positioned after the item.</param>
+  /// <param name="item">The item read.</param>
+  /// <returns>True if successful; otherwise false.</returns>
+  virtual bool deserialize_from(amf_reader &reader,
+                                const amf_item &item) override {
+    if (item.type != ECMAArrayType) {
+      return false;
     }
-
-    buf.emplace_back(0);
-    buf.emplace_back(0);
-    buf.emplace_back(9);
+    v.clear();
+    return read_properties(reader, v);
   }
 
   /// <summary>
-  /// De-serializes the bytes array to AMF object.
+  /// Gets the items collection.
   /// </summary>
-  /// <param name="data">The bytes array data to be parsed.</param>
-  /// <returns>True if successful; otherwise fale.</returns>
-  virtual bool deserialize(const std::vector<uint8_t> &data) override {
-    throw std::logic_error("The method or operation is not implemented.");
-  }
+  /// <returns>The items collection.</returns>
+  const std::map<std::string, amf_value_ref> &items() const { return v; }
 
 protected:
   explicit amf_array() : amf_value(ECMAArrayType){};
@@ -497,423 +1373,6673 @@ private:
   std::map<std::string, amf_value_ref> v;
 };
 typedef amf_ref<amf_array> amf_array_ref;
-} // namespace amf
-
-static const uint8_t FLV_HEADER_SIZE = 9;
-static const uint8_t FLV_TAG_HEADER_SIZE = 11;
-static const uint8_t VIDEO_HEADER_SIZE = 5;
-static const uint8_t VIDEO_SPECIFIC_CONFIG_EXTENDED_SIZE = 11;
-static const uint8_t AUDIO_HEADER_SIZE = 2;
-static const uint8_t AUDIO_SPECIFIC_CONFIG_SIZE = 2;
-static const char *ON_META_DATA = "onMetaData";
-static const uint8_t ON_META_DATA_LENGTH = 0x0a;
-
-/// <summary>
-/// The FLV tag types.
-/// </summary>
-enum class tag_type_t : uint8_t {
-  Unknown = 0,
-  Audio = 0x08,
-  Video = 0x09,
-  Script = 0x12,
-
-  FORCE_UINT8 = (uint8_t)0xff
-};
-
-/// <summary>
-/// The audio data sound formats.
-/// </summary>
-enum class audio_data_sound_format : uint8_t {
-  LPCM_PE = 0,
-  ADPCM = 1,
-  MP3 = 2,
-  LPCM_LE = 3,
-  NELLYMOSER_16K_MONO = 4,
-  NELLYMOSER_8K_MONO = 5,
-  NELLYMOSER = 6,
-  G711_A = 7,
-  G711_MU = 8,
-  RESERVERD = 9,
-  AAC = 10,
-  SPEEX = 11,
-  MP3_8K = 14,
-  DEVICE_SPECIFIC = 15,
-};
-
-/// <summary>
-/// The AAC audio data packet types.
-/// </summary>
-enum class aac_audio_data_packet_type : uint8_t {
-  AacSequenceHeader = 0,
-  AacRaw = 1,
-};
-
-/// <summary>
-/// The audio data sound sample rates.
-/// </summary>
-enum class audio_data_sound_rate_t : uint8_t {
-  R5K5HZ = 0,
-  R11KHZ = 1,
-  R22KHZ = 2,
-  R44KHZ = 3,
-};
-
-/// <summary>
-/// The audio data sound bit depths.
-/// </summary>
-enum class audio_data_sound_size_t : uint8_t {
-  S8BIT = 0,
-  S16BIT = 1,
-};
-
-/// <summary>
-/// The audio data sound channel counts.
-/// </summary>
-enum class audio_data_sound_type_t : uint8_t {
-  MONO = 0,
-  STEREO = 1,
-};
-
-/// <summary>
-/// The video data frame types.
-/// </summary>
-enum class video_data_frame_type : uint8_t {
-  KEY_FRAME = 1,
-  INTER_FRAME = 2,
-  DISPOSABLE_INTER_FRAME = 3,
-  GENERATED_KEY_FRAME = 4,
-  VIDEO_INFO_COMMAND_FRAME = 5,
-};
-
-/// <summary>
-/// The video data codec ids.
-/// </summary>
-enum class video_data_codec_id : uint8_t {
-  JPEG = 1,
-  H263 = 2,
-  SCREEN_VIDEO = 3,
-  ON2VP6 = 4,
-  ON2VP6_WITH_ALPHA = 5,
-  SCREEN_VIDEO_V2 = 6,
-  AVC = 7,
-};
-
-/// <summary>
-/// The AVC video packet types.
-/// </summary>
-enum class avc_video_packet_type : uint8_t {
-  AvcSequenceHeader = 0,
-  AvcNALU = 1,
-  AvcSequenceHeaderEOF = 2,
-};
 
 /// <summary>
-/// Represents the FLV stream builder.
+/// Represents the AMF Strict Array object, the values without keys.
 /// </summary>
-class flv_stream_builder {
-private:
+class amf_strict_array : public amf_value,
+                         public std::enable_shared_from_this<amf_strict_array> {
+public:
   /// <summary>
-  /// The under layer stream
+  /// Creates an instance of the AMF Strict Array object.
   /// </summary>
-  std::ostream &os_;
+  /// <returns>The instance of the AMF Strict Array object.</returns>
+  static amf_ref<amf_strict_array> create() {
+    return amf_ref<amf_strict_array>(new amf_strict_array());
+  }
 
   /// <summary>
-  /// The tag count already proceed.
+  /// Appends an AMF Number item to the AMF Strict Array instance.
   /// </summary>
-  std::atomic<uint64_t> tag_count_;
+  /// <param name="v">The item value.</param>
+  /// <returns>The self-reference.</returns>
+  amf_ref<amf_strict_array> with_item(double v) {
+    return this->with_item(amf_number::create(v));
+  }
 
   /// <summary>
-  /// Indicates whether there is audio data in the stream.
+  /// Appends an AMF Boolean item to the AMF Strict Array instance.
   /// </summary>
-  bool has_audio_;
+  /// <param name="v">The item value.</param>
+  /// <returns>The self-reference.</returns>
+  amf_ref<amf_strict_array> with_item(bool v) {
+    return this->with_item(amf_boolean::create(v));
+  }
 
   /// <summary>
-  /// Indicates whether there is video data in the stream.
+  /// Appends an AMF String item to the AMF Strict Array instance.
   /// </summary>
-  bool has_video_;
+  /// <param name="v">The item value.</param>
+  /// <returns>The self-reference.</returns>
+  amf_ref<amf_strict_array> with_item(const char *v) {
+    return this->with_item(amf_string::create(v));
+  }
 
-public:
   /// <summary>
-  /// Constructs an instance of the FLV builder stream.
+  /// Appends an AMF value item to the AMF Strict Array instance.
   /// </summary>
-  flv_stream_builder(std::ostream &s) : os_(s) {}
+  /// <param name="v">The item value.</param>
+  /// <returns>The self-reference.</returns>
+  amf_ref<amf_strict_array> with_item(amf_value_ref v) {
+    this->v.push_back(v);
+    return shared_from_this();
+  }
 
   /// <summary>
-  /// Destructs the instance.
+  /// Gets the size of the serialized bytes.
   /// </summary>
-  ~flv_stream_builder() {}
+  /// <returns>The size in bytes.</returns>
+  virtual size_t serialized_size() const override {
+    size_t size = 1 + 4;
+    for (auto &item : v) {
+      size += item->serialized_size();
+    }
+    return size;
+  }
 
   /// <summary>
-  ///
+  /// Serializes the AMF object into raw memory.
   /// </summary>
-  void flush() { os_.flush(); }
+  /// <param name="p">The destination, serialized_size() bytes.</param>
+  /// <returns>The position after the serialized bytes.</returns>
+  virtual uint8_t *serialize_to(uint8_t *p) const override {
+    *p++ = type;
+    p = store_be32(p, static_cast<uint32_t>(v.size()));
+    for (auto &item : v) {
+      p = item->serialize_to(p);
+    }
+    return p;
+  }
 
   /// <summary>
-  /// Initializes the FLV stream/file header and append it to the end of the
-  /// specified buffer.
+  /// Deserializes the AMF object from the item just read and the items
+  /// following it.
   /// </summary>
-  /// <param name="buf">The buffer to receive the header data.</param>
-  /// <param name="has_audio">Whether there is audio data or not.</param>
-  /// <param name="has_video">Whether there is video data or not.</param>
+  /// <param name="reader">The reader positioned after the item.</param>
+  /// <param name="item">The item read.</param>
+  /// <returns>True if successful; otherwise false.</returns>
+  virtual bool deserialize_from(amf_reader &reader,
+                                const amf_item &item) override {
+    if (item.type != StrictArrayType) {
+      return false;
+    }
+    v.clear();
+    amf_item member;
+    while (reader.next(member) == amf_read_result::Ok) {
+      if (member.type == ObjectEndType) {
+        return true;
+      }
+      amf_value_ref value = create_value(reader, member);
+      if (!value) {
+        return false;
+      }
+      v.push_back(value);
+    }
+    return false;
+  }
+
+  /// <summary>
+  /// Gets the items collection.
+  /// </summary>
+  /// <returns>The items collection.</returns>
+  const std::vector<amf_value_ref> &items() const { return v; }
+
+protected:
+  explicit amf_strict_array() : amf_value(StrictArrayType){};
+
+private:
+  DISALLOW_COPY_AND_ASSIGN(amf_strict_array);
+
+private:
+  /// <summary>
+  /// The items collection.
+  /// </summary>
+  std::vector<amf_value_ref> v;
+};
+typedef amf_ref<amf_strict_array> amf_strict_array_ref;
+
+#if FLV_HAS_SSSE3
+/// <summary>
+/// Represents the byte shuffles of store_numbers(). A block of 16 values,
+/// 128 bytes, becomes 144 output bytes written by 9 stores of 16 bytes.
+/// The bytes of each store come from two 16-byte loads of the block, byte
+/// reversed by the shuffles, while the mask value 0x80 yields the zero
+/// bytes of the Number type markers.
+/// </summary>
+struct number_shuffles {
+  /// <summary>
+  /// The offsets in the block of the two loads of each store.
+  /// </summary>
+  uint8_t offsets[9][2];
+
+  /// <summary>
+  /// The shuffle masks of the two loads of each store.
+  /// </summary>
+  uint8_t masks[9][2][16];
+
+  /// <summary>
+  /// Builds the shuffles. A store spans 3 values at most, the first load
+  /// starts at the first of them and the second load 8 bytes later, both
+  /// kept inside the block.
+  /// </summary>
+  number_shuffles() {
+    for (int s = 0; s < 9; s++) {
+      int a = std::min(s * 16 / 9 * 8, 112);
+      int b = std::min(a + 8, 112);
+      offsets[s][0] = static_cast<uint8_t>(a);
+      offsets[s][1] = static_cast<uint8_t>(b);
+      for (int i = 0; i < 16; i++) {
+        int o = s * 16 + i;
+        masks[s][0][i] = masks[s][1][i] = 0x80;
+        if (o % 9) {
+          int in = o / 9 * 8 + 8 - o % 9;
+          if (in < a + 16) {
+            masks[s][0][i] = static_cast<uint8_t>(in - a);
+          } else {
+            masks[s][1][i] = static_cast<uint8_t>(in - b);
+          }
+        }
+      }
+    }
+  }
+
+  /// <summary>
+  /// Gets the shuffles, built once.
+  /// </summary>
+  /// <returns>The shuffles.</returns>
+  static const number_shuffles &get() {
+    static const number_shuffles shuffles;
+    return shuffles;
+  }
+};
+#endif
+
+/// <summary>
+/// Stores doubles as the items of a Strict Array of Numbers, each a Number
+/// type marker and the 8 big-endian bytes of the value, into unaligned
+/// memory. With SSSE3 enabled at compile time, blocks of 16 values are byte
+/// swapped and interleaved with the markers by byte shuffles, 16 output
+/// bytes per store; the tail and the other targets use the scalar stores.
+/// Define FLV_NO_SIMD to force the scalar stores.
+/// </summary>
+/// <param name="p">The destination, 9 bytes per value.</param>
+/// <param name="values">The values.</param>
+/// <param name="count">The count of the values.</param>
+/// <returns>The position after the values.</returns>
+inline uint8_t *store_numbers(uint8_t *p, const double *values, size_t count) {
+#if FLV_HAS_SSSE3
+  const number_shuffles &shuffles = number_shuffles::get();
+  while (count >= 16) {
+    const uint8_t *block = reinterpret_cast<const uint8_t *>(values);
+    for (int s = 0; s < 9; s++) {
+      __m128i a =
+          _mm_loadu_si128((const __m128i *)(block + shuffles.offsets[s][0]));
+      __m128i b =
+          _mm_loadu_si128((const __m128i *)(block + shuffles.offsets[s][1]));
+      __m128i ma = _mm_loadu_si128((const __m128i *)shuffles.masks[s][0]);
+      __m128i mb = _mm_loadu_si128((const __m128i *)shuffles.masks[s][1]);
+      _mm_storeu_si128((__m128i *)(p + s * 16),
+                       _mm_or_si128(_mm_shuffle_epi8(a, ma),
+                                    _mm_shuffle_epi8(b, mb)));
+    }
+    p += 16 * 9;
+    values += 16;
+    count -= 16;
+  }
+#endif
+  for (size_t i = 0; i < count; i++) {
+    *p++ = NumberType;
+    p = store_be_f64(p, values[i]);
+  }
+  return p;
+}
+
+/// <summary>
+/// Represents the AMF Strict Array object of Numbers only, such as the
+/// keyframe times and file positions. The values are kept as one array of
+/// doubles instead of one AMF Number object per item, and are serialized in
+/// one pass by store_numbers().
+/// </summary>
+class amf_number_array : public amf_value,
+                         public std::enable_shared_from_this<amf_number_array> {
+public:
+  /// <summary>
+  /// Creates an instance of the AMF Strict Array of Numbers object.
+  /// </summary>
+  /// <returns>The instance of the AMF Strict Array of Numbers object.</returns>
+  static amf_ref<amf_number_array> create() {
+    return amf_ref<amf_number_array>(new amf_number_array());
+  }
+
+  /// <summary>
+  /// Creates an instance of the AMF Strict Array of Numbers object.
+  /// </summary>
+  /// <param name="values">The values.</param>
+  /// <param name="count">The count of the values.</param>
+  /// <returns>The instance of the AMF Strict Array of Numbers object.</returns>
+  static amf_ref<amf_number_array> create(const double *values, size_t count) {
+    amf_ref<amf_number_array> array(new amf_number_array());
+    array->v.assign(values, values + count);
+    return array;
+  }
+
+  /// <summary>
+  /// Appends an item to the AMF Strict Array of Numbers instance.
+  /// </summary>
+  /// <param name="v">The item value.</param>
   /// <returns>The self-reference.</returns>
-  flv_stream_builder &init_stream_header(bool has_audio, bool has_video) {
-    std::vector<uint8_t> buf(9 + 4, 0);
+  amf_ref<amf_number_array> with_item(double v) {
+    this->v.push_back(v);
+    return shared_from_this();
+  }
 
-    uint8_t flags = 0;
-    has_audio_ = has_audio;
-    if (has_audio_) {
-      flags |= 0x04;
+  /// <summary>
+  /// Gets the size of the serialized bytes.
+  /// </summary>
+  /// <returns>The size in bytes.</returns>
+  virtual size_t serialized_size() const override {
+    return 1 + 4 + (1 + 8) * v.size();
+  }
+
+  /// <summary>
+  /// Serializes the AMF object into raw memory.
+  /// </summary>
+  /// <param name="p">The destination, serialized_size() bytes.</param>
+  /// <returns>The position after the serialized bytes.</returns>
+  virtual uint8_t *serialize_to(uint8_t *p) const override {
+    *p++ = type;
+    p = store_be32(p, static_cast<uint32_t>(v.size()));
+    return store_numbers(p, v.data(), v.size());
+  }
+
+  /// <summary>
+  /// Deserializes the AMF object from the item just read and the items
+  /// following it, which must all be Numbers.
+  /// </summary>
+  /// <param name="reader">The reader positioned after the item.</param>
+  /// <param name="item">The item read.</param>
+  /// <returns>True if successful; otherwise false.</returns>
+  virtual bool deserialize_from(amf_reader &reader,
+                                const amf_item &item) override {
+    if (item.type != StrictArrayType) {
+      return false;
     }
-    has_video_ = has_video;
-    if (has_video_) {
-      flags |= 0x01;
+    v.clear();
+    amf_item member;
+    while (reader.next(member) == amf_read_result::Ok) {
+      if (member.type == ObjectEndType) {
+        return true;
+      }
+      if (member.type != NumberType) {
+        return false;
+      }
+      v.push_back(member.number);
     }
+    return false;
+  }
 
-    // Signature
-    buf[0] = 'F';
-    buf[1] = 'L';
-    buf[2] = 'V';
+  /// <summary>
+  /// Gets the values.
+  /// </summary>
+  /// <returns>The values.</returns>
+  const std::vector<double> &values() const { return v; }
 
-    // Version
-    buf[3] = 0x01;
+protected:
+  explicit amf_number_array() : amf_value(StrictArrayType){};
 
-    // Flags
-    buf[4] = flags;
+private:
+  DISALLOW_COPY_AND_ASSIGN(amf_number_array);
 
-    // Header size
-    buf[5] = 0;
-    buf[6] = 0;
-    buf[7] = 0;
-    buf[8] = FLV_HEADER_SIZE;
-
-    buf[9] = 0;
-    buf[10] = 0;
-    buf[11] = 0;
-    buf[12] = 0;
-    os_.write((char *)buf.data(), buf.size());
-    return *this;
+private:
+  /// <summary>
+  /// The values.
+  /// </summary>
+  std::vector<double> v;
+};
+typedef amf_ref<amf_number_array> amf_number_array_ref;
+
+inline amf_value_ref create_value(amf_reader &reader, const amf_item &item) {
+  amf_value_ref value;
+  switch (item.type) {
+  case NumberType:
+    value = amf_number::create(0);
+    break;
+  case BooleanType:
+    value = amf_boolean::create(false);
+    break;
+  case StringType:
+  case LongStringType:
+    value = amf_string::create("");
+    break;
+  case ObjectType:
+    value = amf_object::create();
+    break;
+  case ECMAArrayType:
+    value = amf_array::create();
+    break;
+  case NullType:
+    value = amf_null::create();
+    break;
+  case DateType:
+    value = amf_date::create(0);
+    break;
+  case StrictArrayType: {
+    // Numbers only is tried first on a copy of the reader
+    amf_reader numbers_reader = reader;
+    value = amf_number_array::create();
+    if (value->deserialize_from(numbers_reader, item)) {
+      reader = numbers_reader;
+      return value;
+    }
+    value = amf_strict_array::create();
+    break;
   }
+  default:
+    return amf_value_ref();
+  }
+  return value->deserialize_from(reader, item) ? value : amf_value_ref();
+}
 
+/// <summary>
+/// Represents an AMF value tree stored flat in two reused arenas instead of
+/// shared nodes: the keys and string values live in one byte arena, and the
+/// nodes live in one node arena where the children of each container are a
+/// contiguous index range. Properties keep their insertion order, so the
+/// output is byte-identical to amf_object and amf_array when the keys are
+/// added in their (sorted) order. The tree is built with begin_object() or
+/// begin_array(), the with_property() values and end(); clear() keeps the
+/// arenas, so rebuilding the tree does not allocate once they are large
+/// enough.
+/// </summary>
+class amf_tree : public amf_root {
+public:
   /// <summary>
-  /// Appends a meta tag data to the end of the specified buffer. This method
-  /// uses the meta passed in as AFM type 2 and appends it to a constructed AMF
-  /// type 1. Then it constructs a meta tag (head + body) with the AMF type 1
-  /// and type 2 and append it to the end of the buffer.
+  /// Represents a node of the tree.
   /// </summary>
-  /// <param name="meta">
-  /// An AMF value which represents AMF type 2 of the meta tag data.
-  /// </param>
-  /// <returns>The self-reference.</returns>
-  flv_stream_builder &append_meta_tag(amf::amf_value_ref meta) {
-    std::vector<uint8_t> meta_data;
-    amf::amf_string::create(ON_META_DATA)->serialize(meta_data);
-    meta->serialize(meta_data);
-    append_tag(tag_type_t::Script, 0, 0, meta_data.data(),
-               static_cast<uint32_t>(meta_data.size()));
-    return *this;
+  struct node {
+    /// <summary>
+    /// The value type.
+    /// </summary>
+    amf_value_type_t type;
+
+    /// <summary>
+    /// The length of the property name, 0 for the root.
+    /// </summary>
+    uint16_t key_length;
+
+    /// <summary>
+    /// The offset of the property name in the byte arena.
+    /// </summary>
+    uint32_t key_offset;
+
+    /// <summary>
+    /// The value of Number.
+    /// </summary>
+    double number;
+
+    /// <summary>
+    /// The index of the first child of a container, the offset of a string
+    /// in the byte arena, or the value of Boolean.
+    /// </summary>
+    uint32_t first;
+
+    /// <summary>
+    /// The count of the children of a container, or the length of a string.
+    /// </summary>
+    uint32_t count;
+  };
+
+  /// <summary>
+  /// Constructs an empty tree.
+  /// </summary>
+  amf_tree() : root_(NO_ROOT), size_(0) {}
+
+  /// <summary>
+  /// Removes all the values, keeping the arenas.
+  /// </summary>
+  void clear() {
+    bytes_.clear();
+    nodes_.clear();
+    pending_.clear();
+    scopes_.clear();
+    root_ = NO_ROOT;
+    size_ = 0;
   }
 
   /// <summary>
-  /// Appends a new video tag to the end of the specified buffer. This method
-  /// uses the data passed in as an VIDEODATA to construct a video tag
-  /// with the VIDEODATA and appends it to the end of the buffer.
+  /// Starts an AMF Object, the root or a property of the current container.
   /// </summary>
-  /// <param name="timestamp">The timetamp of the tag.</param>
-  /// <param name="data">The video tag body data.</param>
-  /// <param name="length">The lenght of the tag body data.</param>
+  /// <param name="key">The property name, ignored for the root.</param>
   /// <returns>The self-reference.</returns>
-  flv_stream_builder &append_video_tag(uint32_t timestamp, const uint8_t *data,
-                                       uint32_t length) {
-    append_tag(tag_type_t::Video, timestamp, 0, data, length);
-    return *this;
+  amf_tree &begin_object(const char *key = "") {
+    return begin(ObjectType, key, strlen(key));
   }
 
   /// <summary>
-  /// Appends a new video tag to the end of the specified buffer. This method
-  /// first uses the data passed in as an AVCDecoderConfigRecord to construct an
-  /// AVCVideoPacket, then constructs a VIDEODATA with the AVCVideoPacket.
-  /// Finally it constructs a video tag with the VIDEODATA and appends it to the
-  /// end of the buffer.
+  /// Starts an AMF ECMA Array, the root or a property of the current
+  /// container.
   /// </summary>
-  /// <param name="timestamp">The timetamp of the tag.</param>
-  /// <param name="data">The AVCDecoderConfigRecord data.</param>
-  /// <param name="length">The data length.</param>
+  /// <param name="key">The property name, ignored for the root.</param>
   /// <returns>The self-reference.</returns>
-  flv_stream_builder &append_video_tag_with_avc_decoder_config(
-      uint32_t timestamp, const uint8_t *data, uint32_t length) {
-    std::vector<uint8_t> avc_packet;
-    avc_packet.reserve(512);
-    avc_packet.emplace_back(
-        static_cast<uint8_t>(video_data_frame_type::INTER_FRAME) << 4 |
-        static_cast<uint8_t>(video_data_codec_id::AVC));
-    avc_packet.emplace_back(
-        static_cast<uint8_t>(avc_video_packet_type::AvcSequenceHeader));
-    avc_packet.emplace_back(0);
-    avc_packet.emplace_back(0);
-    avc_packet.emplace_back(0);
-    std::copy(data, data + length, std::back_inserter(avc_packet));
-    append_video_tag(timestamp, avc_packet.data(),
-                     static_cast<uint32_t>(avc_packet.size()));
-    return *this;
+  amf_tree &begin_array(const char *key = "") {
+    return begin(ECMAArrayType, key, strlen(key));
   }
 
   /// <summary>
-  /// Appends a new video tag to the end of the specified buffer. This method
-  /// first uses the data passed in as an NALU to construct an AVCVideoPacket,
-  /// then constructs a VIDEODATA with the AVCVideoPacket. Finally it constructs
-  /// a video tag with the VIDEODATA and appends it to the end of the buffer.
+  /// Ends the current container.
   /// </summary>
-  /// <param name="timestamp">The timetamp of the tag.</param>
-  /// <param name="data">
-  /// The NALU data (AVC format, first 4 bytes represents the length).
-  /// </param> <param name="length">The data length.</param>
   /// <returns>The self-reference.</returns>
-  flv_stream_builder &append_video_tag_with_avc_nalu_data(uint32_t timestamp,
-                                                          const uint8_t *data,
-                                                          uint32_t length) {
-    std::vector<uint8_t> avc_packet;
-    avc_packet.reserve(512);
-    avc_packet.emplace_back(
-        static_cast<uint8_t>(video_data_frame_type::INTER_FRAME) << 4 |
-        static_cast<uint8_t>(video_data_codec_id::AVC));
-    avc_packet.emplace_back(
-        static_cast<uint8_t>(avc_video_packet_type::AvcNALU));
-    uint32_t composition_time = timestamp;
-    avc_packet.emplace_back((composition_time & 0x00ff0000) >> 16);
-    avc_packet.emplace_back((composition_time & 0x0000ff00) >> 8);
-    avc_packet.emplace_back((composition_time & 0x000000ff));
-    std::copy(data, data + length, std::back_inserter(avc_packet));
-    append_video_tag(timestamp, avc_packet.data(),
-                     static_cast<uint32_t>(avc_packet.size()));
+  amf_tree &end() {
+    if (scopes_.empty()) {
+      throw std::logic_error("No AMF container to end");
+    }
+
+    // The children are final now, move them to the node arena as one range
+    scope_t scope = scopes_.back();
+    scopes_.pop_back();
+    node &container = pending_[scope.container];
+    container.first = static_cast<uint32_t>(nodes_.size());
+    container.count = static_cast<uint32_t>(pending_.size() - scope.children);
+    nodes_.insert(nodes_.end(), pending_.begin() + scope.children,
+                  pending_.end());
+    pending_.resize(scope.children);
+    if (scopes_.empty()) {
+      root_ = static_cast<uint32_t>(nodes_.size());
+      nodes_.emplace_back(pending_.back());
+      pending_.clear();
+    }
     return *this;
   }
 
   /// <summary>
-  /// Appends a new audio tag to the end of the specified buffer. This method
-  /// first uses the data passed in as an AUDIODATA to construct a video tag
-  /// with the AUDIODATA, then appends it to the end of the buffer.
+  /// Adds an AMF Number property to the current container.
   /// </summary>
-  /// <param name="timestamp">The timetamp of the tag.</param>
-  /// <param name="data">The audio tag body data.</param>
-  /// <param name="length">The lenght of the tag body data.</param>
+  /// <param name="key">The property name.</param>
+  /// <param name="v">The property value.</param>
   /// <returns>The self-reference.</returns>
-  flv_stream_builder &append_audio_tag(uint32_t timestamp, const uint8_t *data,
-                                       uint32_t length) {
-    append_tag(tag_type_t::Audio, timestamp, 0, data, length);
+  amf_tree &with_property(const char *key, double v) {
+    node &n = add(NumberType, key, strlen(key));
+    n.number = v;
+    size_ += 1 + 8;
     return *this;
   }
 
   /// <summary>
-  /// Appends a new audio tag to the end of the specified buffer. This method
-  /// first uses the data passed in as an AudioSpecificConfig to construct an
-  /// AACAudioPacket, then constructs an AUDIODTA with the AACAudioPacket.
-  /// Finally it constructs a video tag with the AUDIODTA and appends it to the
-  /// end of the buffer.
+  /// Adds an AMF Boolean property to the current container.
   /// </summary>
-  /// <param name="timestamp">The timetamp of the tag.</param>
-  /// <param name="rate">The sound sample rate.</param>
-  /// <param name="size">The sound bit depth.</param>
-  /// <param name="type">The sound channel count.</param>
-  /// <param name="data">The AudioSpecificConfig data.</param>
-  /// <param name="length">The lenght of the AudioSpecificConfig data.</param>
+  /// <param name="key">The property name.</param>
+  /// <param name="v">The property value.</param>
   /// <returns>The self-reference.</returns>
-  flv_stream_builder &append_audio_tag_with_aac_specific_config(
-      uint32_t timestamp, audio_data_sound_rate_t rate,
-      audio_data_sound_size_t size, audio_data_sound_type_t type,
-      const uint8_t *data, uint32_t length) {
-    std::vector<uint8_t> aac_packet;
-    aac_packet.reserve(32);
-    uint8_t fb = static_cast<uint8_t>(audio_data_sound_format::AAC) << 4;
-    fb |= ((static_cast<uint8_t>(rate) << 2) & 0x06);
-    fb |= ((static_cast<uint8_t>(size) << 1) & 0x02);
-    fb |= (static_cast<uint8_t>(type) & 0x01);
-    aac_packet.emplace_back(fb);
-    aac_packet.emplace_back(
-        static_cast<uint8_t>(aac_audio_data_packet_type::AacSequenceHeader));
-    std::copy(data, data + length, std::back_inserter(aac_packet));
-    append_audio_tag(timestamp, aac_packet.data(),
-                     static_cast<uint32_t>(aac_packet.size()));
+  amf_tree &with_property(const char *key, bool v) {
+    node &n = add(BooleanType, key, strlen(key));
+    n.first = v ? 1 : 0;
+    size_ += 1 + 1;
     return *this;
   }
 
   /// <summary>
-  /// Appends a new audio tag to the end of the specified buffer. This method
-  /// first uses the data passed in as an raw AAC frame data to construct an
-  /// AACAudioPacket, then constructs an AUDIODTA with the AACAudioPacket.
-  /// Finally it constructs a video tag with the AUDIODTA and appends it to the
-  /// end of the buffer.
+  /// Adds an AMF String property to the current container.
   /// </summary>
-  /// <param name="timestamp">The timetamp of the tag.</param>
-  /// <param name="rate">The sound sample rate.</param>
-  /// <param name="size">The sound bit depth.</param>
-  /// <param name="type">The sound channel count.</param>
-  /// <param name="data">The raw AAC frame data.</param>
-  /// <param name="length">The length of the raw AAC frame data.</param>
+  /// <param name="key">The property name.</param>
+  /// <param name="v">The property value.</param>
   /// <returns>The self-reference.</returns>
-  flv_stream_builder &append_audio_tag_with_aac_frame_data(
-      uint32_t timestamp, audio_data_sound_rate_t rate,
-      audio_data_sound_size_t size, audio_data_sound_type_t type,
-      const uint8_t *data, uint32_t length) {
-    std::vector<uint8_t> aac_packet;
-    uint8_t fb = static_cast<uint8_t>(audio_data_sound_format::AAC) << 4;
-    fb |= ((static_cast<uint8_t>(rate) << 2) & 0x06);
-    fb |= ((static_cast<uint8_t>(size) << 1) & 0x02);
-    fb |= (static_cast<uint8_t>(type) & 0x01);
-    aac_packet.emplace_back(fb);
-    aac_packet.emplace_back(
-        static_cast<uint8_t>(aac_audio_data_packet_type::AacRaw));
-    std::copy(data, data + length, std::back_inserter(aac_packet));
-    append_audio_tag(timestamp, aac_packet.data(),
-                     static_cast<uint32_t>(aac_packet.size()));
+  amf_tree &with_property(const char *key, const char *v) {
+    add_string(key, strlen(key), v, strlen(v));
     return *this;
   }
 
-protected:
   /// <summary>
-  /// Appends a new flv tag to the end of the specified buffer. This method
-  /// uses the data passed in as an tag body to constructs a FLV tag then
-  /// appends it to the end of the buffer.
+  /// Gets the AMF value type of the root.
   /// </summary>
-  /// <param name="type"></param>
-  /// <param name="timestamp">The timetamp of the tag.</param>
-  /// <param name="strem_id">The strem id (always 0).</param>
-  /// <param name="data">The tag body data.</param>
-  /// <param name="length">The lenght of the tag body data.</param>
-  void append_tag(tag_type_t type, uint32_t timestamp, uint32_t strem_id,
-                  const uint8_t *data, uint32_t length) {
-    // Header.Type
-    os_.put(static_cast<uint8_t>(type));
+  /// <returns>The root type, or UndefinedType if the tree is not
+  /// complete.</returns>
+  virtual amf_value_type_t value_type() const override {
+    return root_ == NO_ROOT ? UndefinedType : nodes_[root_].type;
+  }
 
-    // Header.DataSize
-    os_.put((length & 0x00ff0000) >> 16);
-    os_.put((length & 0x0000ff00) >> 8);
-    os_.put((length & 0x000000ff));
+  /// <summary>
+  /// Gets the size of the serialized bytes, tracked while building.
+  /// </summary>
+  /// <returns>The size in bytes, 0 if the tree is not complete.</returns>
+  virtual size_t serialized_size() const override {
+    return root_ == NO_ROOT ? 0 : size_;
+  }
 
-    // Header.Timestamp
-    os_.put((timestamp & 0x00ff0000) >> 16);
-    os_.put((timestamp & 0x0000ff00) >> 8);
-    os_.put((timestamp & 0x000000ff));
+  /// <summary>
+  /// Serializes the tree into raw memory.
+  /// </summary>
+  /// <param name="p">The destination, serialized_size() bytes.</param>
+  /// <returns>The position after the serialized bytes.</returns>
+  virtual uint8_t *serialize_to(uint8_t *p) const override {
+    if (root_ == NO_ROOT) {
+      throw std::logic_error("The AMF tree is not complete");
+    }
+    return write_value(nodes_[root_], p);
+  }
 
-    // Header.TimestampExtended
-    os_.put((timestamp & 0xff000000) >> 24);
+  /// <summary>
+  /// Deserializes the tree from the item just read and, for the containers,
+  /// from the items following it. Number, Boolean, String, Long String,
+  /// Object and ECMA Array values are supported.
+  /// </summary>
+  /// <param name="reader">The reader positioned after the item.</param>
+  /// <param name="item">The item read.</param>
+  /// <returns>True if successful; otherwise false.</returns>
+  virtual bool deserialize_from(amf_reader &reader,
+                                const amf_item &item) override {
+    clear();
+    if (item.type != ObjectType && item.type != ECMAArrayType) {
+      return false;
+    }
+    begin(item.type, "", 0);
+    amf_item member;
+    while (!scopes_.empty()) {
+      if (reader.next(member) != amf_read_result::Ok) {
+        clear();
+        return false;
+      }
+      const char *key = member.key.data;
+      size_t key_length = member.key.length;
+      switch (member.type) {
+      case NumberType:
+        add(NumberType, key, key_length).number = member.number;
+        size_ += 1 + 8;
+        break;
+      case BooleanType:
+        add(BooleanType, key, key_length).first = member.boolean ? 1 : 0;
+        size_ += 1 + 1;
+        break;
+      case StringType:
+      case LongStringType:
+        add_string(key, key_length, member.string.data, member.string.length);
+        break;
+      case ObjectType:
+      case ECMAArrayType:
+        begin(member.type, key, key_length);
+        break;
+      case ObjectEndType:
+        end();
+        break;
+      default:
+        clear();
+        return false;
+      }
+    }
+    return true;
+  }
 
-    // Header.StreamID (actually this is always 0 according to the
-    // specification)
-    os_.put((strem_id & 0x00ff0000) >> 16);
-    os_.put((strem_id & 0x0000ff00) >> 8);
-    os_.put((strem_id & 0x000000ff));
+  /// <summary>
+  /// Gets the root node.
+  /// </summary>
+  /// <returns>The root node, or null if the tree is not complete.</returns>
+  const node *root() const {
+    return root_ == NO_ROOT ? nullptr : &nodes_[root_];
+  }
+
+  /// <summary>
+  /// Gets the first child of a container node; the children follow it.
+  /// </summary>
+  /// <param name="container">The container node.</param>
+  /// <returns>The first child.</returns>
+  const node *children(const node &container) const {
+    return nodes_.data() + container.first;
+  }
 
-    // Data
-    os_.write((char *)data, length);
+  /// <summary>
+  /// Gets the property name of a node.
+  /// </summary>
+  /// <param name="n">The node.</param>
+  /// <returns>The property name, pointing into the byte arena.</returns>
+  amf_string_view key(const node &n) const {
+    amf_string_view v = {
+        reinterpret_cast<const char *>(bytes_.data()) + n.key_offset,
+        n.key_length};
+    return v;
+  }
 
-    // Size
-    uint32_t size = FLV_TAG_HEADER_SIZE + length;
-    os_.put((length & 0xff000000) >> 24);
-    os_.put((length & 0x00ff0000) >> 16);
-    os_.put((length & 0x0000ff00) >> 8);
-    os_.put((length & 0x000000ff));
+  /// <summary>
+  /// Gets the string value of a String node.
+  /// </summary>
+  /// <param name="n">The node.</param>
+  /// <returns>The string value, pointing into the byte arena.</returns>
+  amf_string_view string(const node &n) const {
+    amf_string_view v = {
+        reinterpret_cast<const char *>(bytes_.data()) + n.first, n.count};
+    return v;
+  }
 
-    tag_count_++;
+  /// <summary>
+  /// Finds a property of a container node by name.
+  /// </summary>
+  /// <param name="container">The container node.</param>
+  /// <param name="name">The property name.</param>
+  /// <returns>The property node, or null if not found.</returns>
+  const node *find(const node &container, const char *name) const {
+    const node *child = children(container);
+    for (uint32_t i = 0; i < container.count; i++) {
+      if (key(child[i]).equals(name)) {
+        return child + i;
+      }
+    }
+    return nullptr;
   }
+
+private:
+  DISALLOW_COPY_AND_ASSIGN(amf_tree);
+
+  /// <summary>
+  /// Represents an open container.
+  /// </summary>
+  struct scope_t {
+    /// <summary>
+    /// The index of the container node in the pending list.
+    /// </summary>
+    size_t container;
+
+    /// <summary>
+    /// The index of the first child in the pending list.
+    /// </summary>
+    size_t children;
+  };
+
+  /// <summary>
+  /// Starts a container.
+  /// </summary>
+  /// <param name="type">The container type.</param>
+  /// <param name="key">The property name.</param>
+  /// <param name="key_length">The property name length.</param>
+  /// <returns>The self-reference.</returns>
+  amf_tree &begin(amf_value_type_t type, const char *key, size_t key_length) {
+    if (scopes_.empty()) {
+      if (root_ != NO_ROOT) {
+        throw std::logic_error("The AMF tree already has a root");
+      }
+      node n = {type, 0, 0, 0, 0, 0};
+      pending_.emplace_back(n);
+    } else {
+      add(type, key, key_length);
+    }
+    scope_t scope = {pending_.size() - 1, pending_.size()};
+    scopes_.emplace_back(scope);
+    size_ += type == ECMAArrayType ? 1 + 4 + 3 : 1 + 3;
+    return *this;
+  }
+
+  /// <summary>
+  /// Adds a property node to the current container.
+  /// </summary>
+  /// <param name="type">The value type.</param>
+  /// <param name="key">The property name.</param>
+  /// <param name="key_length">The property name length.</param>
+  /// <returns>The node added.</returns>
+  node &add(amf_value_type_t type, const char *key, size_t key_length) {
+    if (scopes_.empty()) {
+      throw std::logic_error("No AMF container to add the property to");
+    }
+    assert(key_length < (size_t)0xffff);
+    node n = {type, static_cast<uint16_t>(key_length),
+              static_cast<uint32_t>(bytes_.size()), 0, 0, 0};
+    bytes_.insert(bytes_.end(), key, key + key_length);
+    pending_.emplace_back(n);
+    size_ += 2 + key_length;
+    return pending_.back();
+  }
+
+  /// <summary>
+  /// Adds a String property node, a Long String if it does not fit.
+  /// </summary>
+  /// <param name="key">The property name.</param>
+  /// <param name="key_length">The property name length.</param>
+  /// <param name="v">The string value.</param>
+  /// <param name="length">The string value length.</param>
+  void add_string(const char *key, size_t key_length, const char *v,
+                  size_t length) {
+    bool is_long = length >= (size_t)0xffff;
+    node &n = add(is_long ? LongStringType : StringType, key, key_length);
+    n.first = static_cast<uint32_t>(bytes_.size());
+    n.count = static_cast<uint32_t>(length);
+    bytes_.insert(bytes_.end(), v, v + length);
+    size_ += (is_long ? 1 + 4 : 1 + 2) + length;
+  }
+
+  /// <summary>
+  /// Writes a value and, for the containers, its properties.
+  /// </summary>
+  /// <param name="n">The node of the value.</param>
+  /// <param name="p">The output position.</param>
+  /// <returns>The output position after the value.</returns>
+  uint8_t *write_value(const node &n, uint8_t *p) const {
+    *p++ = n.type;
+    switch (n.type) {
+    case NumberType:
+      p = store_be_f64(p, n.number);
+      break;
+    case BooleanType:
+      *p++ = static_cast<uint8_t>(n.first);
+      break;
+    case StringType:
+    case LongStringType:
+      if (n.type == LongStringType) {
+        p = store_be32(p, n.count);
+      } else {
+        p = store_be16(p, static_cast<uint16_t>(n.count));
+      }
+      memcpy(p, bytes_.data() + n.first, n.count);
+      p += n.count;
+      break;
+    default: {
+      if (n.type == ECMAArrayType) {
+        p = store_be32(p, n.count);
+      }
+      const node *child = children(n);
+      for (uint32_t i = 0; i < n.count; i++) {
+        p = store_be16(p, child[i].key_length);
+        memcpy(p, bytes_.data() + child[i].key_offset, child[i].key_length);
+        p += child[i].key_length;
+        p = write_value(child[i], p);
+      }
+      *p++ = 0;
+      *p++ = 0;
+      *p++ = 9;
+      break;
+    }
+    }
+    return p;
+  }
+
+private:
+  /// <summary>
+  /// The root index value of an incomplete tree.
+  /// </summary>
+  static const uint32_t NO_ROOT = 0xffffffff;
+
+  /// <summary>
+  /// The byte arena of the keys and the string values.
+  /// </summary>
+  std::vector<uint8_t> bytes_;
+
+  /// <summary>
+  /// The node arena, the children of each container are contiguous.
+  /// </summary>
+  std::vector<node> nodes_;
+
+  /// <summary>
+  /// The nodes of the open containers, moved to the node arena by end().
+  /// </summary>
+  std::vector<node> pending_;
+
+  /// <summary>
+  /// The open containers.
+  /// </summary>
+  std::vector<scope_t> scopes_;
+
+  /// <summary>
+  /// The index of the root node.
+  /// </summary>
+  uint32_t root_;
+
+  /// <summary>
+  /// The serialized size of the tree.
+  /// </summary>
+  size_t size_;
+};
+} // namespace amf
+
+static const uint8_t FLV_HEADER_SIZE = 9;
+static const uint8_t FLV_TAG_HEADER_SIZE = 11;
+static const uint8_t VIDEO_HEADER_SIZE = 5;
+static const uint8_t VIDEO_EX_HEADER_SIZE = 5;
+static const uint8_t VIDEO_EX_HEADER_FLAG = 0x80;
+static const uint8_t VIDEO_SPECIFIC_CONFIG_EXTENDED_SIZE = 11;
+static const uint8_t AUDIO_HEADER_SIZE = 2;
+static const uint8_t AUDIO_SPECIFIC_CONFIG_SIZE = 2;
+static const uint8_t KEYFRAME_INDEX_FIXED_SIZE = 2 + 5 + 1 + 4 + 2 + 13 + 1 + 4;
+static const uint8_t KEYFRAME_INDEX_ENTRY_SIZE = 9 + 9;
+static const uint32_t MAX_TAG_DATA_SIZE = 0xffffff;
+static const char *ON_META_DATA = "onMetaData";
+static const uint8_t ON_META_DATA_LENGTH = 0x0a;
+
+/// <summary>
+/// The maximum count of keyframe index entries, the index of an otherwise
+/// empty ECMA Array meta filling the 24-bit tag data size.
+/// </summary>
+static const uint32_t MAX_KEYFRAME_INDEX_ENTRIES =
+    (MAX_TAG_DATA_SIZE - (1 + 2 + ON_META_DATA_LENGTH) - (1 + 4 + 3) -
+     (2 + 9 + 1) - KEYFRAME_INDEX_FIXED_SIZE - 3) /
+    KEYFRAME_INDEX_ENTRY_SIZE;
+
+/// <summary>
+/// The FLV tag types.
+/// </summary>
+enum class tag_type_t : uint8_t {
+  Unknown = 0,
+  Audio = 0x08,
+  Video = 0x09,
+  Script = 0x12,
+
+  FORCE_UINT8 = (uint8_t)0xff
+};
+
+/// <summary>
+/// The audio data sound formats.
+/// </summary>
+enum class audio_data_sound_format : uint8_t {
+  LPCM_PE = 0,
+  ADPCM = 1,
+  MP3 = 2,
+  LPCM_LE = 3,
+  NELLYMOSER_16K_MONO = 4,
+  NELLYMOSER_8K_MONO = 5,
+  NELLYMOSER = 6,
+  G711_A = 7,
+  G711_MU = 8,
+  RESERVERD = 9,
+  AAC = 10,
+  SPEEX = 11,
+  MP3_8K = 14,
+  DEVICE_SPECIFIC = 15,
+};
+
+/// <summary>
+/// The AAC audio data packet types.
+/// </summary>
+enum class aac_audio_data_packet_type : uint8_t {
+  AacSequenceHeader = 0,
+  AacRaw = 1,
+};
+
+/// <summary>
+/// The audio data sound sample rates.
+/// </summary>
+enum class audio_data_sound_rate_t : uint8_t {
+  R5K5HZ = 0,
+  R11KHZ = 1,
+  R22KHZ = 2,
+  R44KHZ = 3,
+};
+
+/// <summary>
+/// The audio data sound bit depths.
+/// </summary>
+enum class audio_data_sound_size_t : uint8_t {
+  S8BIT = 0,
+  S16BIT = 1,
+};
+
+/// <summary>
+/// The audio data sound channel counts.
+/// </summary>
+enum class audio_data_sound_type_t : uint8_t {
+  MONO = 0,
+  STEREO = 1,
+};
+
+/// <summary>
+/// The video data frame types.
+/// </summary>
+enum class video_data_frame_type : uint8_t {
+  KEY_FRAME = 1,
+  INTER_FRAME = 2,
+  DISPOSABLE_INTER_FRAME = 3,
+  GENERATED_KEY_FRAME = 4,
+  VIDEO_INFO_COMMAND_FRAME = 5,
+};
+
+/// <summary>
+/// The video data codec ids.
+/// </summary>
+enum class video_data_codec_id : uint8_t {
+  JPEG = 1,
+  H263 = 2,
+  SCREEN_VIDEO = 3,
+  ON2VP6 = 4,
+  ON2VP6_WITH_ALPHA = 5,
+  SCREEN_VIDEO_V2 = 6,
+  AVC = 7,
+};
+
+/// <summary>
+/// The AVC video packet types.
+/// </summary>
+enum class avc_video_packet_type : uint8_t {
+  AvcSequenceHeader = 0,
+  AvcNALU = 1,
+  AvcSequenceHeaderEOF = 2,
+};
+
+/// <summary>
+/// The packet types of the Enhanced RTMP extended video tag header.
+/// </summary>
+enum class ex_video_packet_type : uint8_t {
+  SequenceStart = 0,
+  CodedFrames = 1,
+  SequenceEnd = 2,
+  CodedFramesX = 3,
+  Metadata = 4,
+  MPEG2TSSequenceStart = 5,
+};
+
+/// <summary>
+/// The FourCC codes of the Enhanced RTMP extended video tag header.
+/// </summary>
+enum class video_fourcc_t : uint32_t {
+  VP9 = 0x76703039,  // 'vp09'
+  AV1 = 0x61763031,  // 'av01'
+  HEVC = 0x68766331, // 'hvc1'
+};
+
+/// <summary>
+/// The kinds of serialized FLV data, as seen by the live stream consumers.
+/// </summary>
+enum class tag_class_t : uint8_t {
+  Header = 0,
+  Meta,
+  VideoConfig,
+  AudioConfig,
+  VideoKeyframe,
+  Video,
+  DisposableVideo,
+  Audio,
+  Other,
+};
+
+/// <summary>
+/// Classifies a VIDEODATA from its legacy or extended header. Sequence ends
+/// and the packets of unknown types are Other, so that only coded frames are
+/// keyframes.
+/// </summary>
+/// <param name="data">The VIDEODATA.</param>
+/// <param name="length">The length of the VIDEODATA.</param>
+/// <returns>The kind of the VIDEODATA.</returns>
+inline tag_class_t classify_video_data(const uint8_t *data, size_t length) {
+  if (!length) {
+    return tag_class_t::Other;
+  }
+  uint8_t frame_type = data[0] >> 4;
+  if (data[0] & VIDEO_EX_HEADER_FLAG) {
+    frame_type &= 0x07;
+    switch (static_cast<ex_video_packet_type>(data[0] & 0x0f)) {
+    case ex_video_packet_type::SequenceStart:
+      return tag_class_t::VideoConfig;
+    case ex_video_packet_type::CodedFrames:
+    case ex_video_packet_type::CodedFramesX:
+      break;
+    default:
+      return tag_class_t::Other;
+    }
+  } else if ((data[0] & 0x0f) ==
+             static_cast<uint8_t>(video_data_codec_id::AVC)) {
+    if (length < 2) {
+      return tag_class_t::Other;
+    }
+    switch (static_cast<avc_video_packet_type>(data[1])) {
+    case avc_video_packet_type::AvcSequenceHeader:
+      return tag_class_t::VideoConfig;
+    case avc_video_packet_type::AvcNALU:
+      break;
+    default:
+      return tag_class_t::Other;
+    }
+  }
+  switch (static_cast<video_data_frame_type>(frame_type)) {
+  case video_data_frame_type::KEY_FRAME:
+    return tag_class_t::VideoKeyframe;
+  case video_data_frame_type::DISPOSABLE_INTER_FRAME:
+    return tag_class_t::DisposableVideo;
+  default:
+    return tag_class_t::Video;
+  }
+}
+
+/// <summary>
+/// The media tracks of the frame descriptors.
+/// </summary>
+enum class track_type_t : uint8_t {
+  Video = 0,
+  Audio = 1,
+};
+
+/// <summary>
+/// Represents one coded frame to be appended as a tag. Video frames are AVC
+/// NAL units in the AVC format (length prefixed), audio frames are raw AAC
+/// frames; codec config frames are the AVCDecoderConfigurationRecord and the
+/// AudioSpecificConfig.
+/// </summary>
+struct frame_desc {
+  /// <summary>
+  /// The track of the frame.
+  /// </summary>
+  track_type_t track;
+
+  /// <summary>
+  /// The decoding timestamp in milliseconds, the tag timestamp.
+  /// </summary>
+  uint32_t dts;
+
+  /// <summary>
+  /// The presentation timestamp in milliseconds.
+  /// </summary>
+  uint32_t pts;
+
+  /// <summary>
+  /// Indicates whether the frame is a video keyframe.
+  /// </summary>
+  bool keyframe;
+
+  /// <summary>
+  /// Indicates whether the frame is the codec config (sequence header).
+  /// </summary>
+  bool config;
+
+  /// <summary>
+  /// The frame data.
+  /// </summary>
+  const uint8_t *data;
+
+  /// <summary>
+  /// The frame data length.
+  /// </summary>
+  uint32_t length;
+};
+
+/// <summary>
+/// Represents a contiguous slice of bytes to be written to a sink.
+/// </summary>
+struct io_slice {
+  /// <summary>
+  /// The start of the bytes.
+  /// </summary>
+  const uint8_t *data;
+
+  /// <summary>
+  /// The length of the bytes.
+  /// </summary>
+  size_t length;
+};
+
+/// <summary>
+/// Represents the output sink of the FLV stream builder. Every FLV tag is
+/// handed to the sink as one gather write (tag header, tag body pieces and
+/// PreviousTagSize), so the sink can push it to the device in one call.
+/// </summary>
+class flv_sink {
+public:
+  virtual ~flv_sink() {}
+
+  /// <summary>
+  /// Writes all the slices, in order, as one gather write.
+  /// </summary>
+  /// <param name="slices">The slices to be written.</param>
+  /// <param name="count">The count of the slices.</param>
+  virtual void write(const io_slice *slices, size_t count) = 0;
+
+  /// <summary>
+  /// Flushes the data buffered in the sink, if any.
+  /// </summary>
+  virtual void flush() {}
+
+  /// <summary>
+  /// Overwrites bytes already written, without moving the write position.
+  /// Only seekable sinks support this.
+  /// </summary>
+  /// <param name="offset">
+  /// The offset of the bytes, relative to the first byte written to the sink.
+  /// </param>
+  /// <param name="data">The new bytes.</param>
+  /// <param name="length">The length of the bytes.</param>
+  /// <returns>True if successful; otherwise false.</returns>
+  virtual bool write_at(uint64_t offset, const uint8_t *data, size_t length) {
+    (void)offset;
+    (void)data;
+    (void)length;
+    return false;
+  }
+};
+
+/// <summary>
+/// Represents the sink adapter writing to a std::ostream.
+/// </summary>
+class ostream_sink : public flv_sink {
+public:
+  /// <summary>
+  /// Constructs an instance of the sink.
+  /// </summary>
+  /// <param name="s">The under layer stream.</param>
+  explicit ostream_sink(std::ostream &s) : os_(s), base_(s.tellp()) {}
+
+  virtual void write(const io_slice *slices, size_t count) override {
+    for (size_t i = 0; i < count; i++) {
+      os_.write((const char *)slices[i].data,
+                static_cast<std::streamsize>(slices[i].length));
+    }
+  }
+
+  virtual void flush() override { os_.flush(); }
+
+  virtual bool write_at(uint64_t offset, const uint8_t *data,
+                        size_t length) override {
+    if (base_ == std::streampos(-1)) {
+      return false;
+    }
+    std::streampos current = os_.tellp();
+    if (current == std::streampos(-1)) {
+      return false;
+    }
+    os_.seekp(base_ + static_cast<std::streamoff>(offset));
+    os_.write((const char *)data, static_cast<std::streamsize>(length));
+    os_.seekp(current);
+    return os_.good();
+  }
+
+private:
+  DISALLOW_COPY_AND_ASSIGN(ostream_sink);
+
+private:
+  /// <summary>
+  /// The under layer stream.
+  /// </summary>
+  std::ostream &os_;
+
+  /// <summary>
+  /// The stream position of the first byte written to the sink, -1 if the
+  /// stream is not seekable.
+  /// </summary>
+  std::streampos base_;
+};
+
+/// <summary>
+/// Represents the sink writing to a file descriptor. Each gather write is
+/// issued as a single writev call (or as few as the partial writes require).
+/// The file descriptor is not owned by the sink.
+/// </summary>
+class fd_sink : public flv_sink {
+public:
+  /// <summary>
+  /// Constructs an instance of the sink.
+  /// </summary>
+  /// <param name="fd">The file descriptor to write to.</param>
+  explicit fd_sink(int fd) : fd_(fd) {
+#if defined(_WIN32)
+    base_ = ::_lseeki64(fd_, 0, SEEK_CUR);
+#else
+    base_ = static_cast<int64_t>(::lseek(fd_, 0, SEEK_CUR));
+#endif
+  }
+
+  /// <summary>
+  /// Writes all the slices, in order, as one gather write.
+  /// </summary>
+  /// <param name="slices">The slices to be written.</param>
+  /// <param name="count">The count of the slices.</param>
+  /// <exception cref="std::system_error">If the write fails.</exception>
+  virtual void write(const io_slice *slices, size_t count) override {
+#if defined(_WIN32)
+    for (size_t i = 0; i < count; i++) {
+      const uint8_t *p = slices[i].data;
+      size_t left = slices[i].length;
+      while (left) {
+        unsigned int n = static_cast<unsigned int>(
+            std::min<size_t>(left, (size_t)0x40000000));
+        int r = ::_write(fd_, p, n);
+        if (r < 0) {
+          throw std::system_error(errno, std::generic_category(), "_write");
+        }
+        p += r;
+        left -= r;
+      }
+    }
+#else
+    static const size_t MAX_IOV = IOV_MAX < 64 ? IOV_MAX : 64;
+    struct iovec iov[MAX_IOV];
+    size_t next = 0;
+    size_t offset = 0;
+    while (next < count) {
+      // Fill the iovec batch, starting from the remainder of a partially
+      // written slice
+      size_t n = 0;
+      for (size_t i = next; i < count && n < MAX_IOV; i++) {
+        size_t skip = (i == next) ? offset : 0;
+        if (slices[i].length == skip) {
+          continue;
+        }
+        iov[n].iov_base = (void *)(slices[i].data + skip);
+        iov[n].iov_len = slices[i].length - skip;
+        n++;
+      }
+      if (!n) {
+        break;
+      }
+
+      ssize_t r = ::writev(fd_, iov, static_cast<int>(n));
+      if (r < 0) {
+        if (errno == EINTR) {
+          continue;
+        }
+        throw std::system_error(errno, std::generic_category(), "writev");
+      }
+
+      // Advance the cursor over the written bytes
+      size_t written = static_cast<size_t>(r);
+      while (next < count && written >= slices[next].length - offset) {
+        written -= slices[next].length - offset;
+        offset = 0;
+        next++;
+      }
+      offset += written;
+    }
+#endif
+  }
+
+  virtual bool write_at(uint64_t offset, const uint8_t *data,
+                        size_t length) override {
+    if (base_ < 0) {
+      return false;
+    }
+    int64_t pos = base_ + static_cast<int64_t>(offset);
+#if defined(_WIN32)
+    int64_t current = ::_lseeki64(fd_, 0, SEEK_CUR);
+    if (current < 0 || ::_lseeki64(fd_, pos, SEEK_SET) < 0) {
+      return false;
+    }
+    bool ok = ::_write(fd_, data, static_cast<unsigned int>(length)) ==
+              static_cast<int>(length);
+    ::_lseeki64(fd_, current, SEEK_SET);
+    return ok;
+#else
+    while (length) {
+      ssize_t r = ::pwrite(fd_, data, length, static_cast<off_t>(pos));
+      if (r < 0) {
+        if (errno == EINTR) {
+          continue;
+        }
+        return false;
+      }
+      data += r;
+      length -= static_cast<size_t>(r);
+      pos += r;
+    }
+    return true;
+#endif
+  }
+
+private:
+  DISALLOW_COPY_AND_ASSIGN(fd_sink);
+
+private:
+  /// <summary>
+  /// The file descriptor.
+  /// </summary>
+  int fd_;
+
+  /// <summary>
+  /// The file offset of the first byte written to the sink, -1 if the file
+  /// descriptor is not seekable.
+  /// </summary>
+  int64_t base_;
+};
+
+/// <summary>
+/// Represents the sink appending to the end of a memory buffer.
+/// </summary>
+class memory_sink : public flv_sink {
+public:
+  /// <summary>
+  /// Constructs an instance of the sink.
+  /// </summary>
+  /// <param name="buf">The buffer to receive the data.</param>
+  explicit memory_sink(std::vector<uint8_t> &buf)
+      : buf_(buf), base_(buf.size()) {}
+
+  virtual void write(const io_slice *slices, size_t count) override {
+    size_t total = 0;
+    for (size_t i = 0; i < count; i++) {
+      total += slices[i].length;
+    }
+
+    size_t pos = buf_.size();
+    buf_.resize(pos + total);
+    for (size_t i = 0; i < count; i++) {
+      if (slices[i].length) {
+        memcpy(buf_.data() + pos, slices[i].data, slices[i].length);
+        pos += slices[i].length;
+      }
+    }
+  }
+
+  virtual bool write_at(uint64_t offset, const uint8_t *data,
+                        size_t length) override {
+    if (offset > buf_.size() - base_ ||
+        length > buf_.size() - base_ - offset) {
+      return false;
+    }
+    memcpy(buf_.data() + base_ + offset, data, length);
+    return true;
+  }
+
+private:
+  DISALLOW_COPY_AND_ASSIGN(memory_sink);
+
+private:
+  /// <summary>
+  /// The buffer to receive the data.
+  /// </summary>
+  std::vector<uint8_t> &buf_;
+
+  /// <summary>
+  /// The buffer size when the sink was created.
+  /// </summary>
+  size_t base_;
+};
+
+/// <summary>
+/// Represents the sink forwarding the gather writes to a user callback.
+/// </summary>
+class callback_sink : public flv_sink {
+public:
+  /// <summary>
+  /// The callback type.
+  /// </summary>
+  typedef std::function<void(const io_slice *slices, size_t count)>
+      callback_t;
+
+  /// <summary>
+  /// Constructs an instance of the sink.
+  /// </summary>
+  /// <param name="cb">The callback receiving the gather writes.</param>
+  explicit callback_sink(callback_t cb) : cb_(std::move(cb)) {}
+
+  virtual void write(const io_slice *slices, size_t count) override {
+    cb_(slices, count);
+  }
+
+private:
+  DISALLOW_COPY_AND_ASSIGN(callback_sink);
+
+private:
+  /// <summary>
+  /// The callback.
+  /// </summary>
+  callback_t cb_;
+};
+
+/// <summary>
+/// The RTMP message type ids written by the RTMP chunk sink.
+/// </summary>
+enum class rtmp_message_type_t : uint8_t {
+  SetChunkSize = 1,
+  Audio = 8,
+  Video = 9,
+  DataAmf0 = 18,
+};
+
+static const uint32_t RTMP_DEFAULT_CHUNK_SIZE = 128;
+static const uint32_t RTMP_MAX_CHUNK_SIZE = 0x7fffffff;
+static const uint32_t RTMP_EXTENDED_TIMESTAMP = 0xffffff;
+static const uint8_t RTMP_MAX_CHUNK_HEADER_SIZE = 1 + 11 + 4;
+
+/// <summary>
+/// The AMF0 string "@setDataFrame" put in front of onMetaData.
+/// </summary>
+static const uint8_t RTMP_SET_DATA_FRAME[16] = {
+    0x02, 0x00, 0x0d, '@', 's', 'e', 't', 'D',
+    'a',  't',  'a',  'F', 'r', 'a', 'm', 'e'};
+
+/// <summary>
+/// Represents the sink turning the output of the builder into an RTMP chunk
+/// stream. Every FLV tag becomes one RTMP message with the tag type, the tag
+/// timestamp and the tag body as the payload (the FLV header and the tag
+/// sizes are dropped), split into chunks of the chunk size. The chunk message
+/// headers are compressed against the previous message of the same chunk
+/// stream (type 0 to 3) and carry the extended timestamp when needed. The
+/// chunk headers are built in an arena and interleaved with the pieces of
+/// the tag bodies in one gather write to the under layer sink, so the
+/// payload is never copied. The sink expects whole tags in every write, as
+/// the builder writes them.
+/// </summary>
+class rtmp_chunk_sink : public flv_sink {
+public:
+  /// <summary>
+  /// The chunk stream ids of the messages.
+  /// </summary>
+  static const uint8_t CSID_CONTROL = 2;
+  static const uint8_t CSID_AUDIO = 4;
+  static const uint8_t CSID_DATA = 5;
+  static const uint8_t CSID_VIDEO = 6;
+
+  /// <summary>
+  /// Constructs an instance of the sink.
+  /// </summary>
+  /// <param name="sink">The under layer sink, a connected socket.</param>
+  /// <param name="chunk_size">
+  /// The chunk size. A size other than the RTMP default of 128 is announced
+  /// with a Set Chunk Size message before the first message.
+  /// </param>
+  /// <param name="stream_id">The message stream id of the messages.</param>
+  /// <param name="set_data_frame">
+  /// Whether the onMetaData script data is sent as "@setDataFrame", as
+  /// publishing clients do.
+  /// </param>
+  explicit rtmp_chunk_sink(flv_sink &sink,
+                           uint32_t chunk_size = 4096,
+                           uint32_t stream_id = 1,
+                           bool set_data_frame = true)
+      : sink_(sink), chunk_size_(RTMP_DEFAULT_CHUNK_SIZE),
+        pending_chunk_size_(chunk_size), stream_id_(stream_id),
+        set_data_frame_(set_data_frame), messages_(0), chunks_(0) {
+    check_chunk_size(chunk_size);
+    memset(streams_, 0, sizeof(streams_));
+  }
+
+  /// <summary>
+  /// Changes the chunk size of the next messages. The Set Chunk Size message
+  /// is sent before the next message.
+  /// </summary>
+  /// <param name="chunk_size">The chunk size, 1 to 0x7fffffff.</param>
+  /// <exception cref="std::invalid_argument">If the size is out of
+  /// range.</exception>
+  void set_chunk_size(uint32_t chunk_size) {
+    check_chunk_size(chunk_size);
+    pending_chunk_size_ = chunk_size;
+  }
+
+  /// <summary>
+  /// Gets the chunk size of the next messages.
+  /// </summary>
+  /// <returns>The chunk size.</returns>
+  uint32_t chunk_size() const { return pending_chunk_size_; }
+
+  /// <summary>
+  /// Gets the count of messages written.
+  /// </summary>
+  /// <returns>The count of messages.</returns>
+  uint64_t messages() const { return messages_; }
+
+  /// <summary>
+  /// Gets the count of chunks written.
+  /// </summary>
+  /// <returns>The count of chunks.</returns>
+  uint64_t chunks() const { return chunks_; }
+
+  virtual void write(const io_slice *slices, size_t count) override {
+    out_slices_.clear();
+    arena_.clear();
+    fixups_.clear();
+    if (pending_chunk_size_ != chunk_size_) {
+      // Set Chunk Size goes out with the old chunk size
+      uint8_t *p = control_payload_;
+      store_be32(p, pending_chunk_size_);
+      io_slice payload = {p, 4};
+      append_message(CSID_CONTROL, rtmp_message_type_t::SetChunkSize, 0, 0,
+                     &payload, 1, 4);
+      chunk_size_ = pending_chunk_size_;
+    }
+
+    cursor_t cursor(slices, count);
+    uint8_t header[FLV_TAG_HEADER_SIZE];
+    while (!cursor.empty()) {
+      if (cursor.peek(header, 3) && header[0] == 'F' && header[1] == 'L' &&
+          header[2] == 'V') {
+        cursor.skip(FLV_HEADER_SIZE + 4);
+        continue;
+      }
+      if (!cursor.read(header, FLV_TAG_HEADER_SIZE)) {
+        throw std::logic_error("rtmp_chunk_sink: partial FLV tag");
+      }
+      uint32_t length = (uint32_t)header[1] << 16 |
+                        (uint32_t)header[2] << 8 | header[3];
+      uint32_t timestamp = (uint32_t)header[7] << 24 |
+                           (uint32_t)header[4] << 16 |
+                           (uint32_t)header[5] << 8 | header[6];
+      uint8_t csid;
+      rtmp_message_type_t type;
+      switch (static_cast<tag_type_t>(header[0] & 0x1f)) {
+      case tag_type_t::Audio:
+        csid = CSID_AUDIO;
+        type = rtmp_message_type_t::Audio;
+        break;
+      case tag_type_t::Video:
+        csid = CSID_VIDEO;
+        type = rtmp_message_type_t::Video;
+        break;
+      default:
+        csid = CSID_DATA;
+        type = rtmp_message_type_t::DataAmf0;
+        break;
+      }
+
+      payload_.clear();
+      uint32_t total = length;
+      if (type == rtmp_message_type_t::DataAmf0 && set_data_frame_ &&
+          is_on_meta_data(cursor)) {
+        payload_.push_back(
+            io_slice{RTMP_SET_DATA_FRAME, sizeof(RTMP_SET_DATA_FRAME)});
+        total += sizeof(RTMP_SET_DATA_FRAME);
+      }
+      if (!cursor.take(length, payload_) || !cursor.skip(4)) {
+        throw std::logic_error("rtmp_chunk_sink: partial FLV tag");
+      }
+      append_message(csid, type, stream_id_, timestamp, payload_.data(),
+                     payload_.size(), total);
+    }
+
+    if (out_slices_.empty()) {
+      return;
+    }
+    for (auto &fixup : fixups_) {
+      out_slices_[fixup.first].data = arena_.data() + fixup.second;
+    }
+    sink_.write(out_slices_.data(), out_slices_.size());
+  }
+
+  virtual void flush() override { sink_.flush(); }
+
+private:
+  DISALLOW_COPY_AND_ASSIGN(rtmp_chunk_sink);
+
+  /// <summary>
+  /// Represents the state of a chunk stream, the fields of its last message.
+  /// </summary>
+  struct chunk_stream_t {
+    /// <summary>
+    /// Indicates whether a message was sent on the chunk stream.
+    /// </summary>
+    bool active;
+
+    /// <summary>
+    /// Indicates whether the last header carried a timestamp delta.
+    /// </summary>
+    bool has_delta;
+
+    /// <summary>
+    /// The message type.
+    /// </summary>
+    uint8_t type;
+
+    /// <summary>
+    /// The message stream id.
+    /// </summary>
+    uint32_t stream_id;
+
+    /// <summary>
+    /// The message timestamp.
+    /// </summary>
+    uint32_t timestamp;
+
+    /// <summary>
+    /// The timestamp delta.
+    /// </summary>
+    uint32_t delta;
+
+    /// <summary>
+    /// The message length.
+    /// </summary>
+    uint32_t length;
+  };
+
+  /// <summary>
+  /// Represents a read position in the slices of a gather write.
+  /// </summary>
+  class cursor_t {
+  public:
+    cursor_t(const io_slice *slices, size_t count)
+        : slices_(slices), count_(count), index_(0), offset_(0) {
+      settle();
+    }
+
+    /// <summary>
+    /// Checks whether every byte was consumed.
+    /// </summary>
+    bool empty() const { return index_ == count_; }
+
+    /// <summary>
+    /// Copies the next bytes without consuming them.
+    /// </summary>
+    bool peek(uint8_t *dst, size_t n) const {
+      size_t index = index_;
+      size_t offset = offset_;
+      while (n) {
+        if (index == count_) {
+          return false;
+        }
+        size_t m = std::min(n, slices_[index].length - offset);
+        memcpy(dst, slices_[index].data + offset, m);
+        dst += m;
+        n -= m;
+        offset += m;
+        if (offset == slices_[index].length) {
+          index++;
+          offset = 0;
+        }
+      }
+      return true;
+    }
+
+    /// <summary>
+    /// Copies and consumes the next bytes.
+    /// </summary>
+    bool read(uint8_t *dst, size_t n) { return peek(dst, n) && skip(n); }
+
+    /// <summary>
+    /// Consumes the next bytes, appending them as slices without copying.
+    /// </summary>
+    bool take(size_t n, std::vector<io_slice> &out) {
+      while (n) {
+        if (empty()) {
+          return false;
+        }
+        size_t m = std::min(n, slices_[index_].length - offset_);
+        out.push_back(io_slice{slices_[index_].data + offset_, m});
+        advance(m);
+        n -= m;
+      }
+      return true;
+    }
+
+    /// <summary>
+    /// Consumes the next bytes.
+    /// </summary>
+    bool skip(size_t n) {
+      while (n) {
+        if (empty()) {
+          return false;
+        }
+        size_t m = std::min(n, slices_[index_].length - offset_);
+        advance(m);
+        n -= m;
+      }
+      return true;
+    }
+
+  private:
+    /// <summary>
+    /// Moves forward within the current slice.
+    /// </summary>
+    void advance(size_t n) {
+      offset_ += n;
+      settle();
+    }
+
+    /// <summary>
+    /// Moves past the slices consumed, empty ones included.
+    /// </summary>
+    void settle() {
+      while (index_ < count_ && offset_ == slices_[index_].length) {
+        index_++;
+        offset_ = 0;
+      }
+    }
+
+    /// <summary>
+    /// The slices.
+    /// </summary>
+    const io_slice *slices_;
+
+    /// <summary>
+    /// The count of the slices.
+    /// </summary>
+    size_t count_;
+
+    /// <summary>
+    /// The current slice.
+    /// </summary>
+    size_t index_;
+
+    /// <summary>
+    /// The offset in the current slice.
+    /// </summary>
+    size_t offset_;
+  };
+
+  /// <summary>
+  /// Checks a chunk size.
+  /// </summary>
+  /// <param name="chunk_size">The chunk size.</param>
+  /// <exception cref="std::invalid_argument">If the size is out of
+  /// range.</exception>
+  static void check_chunk_size(uint32_t chunk_size) {
+    if (!chunk_size || chunk_size > RTMP_MAX_CHUNK_SIZE) {
+      throw std::invalid_argument("rtmp_chunk_sink: invalid chunk size");
+    }
+  }
+
+  /// <summary>
+  /// Checks whether the script data at the cursor is onMetaData.
+  /// </summary>
+  /// <param name="cursor">The cursor at the tag body.</param>
+  /// <returns>True if the script data is onMetaData.</returns>
+  static bool is_on_meta_data(const cursor_t &cursor) {
+    uint8_t name[3 + ON_META_DATA_LENGTH];
+    return cursor.peek(name, sizeof(name)) &&
+           name[0] == static_cast<uint8_t>(amf::StringType) &&
+           name[1] == 0 && name[2] == ON_META_DATA_LENGTH &&
+           memcmp(name + 3, ON_META_DATA, ON_META_DATA_LENGTH) == 0;
+  }
+
+  /// <summary>
+  /// Appends the chunks of a message to the output slices. The first chunk
+  /// header is compressed against the last message of the chunk stream; the
+  /// other chunks have type 3 headers.
+  /// </summary>
+  /// <param name="csid">The chunk stream id.</param>
+  /// <param name="type">The message type.</param>
+  /// <param name="stream_id">The message stream id.</param>
+  /// <param name="timestamp">The message timestamp.</param>
+  /// <param name="payload">The payload pieces.</param>
+  /// <param name="count">The count of the payload pieces.</param>
+  /// <param name="length">The payload length.</param>
+  void append_message(uint8_t csid, rtmp_message_type_t type,
+                      uint32_t stream_id, uint32_t timestamp,
+                      const io_slice *payload, size_t count, uint32_t length) {
+    chunk_stream_t &cs = streams_[csid];
+    uint8_t fmt;
+    uint32_t field;
+    if (!cs.active || cs.stream_id != stream_id || timestamp < cs.timestamp) {
+      fmt = 0;
+      field = timestamp;
+    } else {
+      field = timestamp - cs.timestamp;
+      if (cs.length != length || cs.type != static_cast<uint8_t>(type)) {
+        fmt = 1;
+      } else if (!cs.has_delta || cs.delta != field) {
+        fmt = 2;
+      } else {
+        fmt = 3;
+      }
+    }
+    bool extended = field >= RTMP_EXTENDED_TIMESTAMP;
+
+    // The first chunk header
+    uint8_t header[RTMP_MAX_CHUNK_HEADER_SIZE];
+    uint8_t *p = header;
+    *p++ = static_cast<uint8_t>(fmt << 6 | csid);
+    if (fmt < 3) {
+      p = store_be24(p, extended ? RTMP_EXTENDED_TIMESTAMP : field);
+    }
+    if (fmt < 2) {
+      p = store_be24(p, length);
+      *p++ = static_cast<uint8_t>(type);
+    }
+    if (fmt == 0) {
+      // The message stream id is little endian
+      *p++ = static_cast<uint8_t>(stream_id);
+      *p++ = static_cast<uint8_t>(stream_id >> 8);
+      *p++ = static_cast<uint8_t>(stream_id >> 16);
+      *p++ = static_cast<uint8_t>(stream_id >> 24);
+    }
+    if (extended) {
+      p = store_be32(p, field);
+    }
+    add_header(header, p - header);
+
+    // The payload, with a type 3 header every chunk size bytes
+    uint8_t continuation[5];
+    p = continuation;
+    *p++ = static_cast<uint8_t>(3 << 6 | csid);
+    if (extended) {
+      p = store_be32(p, field);
+    }
+    size_t chunks = 1;
+    uint32_t left = chunk_size_;
+    for (size_t i = 0; i < count; i++) {
+      const uint8_t *data = payload[i].data;
+      size_t size = payload[i].length;
+      while (size) {
+        if (!left) {
+          add_header(continuation, p - continuation);
+          left = chunk_size_;
+          chunks++;
+        }
+        size_t m = std::min<size_t>(size, left);
+        out_slices_.push_back(io_slice{data, m});
+        data += m;
+        size -= m;
+        left -= static_cast<uint32_t>(m);
+      }
+    }
+
+    cs.active = true;
+    cs.stream_id = stream_id;
+    cs.type = static_cast<uint8_t>(type);
+    cs.length = length;
+    cs.timestamp = timestamp;
+    cs.has_delta = fmt != 0;
+    cs.delta = fmt ? field : 0;
+    messages_++;
+    chunks_ += chunks;
+  }
+
+  /// <summary>
+  /// Copies a chunk header into the arena and appends its output slice. The
+  /// slice points into the arena once the whole write is built, as the arena
+  /// may move while it grows.
+  /// </summary>
+  /// <param name="header">The chunk header.</param>
+  /// <param name="length">The chunk header length.</param>
+  void add_header(const uint8_t *header, size_t length) {
+    fixups_.push_back(std::make_pair(out_slices_.size(), arena_.size()));
+    arena_.insert(arena_.end(), header, header + length);
+    out_slices_.push_back(io_slice{nullptr, length});
+  }
+
+private:
+  /// <summary>
+  /// The under layer sink.
+  /// </summary>
+  flv_sink &sink_;
+
+  /// <summary>
+  /// The chunk size in use.
+  /// </summary>
+  uint32_t chunk_size_;
+
+  /// <summary>
+  /// The chunk size of the next messages.
+  /// </summary>
+  uint32_t pending_chunk_size_;
+
+  /// <summary>
+  /// The message stream id.
+  /// </summary>
+  uint32_t stream_id_;
+
+  /// <summary>
+  /// Whether onMetaData is sent as "@setDataFrame".
+  /// </summary>
+  bool set_data_frame_;
+
+  /// <summary>
+  /// The state of the chunk streams, by chunk stream id.
+  /// </summary>
+  chunk_stream_t streams_[CSID_VIDEO + 1];
+
+  /// <summary>
+  /// The payload of the Set Chunk Size message.
+  /// </summary>
+  uint8_t control_payload_[4];
+
+  /// <summary>
+  /// The reused list of the payload pieces of a message.
+  /// </summary>
+  std::vector<io_slice> payload_;
+
+  /// <summary>
+  /// The reused list of the slices of the gather write.
+  /// </summary>
+  std::vector<io_slice> out_slices_;
+
+  /// <summary>
+  /// The reused arena of the chunk headers.
+  /// </summary>
+  std::vector<uint8_t> arena_;
+
+  /// <summary>
+  /// The header slices to point into the arena, with their arena offsets.
+  /// </summary>
+  std::vector<std::pair<size_t, size_t>> fixups_;
+
+  /// <summary>
+  /// The count of messages written.
+  /// </summary>
+  uint64_t messages_;
+
+  /// <summary>
+  /// The count of chunks written.
+  /// </summary>
+  uint64_t chunks_;
+};
+
+namespace avc {
+/// <summary>
+/// The H.264 NAL unit types used by the Annex-B ingest.
+/// </summary>
+enum class nalu_type_t : uint8_t {
+  NonIDR = 1,
+  IDR = 5,
+  SEI = 6,
+  SPS = 7,
+  PPS = 8,
+  AUD = 9,
+};
+
+/// <summary>
+/// Represents a NAL unit inside the caller's buffer.
+/// </summary>
+struct nalu_view {
+  /// <summary>
+  /// The first byte of the NAL unit (the NAL unit header).
+  /// </summary>
+  const uint8_t *data;
+
+  /// <summary>
+  /// The length of the NAL unit, the start code excluded.
+  /// </summary>
+  uint32_t length;
+
+  /// <summary>
+  /// Gets the NAL unit type.
+  /// </summary>
+  /// <returns>The NAL unit type.</returns>
+  uint8_t type() const { return data[0] & 0x1f; }
+};
+
+/// <summary>
+/// Finds the first 3-byte start code (00 00 01) with the scalar scanner.
+/// </summary>
+/// <param name="p">The start of the range to be scanned.</param>
+/// <param name="end">The end of the range to be scanned.</param>
+/// <returns>The first byte of the start code, or end if none.</returns>
+inline const uint8_t *find_start_code_scalar(const uint8_t *p,
+                                             const uint8_t *end) {
+  while (end - p >= 3) {
+    if (p[2] > 1) {
+      p += 3;
+    } else if (p[1]) {
+      p += 2;
+    } else if (p[0] || p[2] != 1) {
+      p++;
+    } else {
+      return p;
+    }
+  }
+  return end;
+}
+
+// @cond PRIVATE_ENTITY
+/// <summary>
+/// Gets the index of the lowest set bit of a non-zero mask.
+/// </summary>
+// @endcond
+inline uint32_t lowest_bit_index(uint32_t mask) {
+#if defined(_MSC_VER)
+  unsigned long index = 0;
+  _BitScanForward(&index, mask);
+  return static_cast<uint32_t>(index);
+#else
+  return static_cast<uint32_t>(__builtin_ctz(mask));
+#endif
+}
+
+/// <summary>
+/// Finds the first 3-byte start code (00 00 01). This uses the widest
+/// vector extension enabled at compile time (AVX2, then SSE2) and falls back
+/// to the scalar scanner for the tail and for other targets. Define
+/// FLV_NO_SIMD to force the scalar scanner.
+/// </summary>
+/// <param name="p">The start of the range to be scanned.</param>
+/// <param name="end">The end of the range to be scanned.</param>
+/// <returns>The first byte of the start code, or end if none.</returns>
+inline const uint8_t *find_start_code(const uint8_t *p, const uint8_t *end) {
+#if FLV_HAS_AVX2
+  const __m256i zero32 = _mm256_setzero_si256();
+  const __m256i one32 = _mm256_set1_epi8(1);
+  while (end - p >= 32 + 2) {
+    __m256i a = _mm256_loadu_si256((const __m256i *)p);
+    __m256i b = _mm256_loadu_si256((const __m256i *)(p + 1));
+    __m256i c = _mm256_loadu_si256((const __m256i *)(p + 2));
+    __m256i m = _mm256_and_si256(
+        _mm256_and_si256(_mm256_cmpeq_epi8(a, zero32),
+                         _mm256_cmpeq_epi8(b, zero32)),
+        _mm256_cmpeq_epi8(c, one32));
+    uint32_t mask = static_cast<uint32_t>(_mm256_movemask_epi8(m));
+    if (mask) {
+      return p + lowest_bit_index(mask);
+    }
+    p += 32;
+  }
+#endif
+#if FLV_HAS_SSE2
+  const __m128i zero16 = _mm_setzero_si128();
+  const __m128i one16 = _mm_set1_epi8(1);
+  while (end - p >= 16 + 2) {
+    __m128i a = _mm_loadu_si128((const __m128i *)p);
+    __m128i b = _mm_loadu_si128((const __m128i *)(p + 1));
+    __m128i c = _mm_loadu_si128((const __m128i *)(p + 2));
+    __m128i m = _mm_and_si128(
+        _mm_and_si128(_mm_cmpeq_epi8(a, zero16), _mm_cmpeq_epi8(b, zero16)),
+        _mm_cmpeq_epi8(c, one16));
+    uint32_t mask = static_cast<uint32_t>(_mm_movemask_epi8(m));
+    if (mask) {
+      return p + lowest_bit_index(mask);
+    }
+    p += 16;
+  }
+#endif
+  return find_start_code_scalar(p, end);
+}
+
+/// <summary>
+/// Gets the next NAL unit of an Annex-B byte stream. The leading zero byte
+/// of 4-byte start codes and the trailing zero bytes are not part of the
+/// returned NAL unit.
+/// </summary>
+/// <param name="cursor">
+/// The scan position, advanced to the start code of the next NAL unit.
+/// </param>
+/// <param name="end">The end of the byte stream.</param>
+/// <param name="nalu">The NAL unit found.</param>
+/// <returns>True if a NAL unit was found; otherwise false.</returns>
+inline bool next_nalu(const uint8_t *&cursor, const uint8_t *end,
+                      nalu_view &nalu) {
+  const uint8_t *sc = find_start_code(cursor, end);
+  while (sc != end) {
+    const uint8_t *begin = sc + 3;
+    const uint8_t *next = find_start_code(begin, end);
+    const uint8_t *last = next;
+    while (last > begin && last[-1] == 0) {
+      last--;
+    }
+    cursor = next;
+    if (last > begin) {
+      nalu.data = begin;
+      nalu.length = static_cast<uint32_t>(last - begin);
+      return true;
+    }
+    sc = next;
+  }
+  cursor = end;
+  return false;
+}
+
+/// <summary>
+/// Rewrites an Annex-B byte stream to the AVCC format in place, replacing
+/// every start code with the 4-byte big-endian length of its NAL unit. This
+/// is only possible when the stream starts with a start code and every start
+/// code is 4 bytes long (00 00 00 01), otherwise the data is left untouched.
+/// </summary>
+/// <param name="data">The byte stream.</param>
+/// <param name="length">The length of the byte stream.</param>
+/// <returns>True if the data was rewritten; otherwise false.</returns>
+inline bool annexb_to_avcc_in_place(uint8_t *data, size_t length) {
+  const uint8_t *end = data + length;
+
+  // Validate all the start codes first, so a failure leaves the data intact.
+  // Shorter data cannot hold a 4-byte start code, even when the scan stops
+  // at its end right after a zero byte
+  if (length < 4) {
+    return false;
+  }
+  const uint8_t *sc = find_start_code(data, end);
+  if (sc != data + 1 || data[0] != 0) {
+    return false;
+  }
+  while (sc != end) {
+    if (sc == data || sc[-1] != 0) {
+      return false;
+    }
+    sc = find_start_code(sc + 3, end);
+  }
+
+  uint8_t *prefix = data;
+  sc = find_start_code(data + 4, end);
+  while (true) {
+    const uint8_t *nalu_end = (sc == end) ? end : sc - 1;
+    uint32_t size = static_cast<uint32_t>(nalu_end - (prefix + 4));
+    store_be32(prefix, size);
+    if (sc == end) {
+      break;
+    }
+    prefix = data + (sc - 1 - data);
+    sc = find_start_code(sc + 3, end);
+  }
+  return true;
+}
+
+// @cond PRIVATE_ENTITY
+/// <summary>
+/// Represents the Exp-Golomb bit reader over an RBSP with emulation
+/// prevention bytes.
+/// </summary>
+// @endcond
+class rbsp_bit_reader {
+public:
+  rbsp_bit_reader(const uint8_t *data, size_t length)
+      : p_(data), end_(data + length), zeros_(0), byte_(0), bits_(0) {}
+
+  bool read_bit(uint32_t &bit) {
+    if (!bits_) {
+      if (p_ == end_) {
+        return false;
+      }
+      if (zeros_ >= 2 && *p_ == 0x03) {
+        zeros_ = 0;
+        if (++p_ == end_) {
+          return false;
+        }
+      }
+      byte_ = *p_++;
+      zeros_ = byte_ ? 0 : zeros_ + 1;
+      bits_ = 8;
+    }
+    bit = (byte_ >> --bits_) & 0x01;
+    return true;
+  }
+
+  bool read_ue(uint32_t &v) {
+    uint32_t leading = 0;
+    uint32_t bit = 0;
+    while (read_bit(bit) && !bit) {
+      if (++leading > 31) {
+        return false;
+      }
+    }
+    if (!bit) {
+      return false;
+    }
+    v = 0;
+    for (uint32_t i = 0; i < leading; i++) {
+      if (!read_bit(bit)) {
+        return false;
+      }
+      v = (v << 1) | bit;
+    }
+    v += (1u << leading) - 1;
+    return true;
+  }
+
+private:
+  const uint8_t *p_;
+  const uint8_t *end_;
+  uint32_t zeros_;
+  uint8_t byte_;
+  uint32_t bits_;
+};
+
+/// <summary>
+/// Builds the AVCDecoderConfigurationRecord from one SPS and one PPS. The
+/// chroma format and bit depth extension of the High profiles is parsed from
+/// the SPS. The NAL unit length size is always 4 bytes.
+/// </summary>
+/// <param name="sps">The SPS NAL unit, header included.</param>
+/// <param name="pps">The PPS NAL unit, header included.</param>
+/// <param name="record">The buffer to receive the record.</param>
+/// <returns>True if successful; otherwise false.</returns>
+inline bool build_decoder_config(const nalu_view &sps, const nalu_view &pps,
+                                 std::vector<uint8_t> &record) {
+  if (sps.length < 4 || sps.length > 0xffff || !pps.length ||
+      pps.length > 0xffff) {
+    return false;
+  }
+
+  uint8_t profile = sps.data[1];
+  record.clear();
+  record.reserve(11 + 4 + sps.length + pps.length);
+  record.emplace_back(1);           // configurationVersion
+  record.emplace_back(profile);     // AVCProfileIndication
+  record.emplace_back(sps.data[2]); // profile_compatibility
+  record.emplace_back(sps.data[3]); // AVCLevelIndication
+  record.emplace_back(0xff);        // lengthSizeMinusOne = 3
+  record.emplace_back(0xe1);        // numOfSequenceParameterSets = 1
+  record.emplace_back((sps.length & 0xff00) >> 8);
+  record.emplace_back((sps.length & 0x00ff));
+  record.insert(record.end(), sps.data, sps.data + sps.length);
+  record.emplace_back(1); // numOfPictureParameterSets
+  record.emplace_back((pps.length & 0xff00) >> 8);
+  record.emplace_back((pps.length & 0x00ff));
+  record.insert(record.end(), pps.data, pps.data + pps.length);
+
+  if (profile == 100 || profile == 110 || profile == 122 || profile == 144) {
+    rbsp_bit_reader reader(sps.data + 4, sps.length - 4);
+    uint32_t sps_id = 0;
+    uint32_t chroma_format_idc = 0;
+    uint32_t separate_colour_plane = 0;
+    uint32_t bit_depth_luma = 0;
+    uint32_t bit_depth_chroma = 0;
+    if (!reader.read_ue(sps_id) || !reader.read_ue(chroma_format_idc) ||
+        (chroma_format_idc == 3 && !reader.read_bit(separate_colour_plane)) ||
+        !reader.read_ue(bit_depth_luma) || !reader.read_ue(bit_depth_chroma)) {
+      return false;
+    }
+    record.emplace_back(0xfc | (chroma_format_idc & 0x03));
+    record.emplace_back(0xf8 | (bit_depth_luma & 0x07));
+    record.emplace_back(0xf8 | (bit_depth_chroma & 0x07));
+    record.emplace_back(0); // numOfSequenceParameterSetExt
+  }
+  return true;
+}
+} // namespace avc
+
+namespace aac {
+/// <summary>
+/// The size of an ADTS header without CRC.
+/// </summary>
+static const uint32_t ADTS_HEADER_SIZE = 7;
+
+/// <summary>
+/// The count of PCM samples per AAC frame.
+/// </summary>
+static const uint32_t SAMPLES_PER_FRAME = 1024;
+
+/// <summary>
+/// Represents an ADTS frame inside the caller's buffer.
+/// </summary>
+struct adts_frame {
+  /// <summary>
+  /// The MPEG-4 audio object type (ADTS profile + 1, 2 for AAC-LC).
+  /// </summary>
+  uint8_t object_type;
+
+  /// <summary>
+  /// The sampling frequency index.
+  /// </summary>
+  uint8_t sampling_index;
+
+  /// <summary>
+  /// The channel configuration.
+  /// </summary>
+  uint8_t channel_config;
+
+  /// <summary>
+  /// The first byte of the raw AAC data, after the header (and CRC).
+  /// </summary>
+  const uint8_t *data;
+
+  /// <summary>
+  /// The length of the raw AAC data.
+  /// </summary>
+  uint32_t length;
+
+  /// <summary>
+  /// The count of raw data blocks in the multi-block frames skipped before
+  /// the frame, each lasting SAMPLES_PER_FRAME samples.
+  /// </summary>
+  uint32_t skipped_blocks;
+};
+
+/// <summary>
+/// Gets the sampling frequency of a sampling frequency index.
+/// </summary>
+/// <param name="index">The sampling frequency index.</param>
+/// <returns>The sampling frequency in Hz, 0 if the index is invalid.</returns>
+inline uint32_t sampling_frequency(uint8_t index) {
+  static const uint32_t frequencies[13] = {96000, 88200, 64000, 48000, 44100,
+                                           32000, 24000, 22050, 16000, 12000,
+                                           11025, 8000,  7350};
+  return index < 13 ? frequencies[index] : 0;
+}
+
+/// <summary>
+/// Gets the next ADTS frame of a byte stream. Bytes not starting a valid
+/// header are skipped. A truncated last frame is not returned. Frames with
+/// more than one raw data block are skipped whole: the block boundaries
+/// cannot be found without decoding them, and an FLV AACAudioPacket holds
+/// one block. Their blocks are counted in skipped_blocks, also when no frame
+/// follows them, so that the caller can keep its timestamps in step.
+/// </summary>
+/// <param name="cursor">
+/// The scan position, advanced past the frame found.
+/// </param>
+/// <param name="end">The end of the byte stream.</param>
+/// <param name="frame">The frame found.</param>
+/// <returns>True if a frame was found; otherwise false.</returns>
+inline bool next_adts_frame(const uint8_t *&cursor, const uint8_t *end,
+                            adts_frame &frame) {
+  const uint8_t *p = cursor;
+  frame.skipped_blocks = 0;
+  while (end - p >= (ptrdiff_t)ADTS_HEADER_SIZE) {
+    // Syncword 0xfff and layer 0
+    if (p[0] != 0xff || (p[1] & 0xf6) != 0xf0) {
+      p++;
+      continue;
+    }
+    uint32_t header_size = (p[1] & 0x01) ? ADTS_HEADER_SIZE : 9;
+    uint32_t frame_length =
+        (p[3] & 0x03) << 11 | p[4] << 3 | (p[5] & 0xe0) >> 5;
+    uint8_t sampling_index = (p[2] & 0x3c) >> 2;
+    if (frame_length < header_size || !sampling_frequency(sampling_index)) {
+      p++;
+      continue;
+    }
+    if (end - p < (ptrdiff_t)frame_length) {
+      break;
+    }
+    if (p[6] & 0x03) {
+      // number_of_raw_data_blocks_in_frame is not 0
+      frame.skipped_blocks += (p[6] & 0x03) + 1u;
+      p += frame_length;
+      continue;
+    }
+    frame.object_type = static_cast<uint8_t>((p[2] >> 6) + 1);
+    frame.sampling_index = sampling_index;
+    frame.channel_config =
+        static_cast<uint8_t>((p[2] & 0x01) << 2 | (p[3] & 0xc0) >> 6);
+    frame.data = p + header_size;
+    frame.length = frame_length - header_size;
+    cursor = p + frame_length;
+    return true;
+  }
+  cursor = end;
+  return false;
+}
+
+/// <summary>
+/// Builds the 2-byte AudioSpecificConfig of an ADTS frame.
+/// </summary>
+/// <param name="frame">The frame.</param>
+/// <param name="config">The buffer of 2 bytes to receive the config.</param>
+inline void build_audio_specific_config(const adts_frame &frame,
+                                        uint8_t *config) {
+  config[0] = static_cast<uint8_t>(frame.object_type << 3 |
+                                   frame.sampling_index >> 1);
+  config[1] = static_cast<uint8_t>((frame.sampling_index & 0x01) << 7 |
+                                   frame.channel_config << 3);
+}
+} // namespace aac
+
+/// <summary>
+/// Gets the length of a null-terminated string at compile time.
+/// </summary>
+/// <param name="s">The string.</param>
+/// <returns>The length.</returns>
+constexpr size_t const_strlen(const char *s) {
+  return *s ? 1 + const_strlen(s + 1) : 0;
+}
+
+/// <summary>
+/// Gets the serialized size of a schema key: the property name, the type
+/// marker and the value.
+/// </summary>
+/// <returns>The size in bytes.</returns>
+template <class Key> constexpr size_t meta_key_size() {
+  return 2 + const_strlen(Key::key()) +
+         (Key::type() == amf::NumberType ? 9 : 2);
+}
+
+/// <summary>
+/// Computes the serialized size of the schema keys.
+/// </summary>
+template <class... Keys> struct meta_keys_size;
+template <> struct meta_keys_size<> {
+  static constexpr size_t value = 0;
+};
+template <class Key, class... Rest> struct meta_keys_size<Key, Rest...> {
+  static constexpr size_t value =
+      meta_key_size<Key>() + meta_keys_size<Rest...>::value;
+};
+
+/// <summary>
+/// Computes the offset of the key Target from the first key of the schema.
+/// </summary>
+template <class Target, class... Keys> struct meta_key_offset;
+template <class Target, class... Rest>
+struct meta_key_offset<Target, Target, Rest...> {
+  static constexpr size_t value = 0;
+};
+template <class Target, class Key, class... Rest>
+struct meta_key_offset<Target, Key, Rest...> {
+  static constexpr size_t value =
+      meta_key_size<Key>() + meta_key_offset<Target, Rest...>::value;
+};
+
+/// <summary>
+/// Represents the position of a value slot of a meta_template.
+/// </summary>
+struct meta_slot_info {
+  /// <summary>
+  /// The property name.
+  /// </summary>
+  const char *key;
+
+  /// <summary>
+  /// The value type.
+  /// </summary>
+  amf::amf_value_type_t type;
+
+  /// <summary>
+  /// The offset of the value (after the type marker) in the tag body.
+  /// </summary>
+  size_t offset;
+};
+
+/// <summary>
+/// Represents an onMetaData script tag body of a fixed schema: an ECMA Array
+/// of the Number and Boolean keys declared with FLV_META_KEY, in the order
+/// given. The size and the offset of every value are compile-time constants,
+/// and the serialized bytes are built once per schema, so a template is a
+/// memcpy of that image and setting a value is one big-endian store.
+/// </summary>
+/// <example>
+/// FLV_META_KEY(duration_key, "duration", NumberType);
+/// FLV_META_KEY(stereo_key, "stereo", BooleanType);
+/// flv::meta_template&lt;duration_key, stereo_key&gt; meta;
+/// meta.set&lt;stereo_key&gt;(true);
+/// builder.append_meta_tag(meta);
+/// </example>
+template <class... Keys> class meta_template {
+public:
+  static_assert(sizeof...(Keys) > 0, "The schema has no keys");
+
+  /// <summary>
+  /// The size of the "onMetaData" String and the ECMA Array header.
+  /// </summary>
+  static constexpr size_t HEADER_SIZE = 1 + 2 + 10 + 1 + 4;
+
+  /// <summary>
+  /// The size of the tag body.
+  /// </summary>
+  static constexpr size_t SIZE =
+      HEADER_SIZE + meta_keys_size<Keys...>::value + 3;
+
+  /// <summary>
+  /// Gets the offset of the value of a key (after the type marker) in the
+  /// tag body.
+  /// </summary>
+  /// <returns>The offset.</returns>
+  template <class Key> static constexpr size_t offset() {
+    return HEADER_SIZE + meta_key_offset<Key, Keys...>::value + 2 +
+           const_strlen(Key::key()) + 1;
+  }
+
+  /// <summary>
+  /// Constructs an instance with all the values 0 or false.
+  /// </summary>
+  meta_template() { memcpy(bytes_, image(), SIZE); }
+
+  /// <summary>
+  /// Sets a Number value.
+  /// </summary>
+  /// <param name="v">The value.</param>
+  /// <returns>The self-reference.</returns>
+  template <class Key> meta_template &set(double v) {
+    static_assert(Key::type() == amf::NumberType, "The key is not a Number");
+    store_be_f64(bytes_ + offset<Key>(), v);
+    return *this;
+  }
+
+  /// <summary>
+  /// Sets a Boolean value.
+  /// </summary>
+  /// <param name="v">The value.</param>
+  /// <returns>The self-reference.</returns>
+  template <class Key> meta_template &set(bool v) {
+    static_assert(Key::type() == amf::BooleanType, "The key is not a Boolean");
+    bytes_[offset<Key>()] = v ? 1 : 0;
+    return *this;
+  }
+
+  /// <summary>
+  /// Gets the tag body.
+  /// </summary>
+  /// <returns>The tag body.</returns>
+  const uint8_t *data() const { return bytes_; }
+
+  /// <summary>
+  /// Gets the size of the tag body.
+  /// </summary>
+  /// <returns>The size of the tag body.</returns>
+  static size_t size() { return SIZE; }
+
+  /// <summary>
+  /// Gets the value slots, in the schema order.
+  /// </summary>
+  /// <returns>The value slots, sizeof...(Keys) of them.</returns>
+  static const meta_slot_info *slots() {
+    static const meta_slot_info table[] = {
+        {Keys::key(), Keys::type(), offset<Keys>()}...};
+    return table;
+  }
+
+private:
+  /// <summary>
+  /// Gets the serialized bytes of the schema with zero values, built on the
+  /// first use.
+  /// </summary>
+  /// <returns>The bytes, SIZE of them.</returns>
+  static const uint8_t *image() {
+    struct image_t {
+      image_t() {
+        uint8_t *p = bytes;
+        static const uint8_t header[HEADER_SIZE - 4] = {
+            amf::StringType, 0, 10, 'o', 'n', 'M', 'e', 't', 'a', 'D', 'a',
+            't', 'a', amf::ECMAArrayType};
+        memcpy(p, header, sizeof(header));
+        p += sizeof(header);
+        p = store_be32(p, sizeof...(Keys));
+        const meta_slot_info *slot = slots();
+        for (size_t i = 0; i < sizeof...(Keys); i++) {
+          size_t length = strlen(slot[i].key);
+          p = store_be16(p, static_cast<uint16_t>(length));
+          memcpy(p, slot[i].key, length);
+          p += length;
+          *p++ = slot[i].type;
+          size_t value = slot[i].type == amf::NumberType ? 8 : 1;
+          memset(p, 0, value);
+          p += value;
+        }
+        *p++ = 0;
+        *p++ = 0;
+        *p++ = amf::ObjectEndType;
+        assert(p == bytes + SIZE);
+      }
+      uint8_t bytes[SIZE];
+    };
+    static const image_t image;
+    return image.bytes;
+  }
+
+private:
+  /// <summary>
+  /// The tag body.
+  /// </summary>
+  uint8_t bytes_[SIZE];
+};
+
+template <class... Keys>
+constexpr size_t meta_template<Keys...>::HEADER_SIZE;
+template <class... Keys> constexpr size_t meta_template<Keys...>::SIZE;
+
+/// <summary>
+/// Represents a snapshot of the runtime statistics of a builder. All the
+/// counters are zero when FLV_BUILDER_DISABLE_STATS is defined.
+/// </summary>
+struct flv_builder_stats {
+  /// <summary>
+  /// The count of write latency histogram buckets.
+  /// </summary>
+  static const size_t LATENCY_BUCKETS = 32;
+
+  /// <summary>
+  /// Represents the counters of one tag type.
+  /// </summary>
+  struct tag_counters {
+    /// <summary>
+    /// The count of tags.
+    /// </summary>
+    uint64_t tags;
+
+    /// <summary>
+    /// The count of stream bytes, tag header and tag size included.
+    /// </summary>
+    uint64_t bytes;
+  };
+
+  /// <summary>
+  /// The audio tags.
+  /// </summary>
+  tag_counters audio;
+
+  /// <summary>
+  /// The video tags.
+  /// </summary>
+  tag_counters video;
+
+  /// <summary>
+  /// The script data (meta) tags.
+  /// </summary>
+  tag_counters script;
+
+  /// <summary>
+  /// The count of video keyframes.
+  /// </summary>
+  uint64_t keyframes;
+
+  /// <summary>
+  /// The timestamp of the last audio tag.
+  /// </summary>
+  uint32_t last_audio_dts;
+
+  /// <summary>
+  /// The timestamp of the last video tag.
+  /// </summary>
+  uint32_t last_video_dts;
+
+  /// <summary>
+  /// The count of sink writes.
+  /// </summary>
+  uint64_t sink_writes;
+
+  /// <summary>
+  /// The nanoseconds spent in sink writes and flushes.
+  /// </summary>
+  uint64_t sink_blocked_ns;
+
+  /// <summary>
+  /// The sink write latency histogram: bucket i counts the writes which
+  /// took [2^i, 2^(i+1)) nanoseconds, the last bucket is open ended.
+  /// </summary>
+  uint64_t write_latency[LATENCY_BUCKETS];
+
+  /// <summary>
+  /// Gets the histogram bucket of a latency.
+  /// </summary>
+  /// <param name="ns">The latency in nanoseconds.</param>
+  /// <returns>The bucket index.</returns>
+  static size_t latency_bucket(uint64_t ns) {
+    if (ns < 2) {
+      return 0;
+    }
+#if defined(_MSC_VER) && defined(_M_X64)
+    unsigned long index = 0;
+    _BitScanReverse64(&index, ns);
+    size_t bucket = index;
+#elif defined(_MSC_VER)
+    size_t bucket = 0;
+    while (ns >>= 1) {
+      bucket++;
+    }
+#else
+    size_t bucket = static_cast<size_t>(63 - __builtin_clzll(ns));
+#endif
+    return bucket < LATENCY_BUCKETS ? bucket : LATENCY_BUCKETS - 1;
+  }
+
+  /// <summary>
+  /// Gets an upper bound of a sink write latency percentile.
+  /// </summary>
+  /// <param name="p">The percentile, 0 to 1.</param>
+  /// <returns>The exclusive upper bound in nanoseconds of the bucket holding
+  /// the percentile, 0 if there were no writes.</returns>
+  uint64_t write_latency_percentile(double p) const {
+    uint64_t total = 0;
+    for (size_t i = 0; i < LATENCY_BUCKETS; i++) {
+      total += write_latency[i];
+    }
+    if (!total) {
+      return 0;
+    }
+    uint64_t rank = static_cast<uint64_t>(p * (total - 1));
+    uint64_t seen = 0;
+    size_t i = 0;
+    for (; i < LATENCY_BUCKETS - 1; i++) {
+      seen += write_latency[i];
+      if (seen > rank) {
+        break;
+      }
+    }
+    return uint64_t(1) << (i + 1);
+  }
+};
+
+#if FLV_BUILDER_STATS
+// @cond PRIVATE_ENTITY
+/// <summary>
+/// Represents the live counters behind flv_builder_stats. There is one
+/// writer at a time (the thread appending to the builder), so the counters
+/// are bumped with relaxed loads and stores rather than read-modify-write
+/// operations; any thread can take a snapshot. Each counter is exact, the
+/// snapshot as a whole is not taken atomically.
+/// </summary>
+// @endcond
+class flv_stats_counters {
+private:
+  /// <summary>
+  /// The tags per tag type: audio, video and script.
+  /// </summary>
+  std::atomic<uint64_t> tags_[3];
+
+  /// <summary>
+  /// The bytes per tag type: audio, video and script.
+  /// </summary>
+  std::atomic<uint64_t> bytes_[3];
+
+  /// <summary>
+  /// The count of video keyframes.
+  /// </summary>
+  std::atomic<uint64_t> keyframes_;
+
+  /// <summary>
+  /// The timestamp of the last audio tag.
+  /// </summary>
+  std::atomic<uint32_t> last_audio_dts_;
+
+  /// <summary>
+  /// The timestamp of the last video tag.
+  /// </summary>
+  std::atomic<uint32_t> last_video_dts_;
+
+  /// <summary>
+  /// The nanoseconds spent in the sink.
+  /// </summary>
+  std::atomic<uint64_t> blocked_ns_;
+
+  /// <summary>
+  /// The sink write latency histogram.
+  /// </summary>
+  std::atomic<uint64_t> write_latency_[flv_builder_stats::LATENCY_BUCKETS];
+
+private:
+  DISALLOW_COPY_AND_ASSIGN(flv_stats_counters);
+
+  /// <summary>
+  /// Adds to a counter which has a single writer.
+  /// </summary>
+  /// <param name="counter">The counter.</param>
+  /// <param name="v">The value to be added.</param>
+  static void bump(std::atomic<uint64_t> &counter, uint64_t v) {
+    counter.store(counter.load(std::memory_order_relaxed) + v,
+                  std::memory_order_relaxed);
+  }
+
+  /// <summary>
+  /// Gets the counter index of a tag type.
+  /// </summary>
+  /// <param name="type">The tag type.</param>
+  /// <returns>The index.</returns>
+  static size_t index_of(tag_type_t type) {
+    return type == tag_type_t::Audio ? 0 : type == tag_type_t::Video ? 1 : 2;
+  }
+
+public:
+  /// <summary>
+  /// Constructs an instance with all counters zero.
+  /// </summary>
+  flv_stats_counters() { reset(); }
+
+  /// <summary>
+  /// Resets all counters to zero.
+  /// </summary>
+  void reset() {
+    for (size_t i = 0; i < 3; i++) {
+      tags_[i].store(0, std::memory_order_relaxed);
+      bytes_[i].store(0, std::memory_order_relaxed);
+    }
+    keyframes_.store(0, std::memory_order_relaxed);
+    last_audio_dts_.store(0, std::memory_order_relaxed);
+    last_video_dts_.store(0, std::memory_order_relaxed);
+    blocked_ns_.store(0, std::memory_order_relaxed);
+    for (size_t i = 0; i < flv_builder_stats::LATENCY_BUCKETS; i++) {
+      write_latency_[i].store(0, std::memory_order_relaxed);
+    }
+  }
+
+  /// <summary>
+  /// Counts a tag.
+  /// </summary>
+  /// <param name="type">The tag type.</param>
+  /// <param name="timestamp">The timetamp of the tag.</param>
+  /// <param name="bytes">The stream bytes of the tag.</param>
+  /// <param name="key_frame">Whether the tag is a video keyframe.</param>
+  void add_tag(tag_type_t type, uint32_t timestamp, uint64_t bytes,
+               bool key_frame) {
+    size_t i = index_of(type);
+    bump(tags_[i], 1);
+    bump(bytes_[i], bytes);
+    if (type == tag_type_t::Audio) {
+      last_audio_dts_.store(timestamp, std::memory_order_relaxed);
+    } else if (type == tag_type_t::Video) {
+      last_video_dts_.store(timestamp, std::memory_order_relaxed);
+      if (key_frame) {
+        bump(keyframes_, 1);
+      }
+    }
+  }
+
+  /// <summary>
+  /// Counts a sink write.
+  /// </summary>
+  /// <param name="ns">The nanoseconds the write took.</param>
+  void add_write(uint64_t ns) {
+    bump(write_latency_[flv_builder_stats::latency_bucket(ns)], 1);
+    bump(blocked_ns_, ns);
+  }
+
+  /// <summary>
+  /// Counts time spent in the sink outside of the writes (flushes).
+  /// </summary>
+  /// <param name="ns">The nanoseconds spent.</param>
+  void add_blocked(uint64_t ns) { bump(blocked_ns_, ns); }
+
+  /// <summary>
+  /// Takes a snapshot of the counters.
+  /// </summary>
+  /// <param name="stats">The snapshot.</param>
+  void snapshot(flv_builder_stats &stats) const {
+    flv_builder_stats::tag_counters *types[3] = {&stats.audio, &stats.video,
+                                                 &stats.script};
+    for (size_t i = 0; i < 3; i++) {
+      types[i]->tags = tags_[i].load(std::memory_order_relaxed);
+      types[i]->bytes = bytes_[i].load(std::memory_order_relaxed);
+    }
+    stats.keyframes = keyframes_.load(std::memory_order_relaxed);
+    stats.last_audio_dts = last_audio_dts_.load(std::memory_order_relaxed);
+    stats.last_video_dts = last_video_dts_.load(std::memory_order_relaxed);
+    stats.sink_blocked_ns = blocked_ns_.load(std::memory_order_relaxed);
+    stats.sink_writes = 0;
+    for (size_t i = 0; i < flv_builder_stats::LATENCY_BUCKETS; i++) {
+      stats.write_latency[i] =
+          write_latency_[i].load(std::memory_order_relaxed);
+      stats.sink_writes += stats.write_latency[i];
+    }
+  }
+};
+#endif
+
+/// <summary>
+/// Represents the FLV stream builder.
+/// </summary>
+class flv_stream_builder {
+private:
+  /// <summary>
+  /// The sink owned by the builder (the std::ostream adapter), if any.
+  /// </summary>
+  std::unique_ptr<flv_sink> owned_sink_;
+
+  /// <summary>
+  /// The under layer sink.
+  /// </summary>
+  flv_sink &sink_;
+
+  /// <summary>
+  /// The tag count already proceed.
+  /// </summary>
+  std::atomic<uint64_t> tag_count_;
+
+  /// <summary>
+  /// Indicates whether there is audio data in the stream.
+  /// </summary>
+  bool has_audio_;
+
+  /// <summary>
+  /// Indicates whether there is video data in the stream.
+  /// </summary>
+  bool has_video_;
+
+  /// <summary>
+  /// The reused slice list for tags made of many pieces.
+  /// </summary>
+  std::vector<io_slice> slice_scratch_;
+
+  /// <summary>
+  /// The last SPS seen by the Annex-B ingest.
+  /// </summary>
+  std::vector<uint8_t> sps_;
+
+  /// <summary>
+  /// The last PPS seen by the Annex-B ingest.
+  /// </summary>
+  std::vector<uint8_t> pps_;
+
+  /// <summary>
+  /// The AVCDecoderConfigurationRecord built from the SPS and PPS.
+  /// </summary>
+  std::vector<uint8_t> avc_config_;
+
+  /// <summary>
+  /// Indicates whether the SPS or PPS changed since the last sequence header.
+  /// </summary>
+  bool avc_config_dirty_;
+
+  /// <summary>
+  /// The AudioSpecificConfig of the last AAC sequence header of the ADTS
+  /// ingest.
+  /// </summary>
+  uint8_t aac_config_[2];
+
+  /// <summary>
+  /// Indicates whether the ADTS ingest appended an AAC sequence header.
+  /// </summary>
+  bool aac_config_sent_;
+
+  /// <summary>
+  /// The reused NAL unit list of the Annex-B ingest.
+  /// </summary>
+  std::vector<avc::nalu_view> annexb_nalus_;
+
+  /// <summary>
+  /// The reused NAL unit length prefixes of the Annex-B ingest.
+  /// </summary>
+  std::vector<uint8_t> annexb_prefixes_;
+
+  /// <summary>
+  /// The reused tag body pieces of the Annex-B ingest.
+  /// </summary>
+  std::vector<io_slice> annexb_slices_;
+
+  /// <summary>
+  /// The count of bytes written to the sink.
+  /// </summary>
+  uint64_t position_;
+
+  /// <summary>
+  /// Represents an entry of the keyframe index.
+  /// </summary>
+  struct keyframe_entry {
+    double time;
+    double position;
+  };
+
+  /// <summary>
+  /// The meta numbers patched by finalize().
+  /// </summary>
+  enum meta_slot_e {
+    DurationSlot = 0,
+    FileSizeSlot,
+    LastKeyframeTimestampSlot,
+    VideoDataRateSlot,
+    AudioDataRateSlot,
+    MetaSlotCount,
+  };
+
+  /// <summary>
+  /// The stream offsets of the 8-byte values of the meta numbers, 0 if the
+  /// meta has no such number.
+  /// </summary>
+  uint64_t meta_slots_[MetaSlotCount];
+
+  /// <summary>
+  /// The largest audio or video timestamp.
+  /// </summary>
+  uint32_t last_timestamp_;
+
+  /// <summary>
+  /// The timestamp the duration is counted from.
+  /// </summary>
+  uint32_t start_timestamp_;
+
+  /// <summary>
+  /// The timestamp of the last video keyframe.
+  /// </summary>
+  uint32_t last_keyframe_timestamp_;
+
+  /// <summary>
+  /// The count of video tag data bytes.
+  /// </summary>
+  uint64_t video_bytes_;
+
+  /// <summary>
+  /// The count of audio tag data bytes.
+  /// </summary>
+  uint64_t audio_bytes_;
+
+  /// <summary>
+  /// The maximum count of keyframe index entries, 0 if the index is off.
+  /// </summary>
+  uint32_t keyframe_capacity_;
+
+  /// <summary>
+  /// The keyframe index entries.
+  /// </summary>
+  std::vector<keyframe_entry> keyframes_;
+
+  /// <summary>
+  /// Only every keyframe_stride_-th keyframe is indexed.
+  /// </summary>
+  uint64_t keyframe_stride_;
+
+  /// <summary>
+  /// The count of keyframes seen.
+  /// </summary>
+  uint64_t keyframe_seen_;
+
+  /// <summary>
+  /// The stream offset of the reserved keyframe index, 0 if not reserved.
+  /// </summary>
+  uint64_t keyframe_region_;
+
+  /// <summary>
+  /// The maximum count of tag body pieces written without the scratch list.
+  /// </summary>
+  static const size_t MAX_INLINE_SLICES = 6;
+
+  /// <summary>
+  /// The reused header arena of append_frames().
+  /// </summary>
+  std::vector<uint8_t> batch_arena_;
+
+  /// <summary>
+  /// The reused slice list of append_frames().
+  /// </summary>
+  std::vector<io_slice> batch_slices_;
+
+  /// <summary>
+  /// The arena bytes per frame: tag header, largest codec header, tag size.
+  /// </summary>
+  static const size_t BATCH_BYTES_PER_FRAME =
+      FLV_TAG_HEADER_SIZE + VIDEO_HEADER_SIZE + 4;
+
+#if FLV_BUILDER_STATS
+  /// <summary>
+  /// The runtime statistics.
+  /// </summary>
+  flv_stats_counters stats_;
+#endif
+
+private:
+  DISALLOW_COPY_AND_ASSIGN(flv_stream_builder);
+
+public:
+  /// <summary>
+  /// Constructs an instance of the FLV builder stream.
+  /// </summary>
+  /// <param name="s">The under layer stream.</param>
+  flv_stream_builder(std::ostream &s)
+      : owned_sink_(new ostream_sink(s)), sink_(*owned_sink_), tag_count_(0),
+        has_audio_(false), has_video_(false), avc_config_dirty_(false),
+        aac_config_sent_(false), position_(0), keyframe_capacity_(0),
+        keyframe_stride_(1), keyframe_seen_(0), keyframe_region_(0) {
+    reset_meta_slots();
+  }
+
+  /// <summary>
+  /// Constructs an instance of the FLV builder stream.
+  /// </summary>
+  /// <param name="sink">The under layer sink, must outlive the builder.</param>
+  flv_stream_builder(flv_sink &sink)
+      : sink_(sink), tag_count_(0), has_audio_(false), has_video_(false),
+        avc_config_dirty_(false), aac_config_sent_(false), position_(0),
+        keyframe_capacity_(0), keyframe_stride_(1), keyframe_seen_(0),
+        keyframe_region_(0) {
+    reset_meta_slots();
+  }
+
+  /// <summary>
+  /// Destructs the instance.
+  /// </summary>
+  ~flv_stream_builder() {}
+
+  /// <summary>
+  /// Flushes the under layer sink.
+  /// </summary>
+  void flush() { flush_sink(); }
+
+  /// <summary>
+  /// Takes a snapshot of the runtime statistics. Can be called from any
+  /// thread while another one appends.
+  /// </summary>
+  /// <returns>
+  /// The statistics, all zero with FLV_BUILDER_DISABLE_STATS.
+  /// </returns>
+  flv_builder_stats stats() const {
+    flv_builder_stats stats = flv_builder_stats();
+#if FLV_BUILDER_STATS
+    stats_.snapshot(stats);
+#endif
+    return stats;
+  }
+
+  /// <summary>
+  /// Enables the keyframe index for seekable recordings. The next meta tag
+  /// gets a "keyframes" object (times and filepositions) with room for the
+  /// specified count of entries, and the keyframes of the video tags are
+  /// tracked from then on. finalize() writes the index into the reserved
+  /// space. When there are more keyframes than entries, the index keeps an
+  /// evenly spaced subset of them.
+  /// </summary>
+  /// <param name="max_keyframes">
+  /// The maximum count of entries, up to MAX_KEYFRAME_INDEX_ENTRIES.
+  /// </param>
+  /// <returns>The self-reference.</returns>
+  /// <exception cref="std::invalid_argument">If the index cannot fit in a
+  /// meta tag.</exception>
+  flv_stream_builder &enable_keyframe_index(uint32_t max_keyframes) {
+    if (max_keyframes > MAX_KEYFRAME_INDEX_ENTRIES) {
+      throw std::invalid_argument("The keyframe index does not fit a tag");
+    }
+    keyframe_capacity_ = max_keyframes;
+    keyframes_.clear();
+    keyframes_.reserve(max_keyframes);
+    keyframe_stride_ = 1;
+    keyframe_seen_ = 0;
+    return *this;
+  }
+
+  /// <summary>
+  /// Sets the timestamp the duration patched by finalize() is counted from,
+  /// for recordings that do not start at 0.
+  /// </summary>
+  /// <param name="timestamp">The timestamp of the start.</param>
+  /// <returns>The self-reference.</returns>
+  flv_stream_builder &set_start_timestamp(uint32_t timestamp) {
+    start_timestamp_ = timestamp;
+    return *this;
+  }
+
+  /// <summary>
+  /// Finalizes the recording, then flushes the sink. Requires a seekable
+  /// sink. The numbers "duration", "filesize", "lastkeyframetimestamp",
+  /// "videodatarate" and "audiodatarate" of the last meta tag are
+  /// overwritten in place with the values tracked while appending (seconds
+  /// and kilobits per second, the duration counted from the start timestamp),
+  /// and the reserved keyframe index is written. Numbers missing from the meta are left out; nothing else is rewritten.
+  /// </summary>
+  /// <returns>True if successful; otherwise false.</returns>
+  bool finalize() {
+    bool ok = true;
+    double duration = last_timestamp_ > start_timestamp_
+                          ? (last_timestamp_ - start_timestamp_) / 1000.0
+                          : 0;
+    double values[MetaSlotCount];
+    values[DurationSlot] = duration;
+    values[FileSizeSlot] = static_cast<double>(position_);
+    values[LastKeyframeTimestampSlot] = last_keyframe_timestamp_ / 1000.0;
+    values[VideoDataRateSlot] =
+        duration > 0 ? video_bytes_ * 8 / 1000.0 / duration : 0;
+    values[AudioDataRateSlot] =
+        duration > 0 ? audio_bytes_ * 8 / 1000.0 / duration : 0;
+    for (int i = 0; i < MetaSlotCount; i++) {
+      if (meta_slots_[i]) {
+        uint8_t bytes[8];
+        store_be_f64(bytes, values[i]);
+        ok = sink_.write_at(meta_slots_[i], bytes, sizeof(bytes)) && ok;
+      }
+    }
+
+    if (keyframe_region_) {
+      std::vector<uint8_t> region;
+      build_keyframe_index(region, keyframes_);
+      ok = sink_.write_at(keyframe_region_, region.data(), region.size()) &&
+           ok;
+    }
+    flush_sink();
+    return ok;
+  }
+
+  /// <summary>
+  /// Initializes the FLV stream/file header and append it to the end of the
+  /// specified buffer.
+  /// </summary>
+  /// <param name="buf">The buffer to receive the header data.</param>
+  /// <param name="has_audio">Whether there is audio data or not.</param>
+  /// <param name="has_video">Whether there is video data or not.</param>
+  /// <returns>The self-reference.</returns>
+  flv_stream_builder &init_stream_header(bool has_audio, bool has_video) {
+    uint8_t buf[FLV_HEADER_SIZE + 4];
+
+    uint8_t flags = 0;
+    has_audio_ = has_audio;
+    if (has_audio_) {
+      flags |= 0x04;
+    }
+    has_video_ = has_video;
+    if (has_video_) {
+      flags |= 0x01;
+    }
+
+    // Signature
+    buf[0] = 'F';
+    buf[1] = 'L';
+    buf[2] = 'V';
+
+    // Version
+    buf[3] = 0x01;
+
+    // Flags
+    buf[4] = flags;
+
+    // Header size
+    store_be32(buf + 5, FLV_HEADER_SIZE);
+
+    // PreviousTagSize0
+    store_be32(buf + 9, 0);
+
+    io_slice slice = {buf, sizeof(buf)};
+    write_sink(&slice, 1);
+    position_ += sizeof(buf);
+    return *this;
+  }
+
+  /// <summary>
+  /// Appends a meta tag data to the end of the specified buffer. This method
+  /// uses the meta passed in as AFM type 2 and appends it to a constructed AMF
+  /// type 1. Then it constructs a meta tag (head + body) with the AMF type 1
+  /// and type 2 and append it to the end of the buffer.
+  /// </summary>
+  /// <param name="meta">
+  /// An AMF value which represents AMF type 2 of the meta tag data.
+  /// </param>
+  /// <returns>The self-reference.</returns>
+  flv_stream_builder &append_meta_tag(amf::amf_value_ref meta) {
+    return append_meta_tag(*meta);
+  }
+
+  /// <summary>
+  /// Appends a meta tag as append_meta_tag(amf::amf_value_ref) does, with
+  /// any AMF root, such as an amf::amf_tree rebuilt for every stream.
+  /// </summary>
+  /// <param name="meta">
+  /// An AMF root which represents AMF type 2 of the meta tag data.
+  /// </param>
+  /// <returns>The self-reference.</returns>
+  flv_stream_builder &append_meta_tag(const amf::amf_root &meta) {
+    // The onMetaData String and the meta go into one exact-size buffer, with
+    // room for the keyframe index and its two extra end markers when it is
+    // enabled
+    size_t meta_offset = 1 + 2 + ON_META_DATA_LENGTH;
+    std::vector<uint8_t> meta_data;
+    size_t index_size = 0;
+    if (keyframe_capacity_) {
+      index_size = 2 + 9 + 1 + KEYFRAME_INDEX_FIXED_SIZE +
+                   KEYFRAME_INDEX_ENTRY_SIZE * keyframe_capacity_ + 3;
+    }
+    meta_data.reserve(meta_offset + meta.serialized_size() + index_size);
+    meta_data.resize(meta_offset + meta.serialized_size());
+    uint8_t *p = meta_data.data();
+    *p++ = amf::StringType;
+    p = store_be16(p, ON_META_DATA_LENGTH);
+    memcpy(p, ON_META_DATA, ON_META_DATA_LENGTH);
+    meta.serialize_to(p + ON_META_DATA_LENGTH);
+    return append_meta_data(meta_data, meta_offset);
+  }
+
+  /// <summary>
+  /// Appends a meta tag whose body is the fixed schema template passed in.
+  /// The body is written as is, and the numbers patched by finalize() are
+  /// located from the slot offsets of the schema. When the keyframe index is
+  /// enabled, the body is copied once to make room for the index.
+  /// </summary>
+  /// <param name="meta">The meta template.</param>
+  /// <returns>The self-reference.</returns>
+  template <class... Keys>
+  flv_stream_builder &append_meta_tag(const meta_template<Keys...> &meta) {
+    if (keyframe_capacity_) {
+      std::vector<uint8_t> meta_data(meta.data(), meta.data() + meta.size());
+      return append_meta_data(meta_data, 1 + 2 + ON_META_DATA_LENGTH);
+    }
+    uint64_t base = position_ + FLV_TAG_HEADER_SIZE;
+    const meta_slot_info *slots = meta.slots();
+    for (int i = 0; i < MetaSlotCount; i++) {
+      meta_slots_[i] = 0;
+      for (size_t j = 0; j < sizeof...(Keys); j++) {
+        if (slots[j].type == amf::NumberType &&
+            !strcmp(slots[j].key, meta_slot_name(i))) {
+          meta_slots_[i] = base + slots[j].offset;
+        }
+      }
+    }
+    append_tag(tag_type_t::Script, 0, 0, meta.data(),
+               static_cast<uint32_t>(meta.size()));
+    return *this;
+  }
+
+  /// <summary>
+  /// Appends a new video tag to the end of the specified buffer. This method
+  /// uses the data passed in as an VIDEODATA to construct a video tag
+  /// with the VIDEODATA and appends it to the end of the buffer.
+  /// </summary>
+  /// <param name="timestamp">The timetamp of the tag.</param>
+  /// <param name="data">The video tag body data.</param>
+  /// <param name="length">The lenght of the tag body data.</param>
+  /// <returns>The self-reference.</returns>
+  flv_stream_builder &append_video_tag(uint32_t timestamp, const uint8_t *data,
+                                       uint32_t length) {
+    append_tag(tag_type_t::Video, timestamp, 0, data, length);
+    return *this;
+  }
+
+  /// <summary>
+  /// Appends a new video tag to the end of the specified buffer. This method
+  /// first uses the data passed in as an AVCDecoderConfigRecord to construct an
+  /// AVCVideoPacket, then constructs a VIDEODATA with the AVCVideoPacket.
+  /// Finally it constructs a video tag with the VIDEODATA and appends it to the
+  /// end of the buffer.
+  /// </summary>
+  /// <param name="timestamp">The timetamp of the tag.</param>
+  /// <param name="data">The AVCDecoderConfigRecord data.</param>
+  /// <param name="length">The data length.</param>
+  /// <returns>The self-reference.</returns>
+  flv_stream_builder &append_video_tag_with_avc_decoder_config(
+      uint32_t timestamp, const uint8_t *data, uint32_t length) {
+    append_avc_packet(timestamp, video_data_frame_type::INTER_FRAME,
+                      avc_video_packet_type::AvcSequenceHeader, 0, data,
+                      length);
+    return *this;
+  }
+
+  /// <summary>
+  /// Appends a new video tag to the end of the specified buffer. This method
+  /// first uses the data passed in as an NALU to construct an AVCVideoPacket,
+  /// then constructs a VIDEODATA with the AVCVideoPacket. Finally it constructs
+  /// a video tag with the VIDEODATA and appends it to the end of the buffer.
+  /// </summary>
+  /// <param name="timestamp">The timetamp of the tag.</param>
+  /// <param name="data">
+  /// The NALU data (AVC format, first 4 bytes represents the length).
+  /// </param> <param name="length">The data length.</param>
+  /// <param name="composition_time">
+  /// The composition time offset (pts - dts).
+  /// </param>
+  /// <param name="key_frame">Whether the frame is a key frame.</param>
+  /// <returns>The self-reference.</returns>
+  flv_stream_builder &
+  append_video_tag_with_avc_nalu_data(uint32_t timestamp, const uint8_t *data,
+                                      uint32_t length,
+                                      uint32_t composition_time = 0,
+                                      bool key_frame = false) {
+    append_avc_packet(timestamp,
+                      key_frame ? video_data_frame_type::KEY_FRAME
+                                : video_data_frame_type::INTER_FRAME,
+                      avc_video_packet_type::AvcNALU, composition_time, data,
+                      length);
+    return *this;
+  }
+
+  /// <summary>
+  /// Appends a new video tag to the end of the specified buffer with the
+  /// Annex-B (start code delimited) H.264 access unit passed in. The SPS and
+  /// PPS found in the access unit are taken out of the frame; whenever they
+  /// change, an AVCDecoderConfigurationRecord is built from them and appended
+  /// as the AVC sequence header first. The remaining NAL units are written as
+  /// one AVCVideoPacket with 4-byte length prefixes, pointing into the
+  /// caller's buffer without copying it. The frame is flagged as a key frame
+  /// when it contains an IDR slice.
+  /// </summary>
+  /// <param name="timestamp">The timetamp of the tag.</param>
+  /// <param name="data">The Annex-B access unit data.</param>
+  /// <param name="length">The data length.</param>
+  /// <param name="composition_time">The composition time offset.</param>
+  /// <returns>The self-reference.</returns>
+  flv_stream_builder &
+  append_video_tag_with_annexb_data(uint32_t timestamp, const uint8_t *data,
+                                    uint32_t length,
+                                    uint32_t composition_time = 0) {
+    const uint8_t *cursor = data;
+    const uint8_t *end = data + length;
+    bool key_frame = false;
+    avc::nalu_view nalu;
+    annexb_nalus_.clear();
+    while (avc::next_nalu(cursor, end, nalu)) {
+      switch (static_cast<avc::nalu_type_t>(nalu.type())) {
+      case avc::nalu_type_t::SPS:
+        update_parameter_set(sps_, nalu);
+        break;
+      case avc::nalu_type_t::PPS:
+        update_parameter_set(pps_, nalu);
+        break;
+      case avc::nalu_type_t::AUD:
+        break;
+      case avc::nalu_type_t::IDR:
+        key_frame = true;
+        annexb_nalus_.emplace_back(nalu);
+        break;
+      default:
+        annexb_nalus_.emplace_back(nalu);
+        break;
+      }
+    }
+
+    if (avc_config_dirty_ && !sps_.empty() && !pps_.empty()) {
+      avc::nalu_view sps = {sps_.data(), static_cast<uint32_t>(sps_.size())};
+      avc::nalu_view pps = {pps_.data(), static_cast<uint32_t>(pps_.size())};
+      if (avc::build_decoder_config(sps, pps, avc_config_)) {
+        append_avc_packet(timestamp, video_data_frame_type::KEY_FRAME,
+                          avc_video_packet_type::AvcSequenceHeader, 0,
+                          avc_config_.data(),
+                          static_cast<uint32_t>(avc_config_.size()));
+        avc_config_dirty_ = false;
+      }
+    }
+
+    if (annexb_nalus_.empty()) {
+      return *this;
+    }
+
+    // Slot 0 is for the AVCVideoPacket header, then a length prefix and the
+    // NAL unit in the caller's buffer for every NAL unit
+    annexb_prefixes_.resize(annexb_nalus_.size() * 4);
+    annexb_slices_.resize(1 + annexb_nalus_.size() * 2);
+    for (size_t i = 0; i < annexb_nalus_.size(); i++) {
+      uint8_t *prefix = annexb_prefixes_.data() + i * 4;
+      uint32_t size = annexb_nalus_[i].length;
+      store_be32(prefix, size);
+      annexb_slices_[1 + i * 2].data = prefix;
+      annexb_slices_[1 + i * 2].length = 4;
+      annexb_slices_[2 + i * 2].data = annexb_nalus_[i].data;
+      annexb_slices_[2 + i * 2].length = size;
+    }
+
+    uint8_t header[VIDEO_HEADER_SIZE];
+    header[0] = static_cast<uint8_t>(key_frame
+                                         ? video_data_frame_type::KEY_FRAME
+                                         : video_data_frame_type::INTER_FRAME)
+                    << 4 |
+                static_cast<uint8_t>(video_data_codec_id::AVC);
+    header[1] = static_cast<uint8_t>(avc_video_packet_type::AvcNALU);
+    store_be24(header + 2, composition_time);
+    annexb_slices_[0].data = header;
+    annexb_slices_[0].length = sizeof(header);
+    append_tag(tag_type_t::Video, timestamp, 0, annexb_slices_.data(),
+               annexb_slices_.size());
+    return *this;
+  }
+
+  /// <summary>
+  /// Appends a new video tag with the Enhanced RTMP extended header, FourCC
+  /// 'hvc1' and PacketType SequenceStart, carrying the
+  /// HEVCDecoderConfigurationRecord passed in.
+  /// </summary>
+  /// <param name="timestamp">The timetamp of the tag.</param>
+  /// <param name="data">The HEVCDecoderConfigurationRecord data.</param>
+  /// <param name="length">The data length.</param>
+  /// <returns>The self-reference.</returns>
+  flv_stream_builder &append_video_tag_with_hevc_decoder_config(
+      uint32_t timestamp, const uint8_t *data, uint32_t length) {
+    append_ex_video_packet(timestamp, video_data_frame_type::KEY_FRAME,
+                           ex_video_packet_type::SequenceStart,
+                           video_fourcc_t::HEVC, 0, data, length);
+    return *this;
+  }
+
+  /// <summary>
+  /// Appends a new video tag with the Enhanced RTMP extended header and FourCC
+  /// 'hvc1', carrying the HEVC NAL units passed in. A zero composition time
+  /// is written as PacketType CodedFramesX, which leaves out the
+  /// CompositionTime field; otherwise the PacketType is CodedFrames.
+  /// </summary>
+  /// <param name="timestamp">The timetamp of the tag.</param>
+  /// <param name="data">
+  /// The NALU data (length prefixed, as configured by the decoder config).
+  /// </param>
+  /// <param name="length">The data length.</param>
+  /// <param name="composition_time">
+  /// The composition time offset (pts - dts).
+  /// </param>
+  /// <param name="key_frame">Whether the frame is a key frame.</param>
+  /// <returns>The self-reference.</returns>
+  flv_stream_builder &
+  append_video_tag_with_hevc_nalu_data(uint32_t timestamp, const uint8_t *data,
+                                       uint32_t length,
+                                       uint32_t composition_time = 0,
+                                       bool key_frame = false) {
+    append_ex_video_packet(timestamp,
+                           key_frame ? video_data_frame_type::KEY_FRAME
+                                     : video_data_frame_type::INTER_FRAME,
+                           composition_time
+                               ? ex_video_packet_type::CodedFrames
+                               : ex_video_packet_type::CodedFramesX,
+                           video_fourcc_t::HEVC, composition_time, data,
+                           length);
+    return *this;
+  }
+
+  /// <summary>
+  /// Appends a new video tag with the Enhanced RTMP extended header, FourCC
+  /// 'av01' and PacketType SequenceStart, carrying the
+  /// AV1CodecConfigurationRecord passed in.
+  /// </summary>
+  /// <param name="timestamp">The timetamp of the tag.</param>
+  /// <param name="data">The AV1CodecConfigurationRecord data.</param>
+  /// <param name="length">The data length.</param>
+  /// <returns>The self-reference.</returns>
+  flv_stream_builder &append_video_tag_with_av1_codec_config(
+      uint32_t timestamp, const uint8_t *data, uint32_t length) {
+    append_ex_video_packet(timestamp, video_data_frame_type::KEY_FRAME,
+                           ex_video_packet_type::SequenceStart,
+                           video_fourcc_t::AV1, 0, data, length);
+    return *this;
+  }
+
+  /// <summary>
+  /// Appends a new video tag with the Enhanced RTMP extended header, FourCC
+  /// 'av01' and PacketType CodedFrames, carrying the AV1 OBUs of one temporal
+  /// unit. AV1 frames have no CompositionTime field.
+  /// </summary>
+  /// <param name="timestamp">The timetamp of the tag.</param>
+  /// <param name="data">The OBU data (low overhead bitstream format).</param>
+  /// <param name="length">The data length.</param>
+  /// <param name="key_frame">Whether the frame is a key frame.</param>
+  /// <returns>The self-reference.</returns>
+  flv_stream_builder &
+  append_video_tag_with_av1_obu_data(uint32_t timestamp, const uint8_t *data,
+                                     uint32_t length, bool key_frame = false) {
+    append_ex_video_packet(timestamp,
+                           key_frame ? video_data_frame_type::KEY_FRAME
+                                     : video_data_frame_type::INTER_FRAME,
+                           ex_video_packet_type::CodedFrames,
+                           video_fourcc_t::AV1, 0, data, length);
+    return *this;
+  }
+
+  /// <summary>
+  /// Appends a new video tag with the Enhanced RTMP extended header and
+  /// PacketType SequenceEnd, marking the end of the sequence of the codec.
+  /// </summary>
+  /// <param name="timestamp">The timetamp of the tag.</param>
+  /// <param name="fourcc">The FourCC of the codec.</param>
+  /// <returns>The self-reference.</returns>
+  flv_stream_builder &
+  append_video_tag_with_sequence_end(uint32_t timestamp,
+                                     video_fourcc_t fourcc) {
+    append_ex_video_packet(timestamp, video_data_frame_type::KEY_FRAME,
+                           ex_video_packet_type::SequenceEnd, fourcc, 0,
+                           nullptr, 0);
+    return *this;
+  }
+
+  /// <summary>
+  /// Appends a new video or audio tag for the frame described. Video frames
+  /// get the frame type from the keyframe flag and the composition time from
+  /// pts - dts. AAC frames use the sound flags the FLV specification requires
+  /// for AAC (44 kHz, 16 bits, stereo).
+  /// </summary>
+  /// <param name="frame">The frame descriptor.</param>
+  /// <returns>The self-reference.</returns>
+  flv_stream_builder &append_frame(const frame_desc &frame) {
+    return append_frames(&frame, 1);
+  }
+
+  /// <summary>
+  /// Appends a new video or audio tag for every frame described, as
+  /// append_frame() does. The tag headers, the codec headers and the tag
+  /// sizes of the whole batch are built in one contiguous arena, and the
+  /// batch is handed to the sink as one gather write of the arena pieces and
+  /// the caller's frame data, which is never copied.
+  /// </summary>
+  /// <param name="frames">The frame descriptors.</param>
+  /// <param name="count">The count of the frame descriptors.</param>
+  /// <returns>The self-reference.</returns>
+  flv_stream_builder &append_frames(const frame_desc *frames, size_t count) {
+    if (!count) {
+      return *this;
+    }
+
+    // The tag size of a tag and the headers of the next tag are adjacent in
+    // the arena, so each frame adds one arena piece and one data piece
+    batch_arena_.resize(count * BATCH_BYTES_PER_FRAME);
+    batch_slices_.resize(count * 2 + 1);
+    uint8_t *arena = batch_arena_.data();
+    uint8_t *cursor = arena;
+    size_t n = 0;
+    uint64_t position = position_;
+    for (size_t i = 0; i < count; i++) {
+      const frame_desc &frame = frames[i];
+      uint8_t *piece = cursor;
+      uint32_t length = frame.length;
+      bool key_frame = false;
+      tag_type_t type;
+      if (frame.track == track_type_t::Video) {
+        type = tag_type_t::Video;
+        length += VIDEO_HEADER_SIZE;
+        key_frame = frame.keyframe && !frame.config;
+        uint32_t composition_time = frame.config ? 0 : frame.pts - frame.dts;
+        uint8_t *video = cursor + FLV_TAG_HEADER_SIZE;
+        video_data_frame_type frame_type =
+            frame.keyframe || frame.config ? video_data_frame_type::KEY_FRAME
+                                           : video_data_frame_type::INTER_FRAME;
+        video[0] = static_cast<uint8_t>(frame_type) << 4 |
+                   static_cast<uint8_t>(video_data_codec_id::AVC);
+        video[1] = static_cast<uint8_t>(
+            frame.config ? avc_video_packet_type::AvcSequenceHeader
+                         : avc_video_packet_type::AvcNALU);
+        store_be24(video + 2, composition_time);
+      } else {
+        type = tag_type_t::Audio;
+        length += AUDIO_HEADER_SIZE;
+        uint8_t *audio = cursor + FLV_TAG_HEADER_SIZE;
+        audio[0] = static_cast<uint8_t>(audio_data_sound_format::AAC) << 4 |
+                   static_cast<uint8_t>(audio_data_sound_rate_t::R44KHZ) << 2 |
+                   static_cast<uint8_t>(audio_data_sound_size_t::S16BIT) << 1 |
+                   static_cast<uint8_t>(audio_data_sound_type_t::STEREO);
+        audio[1] = static_cast<uint8_t>(
+            frame.config ? aac_audio_data_packet_type::AacSequenceHeader
+                         : aac_audio_data_packet_type::AacRaw);
+      }
+      store_tag_header(cursor, type, frame.dts, 0, length);
+      cursor += FLV_TAG_HEADER_SIZE + (length - frame.length);
+      track_tag(type, frame.dts, length, key_frame, position);
+      position += FLV_TAG_HEADER_SIZE + length + 4;
+
+      if (i) {
+        // Extend the previous piece, which ends with the previous tag size
+        batch_slices_[n - 1].length += cursor - piece;
+      } else {
+        batch_slices_[n].data = piece;
+        batch_slices_[n].length = cursor - piece;
+        n++;
+      }
+      if (frame.length) {
+        batch_slices_[n].data = frame.data;
+        batch_slices_[n].length = frame.length;
+        n++;
+      }
+
+      store_tag_size(cursor, FLV_TAG_HEADER_SIZE + length);
+      batch_slices_[n].data = cursor;
+      batch_slices_[n].length = 4;
+      n++;
+      cursor += 4;
+    }
+
+    write_sink(batch_slices_.data(), n);
+    position_ = position;
+    tag_count_ += count;
+    return *this;
+  }
+
+  /// <summary>
+  /// Appends a new audio tag to the end of the specified buffer. This method
+  /// first uses the data passed in as an AUDIODATA to construct a video tag
+  /// with the AUDIODATA, then appends it to the end of the buffer.
+  /// </summary>
+  /// <param name="timestamp">The timetamp of the tag.</param>
+  /// <param name="data">The audio tag body data.</param>
+  /// <param name="length">The lenght of the tag body data.</param>
+  /// <returns>The self-reference.</returns>
+  flv_stream_builder &append_audio_tag(uint32_t timestamp, const uint8_t *data,
+                                       uint32_t length) {
+    append_tag(tag_type_t::Audio, timestamp, 0, data, length);
+    return *this;
+  }
+
+  /// <summary>
+  /// Appends a new audio tag to the end of the specified buffer. This method
+  /// first uses the data passed in as an AudioSpecificConfig to construct an
+  /// AACAudioPacket, then constructs an AUDIODTA with the AACAudioPacket.
+  /// Finally it constructs a video tag with the AUDIODTA and appends it to the
+  /// end of the buffer.
+  /// </summary>
+  /// <param name="timestamp">The timetamp of the tag.</param>
+  /// <param name="rate">The sound sample rate.</param>
+  /// <param name="size">The sound bit depth.</param>
+  /// <param name="type">The sound channel count.</param>
+  /// <param name="data">The AudioSpecificConfig data.</param>
+  /// <param name="length">The lenght of the AudioSpecificConfig data.</param>
+  /// <returns>The self-reference.</returns>
+  flv_stream_builder &append_audio_tag_with_aac_specific_config(
+      uint32_t timestamp, audio_data_sound_rate_t rate,
+      audio_data_sound_size_t size, audio_data_sound_type_t type,
+      const uint8_t *data, uint32_t length) {
+    append_aac_packet(timestamp, rate, size, type,
+                      aac_audio_data_packet_type::AacSequenceHeader, data,
+                      length);
+    return *this;
+  }
+
+  /// <summary>
+  /// Appends a new audio tag to the end of the specified buffer. This method
+  /// first uses the data passed in as an raw AAC frame data to construct an
+  /// AACAudioPacket, then constructs an AUDIODTA with the AACAudioPacket.
+  /// Finally it constructs a video tag with the AUDIODTA and appends it to the
+  /// end of the buffer.
+  /// </summary>
+  /// <param name="timestamp">The timetamp of the tag.</param>
+  /// <param name="rate">The sound sample rate.</param>
+  /// <param name="size">The sound bit depth.</param>
+  /// <param name="type">The sound channel count.</param>
+  /// <param name="data">The raw AAC frame data.</param>
+  /// <param name="length">The length of the raw AAC frame data.</param>
+  /// <returns>The self-reference.</returns>
+  flv_stream_builder &append_audio_tag_with_aac_frame_data(
+      uint32_t timestamp, audio_data_sound_rate_t rate,
+      audio_data_sound_size_t size, audio_data_sound_type_t type,
+      const uint8_t *data, uint32_t length) {
+    append_aac_packet(timestamp, rate, size, type,
+                      aac_audio_data_packet_type::AacRaw, data, length);
+    return *this;
+  }
+
+  /// <summary>
+  /// Appends audio tags with the ADTS framed AAC data passed in, which may
+  /// hold several frames. The AudioSpecificConfig is built from the ADTS
+  /// header and appended as the AAC sequence header before the first frame
+  /// and whenever it changes. Every frame is written as one AACAudioPacket,
+  /// pointing into the caller's buffer without copying it. The n-th frame of
+  /// the buffer gets the timestamp plus the duration of n frames, counting
+  /// the blocks of the multi-block frames skipped before it. The tag
+  /// flags are the ones the FLV specification requires for AAC (44 kHz,
+  /// 16-bit, stereo), the real values are in the AudioSpecificConfig.
+  /// </summary>
+  /// <param name="timestamp">The timetamp of the first frame.</param>
+  /// <param name="data">The ADTS data.</param>
+  /// <param name="length">The data length.</param>
+  /// <returns>The self-reference.</returns>
+  flv_stream_builder &append_audio_tag_with_adts_data(uint32_t timestamp,
+                                                      const uint8_t *data,
+                                                      uint32_t length) {
+    const uint8_t *cursor = data;
+    const uint8_t *end = data + length;
+    aac::adts_frame frame;
+    uint64_t samples = 0;
+    while (aac::next_adts_frame(cursor, end, frame)) {
+      uint32_t frequency = aac::sampling_frequency(frame.sampling_index);
+      samples += uint64_t(frame.skipped_blocks) * aac::SAMPLES_PER_FRAME;
+      uint32_t frame_timestamp =
+          timestamp + static_cast<uint32_t>(samples * 1000 / frequency);
+      samples += aac::SAMPLES_PER_FRAME;
+
+      uint8_t config[2];
+      aac::build_audio_specific_config(frame, config);
+      if (!aac_config_sent_ || config[0] != aac_config_[0] ||
+          config[1] != aac_config_[1]) {
+        append_aac_packet(frame_timestamp, audio_data_sound_rate_t::R44KHZ,
+                          audio_data_sound_size_t::S16BIT,
+                          audio_data_sound_type_t::STEREO,
+                          aac_audio_data_packet_type::AacSequenceHeader, config,
+                          sizeof(config));
+        aac_config_[0] = config[0];
+        aac_config_[1] = config[1];
+        aac_config_sent_ = true;
+      }
+      append_aac_packet(frame_timestamp, audio_data_sound_rate_t::R44KHZ,
+                        audio_data_sound_size_t::S16BIT,
+                        audio_data_sound_type_t::STEREO,
+                        aac_audio_data_packet_type::AacRaw, frame.data,
+                        frame.length);
+    }
+    return *this;
+  }
+
+protected:
+  /// <summary>
+  /// Appends a new AVC video tag. The AVCVideoPacket header is built on the
+  /// stack and written in front of the caller's data as a separate piece of
+  /// the same tag, so the data is never copied.
+  /// </summary>
+  /// <param name="timestamp">The timetamp of the tag.</param>
+  /// <param name="frame_type">The video frame type.</param>
+  /// <param name="packet_type">The AVC packet type.</param>
+  /// <param name="composition_time">The composition time offset.</param>
+  /// <param name="data">The AVC packet body data.</param>
+  /// <param name="length">The length of the AVC packet body data.</param>
+  void append_avc_packet(uint32_t timestamp, video_data_frame_type frame_type,
+                         avc_video_packet_type packet_type,
+                         uint32_t composition_time, const uint8_t *data,
+                         uint32_t length) {
+    uint8_t header[VIDEO_HEADER_SIZE];
+    header[0] = static_cast<uint8_t>(frame_type) << 4 |
+                static_cast<uint8_t>(video_data_codec_id::AVC);
+    header[1] = static_cast<uint8_t>(packet_type);
+    store_be24(header + 2, composition_time);
+
+    io_slice body[2] = {{header, sizeof(header)}, {data, length}};
+    append_tag(tag_type_t::Video, timestamp, 0, body, 2);
+  }
+
+  /// <summary>
+  /// Appends a new video tag with the Enhanced RTMP extended header. The
+  /// header is built on the stack and written in front of the caller's data
+  /// as a separate piece of the same tag, so the data is never copied. Only
+  /// 'hvc1' CodedFrames carry the CompositionTime field.
+  /// </summary>
+  /// <param name="timestamp">The timetamp of the tag.</param>
+  /// <param name="frame_type">The video frame type.</param>
+  /// <param name="packet_type">The extended packet type.</param>
+  /// <param name="fourcc">The FourCC of the codec.</param>
+  /// <param name="composition_time">The composition time offset.</param>
+  /// <param name="data">The packet body data.</param>
+  /// <param name="length">The length of the packet body data.</param>
+  void append_ex_video_packet(uint32_t timestamp,
+                              video_data_frame_type frame_type,
+                              ex_video_packet_type packet_type,
+                              video_fourcc_t fourcc, uint32_t composition_time,
+                              const uint8_t *data, uint32_t length) {
+    uint8_t header[VIDEO_EX_HEADER_SIZE + 3];
+    size_t size = VIDEO_EX_HEADER_SIZE;
+    header[0] = VIDEO_EX_HEADER_FLAG |
+                (static_cast<uint8_t>(frame_type) & 0x07) << 4 |
+                static_cast<uint8_t>(packet_type);
+    store_be32(header + 1, static_cast<uint32_t>(fourcc));
+    if (fourcc == video_fourcc_t::HEVC &&
+        packet_type == ex_video_packet_type::CodedFrames) {
+      store_be24(header + VIDEO_EX_HEADER_SIZE, composition_time);
+      size += 3;
+    }
+
+    io_slice body[2] = {{header, size}, {data, length}};
+    append_tag(tag_type_t::Video, timestamp, 0, body, length ? 2 : 1);
+  }
+
+  /// <summary>
+  /// Appends a new AAC audio tag. The AACAudioPacket header is built on the
+  /// stack and written in front of the caller's data as a separate piece of
+  /// the same tag, so the data is never copied.
+  /// </summary>
+  /// <param name="timestamp">The timetamp of the tag.</param>
+  /// <param name="rate">The sound sample rate.</param>
+  /// <param name="size">The sound bit depth.</param>
+  /// <param name="type">The sound channel count.</param>
+  /// <param name="packet_type">The AAC packet type.</param>
+  /// <param name="data">The AAC packet body data.</param>
+  /// <param name="length">The length of the AAC packet body data.</param>
+  void append_aac_packet(uint32_t timestamp, audio_data_sound_rate_t rate,
+                         audio_data_sound_size_t size,
+                         audio_data_sound_type_t type,
+                         aac_audio_data_packet_type packet_type,
+                         const uint8_t *data, uint32_t length) {
+    uint8_t header[AUDIO_HEADER_SIZE];
+    header[0] = static_cast<uint8_t>(audio_data_sound_format::AAC) << 4;
+    header[0] |= ((static_cast<uint8_t>(rate) << 2) & 0x0c);
+    header[0] |= ((static_cast<uint8_t>(size) << 1) & 0x02);
+    header[0] |= (static_cast<uint8_t>(type) & 0x01);
+    header[1] = static_cast<uint8_t>(packet_type);
+
+    io_slice body[2] = {{header, sizeof(header)}, {data, length}};
+    append_tag(tag_type_t::Audio, timestamp, 0, body, 2);
+  }
+
+  /// <summary>
+  /// Appends a serialized meta tag body, reserving the keyframe index and
+  /// locating the numbers patched by finalize() first.
+  /// </summary>
+  /// <param name="meta_data">The serialized meta tag body.</param>
+  /// <param name="meta_offset">The offset of the meta value.</param>
+  /// <returns>The self-reference.</returns>
+  flv_stream_builder &append_meta_data(std::vector<uint8_t> &meta_data,
+                                       size_t meta_offset) {
+    if (keyframe_capacity_) {
+      size_t region = reserve_keyframe_index(meta_data, meta_offset);
+      if (region) {
+        keyframe_region_ = position_ + FLV_TAG_HEADER_SIZE + region;
+      }
+    }
+    locate_meta_slots(meta_data, position_ + FLV_TAG_HEADER_SIZE);
+    append_tag(tag_type_t::Script, 0, 0, meta_data.data(),
+               static_cast<uint32_t>(meta_data.size()));
+    return *this;
+  }
+
+  /// <summary>
+  /// Stores the parameter set NAL unit and marks the AVC decoder config as
+  /// out of date if it has changed.
+  /// </summary>
+  /// <param name="stored">The stored parameter set.</param>
+  /// <param name="nalu">The parameter set NAL unit.</param>
+  void update_parameter_set(std::vector<uint8_t> &stored,
+                            const avc::nalu_view &nalu) {
+    if (stored.size() == nalu.length &&
+        std::equal(stored.begin(), stored.end(), nalu.data)) {
+      return;
+    }
+    stored.assign(nalu.data, nalu.data + nalu.length);
+    avc_config_dirty_ = true;
+  }
+
+  /// <summary>
+  /// Appends a new flv tag to the end of the specified buffer. This method
+  /// uses the data passed in as an tag body to constructs a FLV tag then
+  /// appends it to the end of the buffer.
+  /// </summary>
+  /// <param name="type"></param>
+  /// <param name="timestamp">The timetamp of the tag.</param>
+  /// <param name="strem_id">The strem id (always 0).</param>
+  /// <param name="data">The tag body data.</param>
+  /// <param name="length">The lenght of the tag body data.</param>
+  void append_tag(tag_type_t type, uint32_t timestamp, uint32_t strem_id,
+                  const uint8_t *data, uint32_t length) {
+    io_slice body = {data, length};
+    append_tag(type, timestamp, strem_id, &body, 1);
+  }
+
+  /// <summary>
+  /// Appends a new flv tag whose body is made of several pieces. The tag
+  /// header, all the body pieces and the tag size are handed to the sink as
+  /// one gather write.
+  /// </summary>
+  /// <param name="type"></param>
+  /// <param name="timestamp">The timetamp of the tag.</param>
+  /// <param name="strem_id">The strem id (always 0).</param>
+  /// <param name="body">The tag body pieces.</param>
+  /// <param name="count">The count of the tag body pieces.</param>
+  void append_tag(tag_type_t type, uint32_t timestamp, uint32_t strem_id,
+                  const io_slice *body, size_t count) {
+    uint32_t length = 0;
+    for (size_t i = 0; i < count; i++) {
+      length += static_cast<uint32_t>(body[i].length);
+    }
+
+    uint8_t header[FLV_TAG_HEADER_SIZE];
+    store_tag_header(header, type, timestamp, strem_id, length);
+
+    // Size (PreviousTagSize of the next tag, header + data)
+    uint8_t trailer[4];
+    uint32_t size = FLV_TAG_HEADER_SIZE + length;
+    store_tag_size(trailer, size);
+
+    // Header, data and size go out as one gather write. Small tags use the
+    // stack, larger piece counts reuse the scratch list of the builder.
+    io_slice inline_slices[MAX_INLINE_SLICES + 2];
+    io_slice *slices = inline_slices;
+    if (count > MAX_INLINE_SLICES) {
+      slice_scratch_.resize(count + 2);
+      slices = slice_scratch_.data();
+    }
+    slices[0].data = header;
+    slices[0].length = sizeof(header);
+    std::copy(body, body + count, slices + 1);
+    slices[count + 1].data = trailer;
+    slices[count + 1].length = sizeof(trailer);
+    track_tag(type, timestamp, length,
+              type == tag_type_t::Video && is_video_keyframe(body, count),
+              position_);
+
+    write_sink(slices, count + 2);
+    position_ += size + sizeof(trailer);
+
+    tag_count_++;
+  }
+
+  /// <summary>
+  /// Builds the FLV tag header.
+  /// </summary>
+  /// <param name="header">The buffer of FLV_TAG_HEADER_SIZE bytes.</param>
+  /// <param name="type">The tag type.</param>
+  /// <param name="timestamp">The timetamp of the tag.</param>
+  /// <param name="strem_id">The strem id (always 0).</param>
+  /// <param name="length">The lenght of the tag body data.</param>
+  static void store_tag_header(uint8_t *header, tag_type_t type,
+                               uint32_t timestamp, uint32_t strem_id,
+                               uint32_t length) {
+    // Header.Type
+    header[0] = static_cast<uint8_t>(type);
+
+    // Header.DataSize
+    store_be24(header + 1, length);
+
+    // Header.Timestamp
+    store_be24(header + 4, timestamp);
+
+    // Header.TimestampExtended
+    header[7] = static_cast<uint8_t>(timestamp >> 24);
+
+    // Header.StreamID (actually this is always 0 according to the
+    // specification)
+    store_be24(header + 8, strem_id);
+  }
+
+  /// <summary>
+  /// Stores the size following a tag (PreviousTagSize of the next tag).
+  /// </summary>
+  /// <param name="p">The buffer of 4 bytes.</param>
+  /// <param name="size">The tag size, header + data.</param>
+  static void store_tag_size(uint8_t *p, uint32_t size) {
+    store_be32(p, size);
+  }
+
+  /// <summary>
+  /// Writes to the sink, timing the write for the statistics.
+  /// </summary>
+  /// <param name="slices">The pieces to be written.</param>
+  /// <param name="count">The count of the pieces.</param>
+  void write_sink(const io_slice *slices, size_t count) {
+#if FLV_BUILDER_STATS
+    auto start = std::chrono::steady_clock::now();
+    sink_.write(slices, count);
+    stats_.add_write(elapsed_ns(start));
+#else
+    sink_.write(slices, count);
+#endif
+  }
+
+  /// <summary>
+  /// Flushes the sink, timing the flush for the statistics.
+  /// </summary>
+  void flush_sink() {
+#if FLV_BUILDER_STATS
+    auto start = std::chrono::steady_clock::now();
+    sink_.flush();
+    stats_.add_blocked(elapsed_ns(start));
+#else
+    sink_.flush();
+#endif
+  }
+
+  /// <summary>
+  /// Gets the nanoseconds elapsed since a time point.
+  /// </summary>
+  /// <param name="start">The time point.</param>
+  /// <returns>The nanoseconds.</returns>
+  static uint64_t elapsed_ns(std::chrono::steady_clock::time_point start) {
+    return static_cast<uint64_t>(
+        std::chrono::duration_cast<std::chrono::nanoseconds>(
+            std::chrono::steady_clock::now() - start)
+            .count());
+  }
+
+  /// <summary>
+  /// Updates the byte counts, timestamps and keyframe index with a tag about
+  /// to be written.
+  /// </summary>
+  /// <param name="type">The tag type.</param>
+  /// <param name="timestamp">The timetamp of the tag.</param>
+  /// <param name="length">The lenght of the tag body data.</param>
+  /// <param name="key_frame">Whether the tag is a video keyframe.</param>
+  /// <param name="position">The stream offset of the tag.</param>
+  void track_tag(tag_type_t type, uint32_t timestamp, uint32_t length,
+                 bool key_frame, uint64_t position) {
+#if FLV_BUILDER_STATS
+    stats_.add_tag(type, timestamp, FLV_TAG_HEADER_SIZE + length + 4,
+                   key_frame);
+#endif
+    if (type == tag_type_t::Video) {
+      video_bytes_ += length;
+      last_timestamp_ = std::max(last_timestamp_, timestamp);
+      if (key_frame) {
+        last_keyframe_timestamp_ = timestamp;
+        if (keyframe_capacity_) {
+          track_keyframe(timestamp, position);
+        }
+      }
+    } else if (type == tag_type_t::Audio) {
+      audio_bytes_ += length;
+      last_timestamp_ = std::max(last_timestamp_, timestamp);
+    }
+  }
+
+  /// <summary>
+  /// Checks whether the VIDEODATA pieces start a keyframe, AVC sequence
+  /// headers and extended header sequence starts and ends excluded.
+  /// </summary>
+  /// <param name="body">The tag body pieces.</param>
+  /// <param name="count">The count of the tag body pieces.</param>
+  /// <returns>True if the tag is a keyframe; otherwise false.</returns>
+  static bool is_video_keyframe(const io_slice *body, size_t count) {
+    uint8_t bytes[2] = {0, 0};
+    size_t n = 0;
+    for (size_t i = 0; i < count && n < 2; i++) {
+      for (size_t j = 0; j < body[i].length && n < 2; j++) {
+        bytes[n++] = body[i].data[j];
+      }
+    }
+    return classify_video_data(bytes, n) == tag_class_t::VideoKeyframe;
+  }
+
+  /// <summary>
+  /// Adds a keyframe to the keyframe index. When the index is full, every
+  /// other entry is dropped and the stride between indexed keyframes is
+  /// doubled.
+  /// </summary>
+  /// <param name="timestamp">The timestamp of the keyframe.</param>
+  /// <param name="position">The stream offset of the keyframe tag.</param>
+  void track_keyframe(uint32_t timestamp, uint64_t position) {
+    if (keyframe_seen_++ % keyframe_stride_) {
+      return;
+    }
+    if (keyframes_.size() == keyframe_capacity_) {
+      if (keyframe_capacity_ < 2) {
+        return;
+      }
+      size_t kept = 0;
+      for (size_t i = 0; i < keyframes_.size(); i += 2) {
+        keyframes_[kept++] = keyframes_[i];
+      }
+      keyframes_.resize(kept);
+      keyframe_stride_ *= 2;
+      if ((keyframe_seen_ - 1) % keyframe_stride_) {
+        return;
+      }
+    }
+    keyframe_entry entry = {timestamp / 1000.0, static_cast<double>(position)};
+    keyframes_.emplace_back(entry);
+  }
+
+  /// <summary>
+  /// Clears the meta number offsets and the values tracked for them.
+  /// </summary>
+  void reset_meta_slots() {
+    for (int i = 0; i < MetaSlotCount; i++) {
+      meta_slots_[i] = 0;
+    }
+    last_timestamp_ = 0;
+    start_timestamp_ = 0;
+    last_keyframe_timestamp_ = 0;
+    video_bytes_ = 0;
+    audio_bytes_ = 0;
+  }
+
+  /// <summary>
+  /// Remembers where the top level meta numbers patched by finalize() are.
+  /// </summary>
+  /// <param name="meta_data">The serialized meta tag body.</param>
+  /// <param name="base">The stream offset of the meta tag body.</param>
+  void locate_meta_slots(const std::vector<uint8_t> &meta_data,
+                         uint64_t base) {
+    for (int i = 0; i < MetaSlotCount; i++) {
+      meta_slots_[i] = 0;
+    }
+    amf::amf_reader reader(meta_data.data(), meta_data.size());
+    amf::amf_item item;
+    while (reader.next(item) == amf::amf_read_result::Ok) {
+      if (item.type != amf::NumberType || reader.depth() != 1) {
+        continue;
+      }
+      for (int i = 0; i < MetaSlotCount; i++) {
+        if (item.key.equals(meta_slot_name(i))) {
+          meta_slots_[i] = base + item.offset + 1;
+        }
+      }
+    }
+  }
+
+  /// <summary>
+  /// Gets the property name of a meta number patched by finalize().
+  /// </summary>
+  /// <param name="slot">The meta_slot_e value.</param>
+  /// <returns>The property name.</returns>
+  static const char *meta_slot_name(int slot) {
+    static const char *names[MetaSlotCount] = {
+        "duration", "filesize", "lastkeyframetimestamp", "videodatarate",
+        "audiodatarate"};
+    return names[slot];
+  }
+
+  /// <summary>
+  /// Stores an AMF0 property name.
+  /// </summary>
+  /// <param name="p">The destination.</param>
+  /// <param name="key">The property name.</param>
+  /// <returns>The position after the property name.</returns>
+  static uint8_t *store_key(uint8_t *p, const char *key) {
+    size_t length = strlen(key);
+    p = store_be16(p, static_cast<uint16_t>(length));
+    memcpy(p, key, length);
+    return p + length;
+  }
+
+  /// <summary>
+  /// Appends the body of the keyframes object: the times and filepositions
+  /// Strict Arrays of the entries, then String properties padding the
+  /// unused entries, so the body always has the size of a full index. The
+  /// buffer grows once, by the size of a full index.
+  /// </summary>
+  /// <param name="buf">The buffer.</param>
+  /// <param name="entries">The index entries.</param>
+  void build_keyframe_index(std::vector<uint8_t> &buf,
+                            const std::vector<keyframe_entry> &entries) const {
+    size_t full = KEYFRAME_INDEX_FIXED_SIZE +
+                  KEYFRAME_INDEX_ENTRY_SIZE * keyframe_capacity_;
+    size_t start = buf.size();
+    buf.resize(start + full);
+    uint8_t *p = buf.data() + start;
+    uint32_t count = static_cast<uint32_t>(entries.size());
+    p = store_key(p, "times");
+    *p++ = amf::StrictArrayType;
+    p = store_be32(p, count);
+    for (auto &e : entries) {
+      *p++ = amf::NumberType;
+      p = store_be_f64(p, e.time);
+    }
+    p = store_key(p, "filepositions");
+    *p++ = amf::StrictArrayType;
+    p = store_be32(p, count);
+    for (auto &e : entries) {
+      *p++ = amf::NumberType;
+      p = store_be_f64(p, e.position);
+    }
+
+    // Each unused entry leaves 18 bytes, at least one padding property of
+    // 12 bytes fits
+    uint8_t *end = buf.data() + buf.size();
+    size_t left = end - p;
+    while (left) {
+      size_t chunk = std::min<size_t>(left, 12 + 0xffff);
+      if (left - chunk && left - chunk < 12) {
+        chunk = left - 12;
+      }
+      p = store_key(p, "padding");
+      *p++ = amf::StringType;
+      size_t length = chunk - 12;
+      p = store_be16(p, static_cast<uint16_t>(length));
+      memset(p, ' ', length);
+      p += length;
+      left -= chunk;
+    }
+  }
+
+  /// <summary>
+  /// Adds the "keyframes" object with room for a full index to the
+  /// serialized meta (an ECMA Array or an Object).
+  /// </summary>
+  /// <param name="meta_data">The serialized meta tag body.</param>
+  /// <param name="meta_offset">The offset of the meta value.</param>
+  /// <returns>
+  /// The offset of the reserved index in the meta tag body, 0 if the meta
+  /// type cannot hold it or the meta and the index overflow the tag.
+  /// </returns>
+  size_t reserve_keyframe_index(std::vector<uint8_t> &meta_data,
+                                size_t meta_offset) {
+    uint8_t type = meta_data[meta_offset];
+    if ((type != amf::ECMAArrayType && type != amf::ObjectType) ||
+        meta_data.size() < meta_offset + 3 ||
+        meta_data.size() + 2 + 9 + 1 + KEYFRAME_INDEX_FIXED_SIZE +
+                (uint64_t)KEYFRAME_INDEX_ENTRY_SIZE * keyframe_capacity_ + 3 >
+            MAX_TAG_DATA_SIZE) {
+      return 0;
+    }
+
+    if (type == amf::ECMAArrayType) {
+      uint8_t *p = meta_data.data() + meta_offset + 1;
+      uint32_t count = (uint32_t)p[0] << 24 | (uint32_t)p[1] << 16 |
+                       (uint32_t)p[2] << 8 | p[3];
+      store_be32(p, count + 1);
+    }
+
+    // Insert the keyframes object before the end marker
+    meta_data.resize(meta_data.size() - 3 + 2 + 9 + 1);
+    uint8_t *p = meta_data.data() + meta_data.size() - (2 + 9 + 1);
+    p = store_key(p, "keyframes");
+    *p = amf::ObjectType;
+    size_t region = meta_data.size();
+    std::vector<keyframe_entry> none;
+    build_keyframe_index(meta_data, none);
+    static const uint8_t end[] = {0, 0, amf::ObjectEndType,
+                                  0, 0, amf::ObjectEndType};
+    meta_data.insert(meta_data.end(), end, end + sizeof(end));
+    return region;
+  }
+};
+
+/// <summary>
+/// The results of checking the PreviousTagSize following a tag.
+/// </summary>
+enum class tag_size_check_t : uint8_t {
+  /// The size is the tag header size plus the data size.
+  Ok = 0,
+  /// The size is the data size only, as written by older builders.
+  DataSizeOnly = 1,
+  /// The size matches nothing.
+  Mismatch = 2,
+  /// The stream ends before the size.
+  Missing = 3,
+};
+
+/// <summary>
+/// Represents a tag inside the buffer of the FLV stream reader. All the
+/// pointers point into the buffer, nothing is copied.
+/// </summary>
+struct flv_tag_view {
+  /// <summary>
+  /// The tag type.
+  /// </summary>
+  tag_type_t type;
+
+  /// <summary>
+  /// The timestamp, with the extended byte.
+  /// </summary>
+  uint32_t timestamp;
+
+  /// <summary>
+  /// The stream id.
+  /// </summary>
+  uint32_t stream_id;
+
+  /// <summary>
+  /// The offset of the tag header in the stream.
+  /// </summary>
+  uint64_t offset;
+
+  /// <summary>
+  /// The tag body data.
+  /// </summary>
+  const uint8_t *data;
+
+  /// <summary>
+  /// The tag body data size.
+  /// </summary>
+  uint32_t length;
+
+  /// <summary>
+  /// The PreviousTagSize following the tag.
+  /// </summary>
+  uint32_t tag_size;
+
+  /// <summary>
+  /// The result of checking the PreviousTagSize following the tag.
+  /// </summary>
+  tag_size_check_t tag_size_check;
+
+  /// <summary>
+  /// The video frame type (video tags).
+  /// </summary>
+  video_data_frame_type frame_type;
+
+  /// <summary>
+  /// The video codec id (video tags).
+  /// </summary>
+  video_data_codec_id codec_id;
+
+  /// <summary>
+  /// The AVC packet type (AVC video tags).
+  /// </summary>
+  avc_video_packet_type avc_packet_type;
+
+  /// <summary>
+  /// The composition time offset (AVC and 'hvc1' CodedFrames video tags).
+  /// </summary>
+  int32_t composition_time;
+
+  /// <summary>
+  /// Indicates whether the video tag has the Enhanced RTMP extended header.
+  /// </summary>
+  bool ex_header;
+
+  /// <summary>
+  /// The extended packet type (extended header video tags).
+  /// </summary>
+  ex_video_packet_type ex_packet_type;
+
+  /// <summary>
+  /// The codec FourCC (extended header video tags).
+  /// </summary>
+  video_fourcc_t fourcc;
+
+  /// <summary>
+  /// The sound format (audio tags).
+  /// </summary>
+  audio_data_sound_format sound_format;
+
+  /// <summary>
+  /// The sound sample rate (audio tags).
+  /// </summary>
+  audio_data_sound_rate_t sound_rate;
+
+  /// <summary>
+  /// The sound bit depth (audio tags).
+  /// </summary>
+  audio_data_sound_size_t sound_size;
+
+  /// <summary>
+  /// The sound channel count (audio tags).
+  /// </summary>
+  audio_data_sound_type_t sound_type;
+
+  /// <summary>
+  /// The AAC packet type (AAC audio tags).
+  /// </summary>
+  aac_audio_data_packet_type aac_packet_type;
+
+  /// <summary>
+  /// The payload after the codec headers.
+  /// </summary>
+  const uint8_t *payload;
+
+  /// <summary>
+  /// The payload length.
+  /// </summary>
+  uint32_t payload_length;
+};
+
+/// <summary>
+/// Represents the FLV stream reader over a memory span or a memory mapped
+/// file. Tags are visited with a forward iterator producing tag views; only
+/// the tag headers are touched, so a scan costs no allocation per tag.
+/// </summary>
+class flv_stream_reader {
+public:
+  /// <summary>
+  /// Represents the forward iterator over the tags.
+  /// </summary>
+  class iterator {
+  public:
+    typedef std::forward_iterator_tag iterator_category;
+    typedef flv_tag_view value_type;
+    typedef std::ptrdiff_t difference_type;
+    typedef const flv_tag_view *pointer;
+    typedef const flv_tag_view &reference;
+
+    iterator() : data_(nullptr), length_(0), pos_(0) {}
+
+    reference operator*() const { return tag_; }
+
+    pointer operator->() const { return &tag_; }
+
+    iterator &operator++() {
+      pos_ = tag_.offset + FLV_TAG_HEADER_SIZE + tag_.length + 4;
+      load();
+      return *this;
+    }
+
+    iterator operator++(int) {
+      iterator it = *this;
+      ++(*this);
+      return it;
+    }
+
+    bool operator==(const iterator &other) const {
+      return pos_ == other.pos_;
+    }
+
+    bool operator!=(const iterator &other) const {
+      return pos_ != other.pos_;
+    }
+
+  private:
+    friend class flv_stream_reader;
+
+    iterator(const uint8_t *data, uint64_t length, uint64_t pos)
+        : data_(data), length_(length), pos_(pos) {
+      load();
+    }
+
+    void load() {
+      // Stop at the end (also past it, after a last tag without its
+      // PreviousTagSize), or at a tag whose data is cut off
+      if (pos_ >= length_ || length_ - pos_ < FLV_TAG_HEADER_SIZE) {
+        pos_ = length_;
+        return;
+      }
+      const uint8_t *p = data_ + pos_;
+      uint32_t length = (uint32_t)p[1] << 16 | (uint32_t)p[2] << 8 | p[3];
+      if (length_ - pos_ - FLV_TAG_HEADER_SIZE < length) {
+        pos_ = length_;
+        return;
+      }
+
+      flv_tag_view &t = tag_;
+      t.type = static_cast<tag_type_t>(p[0]);
+      t.length = length;
+      t.timestamp = (uint32_t)p[7] << 24 | (uint32_t)p[4] << 16 |
+                    (uint32_t)p[5] << 8 | p[6];
+      t.stream_id = (uint32_t)p[8] << 16 | (uint32_t)p[9] << 8 | p[10];
+      t.offset = pos_;
+      t.data = p + FLV_TAG_HEADER_SIZE;
+      t.payload = t.data;
+      t.payload_length = length;
+      t.frame_type = static_cast<video_data_frame_type>(0);
+      t.codec_id = static_cast<video_data_codec_id>(0);
+      t.avc_packet_type = static_cast<avc_video_packet_type>(0);
+      t.composition_time = 0;
+      t.ex_header = false;
+      t.ex_packet_type = static_cast<ex_video_packet_type>(0);
+      t.fourcc = static_cast<video_fourcc_t>(0);
+      t.sound_format = static_cast<audio_data_sound_format>(0);
+      t.sound_rate = static_cast<audio_data_sound_rate_t>(0);
+      t.sound_size = static_cast<audio_data_sound_size_t>(0);
+      t.sound_type = static_cast<audio_data_sound_type_t>(0);
+      t.aac_packet_type = static_cast<aac_audio_data_packet_type>(0);
+
+      uint64_t trailer = pos_ + FLV_TAG_HEADER_SIZE + length;
+      if (length_ - trailer < 4) {
+        t.tag_size = 0;
+        t.tag_size_check = tag_size_check_t::Missing;
+      } else {
+        const uint8_t *s = data_ + trailer;
+        t.tag_size = (uint32_t)s[0] << 24 | (uint32_t)s[1] << 16 |
+                     (uint32_t)s[2] << 8 | s[3];
+        if (t.tag_size == FLV_TAG_HEADER_SIZE + length) {
+          t.tag_size_check = tag_size_check_t::Ok;
+        } else if (t.tag_size == length) {
+          t.tag_size_check = tag_size_check_t::DataSizeOnly;
+        } else {
+          t.tag_size_check = tag_size_check_t::Mismatch;
+        }
+      }
+
+      if (t.type == tag_type_t::Video && length >= VIDEO_EX_HEADER_SIZE &&
+          (t.data[0] & VIDEO_EX_HEADER_FLAG)) {
+        t.frame_type =
+            static_cast<video_data_frame_type>((t.data[0] >> 4) & 0x07);
+        t.ex_header = true;
+        t.ex_packet_type = static_cast<ex_video_packet_type>(t.data[0] & 0x0f);
+        t.fourcc = static_cast<video_fourcc_t>(
+            (uint32_t)t.data[1] << 24 | (uint32_t)t.data[2] << 16 |
+            (uint32_t)t.data[3] << 8 | t.data[4]);
+        t.payload = t.data + VIDEO_EX_HEADER_SIZE;
+        t.payload_length = length - VIDEO_EX_HEADER_SIZE;
+        if (t.fourcc == video_fourcc_t::HEVC &&
+            t.ex_packet_type == ex_video_packet_type::CodedFrames &&
+            length >= VIDEO_EX_HEADER_SIZE + 3) {
+          uint32_t cts = (uint32_t)t.data[5] << 16 |
+                         (uint32_t)t.data[6] << 8 | t.data[7];
+          t.composition_time =
+              static_cast<int32_t>(cts & 0x800000 ? cts | 0xff000000 : cts);
+          t.payload += 3;
+          t.payload_length -= 3;
+        }
+      } else if (t.type == tag_type_t::Video && length >= 1) {
+        t.frame_type = static_cast<video_data_frame_type>(t.data[0] >> 4);
+        t.codec_id = static_cast<video_data_codec_id>(t.data[0] & 0x0f);
+        t.payload = t.data + 1;
+        t.payload_length = length - 1;
+        if (t.codec_id == video_data_codec_id::AVC &&
+            length >= VIDEO_HEADER_SIZE) {
+          t.avc_packet_type = static_cast<avc_video_packet_type>(t.data[1]);
+          uint32_t cts = (uint32_t)t.data[2] << 16 |
+                         (uint32_t)t.data[3] << 8 | t.data[4];
+          t.composition_time =
+              static_cast<int32_t>(cts & 0x800000 ? cts | 0xff000000 : cts);
+          t.payload = t.data + VIDEO_HEADER_SIZE;
+          t.payload_length = length - VIDEO_HEADER_SIZE;
+        }
+      } else if (t.type == tag_type_t::Audio && length >= 1) {
+        t.sound_format = static_cast<audio_data_sound_format>(t.data[0] >> 4);
+        t.sound_rate =
+            static_cast<audio_data_sound_rate_t>((t.data[0] >> 2) & 0x03);
+        t.sound_size =
+            static_cast<audio_data_sound_size_t>((t.data[0] >> 1) & 0x01);
+        t.sound_type = static_cast<audio_data_sound_type_t>(t.data[0] & 0x01);
+        t.payload = t.data + 1;
+        t.payload_length = length - 1;
+        if (t.sound_format == audio_data_sound_format::AAC &&
+            length >= AUDIO_HEADER_SIZE) {
+          t.aac_packet_type =
+              static_cast<aac_audio_data_packet_type>(t.data[1]);
+          t.payload = t.data + AUDIO_HEADER_SIZE;
+          t.payload_length = length - AUDIO_HEADER_SIZE;
+        }
+      }
+    }
+
+  private:
+    const uint8_t *data_;
+    uint64_t length_;
+    uint64_t pos_;
+    flv_tag_view tag_;
+  };
+
+  /// <summary>
+  /// Constructs an instance of the reader over a memory span. The span must
+  /// outlive the reader and the tag views.
+  /// </summary>
+  /// <param name="data">The FLV stream data.</param>
+  /// <param name="length">The data length.</param>
+  flv_stream_reader(const uint8_t *data, size_t length)
+      : data_(data), length_(length), mapped_(false) {
+    parse_header();
+  }
+
+  /// <summary>
+  /// Constructs an instance of the reader over a memory mapped file.
+  /// </summary>
+  /// <param name="path">The file path.</param>
+  /// <exception cref="std::system_error">If the file cannot be
+  /// mapped.</exception>
+  explicit flv_stream_reader(const char *path)
+      : data_(nullptr), length_(0), mapped_(true) {
+#if defined(_WIN32)
+    HANDLE file = ::CreateFileA(path, GENERIC_READ, FILE_SHARE_READ, NULL,
+                                OPEN_EXISTING, FILE_FLAG_SEQUENTIAL_SCAN, NULL);
+    if (file == INVALID_HANDLE_VALUE) {
+      throw std::system_error(::GetLastError(), std::system_category(),
+                              "CreateFileA");
+    }
+    LARGE_INTEGER size;
+    ::GetFileSizeEx(file, &size);
+    length_ = static_cast<uint64_t>(size.QuadPart);
+    if (length_) {
+      HANDLE mapping =
+          ::CreateFileMappingA(file, NULL, PAGE_READONLY, 0, 0, NULL);
+      if (mapping) {
+        data_ = (const uint8_t *)::MapViewOfFile(mapping, FILE_MAP_READ, 0, 0,
+                                                 0);
+        ::CloseHandle(mapping);
+      }
+      if (!data_) {
+        DWORD error = ::GetLastError();
+        ::CloseHandle(file);
+        throw std::system_error(error, std::system_category(),
+                                "MapViewOfFile");
+      }
+    }
+    ::CloseHandle(file);
+#else
+    int fd = ::open(path, O_RDONLY);
+    if (fd < 0) {
+      throw std::system_error(errno, std::generic_category(), "open");
+    }
+    struct stat st;
+    if (::fstat(fd, &st) < 0) {
+      int error = errno;
+      ::close(fd);
+      throw std::system_error(error, std::generic_category(), "fstat");
+    }
+    length_ = static_cast<uint64_t>(st.st_size);
+    if (length_) {
+      void *p = ::mmap(nullptr, length_, PROT_READ, MAP_SHARED, fd, 0);
+      if (p == MAP_FAILED) {
+        int error = errno;
+        ::close(fd);
+        throw std::system_error(error, std::generic_category(), "mmap");
+      }
+      ::madvise(p, length_, MADV_SEQUENTIAL);
+      data_ = (const uint8_t *)p;
+    }
+    ::close(fd);
+#endif
+    parse_header();
+  }
+
+  /// <summary>
+  /// Destructs the instance.
+  /// </summary>
+  ~flv_stream_reader() {
+    if (!mapped_ || !data_) {
+      return;
+    }
+#if defined(_WIN32)
+    ::UnmapViewOfFile(data_);
+#else
+    ::munmap((void *)data_, length_);
+#endif
+  }
+
+  /// <summary>
+  /// Gets whether the stream starts with a valid FLV header.
+  /// </summary>
+  /// <returns>True if valid; otherwise false.</returns>
+  bool valid() const { return first_tag_ != 0; }
+
+  /// <summary>
+  /// Gets whether the header declares audio data.
+  /// </summary>
+  /// <returns>True if there is audio data; otherwise false.</returns>
+  bool has_audio() const { return valid() && (data_[4] & 0x04); }
+
+  /// <summary>
+  /// Gets whether the header declares video data.
+  /// </summary>
+  /// <returns>True if there is video data; otherwise false.</returns>
+  bool has_video() const { return valid() && (data_[4] & 0x01); }
+
+  /// <summary>
+  /// Gets the whole stream data.
+  /// </summary>
+  /// <returns>The stream data.</returns>
+  const uint8_t *data() const { return data_; }
+
+  /// <summary>
+  /// Gets the whole stream length.
+  /// </summary>
+  /// <returns>The stream length.</returns>
+  uint64_t length() const { return length_; }
+
+  /// <summary>
+  /// Gets the iterator of the first tag.
+  /// </summary>
+  /// <returns>The iterator.</returns>
+  iterator begin() const {
+    return valid() ? iterator(data_, length_, first_tag_) : end();
+  }
+
+  /// <summary>
+  /// Gets the iterator past the last complete tag.
+  /// </summary>
+  /// <returns>The iterator.</returns>
+  iterator end() const { return iterator(data_, length_, length_); }
+
+private:
+  DISALLOW_COPY_AND_ASSIGN(flv_stream_reader);
+
+  void parse_header() {
+    first_tag_ = 0;
+    if (length_ < FLV_HEADER_SIZE + 4 || data_[0] != 'F' ||
+        data_[1] != 'L' || data_[2] != 'V') {
+      return;
+    }
+    uint32_t header_size = (uint32_t)data_[5] << 24 |
+                           (uint32_t)data_[6] << 16 |
+                           (uint32_t)data_[7] << 8 | data_[8];
+    if (header_size < FLV_HEADER_SIZE || header_size > length_ - 4) {
+      return;
+    }
+    first_tag_ = static_cast<uint64_t>(header_size) + 4;
+  }
+
+private:
+  /// <summary>
+  /// The stream data.
+  /// </summary>
+  const uint8_t *data_;
+
+  /// <summary>
+  /// The stream length.
+  /// </summary>
+  uint64_t length_;
+
+  /// <summary>
+  /// Indicates whether the data is a mapping owned by the reader.
+  /// </summary>
+  bool mapped_;
+
+  /// <summary>
+  /// The offset of the first tag, 0 if the header is invalid.
+  /// </summary>
+  uint64_t first_tag_;
+};
+
+/// <summary>
+/// Classifies a serialized FLV header or tag.
+/// </summary>
+/// <param name="data">The serialized header or tag.</param>
+/// <param name="length">The data length.</param>
+/// <returns>The kind of the data.</returns>
+inline tag_class_t classify_tag(const uint8_t *data, size_t length) {
+  if (length >= 3 && data[0] == 'F' && data[1] == 'L' && data[2] == 'V') {
+    return tag_class_t::Header;
+  }
+  if (length < FLV_TAG_HEADER_SIZE + 1) {
+    return tag_class_t::Other;
+  }
+  const uint8_t *body = data + FLV_TAG_HEADER_SIZE;
+  bool has_packet_type = length >= FLV_TAG_HEADER_SIZE + 2;
+  switch (static_cast<tag_type_t>(data[0])) {
+  case tag_type_t::Script:
+    return tag_class_t::Meta;
+  case tag_type_t::Audio:
+    if ((body[0] >> 4) == static_cast<uint8_t>(audio_data_sound_format::AAC) &&
+        has_packet_type &&
+        body[1] == static_cast<uint8_t>(
+                       aac_audio_data_packet_type::AacSequenceHeader)) {
+      return tag_class_t::AudioConfig;
+    }
+    return tag_class_t::Audio;
+  case tag_type_t::Video:
+    return classify_video_data(body, length - FLV_TAG_HEADER_SIZE);
+  default:
+    return tag_class_t::Other;
+  }
+}
+
+/// <summary>
+/// The immutable, reference-counted buffer of one serialized FLV header or
+/// tag (PreviousTagSize included), shared by all the consumers.
+/// </summary>
+typedef std::shared_ptr<const std::vector<uint8_t>> tag_buffer_ref;
+
+/// <summary>
+/// Copies one gather write of the builder into shared buffers, one per FLV
+/// header or tag.
+/// </summary>
+/// <param name="slices">The slices of the gather write.</param>
+/// <param name="count">The count of the slices.</param>
+/// <param name="publish">The function receiving the buffers, in order.</param>
+template <typename Publish>
+inline void split_gather_write(const io_slice *slices, size_t count,
+                               Publish publish) {
+  size_t total = 0;
+  for (size_t i = 0; i < count; i++) {
+    total += slices[i].length;
+  }
+  std::vector<uint8_t> buf;
+  buf.reserve(total);
+  for (size_t i = 0; i < count; i++) {
+    buf.insert(buf.end(), slices[i].data, slices[i].data + slices[i].length);
+  }
+
+  // The span of a tag, PreviousTagSize included
+  auto tag_span = [](const uint8_t *p, size_t left) -> size_t {
+    if (left < FLV_TAG_HEADER_SIZE + 4) {
+      return left;
+    }
+    size_t span = FLV_TAG_HEADER_SIZE + 4 +
+                  ((uint32_t)p[1] << 16 | (uint32_t)p[2] << 8 | p[3]);
+    return std::min(span, left);
+  };
+
+  // A gather write holds either the FLV header or whole tags
+  if (classify_tag(buf.data(), buf.size()) == tag_class_t::Header ||
+      total == tag_span(buf.data(), total)) {
+    publish(std::make_shared<const std::vector<uint8_t>>(std::move(buf)));
+    return;
+  }
+  size_t pos = 0;
+  while (pos < total) {
+    size_t span = tag_span(buf.data() + pos, total - pos);
+    publish(std::make_shared<const std::vector<uint8_t>>(
+        buf.begin() + pos, buf.begin() + pos + span));
+    pos += span;
+  }
+}
+
+/// <summary>
+/// Represents a live FLV stream fanned out to many subscribers. The producer
+/// appends through the flv_stream_builder returned by builder(); every tag is
+/// serialized once into a shared buffer. The stream caches the FLV header,
+/// the last meta tag, the last audio/video sequence headers and the tags
+/// since the last video keyframe, so a new subscriber starts with a
+/// decodable stream. Joining only takes a snapshot of the cache and a read
+/// cursor, whatever the GOP size. Video subscribers always start at a
+/// keyframe: when the cache limit has evicted the last one, they wait for
+/// the next one. Streams without video start after the prelude tags.
+/// </summary>
+class flv_live_stream {
+public:
+  /// <summary>
+  /// Represents the cached stream prelude (header, meta and sequence
+  /// headers). A new copy is made whenever one of them changes.
+  /// </summary>
+  struct prelude_t {
+    /// <summary>
+    /// The header, meta, video and audio sequence header buffers.
+    /// </summary>
+    tag_buffer_ref items[4];
+
+    /// <summary>
+    /// The sequence numbers of the items.
+    /// </summary>
+    uint64_t seqs[4];
+  };
+
+  /// <summary>
+  /// Represents a subscriber with its own read cursor. It must not outlive
+  /// the stream, and each subscriber is read by one thread at a time.
+  /// </summary>
+  class subscriber {
+  public:
+    /// <summary>
+    /// Reads the next buffers to send, in order.
+    /// </summary>
+    /// <param name="out">The list to receive the buffers.</param>
+    /// <param name="max_count">The maximum count of buffers to read.</param>
+    /// <returns>The count of buffers read, 0 if none is available.</returns>
+    size_t read(std::vector<tag_buffer_ref> &out, size_t max_count) {
+      return stream_.read(*this, out, max_count);
+    }
+
+    /// <summary>
+    /// Gets the count of tags skipped because the subscriber fell behind the
+    /// cache.
+    /// </summary>
+    /// <returns>The count of tags skipped.</returns>
+    uint64_t skipped() const { return skipped_; }
+
+  private:
+    friend class flv_live_stream;
+
+    explicit subscriber(flv_live_stream &stream)
+        : stream_(stream), prelude_index_(0), cursor_(0), skipped_(0),
+          started_(false), waiting_(false) {}
+
+    DISALLOW_COPY_AND_ASSIGN(subscriber);
+
+    /// <summary>
+    /// The stream.
+    /// </summary>
+    flv_live_stream &stream_;
+
+    /// <summary>
+    /// The prelude snapshot taken when joining.
+    /// </summary>
+    std::shared_ptr<const prelude_t> prelude_;
+
+    /// <summary>
+    /// The next prelude item to read.
+    /// </summary>
+    size_t prelude_index_;
+
+    /// <summary>
+    /// The sequence number of the next tag to read.
+    /// </summary>
+    uint64_t cursor_;
+
+    /// <summary>
+    /// The count of tags skipped.
+    /// </summary>
+    uint64_t skipped_;
+
+    /// <summary>
+    /// Indicates whether anything was read (the FLV header first).
+    /// </summary>
+    bool started_;
+
+    /// <summary>
+    /// Indicates whether the subscriber waits for the next keyframe, the
+    /// last one having been evicted from the cache.
+    /// </summary>
+    bool waiting_;
+  };
+
+  /// <summary>
+  /// Constructs an instance of the live stream.
+  /// </summary>
+  /// <param name="max_cached_tags">
+  /// The maximum count of tags kept for the subscribers. The tags of the
+  /// previous and the current GOP are kept within this limit.
+  /// </param>
+  explicit flv_live_stream(size_t max_cached_tags = 8192)
+      : sink_(*this), builder_(sink_), max_cached_tags_(max_cached_tags),
+        prelude_(std::make_shared<prelude_t>()), front_seq_(0), next_seq_(0),
+        has_gop_(false), gop_seq_(0), previous_gop_seq_(0) {}
+
+  /// <summary>
+  /// Gets the builder to append the stream with.
+  /// </summary>
+  /// <returns>The builder.</returns>
+  flv_stream_builder &builder() { return builder_; }
+
+  /// <summary>
+  /// Creates a subscriber starting with the stream prelude and the tags of
+  /// the current GOP.
+  /// </summary>
+  /// <returns>The subscriber.</returns>
+  std::unique_ptr<subscriber> subscribe() {
+    std::unique_ptr<subscriber> s(new subscriber(*this));
+    std::lock_guard<std::mutex> lock(lock_);
+    s->prelude_ = prelude_;
+    start(*s);
+    return s;
+  }
+
+  /// <summary>
+  /// Gets the count of tags currently cached.
+  /// </summary>
+  /// <returns>The count of tags.</returns>
+  size_t cached_tags() const {
+    std::lock_guard<std::mutex> lock(lock_);
+    return tags_.size();
+  }
+
+  /// <summary>
+  /// Publishes one serialized header or tag.
+  /// </summary>
+  /// <param name="buf">The serialized header or tag.</param>
+  void publish(tag_buffer_ref buf) {
+    tag_class_t cls = classify_tag(buf->data(), buf->size());
+    std::unique_lock<std::mutex> lock(lock_);
+    int slot = -1;
+    switch (cls) {
+    case tag_class_t::Header:
+      slot = 0;
+      break;
+    case tag_class_t::Meta:
+      slot = 1;
+      break;
+    case tag_class_t::VideoConfig:
+      slot = 2;
+      break;
+    case tag_class_t::AudioConfig:
+      slot = 3;
+      break;
+    case tag_class_t::VideoKeyframe:
+      previous_gop_seq_ = has_gop_ ? gop_seq_ : front_seq_;
+      gop_seq_ = next_seq_;
+      has_gop_ = true;
+      break;
+    default:
+      break;
+    }
+    if (slot >= 0) {
+      std::shared_ptr<prelude_t> prelude =
+          std::make_shared<prelude_t>(*prelude_);
+      prelude->items[slot] = buf;
+      prelude->seqs[slot] = next_seq_;
+      prelude_ = prelude;
+    }
+
+    tags_.emplace_back(std::move(buf));
+    next_seq_++;
+
+    // Keep the previous and the current GOP, within the limit
+    while (front_seq_ < previous_gop_seq_ ||
+           tags_.size() > max_cached_tags_) {
+      tags_.pop_front();
+      front_seq_++;
+    }
+    lock.unlock();
+    if (publish_hook_) {
+      publish_hook_();
+    }
+  }
+
+  /// <summary>
+  /// Sets the function called after every published header or tag, outside
+  /// the stream lock, so the consumers can be woken up. It must be set before
+  /// the producer starts.
+  /// </summary>
+  /// <param name="hook">The function.</param>
+  void set_publish_hook(std::function<void()> hook) {
+    publish_hook_ = std::move(hook);
+  }
+
+private:
+  DISALLOW_COPY_AND_ASSIGN(flv_live_stream);
+
+  /// <summary>
+  /// Represents the sink turning each serialized tag into a shared buffer.
+  /// </summary>
+  class capture_sink : public flv_sink {
+  public:
+    explicit capture_sink(flv_live_stream &stream) : stream_(stream) {}
+
+    virtual void write(const io_slice *slices, size_t count) override {
+      split_gather_write(slices, count, [this](tag_buffer_ref buf) {
+        stream_.publish(std::move(buf));
+      });
+    }
+
+  private:
+    flv_live_stream &stream_;
+  };
+
+  /// <summary>
+  /// Positions the cursor of a subscriber which just took the prelude: at
+  /// the last keyframe, after the prelude tags when there is no video
+  /// keyframe yet, or waiting for the next keyframe when the cache limit has
+  /// evicted the last one.
+  /// </summary>
+  /// <param name="s">The subscriber.</param>
+  void start(subscriber &s) {
+    s.waiting_ = false;
+    if (!has_gop_) {
+      uint64_t after = 0;
+      for (int i = 0; i < 4; i++) {
+        if (s.prelude_->items[i]) {
+          after = std::max(after, s.prelude_->seqs[i] + 1);
+        }
+      }
+      s.cursor_ = std::max(front_seq_, after);
+    } else if (gop_seq_ >= front_seq_) {
+      s.cursor_ = gop_seq_;
+    } else {
+      s.cursor_ = next_seq_;
+      s.waiting_ = true;
+    }
+  }
+
+  /// <summary>
+  /// Checks whether a tag was already read as part of the prelude snapshot
+  /// of a subscriber.
+  /// </summary>
+  /// <param name="s">The subscriber.</param>
+  /// <param name="seq">The sequence number of the tag.</param>
+  /// <returns>True if the tag is a prelude item.</returns>
+  static bool in_prelude(const subscriber &s, uint64_t seq) {
+    for (int i = 0; i < 4; i++) {
+      if (s.prelude_->items[i] && s.prelude_->seqs[i] == seq) {
+        return true;
+      }
+    }
+    return false;
+  }
+
+  /// <summary>
+  /// Reads the next buffers of a subscriber, the prelude snapshot first.
+  /// </summary>
+  /// <param name="s">The subscriber.</param>
+  /// <param name="out">The list to receive the buffers.</param>
+  /// <param name="max_count">The maximum count of buffers to read.</param>
+  /// <returns>The count of buffers read.</returns>
+  size_t read(subscriber &s, std::vector<tag_buffer_ref> &out,
+              size_t max_count) {
+    std::lock_guard<std::mutex> lock(lock_);
+    if (!s.waiting_ && s.cursor_ < front_seq_) {
+      // Fell behind the cache, resume after the current prelude, without
+      // repeating the FLV header
+      uint64_t cursor = s.cursor_;
+      s.prelude_ = prelude_;
+      s.prelude_index_ = s.started_ ? 1 : 0;
+      start(s);
+      s.skipped_ += s.cursor_ - cursor;
+    }
+    if (s.waiting_) {
+      // Skip to the next keyframe once published, if still cached
+      uint64_t resume = has_gop_ && gop_seq_ >= s.cursor_ &&
+                                gop_seq_ >= front_seq_
+                            ? gop_seq_
+                            : next_seq_;
+      s.skipped_ += resume - s.cursor_;
+      s.cursor_ = resume;
+      s.waiting_ = resume == next_seq_;
+      if (!s.waiting_ && s.prelude_ != prelude_) {
+        // Sequence headers may have changed while waiting
+        s.prelude_ = prelude_;
+        s.prelude_index_ = s.started_ ? 1 : 0;
+      }
+    }
+
+    size_t n = 0;
+    while (n < max_count && s.prelude_index_ < 4) {
+      const tag_buffer_ref &item = s.prelude_->items[s.prelude_index_++];
+      if (item) {
+        out.emplace_back(item);
+        n++;
+      }
+    }
+    while (n < max_count && !s.waiting_ && s.cursor_ < next_seq_) {
+      if (!in_prelude(s, s.cursor_)) {
+        out.emplace_back(tags_[static_cast<size_t>(s.cursor_ - front_seq_)]);
+        n++;
+      }
+      s.cursor_++;
+    }
+    s.started_ = s.started_ || n;
+    return n;
+  }
+
+private:
+  /// <summary>
+  /// The sink of the builder.
+  /// </summary>
+  capture_sink sink_;
+
+  /// <summary>
+  /// The builder of the producer.
+  /// </summary>
+  flv_stream_builder builder_;
+
+  /// <summary>
+  /// The maximum count of tags kept.
+  /// </summary>
+  size_t max_cached_tags_;
+
+  /// <summary>
+  /// The lock of the cache.
+  /// </summary>
+  mutable std::mutex lock_;
+
+  /// <summary>
+  /// The current prelude.
+  /// </summary>
+  std::shared_ptr<const prelude_t> prelude_;
+
+  /// <summary>
+  /// The cached header and tags, from sequence number front_seq_ to
+  /// next_seq_.
+  /// </summary>
+  std::deque<tag_buffer_ref> tags_;
+
+  /// <summary>
+  /// The sequence number of the first cached tag.
+  /// </summary>
+  uint64_t front_seq_;
+
+  /// <summary>
+  /// The sequence number of the next published tag.
+  /// </summary>
+  uint64_t next_seq_;
+
+  /// <summary>
+  /// Indicates whether a video keyframe was published.
+  /// </summary>
+  bool has_gop_;
+
+  /// <summary>
+  /// The sequence number of the last video keyframe.
+  /// </summary>
+  uint64_t gop_seq_;
+
+  /// <summary>
+  /// The sequence number of the video keyframe before the last one.
+  /// </summary>
+  uint64_t previous_gop_seq_;
+
+  /// <summary>
+  /// The function called after every published header or tag.
+  /// </summary>
+  std::function<void()> publish_hook_;
+};
+
+/// <summary>
+/// Represents the counters of a flv_output_queue.
+/// </summary>
+struct output_queue_stats {
+  /// <summary>
+  /// The count of headers and tags written to the output sink.
+  /// </summary>
+  uint64_t written_tags;
+
+  /// <summary>
+  /// The count of bytes written to the output sink.
+  /// </summary>
+  uint64_t written_bytes;
+
+  /// <summary>
+  /// The count of frames dropped under pressure.
+  /// </summary>
+  uint64_t dropped_frames;
+
+  /// <summary>
+  /// The count of bytes of the frames dropped.
+  /// </summary>
+  uint64_t dropped_bytes;
+
+  /// <summary>
+  /// The count of tags queued.
+  /// </summary>
+  size_t queued_tags;
+
+  /// <summary>
+  /// The count of bytes queued.
+  /// </summary>
+  size_t queued_bytes;
+
+  /// <summary>
+  /// The highest count of bytes queued.
+  /// </summary>
+  size_t peak_queued_bytes;
+};
+
+/// <summary>
+/// Represents a bounded queue in front of one slow output sink, so a slow
+/// consumer never blocks the producer. The builder (or a live stream
+/// subscriber) writes into the queue and a writer thread drains it into the
+/// output sink, several tags per gather write. When the queue is full, the
+/// incoming inter and disposable video frames are dropped until the next
+/// keyframe. Audio frames and keyframes make room by dropping the newest
+/// queued inter frames, so every GOP left in the queue stays decodable, and
+/// are dropped only when there are none. The FLV header, meta tags and
+/// sequence headers are always queued.
+/// </summary>
+class flv_output_queue : public flv_sink {
+public:
+  /// <summary>
+  /// Constructs an instance of the queue and starts the writer thread.
+  /// </summary>
+  /// <param name="sink">The output sink, must outlive the queue.</param>
+  /// <param name="max_tags">The maximum count of tags queued.</param>
+  /// <param name="max_bytes">
+  /// The maximum count of bytes queued. A single larger tag is still queued
+  /// when the queue is empty.
+  /// </param>
+  explicit flv_output_queue(flv_sink &sink, size_t max_tags = 1024,
+                            size_t max_bytes = 16 * 1024 * 1024)
+      : sink_(sink), max_tags_(std::max<size_t>(max_tags, 1)),
+        max_bytes_(max_bytes), queued_bytes_(0), skipping_(false),
+        stopping_(false) {
+    memset(&stats_, 0, sizeof(stats_));
+    thread_ = std::thread(&flv_output_queue::run, this);
+  }
+
+  /// <summary>
+  /// Destructs the instance, writing the queued tags first.
+  /// </summary>
+  ~flv_output_queue() {
+    try {
+      stop();
+    } catch (...) {
+    }
+  }
+
+  virtual void write(const io_slice *slices, size_t count) override {
+    split_gather_write(slices, count,
+                       [this](tag_buffer_ref buf) { push(std::move(buf)); });
+  }
+
+  /// <summary>
+  /// Queues one serialized header or tag, or drops it under pressure.
+  /// </summary>
+  /// <param name="buf">The serialized header or tag.</param>
+  /// <exception>Rethrows the exception of the output sink, if
+  /// any.</exception>
+  void push(tag_buffer_ref buf) {
+    tag_class_t cls = classify_tag(buf->data(), buf->size());
+    size_t size = buf->size();
+    bool inter = cls == tag_class_t::Video ||
+                 cls == tag_class_t::DisposableVideo;
+    bool frame = inter || cls == tag_class_t::VideoKeyframe ||
+                 cls == tag_class_t::Audio;
+
+    std::lock_guard<std::mutex> lock(lock_);
+    if (error_) {
+      std::rethrow_exception(error_);
+    }
+    if (stopping_) {
+      throw std::logic_error("the output queue is stopped");
+    }
+    if (cls == tag_class_t::VideoKeyframe) {
+      skipping_ = false;
+    }
+    if (inter && skipping_) {
+      drop(size);
+      return;
+    }
+    if (frame && !fits(size)) {
+      if (inter) {
+        skipping_ = true;
+        drop(size);
+        return;
+      }
+
+      // Make room with the newest queued inter frames, the next ones of the
+      // stream refer to them
+      for (size_t i = queue_.size(); i-- > 0 && !fits(size);) {
+        if (queue_[i].inter) {
+          drop(queue_[i].buf->size());
+          queued_bytes_ -= queue_[i].buf->size();
+          queue_.erase(queue_.begin() + i);
+          skipping_ = skipping_ || cls == tag_class_t::Audio;
+        }
+      }
+      if (!fits(size)) {
+        skipping_ = skipping_ || cls == tag_class_t::VideoKeyframe;
+        drop(size);
+        return;
+      }
+    }
+
+    queued_bytes_ += size;
+    stats_.peak_queued_bytes =
+        std::max(stats_.peak_queued_bytes, queued_bytes_);
+    queue_.push_back(entry_t{std::move(buf), inter});
+    wake_.notify_one();
+  }
+
+  /// <summary>
+  /// Stops the writer thread after writing the queued tags. Later writes
+  /// throw std::logic_error.
+  /// </summary>
+  /// <exception>Rethrows the exception of the output sink, if
+  /// any.</exception>
+  void stop() {
+    if (thread_.joinable()) {
+      {
+        std::lock_guard<std::mutex> lock(lock_);
+        stopping_ = true;
+      }
+      wake_.notify_all();
+      thread_.join();
+    }
+    std::lock_guard<std::mutex> lock(lock_);
+    if (error_) {
+      std::exception_ptr error = error_;
+      error_ = nullptr;
+      std::rethrow_exception(error);
+    }
+  }
+
+  /// <summary>
+  /// Gets the counters of the queue.
+  /// </summary>
+  /// <returns>The counters.</returns>
+  output_queue_stats stats() const {
+    std::lock_guard<std::mutex> lock(lock_);
+    output_queue_stats stats = stats_;
+    stats.queued_tags = queue_.size();
+    stats.queued_bytes = queued_bytes_;
+    return stats;
+  }
+
+private:
+  DISALLOW_COPY_AND_ASSIGN(flv_output_queue);
+
+  /// <summary>
+  /// The maximum count of tags per gather write of the writer thread.
+  /// </summary>
+  static const size_t MAX_BATCH = 64;
+
+  /// <summary>
+  /// Represents a queued header or tag.
+  /// </summary>
+  struct entry_t {
+    /// <summary>
+    /// The serialized header or tag.
+    /// </summary>
+    tag_buffer_ref buf;
+
+    /// <summary>
+    /// Indicates whether the tag is an inter or disposable video frame.
+    /// </summary>
+    bool inter;
+  };
+
+  /// <summary>
+  /// Checks whether a tag fits in the queue. The lock must be held.
+  /// </summary>
+  /// <param name="size">The tag size.</param>
+  /// <returns>True if the tag fits; otherwise false.</returns>
+  bool fits(size_t size) const {
+    return queue_.empty() || (queue_.size() < max_tags_ &&
+                              queued_bytes_ + size <= max_bytes_);
+  }
+
+  /// <summary>
+  /// Counts a dropped frame. The lock must be held.
+  /// </summary>
+  /// <param name="size">The tag size.</param>
+  void drop(size_t size) {
+    stats_.dropped_frames++;
+    stats_.dropped_bytes += size;
+  }
+
+  /// <summary>
+  /// The writer thread procedure.
+  /// </summary>
+  void run() {
+    std::vector<tag_buffer_ref> batch;
+    std::vector<io_slice> slices;
+    bool dirty = false;
+    try {
+      while (true) {
+        {
+          std::unique_lock<std::mutex> lock(lock_);
+          if (queue_.empty() && dirty) {
+            // Idle, hand the buffered data to the device
+            lock.unlock();
+            sink_.flush();
+            dirty = false;
+            lock.lock();
+          }
+          while (queue_.empty() && !stopping_) {
+            wake_.wait(lock);
+          }
+          if (queue_.empty()) {
+            break;
+          }
+          while (!queue_.empty() && batch.size() < MAX_BATCH) {
+            queued_bytes_ -= queue_.front().buf->size();
+            batch.emplace_back(std::move(queue_.front().buf));
+            queue_.pop_front();
+          }
+        }
+
+        size_t bytes = 0;
+        slices.clear();
+        for (auto &buf : batch) {
+          slices.push_back(io_slice{buf->data(), buf->size()});
+          bytes += buf->size();
+        }
+        sink_.write(slices.data(), slices.size());
+        dirty = true;
+
+        std::lock_guard<std::mutex> lock(lock_);
+        stats_.written_tags += batch.size();
+        stats_.written_bytes += bytes;
+        batch.clear();
+      }
+      if (dirty) {
+        sink_.flush();
+      }
+    } catch (...) {
+      std::lock_guard<std::mutex> lock(lock_);
+      error_ = std::current_exception();
+      queue_.clear();
+      queued_bytes_ = 0;
+    }
+  }
+
+private:
+  /// <summary>
+  /// The output sink.
+  /// </summary>
+  flv_sink &sink_;
+
+  /// <summary>
+  /// The maximum count of tags queued.
+  /// </summary>
+  size_t max_tags_;
+
+  /// <summary>
+  /// The maximum count of bytes queued.
+  /// </summary>
+  size_t max_bytes_;
+
+  /// <summary>
+  /// The lock of the queue.
+  /// </summary>
+  mutable std::mutex lock_;
+
+  /// <summary>
+  /// Wakes the writer thread up.
+  /// </summary>
+  std::condition_variable wake_;
+
+  /// <summary>
+  /// The queued headers and tags.
+  /// </summary>
+  std::deque<entry_t> queue_;
+
+  /// <summary>
+  /// The count of bytes queued.
+  /// </summary>
+  size_t queued_bytes_;
+
+  /// <summary>
+  /// Indicates whether inter frames are dropped until the next keyframe.
+  /// </summary>
+  bool skipping_;
+
+  /// <summary>
+  /// Indicates whether the writer thread is stopping.
+  /// </summary>
+  bool stopping_;
+
+  /// <summary>
+  /// The counters.
+  /// </summary>
+  output_queue_stats stats_;
+
+  /// <summary>
+  /// The exception of the output sink.
+  /// </summary>
+  std::exception_ptr error_;
+
+  /// <summary>
+  /// The writer thread.
+  /// </summary>
+  std::thread thread_;
+};
+
+/// <summary>
+/// The policies of a full frame queue.
+/// </summary>
+enum class queue_full_policy_t : uint8_t {
+  /// The producer waits until there is room.
+  Block = 0,
+  /// The push fails and the producer keeps the frame.
+  Fail = 1,
+  /// The frame is dropped and counted.
+  Drop = 2,
+};
+
+/// <summary>
+/// Represents the concurrent front end of a flv_stream_builder. Producer
+/// threads push frames into a bounded lock-free multi-producer single-consumer
+/// queue, and one writer thread drains it in batches into the builder, so the
+/// producers never wait for the sink. The builder must outlive the writer,
+/// and must not be used by other threads while the writer runs.
+/// </summary>
+class flv_async_writer {
+public:
+  /// <summary>
+  /// Constructs an instance of the writer and starts the writer thread.
+  /// </summary>
+  /// <param name="builder">The builder to append the frames with.</param>
+  /// <param name="capacity">
+  /// The queue capacity, rounded up to a power of 2.
+  /// </param>
+  /// <param name="policy">The policy of a full queue.</param>
+  /// <param name="batch_size">The maximum count of frames per batch.</param>
+  flv_async_writer(flv_stream_builder &builder, size_t capacity = 1024,
+                   queue_full_policy_t policy = queue_full_policy_t::Block,
+                   size_t batch_size = 64)
+      : builder_(builder), policy_(policy), batch_size_(batch_size),
+        enqueue_pos_(0), dequeue_pos_(0), stopping_(false), sleeping_(false),
+        dropped_(0), written_(0) {
+    size_t n = 2;
+    while (n < capacity) {
+      n <<= 1;
+    }
+    mask_ = n - 1;
+    if (!batch_size_) {
+      batch_size_ = 1;
+    }
+    batch_.reserve(batch_size_);
+    cells_.reset(new cell_t[n]);
+    for (size_t i = 0; i < n; i++) {
+      cells_[i].sequence.store(i, std::memory_order_relaxed);
+    }
+    thread_ = std::thread(&flv_async_writer::run, this);
+  }
+
+  /// <summary>
+  /// Destructs the instance, writing the queued frames first.
+  /// </summary>
+  ~flv_async_writer() {
+    try {
+      stop();
+    } catch (...) {
+    }
+  }
+
+  /// <summary>
+  /// Pushes a frame, copying its data into the queue. The queue slots keep
+  /// their buffers, so no allocation happens once they are large enough.
+  /// </summary>
+  /// <param name="frame">The frame descriptor.</param>
+  /// <returns>True if the frame was queued; otherwise false.</returns>
+  bool push(const frame_desc &frame) {
+    return enqueue(frame, nullptr);
+  }
+
+  /// <summary>
+  /// Pushes a frame whose data is in the specified buffer, without copying.
+  /// The buffer is swapped with the buffer of the queue slot, so the caller
+  /// gets a recycled buffer back if the frame was queued.
+  /// </summary>
+  /// <param name="frame">
+  /// The frame descriptor, its data pointer is ignored.
+  /// </param>
+  /// <param name="payload">The frame data.</param>
+  /// <returns>True if the frame was queued; otherwise false.</returns>
+  bool push(const frame_desc &frame, std::vector<uint8_t> &payload) {
+    return enqueue(frame, &payload);
+  }
+
+  /// <summary>
+  /// Stops the writer thread after writing the queued frames. Frames pushed
+  /// later are not written.
+  /// </summary>
+  /// <exception>Rethrows the exception that stopped the writer, if
+  /// any.</exception>
+  void stop() {
+    if (thread_.joinable()) {
+      {
+        std::lock_guard<std::mutex> lock(lock_);
+        stopping_ = true;
+      }
+      wake_.notify_all();
+      thread_.join();
+    }
+    if (error_) {
+      std::exception_ptr error = error_;
+      error_ = nullptr;
+      std::rethrow_exception(error);
+    }
+  }
+
+  /// <summary>
+  /// Gets the count of frames dropped by the Drop policy.
+  /// </summary>
+  /// <returns>The count of frames dropped.</returns>
+  uint64_t dropped() const { return dropped_.load(std::memory_order_relaxed); }
+
+  /// <summary>
+  /// Gets the count of frames written to the builder.
+  /// </summary>
+  /// <returns>The count of frames written.</returns>
+  uint64_t written() const { return written_.load(std::memory_order_relaxed); }
+
+private:
+  DISALLOW_COPY_AND_ASSIGN(flv_async_writer);
+
+  /// <summary>
+  /// Represents a queue slot.
+  /// </summary>
+  struct cell_t {
+    /// <summary>
+    /// The position the slot is ready for, pushes see the position and the
+    /// writer sees the position plus 1.
+    /// </summary>
+    std::atomic<size_t> sequence;
+
+    /// <summary>
+    /// The frame descriptor, pointing into the payload.
+    /// </summary>
+    frame_desc frame;
+
+    /// <summary>
+    /// The frame data.
+    /// </summary>
+    std::vector<uint8_t> payload;
+  };
+
+  /// <summary>
+  /// Claims a slot and fills it, or applies the full queue policy.
+  /// </summary>
+  /// <param name="frame">The frame descriptor.</param>
+  /// <param name="payload">The buffer to swap in, or null to copy.</param>
+  /// <returns>True if the frame was queued; otherwise false.</returns>
+
+  bool enqueue(const frame_desc &frame, std::vector<uint8_t> *payload) {
+    int spins = 0;
+    while (true) {
+      size_t pos = enqueue_pos_.load(std::memory_order_relaxed);
+      cell_t &cell = cells_[pos & mask_];
+      size_t seq = cell.sequence.load(std::memory_order_acquire);
+      intptr_t diff = (intptr_t)seq - (intptr_t)pos;
+      if (diff == 0) {
+        if (!enqueue_pos_.compare_exchange_weak(pos, pos + 1,
+                                                std::memory_order_relaxed)) {
+          continue;
+        }
+        cell.frame = frame;
+        if (payload) {
+          cell.payload.swap(*payload);
+        } else {
+          cell.payload.assign(frame.data, frame.data + frame.length);
+        }
+        cell.frame.data = cell.payload.data();
+        cell.frame.length = static_cast<uint32_t>(cell.payload.size());
+        cell.sequence.store(pos + 1, std::memory_order_release);
+        if (sleeping_.load(std::memory_order_acquire)) {
+          std::lock_guard<std::mutex> lock(lock_);
+          wake_.notify_one();
+        }
+        return true;
+      }
+      if (diff > 0) {
+        continue;
+      }
+
+      // The queue is full
+      if (policy_ == queue_full_policy_t::Fail) {
+        return false;
+      }
+      if (policy_ == queue_full_policy_t::Drop) {
+        dropped_.fetch_add(1, std::memory_order_relaxed);
+        return false;
+      }
+      if (++spins < 64) {
+        std::this_thread::yield();
+      } else {
+        std::unique_lock<std::mutex> lock(lock_);
+        if (stopping_) {
+          return false;
+        }
+        drained_.wait_for(lock, std::chrono::milliseconds(1));
+      }
+    }
+  }
+
+  /// <summary>
+  /// The writer thread procedure.
+  /// </summary>
+  void run() {
+    try {
+      while (true) {
+        size_t n = drain();
+        if (n) {
+          builder_.flush();
+          written_.fetch_add(n, std::memory_order_relaxed);
+          drained_.notify_all();
+          continue;
+        }
+
+        std::unique_lock<std::mutex> lock(lock_);
+        sleeping_.store(true, std::memory_order_seq_cst);
+        if (!ready() && !stopping_) {
+          wake_.wait_for(lock, std::chrono::milliseconds(10));
+        }
+        sleeping_.store(false, std::memory_order_relaxed);
+        if (stopping_ && !ready()) {
+          break;
+        }
+      }
+    } catch (...) {
+      error_ = std::current_exception();
+      std::lock_guard<std::mutex> lock(lock_);
+      stopping_ = true;
+    }
+    drained_.notify_all();
+  }
+
+  /// <summary>
+  /// Checks whether the next slot has been filled.
+  /// </summary>
+  /// <returns>True if the next slot is ready; otherwise false.</returns>
+  bool ready() const {
+    size_t pos = dequeue_pos_;
+    return cells_[pos & mask_].sequence.load(std::memory_order_acquire) ==
+           pos + 1;
+  }
+
+  /// <summary>
+  /// Appends a batch of ready frames to the builder with one call of
+  /// append_frames(), then hands their slots back to the producers.
+  /// </summary>
+  /// <returns>The count of frames appended.</returns>
+  size_t drain() {
+    batch_.clear();
+    size_t pos = dequeue_pos_;
+    while (batch_.size() < batch_size_ &&
+           cells_[pos & mask_].sequence.load(std::memory_order_acquire) ==
+               pos + 1) {
+      batch_.push_back(cells_[pos & mask_].frame);
+      pos++;
+    }
+    if (batch_.empty()) {
+      return 0;
+    }
+    builder_.append_frames(batch_.data(), batch_.size());
+    for (; dequeue_pos_ != pos; dequeue_pos_++) {
+      cells_[dequeue_pos_ & mask_].sequence.store(dequeue_pos_ + mask_ + 1,
+                                                  std::memory_order_release);
+    }
+    return batch_.size();
+  }
+
+private:
+  /// <summary>
+  /// The builder.
+  /// </summary>
+  flv_stream_builder &builder_;
+
+  /// <summary>
+  /// The policy of a full queue.
+  /// </summary>
+  queue_full_policy_t policy_;
+
+  /// <summary>
+  /// The maximum count of frames per batch.
+  /// </summary>
+  size_t batch_size_;
+
+  /// <summary>
+  /// The queue capacity minus 1.
+  /// </summary>
+  size_t mask_;
+
+  /// <summary>
+  /// The queue slots.
+  /// </summary>
+  std::unique_ptr<cell_t[]> cells_;
+
+  /// <summary>
+  /// The next slot to push, shared by the producers.
+  /// </summary>
+  std::atomic<size_t> enqueue_pos_;
+
+  /// <summary>
+  /// The next slot to write, owned by the writer thread.
+  /// </summary>
+  size_t dequeue_pos_;
+
+  /// <summary>
+  /// The reused batch of frames handed to the builder.
+  /// </summary>
+  std::vector<frame_desc> batch_;
+
+  /// <summary>
+  /// The lock of the slow paths (waiting writer, blocked producers).
+  /// </summary>
+  std::mutex lock_;
+
+  /// <summary>
+  /// Wakes the writer thread up.
+  /// </summary>
+  std::condition_variable wake_;
+
+  /// <summary>
+  /// Wakes the blocked producers up.
+  /// </summary>
+  std::condition_variable drained_;
+
+  /// <summary>
+  /// Indicates whether the writer thread is stopping.
+  /// </summary>
+  bool stopping_;
+
+  /// <summary>
+  /// Indicates whether the writer thread is waiting for frames.
+  /// </summary>
+  std::atomic<bool> sleeping_;
+
+  /// <summary>
+  /// The count of frames dropped.
+  /// </summary>
+  std::atomic<uint64_t> dropped_;
+
+  /// <summary>
+  /// The count of frames written.
+  /// </summary>
+  std::atomic<uint64_t> written_;
+
+  /// <summary>
+  /// The exception that stopped the writer thread.
+  /// </summary>
+  std::exception_ptr error_;
+
+  /// <summary>
+  /// The writer thread.
+  /// </summary>
+  std::thread thread_;
+};
+
+/// <summary>
+/// Represents an interleaving stage in front of a flv_stream_builder. Audio
+/// and video frames pushed out of order are buffered in a bounded min-heap per
+/// track and appended in DTS order, so the tag timestamps never go backwards.
+/// A frame is appended as soon as every expected track has a frame buffered,
+/// or once it is older than the newest DTS by the maximum delay, or when a
+/// heap is full.
+/// </summary>
+class flv_interleaver {
+public:
+  /// <summary>
+  /// Constructs an instance of the interleaver.
+  /// </summary>
+  /// <param name="builder">The builder to append the frames with.</param>
+  /// <param name="max_delay">
+  /// The maximum time in milliseconds a frame waits for the other track.
+  /// </param>
+  /// <param name="capacity">The maximum count of frames per track.</param>
+  /// <param name="has_audio">Whether audio frames are expected.</param>
+  /// <param name="has_video">Whether video frames are expected.</param>
+  flv_interleaver(flv_stream_builder &builder, uint32_t max_delay = 500,
+                  size_t capacity = 64, bool has_audio = true,
+                  bool has_video = true)
+      : builder_(builder), max_delay_(max_delay), order_(0), newest_(0),
+        last_emitted_(0), emitted_(0), late_(0), dropped_(0) {
+    if (!capacity) {
+      capacity = 1;
+    }
+    tracks_[0].active = has_video;
+    tracks_[1].active = has_audio;
+    for (auto &t : tracks_) {
+      t.slots.resize(capacity);
+      t.heap.reserve(capacity);
+      t.free.reserve(capacity);
+      for (size_t i = capacity; i > 0; i--) {
+        t.free.push_back(i - 1);
+      }
+    }
+  }
+
+  /// <summary>
+  /// Pushes a frame, copying its data. Frames older than the last appended
+  /// frame are dropped.
+  /// </summary>
+  /// <param name="frame">The frame descriptor.</param>
+  /// <returns>True if the frame was accepted; otherwise false.</returns>
+  bool push(const frame_desc &frame) {
+    if (emitted_ && frame.dts < last_emitted_) {
+      dropped_++;
+      return false;
+    }
+    if ((uint64_t)frame.dts + max_delay_ < newest_) {
+      late_++;
+    }
+    newest_ = std::max(newest_, frame.dts);
+
+    track_t &t = tracks_[track_index(frame.track)];
+    t.active = true;
+    if (t.free.empty()) {
+      // A frame older than everything buffered goes out first, as is
+      if (frame.dts < head(*oldest()).frame.dts) {
+        emit(frame);
+        return true;
+      }
+      make_room(t);
+      if (frame.dts < last_emitted_) {
+        dropped_++;
+        return false;
+      }
+    }
+    size_t slot = t.free.back();
+    t.free.pop_back();
+    pending_frame &p = t.slots[slot];
+    p.frame = frame;
+    p.payload.assign(frame.data, frame.data + frame.length);
+    p.frame.data = p.payload.data();
+    p.order = order_++;
+    t.heap.push_back(slot);
+    std::push_heap(t.heap.begin(), t.heap.end(), later_than(t.slots));
+
+    drain(false);
+    return true;
+  }
+
+  /// <summary>
+  /// Appends all the buffered frames, in DTS order.
+  /// </summary>
+  void flush() { drain(true); }
+
+  /// <summary>
+  /// Gets the count of frames buffered.
+  /// </summary>
+  /// <returns>The count of frames buffered.</returns>
+  size_t buffered() const {
+    return tracks_[0].heap.size() + tracks_[1].heap.size();
+  }
+
+  /// <summary>
+  /// Gets the count of frames appended.
+  /// </summary>
+  /// <returns>The count of frames appended.</returns>
+  uint64_t emitted() const { return emitted_; }
+
+  /// <summary>
+  /// Gets the count of frames that arrived more than the maximum delay behind
+  /// the newest frame, but were still appended in order.
+  /// </summary>
+  /// <returns>The count of late frames.</returns>
+  uint64_t late() const { return late_; }
+
+  /// <summary>
+  /// Gets the count of frames dropped because a newer frame had already been
+  /// appended.
+  /// </summary>
+  /// <returns>The count of dropped frames.</returns>
+  uint64_t dropped() const { return dropped_; }
+
+private:
+  DISALLOW_COPY_AND_ASSIGN(flv_interleaver);
+
+  /// <summary>
+  /// Represents a buffered frame.
+  /// </summary>
+  struct pending_frame {
+    /// <summary>
+    /// The frame descriptor, pointing into the payload.
+    /// </summary>
+    frame_desc frame;
+
+    /// <summary>
+    /// The frame data, the capacity is reused.
+    /// </summary>
+    std::vector<uint8_t> payload;
+
+    /// <summary>
+    /// The arrival order, breaking DTS ties.
+    /// </summary>
+    uint64_t order;
+  };
+
+  /// <summary>
+  /// Represents the buffer of one track.
+  /// </summary>
+  struct track_t {
+    /// <summary>
+    /// Indicates whether the track is expected or has received any frame.
+    /// </summary>
+    bool active;
+
+    /// <summary>
+    /// The frame slots.
+    /// </summary>
+    std::vector<pending_frame> slots;
+
+    /// <summary>
+    /// The min-heap of slot indices, ordered by DTS.
+    /// </summary>
+    std::vector<size_t> heap;
+
+    /// <summary>
+    /// The free slot indices.
+    /// </summary>
+    std::vector<size_t> free;
+  };
+
+  /// <summary>
+  /// Orders the slots for a min-heap by DTS then arrival.
+  /// </summary>
+  struct later_than {
+    explicit later_than(const std::vector<pending_frame> &slots)
+        : slots(slots) {}
+    bool operator()(size_t a, size_t b) const {
+      const pending_frame &x = slots[a];
+      const pending_frame &y = slots[b];
+      if (x.frame.dts != y.frame.dts) {
+        return x.frame.dts > y.frame.dts;
+      }
+      return x.order > y.order;
+    }
+    const std::vector<pending_frame> &slots;
+  };
+
+  /// <summary>
+  /// Gets the track buffer index of the track type.
+  /// </summary>
+  /// <param name="track">The track type.</param>
+  /// <returns>The index.</returns>
+  static size_t track_index(track_type_t track) {
+    return track == track_type_t::Audio ? 1 : 0;
+  }
+
+  /// <summary>
+  /// Gets the oldest frame of the track.
+  /// </summary>
+  /// <param name="t">The track buffer, not empty.</param>
+  /// <returns>The oldest frame.</returns>
+  static const pending_frame &head(const track_t &t) {
+    return t.slots[t.heap.front()];
+  }
+
+  /// <summary>
+  /// Appends the oldest frames of all the tracks until the specified track
+  /// has a free slot.
+  /// </summary>
+  /// <param name="full">The track that needs a free slot.</param>
+  void make_room(track_t &full) {
+    while (full.free.empty()) {
+      track_t *t = oldest();
+      pop(*t);
+    }
+  }
+
+  /// <summary>
+  /// Gets the track holding the oldest frame.
+  /// </summary>
+  /// <returns>The track, or null if nothing is buffered.</returns>
+  track_t *oldest() {
+    track_t *best = nullptr;
+    for (auto &t : tracks_) {
+      if (t.heap.empty()) {
+        continue;
+      }
+      if (!best || before(head(t), head(*best))) {
+        best = &t;
+      }
+    }
+    return best;
+  }
+
+  /// <summary>
+  /// Compares two buffered frames.
+  /// </summary>
+  /// <param name="x">The first frame.</param>
+  /// <param name="y">The second frame.</param>
+  /// <returns>True if the first frame goes first; otherwise false.</returns>
+  static bool before(const pending_frame &x, const pending_frame &y) {
+    if (x.frame.dts != y.frame.dts) {
+      return x.frame.dts < y.frame.dts;
+    }
+    return x.order < y.order;
+  }
+
+  /// <summary>
+  /// Appends the oldest frame of the track and frees its slot.
+  /// </summary>
+  /// <param name="t">The track buffer, not empty.</param>
+  void pop(track_t &t) {
+    std::pop_heap(t.heap.begin(), t.heap.end(), later_than(t.slots));
+    size_t slot = t.heap.back();
+    t.heap.pop_back();
+    t.free.push_back(slot);
+    emit(t.slots[slot].frame);
+  }
+
+  /// <summary>
+  /// Appends a frame.
+  /// </summary>
+  /// <param name="frame">The frame descriptor.</param>
+  void emit(const frame_desc &frame) {
+    last_emitted_ = frame.dts;
+    emitted_++;
+    builder_.append_frame(frame);
+  }
+
+  /// <summary>
+  /// Appends the frames that can no longer be preceded by another frame.
+  /// </summary>
+  /// <param name="all">Whether to append all the frames.</param>
+  void drain(bool all) {
+    while (track_t *t = oldest()) {
+      bool ready = all;
+      if (!ready) {
+        ready = true;
+        for (auto &other : tracks_) {
+          if (other.active && other.heap.empty()) {
+            ready = false;
+          }
+        }
+      }
+      if (!ready) {
+        ready = (uint64_t)head(*t).frame.dts + max_delay_ <= newest_;
+      }
+      if (!ready) {
+        break;
+      }
+      pop(*t);
+    }
+  }
+
+private:
+  /// <summary>
+  /// The builder.
+  /// </summary>
+  flv_stream_builder &builder_;
+
+  /// <summary>
+  /// The maximum time in milliseconds a frame waits for the other track.
+  /// </summary>
+  uint32_t max_delay_;
+
+  /// <summary>
+  /// The track buffers, video then audio.
+  /// </summary>
+  track_t tracks_[2];
+
+  /// <summary>
+  /// The arrival counter.
+  /// </summary>
+  uint64_t order_;
+
+  /// <summary>
+  /// The newest DTS pushed.
+  /// </summary>
+  uint32_t newest_;
+
+  /// <summary>
+  /// The DTS of the last frame appended.
+  /// </summary>
+  uint32_t last_emitted_;
+
+  /// <summary>
+  /// The count of frames appended.
+  /// </summary>
+  uint64_t emitted_;
+
+  /// <summary>
+  /// The count of late frames.
+  /// </summary>
+  uint64_t late_;
+
+  /// <summary>
+  /// The count of dropped frames.
+  /// </summary>
+  uint64_t dropped_;
+};
+
+/// <summary>
+/// Represents the writer splitting a recording into segment files. A new
+/// segment starts at the first video keyframe (or audio frame, for audio
+/// only streams) after the maximum duration or size. Each segment gets its
+/// own stream header, meta tag and the last AVC/AAC sequence headers, and
+/// its timestamps can be rebased to 0. Old segments are finalized, synced
+/// and closed by a background thread, so a rollover never waits for the
+/// disk.
+/// </summary>
+class flv_segment_writer {
+public:
+  /// <summary>
+  /// Opens the file of a segment, returning its file descriptor (owned by
+  /// the writer from then on) or -1 with errno set.
+  /// </summary>
+  typedef std::function<int(uint32_t index)> open_segment_t;
+
+  /// <summary>
+  /// Constructs an instance of the writer and starts the closing thread.
+  /// The first segment is opened by the first tag.
+  /// </summary>
+  /// <param name="open_segment">Opens the file of a segment.</param>
+  /// <param name="max_duration">
+  /// The duration in milliseconds after which a segment ends, 0 for none.
+  /// </param>
+  /// <param name="max_bytes">
+  /// The size in bytes after which a segment ends, 0 for none.
+  /// </param>
+  /// <param name="rebase">Whether each segment starts at timestamp 0.</param>
+  /// <param name="has_audio">Whether there is audio data.</param>
+  /// <param name="has_video">Whether there is video data.</param>
+  flv_segment_writer(open_segment_t open_segment, uint32_t max_duration = 60000,
+                     uint64_t max_bytes = 0, bool rebase = true,
+                     bool has_audio = true, bool has_video = true)
+      : open_segment_(open_segment), max_duration_(max_duration),
+        max_bytes_(max_bytes), rebase_(rebase), has_audio_(has_audio),
+        has_video_(has_video), keyframe_capacity_(0), builder_(nullptr),
+        opened_(0), start_timestamp_(0), base_timestamp_(0), bytes_(0),
+        busy_(false), stopping_(false), closed_(0) {
+    thread_ = std::thread(&flv_segment_writer::run, this);
+  }
+
+  /// <summary>
+  /// Destructs the instance, closing all the segments.
+  /// </summary>
+  ~flv_segment_writer() {
+    try {
+      close();
+    } catch (...) {
+    }
+    {
+      std::lock_guard<std::mutex> lock(lock_);
+      stopping_ = true;
+    }
+    wake_.notify_all();
+    thread_.join();
+  }
+
+  /// <summary>
+  /// Sets the meta of the segments opened from now on. Its "duration" and
+  /// "filesize" are patched per segment when the segment is closed.
+  /// </summary>
+  /// <param name="meta">The meta.</param>
+  /// <returns>The writer.</returns>
+  flv_segment_writer &set_meta(const amf::amf_value_ref &meta) {
+    meta_ = meta;
+    return *this;
+  }
+
+  /// <summary>
+  /// Enables the keyframe index in the segments opened from now on.
+  /// </summary>
+  /// <param name="max_keyframes">
+  /// The maximum count of entries, up to MAX_KEYFRAME_INDEX_ENTRIES.
+  /// </param>
+  /// <returns>The writer.</returns>
+  /// <exception cref="std::invalid_argument">If the index cannot fit in a
+  /// meta tag.</exception>
+  flv_segment_writer &enable_keyframe_index(uint32_t max_keyframes) {
+    if (max_keyframes > MAX_KEYFRAME_INDEX_ENTRIES) {
+      throw std::invalid_argument("The keyframe index does not fit a tag");
+    }
+    keyframe_capacity_ = max_keyframes;
+    return *this;
+  }
+
+  /// <summary>
+  /// Appends a video tag, as flv_stream_builder::append_video_tag.
+  /// </summary>
+  /// <param name="timestamp">The timetamp of the tag.</param>
+  /// <param name="data">The VIDEODATA.</param>
+  /// <param name="length">The length of the VIDEODATA.</param>
+  void append_video_tag(uint32_t timestamp, const uint8_t *data,
+                        uint32_t length) {
+    tag_class_t kind = classify_video_data(data, length);
+    prepare(timestamp, kind == tag_class_t::VideoKeyframe, length);
+    builder_->append_video_tag(rebased(timestamp), data, length);
+    if (kind == tag_class_t::VideoConfig) {
+      video_config_.assign(data, data + length);
+    }
+  }
+
+  /// <summary>
+  /// Appends an audio tag, as flv_stream_builder::append_audio_tag.
+  /// </summary>
+  /// <param name="timestamp">The timetamp of the tag.</param>
+  /// <param name="data">The AUDIODATA.</param>
+  /// <param name="length">The length of the AUDIODATA.</param>
+  void append_audio_tag(uint32_t timestamp, const uint8_t *data,
+                        uint32_t length) {
+    bool aac = length >= 2 &&
+               (data[0] >> 4) ==
+                   static_cast<uint8_t>(audio_data_sound_format::AAC);
+    bool config =
+        aac && data[1] == static_cast<uint8_t>(
+                              aac_audio_data_packet_type::AacSequenceHeader);
+    prepare(timestamp, !has_video_ && !config, length);
+    builder_->append_audio_tag(rebased(timestamp), data, length);
+    if (config) {
+      audio_config_.assign(data, data + length);
+    }
+  }
+
+  /// <summary>
+  /// Appends an AVC or AAC frame, as flv_stream_builder::append_frame.
+  /// </summary>
+  /// <param name="frame">The frame descriptor.</param>
+  void append_frame(const frame_desc &frame) {
+    bool video = frame.track == track_type_t::Video;
+    bool sync = !frame.config && (video ? frame.keyframe : !has_video_);
+    prepare(frame.dts, sync, frame.length);
+    frame_desc rebased_frame = frame;
+    rebased_frame.dts = rebased(frame.dts);
+    rebased_frame.pts = rebased_frame.dts + (frame.pts - frame.dts);
+    builder_->append_frame(rebased_frame);
+    if (frame.config) {
+      // Keep the tag body the builder makes, to be replayed per segment
+      std::vector<uint8_t> &config = video ? video_config_ : audio_config_;
+      if (video) {
+        const uint8_t header[VIDEO_HEADER_SIZE] = {0x17, 0, 0, 0, 0};
+        config.assign(header, header + sizeof(header));
+      } else {
+        const uint8_t header[AUDIO_HEADER_SIZE] = {0xaf, 0};
+        config.assign(header, header + sizeof(header));
+      }
+      config.insert(config.end(), frame.data, frame.data + frame.length);
+    }
+  }
+
+  /// <summary>
+  /// Closes the current segment and waits for all the segments to be
+  /// closed. A later tag opens a new segment.
+  /// </summary>
+  /// <exception>Rethrows the first error of the closing thread, if
+  /// any.</exception>
+  void close() {
+    retire();
+    {
+      std::unique_lock<std::mutex> lock(lock_);
+      idle_.wait(lock, [this]() { return queue_.empty() && !busy_; });
+    }
+    std::exception_ptr error;
+    {
+      std::lock_guard<std::mutex> lock(lock_);
+      std::swap(error, error_);
+    }
+    if (error) {
+      std::rethrow_exception(error);
+    }
+  }
+
+  /// <summary>
+  /// Gets the count of segments opened.
+  /// </summary>
+  /// <returns>The count of segments opened.</returns>
+  uint32_t opened() const { return opened_; }
+
+  /// <summary>
+  /// Gets the count of segments finalized, synced and closed.
+  /// </summary>
+  /// <returns>The count of segments closed.</returns>
+  uint64_t closed() const { return closed_.load(std::memory_order_relaxed); }
+
+private:
+  DISALLOW_COPY_AND_ASSIGN(flv_segment_writer);
+
+  /// <summary>
+  /// Represents a segment.
+  /// </summary>
+  struct segment_t {
+    /// <summary>
+    /// The file descriptor.
+    /// </summary>
+    int fd;
+
+    /// <summary>
+    /// The sink of the file.
+    /// </summary>
+    std::unique_ptr<fd_sink> sink;
+
+    /// <summary>
+    /// The builder of the segment.
+    /// </summary>
+    std::unique_ptr<flv_stream_builder> builder;
+  };
+
+  /// <summary>
+  /// Opens the first segment, or starts a new one at a sync point once the
+  /// current one is long or large enough.
+  /// </summary>
+  /// <param name="timestamp">The timestamp of the tag.</param>
+  /// <param name="sync">Whether a segment can start with the tag.</param>
+  /// <param name="length">The length of the tag body.</param>
+  void prepare(uint32_t timestamp, bool sync, uint32_t length) {
+    if (segment_ && sync &&
+        ((max_duration_ && timestamp >= start_timestamp_ &&
+          timestamp - start_timestamp_ >= max_duration_) ||
+         (max_bytes_ && bytes_ >= max_bytes_))) {
+      retire();
+    }
+    if (!segment_) {
+      open(timestamp);
+    }
+    bytes_ += FLV_TAG_HEADER_SIZE + length + 4;
+  }
+
+  /// <summary>
+  /// Opens a segment and writes its header, meta and sequence headers.
+  /// </summary>
+  /// <param name="timestamp">The timestamp of the first tag.</param>
+  /// <exception cref="std::system_error">If the file cannot be
+  /// opened.</exception>
+  void open(uint32_t timestamp) {
+    int fd = open_segment_(opened_);
+    if (fd < 0) {
+      throw std::system_error(errno, std::generic_category(), "open segment");
+    }
+    std::unique_ptr<segment_t> segment(new segment_t);
+    segment->fd = fd;
+    segment->sink.reset(new fd_sink(fd));
+    segment->builder.reset(new flv_stream_builder(*segment->sink));
+    opened_++;
+    start_timestamp_ = timestamp;
+    base_timestamp_ = rebase_ ? timestamp : 0;
+    bytes_ = 0;
+    segment_ = std::move(segment);
+    builder_ = segment_->builder.get();
+
+    if (keyframe_capacity_) {
+      builder_->enable_keyframe_index(keyframe_capacity_);
+    }
+    builder_->set_start_timestamp(rebased(timestamp));
+    builder_->init_stream_header(has_audio_, has_video_);
+    if (meta_) {
+      builder_->append_meta_tag(meta_);
+    }
+    if (!video_config_.empty()) {
+      builder_->append_video_tag(rebased(timestamp), video_config_.data(),
+                                 static_cast<uint32_t>(video_config_.size()));
+    }
+    if (!audio_config_.empty()) {
+      builder_->append_audio_tag(rebased(timestamp), audio_config_.data(),
+                                 static_cast<uint32_t>(audio_config_.size()));
+    }
+  }
+
+  /// <summary>
+  /// Hands the current segment over to the closing thread.
+  /// </summary>
+  void retire() {
+    if (!segment_) {
+      return;
+    }
+    builder_ = nullptr;
+    {
+      std::lock_guard<std::mutex> lock(lock_);
+      queue_.push_back(std::move(segment_));
+    }
+    wake_.notify_one();
+  }
+
+  /// <summary>
+  /// Rebases a timestamp on the start of the segment. Tags older than the
+  /// first tag of the segment (audio behind the keyframe) get 0.
+  /// </summary>
+  /// <param name="timestamp">The timestamp.</param>
+  /// <returns>The timestamp in the segment.</returns>
+  uint32_t rebased(uint32_t timestamp) const {
+    return timestamp >= base_timestamp_ ? timestamp - base_timestamp_ : 0;
+  }
+
+  /// <summary>
+  /// The closing thread procedure.
+  /// </summary>
+  void run() {
+    std::unique_lock<std::mutex> lock(lock_);
+    while (true) {
+      wake_.wait(lock, [this]() { return stopping_ || !queue_.empty(); });
+      if (queue_.empty()) {
+        return;
+      }
+      std::unique_ptr<segment_t> segment = std::move(queue_.front());
+      queue_.pop_front();
+      busy_ = true;
+      lock.unlock();
+
+      std::exception_ptr error;
+      try {
+        finish(*segment);
+      } catch (...) {
+        error = std::current_exception();
+      }
+      closed_.fetch_add(1, std::memory_order_relaxed);
+
+      lock.lock();
+      busy_ = false;
+      if (error && !error_) {
+        error_ = error;
+      }
+      idle_.notify_all();
+    }
+  }
+
+  /// <summary>
+  /// Finalizes, syncs and closes a segment.
+  /// </summary>
+  /// <param name="segment">The segment.</param>
+  /// <exception cref="std::system_error">If the file cannot be
+  /// synced.</exception>
+  static void finish(segment_t &segment) {
+    segment.builder->finalize();
+    segment.builder.reset();
+    segment.sink.reset();
+#if defined(_WIN32)
+    int r = ::_commit(segment.fd);
+#else
+    int r = ::fsync(segment.fd);
+#endif
+    int error = errno;
+#if defined(_WIN32)
+    ::_close(segment.fd);
+#else
+    ::close(segment.fd);
+#endif
+    if (r) {
+      throw std::system_error(error, std::generic_category(), "fsync");
+    }
+  }
+
+  /// <summary>
+  /// Opens the file of a segment.
+  /// </summary>
+  open_segment_t open_segment_;
+
+  /// <summary>
+  /// The duration in milliseconds after which a segment ends, 0 for none.
+  /// </summary>
+  uint32_t max_duration_;
+
+  /// <summary>
+  /// The size in bytes after which a segment ends, 0 for none.
+  /// </summary>
+  uint64_t max_bytes_;
+
+  /// <summary>
+  /// Indicates whether each segment starts at timestamp 0.
+  /// </summary>
+  bool rebase_;
+
+  /// <summary>
+  /// Indicates whether there is audio data.
+  /// </summary>
+  bool has_audio_;
+
+  /// <summary>
+  /// Indicates whether there is video data.
+  /// </summary>
+  bool has_video_;
+
+  /// <summary>
+  /// The meta of the segments, if any.
+  /// </summary>
+  amf::amf_value_ref meta_;
+
+  /// <summary>
+  /// The keyframe index capacity of the segments, 0 if the index is off.
+  /// </summary>
+  uint32_t keyframe_capacity_;
+
+  /// <summary>
+  /// The last AVC sequence header tag body.
+  /// </summary>
+  std::vector<uint8_t> video_config_;
+
+  /// <summary>
+  /// The last AAC sequence header tag body.
+  /// </summary>
+  std::vector<uint8_t> audio_config_;
+
+  /// <summary>
+  /// The current segment, null if none is open.
+  /// </summary>
+  std::unique_ptr<segment_t> segment_;
+
+  /// <summary>
+  /// The builder of the current segment.
+  /// </summary>
+  flv_stream_builder *builder_;
+
+  /// <summary>
+  /// The count of segments opened.
+  /// </summary>
+  uint32_t opened_;
+
+  /// <summary>
+  /// The timestamp of the first tag of the current segment.
+  /// </summary>
+  uint32_t start_timestamp_;
+
+  /// <summary>
+  /// The timestamp subtracted from the tags of the current segment.
+  /// </summary>
+  uint32_t base_timestamp_;
+
+  /// <summary>
+  /// The count of bytes in the current segment.
+  /// </summary>
+  uint64_t bytes_;
+
+  /// <summary>
+  /// The segments waiting to be closed.
+  /// </summary>
+  std::deque<std::unique_ptr<segment_t>> queue_;
+
+  /// <summary>
+  /// Indicates whether the closing thread is closing a segment.
+  /// </summary>
+  bool busy_;
+
+  /// <summary>
+  /// Indicates whether the closing thread has to exit.
+  /// </summary>
+  bool stopping_;
+
+  /// <summary>
+  /// The first error of the closing thread.
+  /// </summary>
+  std::exception_ptr error_;
+
+  /// <summary>
+  /// The count of segments closed.
+  /// </summary>
+  std::atomic<uint64_t> closed_;
+
+  /// <summary>
+  /// The mutex of the queue.
+  /// </summary>
+  std::mutex lock_;
+
+  /// <summary>
+  /// Signaled when a segment is queued or the thread has to exit.
+  /// </summary>
+  std::condition_variable wake_;
+
+  /// <summary>
+  /// Signaled when the closing thread is done with a segment.
+  /// </summary>
+  std::condition_variable idle_;
+
+  /// <summary>
+  /// The closing thread.
+  /// </summary>
+  std::thread thread_;
 };
 } // namespace flv
@@ -0,0 +1,1063 @@
+/*
+ * This CPP header-only file implements a Linux io_uring file sink for the FLV
+ * stream builder. Tags are copied into fixed buffers registered with the
+ * kernel, and whole buffers are submitted as asynchronous writes. Many sinks
+ * (one per recorded stream) share one ring and one buffer pool. When io_uring
+ * is not available the same sink writes the buffers with pwrite.
+ *
+ * https://github.com/tishion
+ *
+ */
+
+#pragma once
+#include <linux/io_uring.h>
+#include <stdlib.h>
+#include <sys/syscall.h>
+
+#include "flv_stream_builder.hpp"
+
+namespace flv {
+class uring_sink;
+
+/// <summary>
+/// Represents an io_uring instance and the pool of fixed buffers shared by
+/// uring_sink instances. Every attached sink holds at most one buffer being
+/// filled, two while an O_DIRECT sink moves its partial last block to a new
+/// buffer; the others are free or have a write in flight. The ring is thread
+/// safe, each of its sinks may be used by a different thread.
+/// </summary>
+class uring_ring {
+public:
+  /// <summary>
+  /// The alignment of the buffers, and of the offsets and lengths of the
+  /// writes of sinks using O_DIRECT.
+  /// </summary>
+  static const size_t DIRECT_ALIGNMENT = 4096;
+
+  /// <summary>
+  /// Constructs an instance of the ring. Falls back to pwrite when the
+  /// kernel refuses io_uring (old kernel, seccomp, ...).
+  /// </summary>
+  /// <param name="buffer_count">
+  /// The count of buffers, must exceed the count of buffers the attached
+  /// sinks may hold: one per sink, two per O_DIRECT sink.
+  /// </param>
+  /// <param name="buffer_size">
+  /// The size of a buffer, rounded up to DIRECT_ALIGNMENT.
+  /// </param>
+  /// <param name="use_uring">False to always use the pwrite fallback.</param>
+  /// <exception cref="std::bad_alloc">If the buffers cannot be
+  /// allocated.</exception>
+  uring_ring(unsigned buffer_count = 16, size_t buffer_size = 256 * 1024,
+             bool use_uring = true)
+      : ring_fd_(-1), sq_ring_(nullptr), sq_ring_size_(0), cq_ring_(nullptr),
+        cq_ring_size_(0), sqes_(nullptr), sqes_size_(0), sq_tail_(nullptr),
+        sq_mask_(0), sq_array_(nullptr), cq_head_(nullptr), cq_tail_(nullptr),
+        cq_mask_(0), cqes_(nullptr), registered_(false), memory_(nullptr),
+        buffer_count_(std::max(buffer_count, 2u)),
+        buffer_size_((std::max<size_t>(buffer_size, 1) + DIRECT_ALIGNMENT - 1) /
+                     DIRECT_ALIGNMENT * DIRECT_ALIGNMENT),
+        pending_(buffer_count_), inflight_(0), reaping_(false), reserved_(0),
+        syscalls_(0) {
+    void *memory = nullptr;
+    if (::posix_memalign(&memory, DIRECT_ALIGNMENT,
+                         buffer_count_ * buffer_size_)) {
+      throw std::bad_alloc();
+    }
+    memory_ = static_cast<uint8_t *>(memory);
+    free_.reserve(buffer_count_);
+    for (unsigned i = buffer_count_; i > 0; i--) {
+      free_.push_back(i - 1);
+    }
+    if (use_uring && !setup()) {
+      teardown();
+    }
+  }
+
+  /// <summary>
+  /// Destructs the instance. All the sinks must be destroyed first.
+  /// </summary>
+  ~uring_ring() {
+    {
+      std::unique_lock<std::mutex> lock(mutex_);
+      while (inflight_) {
+        wait_locked(lock);
+      }
+    }
+    teardown();
+    ::free(memory_);
+  }
+
+  /// <summary>
+  /// Checks whether the writes go through io_uring.
+  /// </summary>
+  /// <returns>True for io_uring; false for the pwrite fallback.</returns>
+  bool available() const { return ring_fd_ >= 0; }
+
+  /// <summary>
+  /// Checks whether the buffers are registered with the kernel.
+  /// </summary>
+  /// <returns>True if the writes use fixed buffers; otherwise false.</returns>
+  bool registered() const { return registered_; }
+
+  /// <summary>
+  /// Gets the size of a buffer.
+  /// </summary>
+  /// <returns>The size in bytes.</returns>
+  size_t buffer_size() const { return buffer_size_; }
+
+  /// <summary>
+  /// Gets the count of system calls made for writes (io_uring_enter or
+  /// pwrite).
+  /// </summary>
+  /// <returns>The count.</returns>
+  uint64_t syscalls() const { return syscalls_; }
+
+  /// <summary>
+  /// Submits the partially filled buffers of the attached sinks whose
+  /// deadline expired, and reaps the completed writes. Call it periodically
+  /// (from a timer, for example) so that idle streams reach the file too.
+  /// </summary>
+  void poll();
+
+private:
+  DISALLOW_COPY_AND_ASSIGN(uring_ring);
+
+  friend class uring_sink;
+
+  /// <summary>
+  /// Represents the write of a buffer.
+  /// </summary>
+  struct pending_t {
+    /// <summary>
+    /// The sink which submitted the write.
+    /// </summary>
+    uring_sink *sink;
+
+    /// <summary>
+    /// The file descriptor.
+    /// </summary>
+    int fd;
+
+    /// <summary>
+    /// The file offset of the buffer.
+    /// </summary>
+    uint64_t offset;
+
+    /// <summary>
+    /// The length of the write.
+    /// </summary>
+    uint32_t length;
+
+    /// <summary>
+    /// The count of bytes already written.
+    /// </summary>
+    uint32_t done;
+  };
+
+  /// <summary>
+  /// Sets up the ring and registers the buffers.
+  /// </summary>
+  /// <returns>True if successful; otherwise false.</returns>
+  bool setup() {
+    unsigned entries = 1;
+    while (entries < buffer_count_) {
+      entries <<= 1;
+    }
+    io_uring_params params;
+    memset(&params, 0, sizeof(params));
+    ring_fd_ =
+        static_cast<int>(::syscall(__NR_io_uring_setup, entries, &params));
+    if (ring_fd_ < 0) {
+      return false;
+    }
+
+    // Map the submission ring, the completion ring and the entries
+    sq_ring_size_ = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+    cq_ring_size_ =
+        params.cq_off.cqes + params.cq_entries * sizeof(io_uring_cqe);
+    bool single = (params.features & IORING_FEAT_SINGLE_MMAP) != 0;
+    if (single) {
+      sq_ring_size_ = cq_ring_size_ = std::max(sq_ring_size_, cq_ring_size_);
+    }
+    sq_ring_ = map(sq_ring_size_, IORING_OFF_SQ_RING);
+    if (!sq_ring_) {
+      return false;
+    }
+    if (single) {
+      cq_ring_ = sq_ring_;
+    } else if (!(cq_ring_ = map(cq_ring_size_, IORING_OFF_CQ_RING))) {
+      return false;
+    }
+    sqes_size_ = params.sq_entries * sizeof(io_uring_sqe);
+    sqes_ = static_cast<io_uring_sqe *>(map(sqes_size_, IORING_OFF_SQES));
+    if (!sqes_) {
+      return false;
+    }
+    uint8_t *sq = static_cast<uint8_t *>(sq_ring_);
+    uint8_t *cq = static_cast<uint8_t *>(cq_ring_);
+    sq_tail_ = reinterpret_cast<unsigned *>(sq + params.sq_off.tail);
+    sq_mask_ = *reinterpret_cast<unsigned *>(sq + params.sq_off.ring_mask);
+    sq_array_ = reinterpret_cast<unsigned *>(sq + params.sq_off.array);
+    cq_head_ = reinterpret_cast<unsigned *>(cq + params.cq_off.head);
+    cq_tail_ = reinterpret_cast<unsigned *>(cq + params.cq_off.tail);
+    cq_mask_ = *reinterpret_cast<unsigned *>(cq + params.cq_off.ring_mask);
+    cqes_ = reinterpret_cast<io_uring_cqe *>(cq + params.cq_off.cqes);
+
+    // Fixed buffers save the page pinning of every write; without them
+    // (RLIMIT_MEMLOCK too low) the ring still works with plain writes
+    std::vector<iovec> iovs(buffer_count_);
+    for (unsigned i = 0; i < buffer_count_; i++) {
+      iovs[i].iov_base = buffer(i);
+      iovs[i].iov_len = buffer_size_;
+    }
+    registered_ = ::syscall(__NR_io_uring_register, ring_fd_,
+                            IORING_REGISTER_BUFFERS, iovs.data(),
+                            buffer_count_) == 0;
+    return true;
+  }
+
+  /// <summary>
+  /// Maps a region of the ring.
+  /// </summary>
+  /// <param name="size">The size of the region.</param>
+  /// <param name="offset">The IORING_OFF_* offset of the region.</param>
+  /// <returns>The region, or null if failed.</returns>
+  void *map(size_t size, uint64_t offset) {
+    void *p = ::mmap(nullptr, size, PROT_READ | PROT_WRITE,
+                     MAP_SHARED | MAP_POPULATE, ring_fd_,
+                     static_cast<off_t>(offset));
+    return p == MAP_FAILED ? nullptr : p;
+  }
+
+  /// <summary>
+  /// Unmaps and closes the ring, leaving the pwrite fallback.
+  /// </summary>
+  void teardown() {
+    if (sqes_) {
+      ::munmap(sqes_, sqes_size_);
+    }
+    if (cq_ring_ && cq_ring_ != sq_ring_) {
+      ::munmap(cq_ring_, cq_ring_size_);
+    }
+    if (sq_ring_) {
+      ::munmap(sq_ring_, sq_ring_size_);
+    }
+    if (ring_fd_ >= 0) {
+      ::close(ring_fd_);
+    }
+    ring_fd_ = -1;
+    sq_ring_ = cq_ring_ = nullptr;
+    sqes_ = nullptr;
+    registered_ = false;
+  }
+
+  /// <summary>
+  /// Gets a buffer.
+  /// </summary>
+  /// <param name="index">The index of the buffer.</param>
+  /// <returns>The first byte of the buffer.</returns>
+  uint8_t *buffer(unsigned index) const {
+    return memory_ + static_cast<size_t>(index) * buffer_size_;
+  }
+
+  /// <summary>
+  /// Attaches a sink, so that poll() handles its deadline.
+  /// </summary>
+  /// <param name="sink">The sink.</param>
+  /// <exception cref="std::logic_error">If there are not enough
+  /// buffers.</exception>
+  void attach(uring_sink *sink);
+
+  /// <summary>
+  /// Detaches a sink.
+  /// </summary>
+  /// <param name="sink">The sink.</param>
+  void detach(uring_sink *sink);
+
+  /// <summary>
+  /// Takes a free buffer, waiting for a write to complete if there is none.
+  /// </summary>
+  /// <returns>The index of the buffer.</returns>
+  unsigned acquire() {
+    std::unique_lock<std::mutex> lock(mutex_);
+    while (free_.empty()) {
+      if (!inflight_) {
+        throw std::logic_error("uring_ring has no free buffer");
+      }
+      wait_locked(lock);
+    }
+    unsigned index = free_.back();
+    free_.pop_back();
+    return index;
+  }
+
+  /// <summary>
+  /// Gives back a buffer which was not submitted.
+  /// </summary>
+  /// <param name="index">The index of the buffer.</param>
+  void release(unsigned index) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    free_.push_back(index);
+  }
+
+  /// <summary>
+  /// Writes a buffer at a file offset. The buffer returns to the pool when
+  /// the write completes.
+  /// </summary>
+  /// <param name="sink">The sink owning the buffer.</param>
+  /// <param name="index">The index of the buffer.</param>
+  /// <param name="fd">The file descriptor.</param>
+  /// <param name="offset">The file offset.</param>
+  /// <param name="length">The length of the write.</param>
+  /// <exception cref="std::system_error">If the write fails to be
+  /// issued.</exception>
+  void submit(uring_sink *sink, unsigned index, int fd, uint64_t offset,
+              size_t length);
+
+  /// <summary>
+  /// Waits until all the writes of a sink completed.
+  /// </summary>
+  /// <param name="sink">The sink.</param>
+  void wait_idle(uring_sink *sink);
+
+  /// <summary>
+  /// Takes the error of the failed writes of a sink.
+  /// </summary>
+  /// <param name="sink">The sink.</param>
+  /// <returns>The errno value, 0 if no write failed.</returns>
+  int take_error(uring_sink *sink);
+
+  /// <summary>
+  /// Records a failed write of a sink.
+  /// </summary>
+  /// <param name="sink">The sink.</param>
+  /// <param name="error">The errno value.</param>
+  void set_error(uring_sink *sink, int error);
+
+  /// <summary>
+  /// Queues the (remaining part of the) write of a buffer. The mutex must be
+  /// held.
+  /// </summary>
+  /// <param name="index">The index of the buffer.</param>
+  void queue_locked(unsigned index) {
+    const pending_t &p = pending_[index];
+    unsigned tail = *sq_tail_;
+    unsigned slot = tail & sq_mask_;
+    io_uring_sqe *sqe = &sqes_[slot];
+    memset(sqe, 0, sizeof(*sqe));
+    sqe->opcode = registered_ ? IORING_OP_WRITE_FIXED : IORING_OP_WRITE;
+    sqe->fd = p.fd;
+    sqe->off = p.offset + p.done;
+    sqe->addr = reinterpret_cast<uint64_t>(buffer(index) + p.done);
+    sqe->len = p.length - p.done;
+    sqe->buf_index = static_cast<uint16_t>(registered_ ? index : 0);
+    sqe->user_data = index;
+    sq_array_[slot] = slot;
+    __atomic_store_n(sq_tail_, tail + 1, __ATOMIC_RELEASE);
+  }
+
+  /// <summary>
+  /// Calls io_uring_enter.
+  /// </summary>
+  /// <param name="to_submit">The count of queued entries.</param>
+  /// <param name="min_complete">The count of completions to wait for.</param>
+  /// <returns>The result of the call, -1 with errno set if failed.</returns>
+  int enter(unsigned to_submit, unsigned min_complete) {
+    unsigned flags = min_complete ? IORING_ENTER_GETEVENTS : 0;
+    int r = 0;
+    do {
+      syscalls_++;
+      r = static_cast<int>(::syscall(__NR_io_uring_enter, ring_fd_, to_submit,
+                                     min_complete, flags, nullptr, 0));
+    } while (r < 0 && errno == EINTR && to_submit);
+    return r;
+  }
+
+  /// <summary>
+  /// Processes the completed writes. The mutex must be held.
+  /// </summary>
+  /// <returns>The count of completions processed.</returns>
+  size_t reap_locked();
+
+  /// <summary>
+  /// Waits for at least one completion and processes it. Only one thread
+  /// blocks in the kernel, the others wait for it to finish. The mutex must
+  /// be held by the lock.
+  /// </summary>
+  /// <param name="lock">The lock of the mutex.</param>
+  void wait_locked(std::unique_lock<std::mutex> &lock) {
+    // Only the waiting thread reaps, or it could sleep on a completion
+    // another thread took
+    if (reaping_) {
+      cv_.wait(lock);
+      return;
+    }
+    if (reap_locked()) {
+      return;
+    }
+    reaping_ = true;
+    lock.unlock();
+    enter(0, 1);
+    lock.lock();
+    reaping_ = false;
+    reap_locked();
+    cv_.notify_all();
+  }
+
+  /// <summary>
+  /// The io_uring file descriptor, -1 for the pwrite fallback.
+  /// </summary>
+  int ring_fd_;
+
+  /// <summary>
+  /// The mapped submission ring.
+  /// </summary>
+  void *sq_ring_;
+
+  /// <summary>
+  /// The size of the mapped submission ring.
+  /// </summary>
+  size_t sq_ring_size_;
+
+  /// <summary>
+  /// The mapped completion ring (the submission ring if mapped once).
+  /// </summary>
+  void *cq_ring_;
+
+  /// <summary>
+  /// The size of the mapped completion ring.
+  /// </summary>
+  size_t cq_ring_size_;
+
+  /// <summary>
+  /// The mapped submission entries.
+  /// </summary>
+  io_uring_sqe *sqes_;
+
+  /// <summary>
+  /// The size of the mapped submission entries.
+  /// </summary>
+  size_t sqes_size_;
+
+  /// <summary>
+  /// The tail of the submission ring.
+  /// </summary>
+  unsigned *sq_tail_;
+
+  /// <summary>
+  /// The index mask of the submission ring.
+  /// </summary>
+  unsigned sq_mask_;
+
+  /// <summary>
+  /// The entry indices of the submission ring.
+  /// </summary>
+  unsigned *sq_array_;
+
+  /// <summary>
+  /// The head of the completion ring.
+  /// </summary>
+  unsigned *cq_head_;
+
+  /// <summary>
+  /// The tail of the completion ring.
+  /// </summary>
+  unsigned *cq_tail_;
+
+  /// <summary>
+  /// The index mask of the completion ring.
+  /// </summary>
+  unsigned cq_mask_;
+
+  /// <summary>
+  /// The completion entries.
+  /// </summary>
+  io_uring_cqe *cqes_;
+
+  /// <summary>
+  /// Indicates whether the buffers are registered with the kernel.
+  /// </summary>
+  bool registered_;
+
+  /// <summary>
+  /// The memory of all the buffers.
+  /// </summary>
+  uint8_t *memory_;
+
+  /// <summary>
+  /// The count of buffers.
+  /// </summary>
+  unsigned buffer_count_;
+
+  /// <summary>
+  /// The size of a buffer.
+  /// </summary>
+  size_t buffer_size_;
+
+  /// <summary>
+  /// The free buffers.
+  /// </summary>
+  std::vector<unsigned> free_;
+
+  /// <summary>
+  /// The writes, by buffer index.
+  /// </summary>
+  std::vector<pending_t> pending_;
+
+  /// <summary>
+  /// The count of writes in flight.
+  /// </summary>
+  unsigned inflight_;
+
+  /// <summary>
+  /// Indicates whether a thread is waiting in the kernel for completions.
+  /// </summary>
+  bool reaping_;
+
+  /// <summary>
+  /// The mutex of the ring and the buffer pool.
+  /// </summary>
+  std::mutex mutex_;
+
+  /// <summary>
+  /// Signaled when a thread is done waiting for completions.
+  /// </summary>
+  std::condition_variable cv_;
+
+  /// <summary>
+  /// The attached sinks.
+  /// </summary>
+  std::vector<uring_sink *> sinks_;
+
+  /// <summary>
+  /// The count of buffers the attached sinks may hold at once.
+  /// </summary>
+  unsigned reserved_;
+
+  /// <summary>
+  /// The mutex of the attached sinks, taken before the one of a sink.
+  /// </summary>
+  std::mutex sinks_mutex_;
+
+  /// <summary>
+  /// The count of system calls made for writes.
+  /// </summary>
+  std::atomic<uint64_t> syscalls_;
+};
+
+/// <summary>
+/// Represents the sink writing to a regular file through a uring_ring. The
+/// data is copied into a buffer of the ring, which is submitted when it is
+/// full, when its oldest byte is older than the deadline, or on flush. Call
+/// flush() (finalize() does) to wait for the data to reach the file. Errors
+/// of the asynchronous writes surface from the next write() or flush(). The
+/// file descriptor is not owned by the sink.
+/// </summary>
+class uring_sink : public flv_sink {
+public:
+  /// <summary>
+  /// Constructs an instance of the sink.
+  /// </summary>
+  /// <param name="ring">The ring, must outlive the sink.</param>
+  /// <param name="fd">The file descriptor of a regular file, the data is
+  /// written from its current offset.</param>
+  /// <param name="deadline_ms">The longest time a byte waits in a buffer
+  /// before being submitted, 0 to wait for the buffer to be full.</param>
+  /// <param name="direct">True if the file was opened with O_DIRECT. The
+  /// writes are then padded to DIRECT_ALIGNMENT and the padding is cut by
+  /// finish().</param>
+  /// <exception cref="std::system_error">If the file is not
+  /// seekable.</exception>
+  /// <exception cref="std::logic_error">If the file offset is not aligned
+  /// for O_DIRECT, or the ring has too few buffers.</exception>
+  uring_sink(uring_ring &ring, int fd, uint32_t deadline_ms = 50,
+             bool direct = false)
+      : ring_(ring), fd_(fd), deadline_(std::chrono::milliseconds(deadline_ms)),
+        direct_(direct), current_(-1), fill_(0), offset_(0), size_(0),
+        dirty_(false), tail_inflight_(false), inflight_(0), error_(0) {
+    off_t base = ::lseek(fd_, 0, SEEK_CUR);
+    if (base < 0) {
+      throw std::system_error(errno, std::generic_category(), "lseek");
+    }
+    if (direct_ && base % uring_ring::DIRECT_ALIGNMENT) {
+      throw std::logic_error("uring_sink O_DIRECT offset is not aligned");
+    }
+    base_ = static_cast<uint64_t>(base);
+    ring_.attach(this);
+  }
+
+  /// <summary>
+  /// Destructs the instance, finishing the file. Errors are ignored, call
+  /// finish() first to get them.
+  /// </summary>
+  ~uring_sink() {
+    ring_.detach(this);
+    try {
+      finish();
+    } catch (...) {
+    }
+    ring_.wait_idle(this);
+    if (current_ >= 0) {
+      ring_.release(static_cast<unsigned>(current_));
+    }
+  }
+
+  /// <summary>
+  /// Copies all the slices into the buffers.
+  /// </summary>
+  /// <param name="slices">The slices to be written.</param>
+  /// <param name="count">The count of the slices.</param>
+  /// <exception cref="std::system_error">If a previous write
+  /// failed.</exception>
+  virtual void write(const io_slice *slices, size_t count) override {
+    std::lock_guard<std::mutex> lock(mutex_);
+    throw_error();
+    const size_t capacity = ring_.buffer_size();
+    for (size_t i = 0; i < count; i++) {
+      const uint8_t *p = slices[i].data;
+      size_t left = slices[i].length;
+      while (left) {
+        if (current_ < 0) {
+          current_ = static_cast<int>(ring_.acquire());
+        }
+        if (!dirty_) {
+          started_ = std::chrono::steady_clock::now();
+          dirty_ = true;
+        }
+        size_t n = std::min(left, capacity - fill_);
+        memcpy(ring_.buffer(static_cast<unsigned>(current_)) + fill_, p, n);
+        fill_ += n;
+        size_ += n;
+        p += n;
+        left -= n;
+        if (fill_ == capacity) {
+          submit_locked();
+        }
+      }
+    }
+    if (dirty_ && expired(std::chrono::steady_clock::now())) {
+      submit_locked();
+    }
+  }
+
+  /// <summary>
+  /// Submits the buffered data and waits for all the writes to complete.
+  /// </summary>
+  /// <exception cref="std::system_error">If a write failed.</exception>
+  virtual void flush() override {
+    std::lock_guard<std::mutex> lock(mutex_);
+    flush_locked();
+  }
+
+  /// <summary>
+  /// Overwrites bytes already written, after flushing the buffered data.
+  /// </summary>
+  /// <param name="offset">
+  /// The offset of the bytes, relative to the first byte written to the sink.
+  /// </param>
+  /// <param name="data">The new bytes.</param>
+  /// <param name="length">The length of the bytes.</param>
+  /// <returns>True if successful; otherwise false.</returns>
+  virtual bool write_at(uint64_t offset, const uint8_t *data,
+                        size_t length) override {
+    std::lock_guard<std::mutex> lock(mutex_);
+    try {
+      flush_locked();
+    } catch (const std::system_error &) {
+      return false;
+    }
+    if (offset + length > size_) {
+      return false;
+    }
+    if (!direct_) {
+      return pwrite_all(data, length, base_ + offset);
+    }
+
+    // O_DIRECT: read, patch and write back the aligned blocks
+    const uint64_t alignment = uring_ring::DIRECT_ALIGNMENT;
+    uint64_t start = (base_ + offset) / alignment * alignment;
+    uint64_t end =
+        (base_ + offset + length + alignment - 1) / alignment * alignment;
+    size_t span = static_cast<size_t>(end - start);
+    void *block = nullptr;
+    if (::posix_memalign(&block, alignment, span)) {
+      return false;
+    }
+    std::unique_ptr<void, void (*)(void *)> guard(block, ::free);
+    uint8_t *bytes = static_cast<uint8_t *>(block);
+    memset(bytes, 0, span);
+    if (::pread(fd_, bytes, span, static_cast<off_t>(start)) < 0) {
+      return false;
+    }
+    memcpy(bytes + (base_ + offset - start), data, length);
+    if (!pwrite_all(bytes, span, start)) {
+      return false;
+    }
+
+    // The kept tail block is written again later, patch it too
+    if (current_ >= 0 && offset + length > offset_ &&
+        offset < offset_ + fill_) {
+      uint64_t from = std::max(offset, offset_);
+      uint64_t to = std::min(offset + length, offset_ + fill_);
+      memcpy(ring_.buffer(static_cast<unsigned>(current_)) + (from - offset_),
+             data + (from - offset), static_cast<size_t>(to - from));
+    }
+    return true;
+  }
+
+  /// <summary>
+  /// Flushes the data and, with O_DIRECT, cuts the padding of the last
+  /// block off the file.
+  /// </summary>
+  /// <exception cref="std::system_error">If a write failed.</exception>
+  void finish() {
+    std::lock_guard<std::mutex> lock(mutex_);
+    flush_locked();
+    if (direct_ && ::ftruncate(fd_, static_cast<off_t>(base_ + size_))) {
+      throw std::system_error(errno, std::generic_category(), "ftruncate");
+    }
+  }
+
+private:
+  DISALLOW_COPY_AND_ASSIGN(uring_sink);
+
+  friend class uring_ring;
+
+  /// <summary>
+  /// Checks whether the oldest buffered byte waited longer than the
+  /// deadline.
+  /// </summary>
+  /// <param name="now">The current time.</param>
+  /// <returns>True if the buffer is due; otherwise false.</returns>
+  bool expired(std::chrono::steady_clock::time_point now) const {
+    return deadline_.count() > 0 && now - started_ >= deadline_;
+  }
+
+  /// <summary>
+  /// Submits the current buffer if its deadline expired. Called by
+  /// uring_ring::poll(), skipped if the sink is busy.
+  /// </summary>
+  /// <param name="now">The current time.</param>
+  void submit_expired(std::chrono::steady_clock::time_point now) {
+    std::unique_lock<std::mutex> lock(mutex_, std::try_to_lock);
+    if (!lock.owns_lock() || !dirty_ || !expired(now)) {
+      return;
+    }
+    try {
+      submit_locked();
+    } catch (const std::system_error &e) {
+      ring_.set_error(this, e.code().value());
+    }
+  }
+
+  /// <summary>
+  /// Submits the current buffer. With O_DIRECT, a partial last block is
+  /// padded and also kept in a new buffer, to be written again once more
+  /// data arrives. Nothing is submitted without new data, so the kept block
+  /// is not written again while the stream is idle. The mutex must be held.
+  /// </summary>
+  void submit_locked() {
+    if (!dirty_) {
+      return;
+    }
+    if (tail_inflight_) {
+      // The kept block overlaps the previous write, which has to land first
+      ring_.wait_idle(this);
+      tail_inflight_ = false;
+    }
+
+    unsigned index = static_cast<unsigned>(current_);
+    uint8_t *data = ring_.buffer(index);
+    uint64_t offset = offset_;
+    size_t length = fill_;
+    size_t keep = 0;
+    if (direct_) {
+      const size_t alignment = uring_ring::DIRECT_ALIGNMENT;
+      size_t padded = (fill_ + alignment - 1) / alignment * alignment;
+      memset(data + fill_, 0, padded - fill_);
+      length = padded;
+      keep = fill_ % alignment;
+    }
+
+    if (keep) {
+      unsigned next = ring_.acquire();
+      memcpy(ring_.buffer(next), data + fill_ - keep, keep);
+      current_ = static_cast<int>(next);
+      offset_ += fill_ - keep;
+      fill_ = keep;
+      tail_inflight_ = true;
+    } else {
+      current_ = -1;
+      offset_ += fill_;
+      fill_ = 0;
+    }
+    dirty_ = false;
+    ring_.submit(this, index, fd_, base_ + offset, length);
+  }
+
+  /// <summary>
+  /// Submits the buffered data and waits for the writes. The mutex must be
+  /// held.
+  /// </summary>
+  void flush_locked() {
+    throw_error();
+    submit_locked();
+    ring_.wait_idle(this);
+    tail_inflight_ = false;
+    throw_error();
+  }
+
+  /// <summary>
+  /// Throws the error of a failed write, if any.
+  /// </summary>
+  /// <exception cref="std::system_error">If a write failed.</exception>
+  void throw_error() {
+    int error = ring_.take_error(this);
+    if (error) {
+      throw std::system_error(error, std::generic_category(), "io_uring write");
+    }
+  }
+
+  /// <summary>
+  /// Writes all the bytes at a file offset.
+  /// </summary>
+  /// <param name="data">The bytes.</param>
+  /// <param name="length">The length of the bytes.</param>
+  /// <param name="offset">The file offset.</param>
+  /// <returns>True if successful; otherwise false.</returns>
+  bool pwrite_all(const uint8_t *data, size_t length, uint64_t offset) {
+    while (length) {
+      ssize_t r = ::pwrite(fd_, data, length, static_cast<off_t>(offset));
+      if (r < 0) {
+        if (errno == EINTR) {
+          continue;
+        }
+        return false;
+      }
+      data += r;
+      length -= static_cast<size_t>(r);
+      offset += static_cast<uint64_t>(r);
+    }
+    return true;
+  }
+
+  /// <summary>
+  /// The ring.
+  /// </summary>
+  uring_ring &ring_;
+
+  /// <summary>
+  /// The file descriptor.
+  /// </summary>
+  int fd_;
+
+  /// <summary>
+  /// The longest time a byte waits in a buffer.
+  /// </summary>
+  std::chrono::steady_clock::duration deadline_;
+
+  /// <summary>
+  /// Indicates whether the file was opened with O_DIRECT.
+  /// </summary>
+  bool direct_;
+
+  /// <summary>
+  /// The file offset of the first byte written to the sink.
+  /// </summary>
+  uint64_t base_;
+
+  /// <summary>
+  /// The mutex of the buffer state, taken before the one of the ring.
+  /// </summary>
+  std::mutex mutex_;
+
+  /// <summary>
+  /// The index of the buffer being filled, -1 if none.
+  /// </summary>
+  int current_;
+
+  /// <summary>
+  /// The count of bytes in the buffer being filled.
+  /// </summary>
+  size_t fill_;
+
+  /// <summary>
+  /// The sink offset of the first byte of the buffer being filled.
+  /// </summary>
+  uint64_t offset_;
+
+  /// <summary>
+  /// The count of bytes written to the sink.
+  /// </summary>
+  uint64_t size_;
+
+  /// <summary>
+  /// Indicates whether bytes were added since the last submission.
+  /// </summary>
+  bool dirty_;
+
+  /// <summary>
+  /// The time the first byte added since the last submission entered the
+  /// buffer.
+  /// </summary>
+  std::chrono::steady_clock::time_point started_;
+
+  /// <summary>
+  /// Indicates whether a padded partial block is being written (O_DIRECT).
+  /// </summary>
+  bool tail_inflight_;
+
+  /// <summary>
+  /// The count of writes in flight, guarded by the mutex of the ring.
+  /// </summary>
+  unsigned inflight_;
+
+  /// <summary>
+  /// The errno value of the first failed write, guarded by the mutex of the
+  /// ring.
+  /// </summary>
+  int error_;
+};
+
+inline void uring_ring::poll() {
+  {
+    std::lock_guard<std::mutex> lock(sinks_mutex_);
+    auto now = std::chrono::steady_clock::now();
+    for (uring_sink *sink : sinks_) {
+      sink->submit_expired(now);
+    }
+  }
+  std::lock_guard<std::mutex> lock(mutex_);
+  if (!reaping_) {
+    reap_locked();
+  }
+}
+
+inline void uring_ring::attach(uring_sink *sink) {
+  std::lock_guard<std::mutex> lock(sinks_mutex_);
+  unsigned held = sink->direct_ ? 2 : 1;
+  if (reserved_ + held >= buffer_count_) {
+    throw std::logic_error("uring_ring has too few buffers for the sinks");
+  }
+  reserved_ += held;
+  sinks_.push_back(sink);
+}
+
+inline void uring_ring::detach(uring_sink *sink) {
+  std::lock_guard<std::mutex> lock(sinks_mutex_);
+  auto it = std::remove(sinks_.begin(), sinks_.end(), sink);
+  if (it != sinks_.end()) {
+    reserved_ -= sink->direct_ ? 2 : 1;
+  }
+  sinks_.erase(it, sinks_.end());
+}
+
+inline void uring_ring::submit(uring_sink *sink, unsigned index, int fd,
+                               uint64_t offset, size_t length) {
+  if (!available()) {
+    // The fallback writes synchronously, the buffer is free right after
+    const uint8_t *data = buffer(index);
+    int error = 0;
+    while (length) {
+      syscalls_++;
+      ssize_t r = ::pwrite(fd, data, length, static_cast<off_t>(offset));
+      if (r <= 0) {
+        if (r < 0 && errno == EINTR) {
+          continue;
+        }
+        error = r < 0 ? errno : EIO;
+        break;
+      }
+      data += r;
+      length -= static_cast<size_t>(r);
+      offset += static_cast<uint64_t>(r);
+    }
+    release(index);
+    if (error) {
+      throw std::system_error(error, std::generic_category(), "pwrite");
+    }
+    return;
+  }
+
+  std::lock_guard<std::mutex> lock(mutex_);
+  pending_t &p = pending_[index];
+  p.sink = sink;
+  p.fd = fd;
+  p.offset = offset;
+  p.length = static_cast<uint32_t>(length);
+  p.done = 0;
+  queue_locked(index);
+  inflight_++;
+  sink->inflight_++;
+  if (enter(1, 0) < 0) {
+    // Not queued by the kernel either, take the entry back
+    int error = errno;
+    __atomic_store_n(sq_tail_, *sq_tail_ - 1, __ATOMIC_RELEASE);
+    inflight_--;
+    sink->inflight_--;
+    free_.push_back(index);
+    throw std::system_error(error, std::generic_category(), "io_uring_enter");
+  }
+}
+
+inline void uring_ring::wait_idle(uring_sink *sink) {
+  std::unique_lock<std::mutex> lock(mutex_);
+  while (sink->inflight_) {
+    wait_locked(lock);
+  }
+}
+
+inline int uring_ring::take_error(uring_sink *sink) {
+  std::lock_guard<std::mutex> lock(mutex_);
+  int error = sink->error_;
+  sink->error_ = 0;
+  return error;
+}
+
+inline void uring_ring::set_error(uring_sink *sink, int error) {
+  std::lock_guard<std::mutex> lock(mutex_);
+  if (!sink->error_) {
+    sink->error_ = error;
+  }
+}
+
+inline size_t uring_ring::reap_locked() {
+  if (!available()) {
+    return 0;
+  }
+  unsigned head = *cq_head_;
+  unsigned tail = __atomic_load_n(cq_tail_, __ATOMIC_ACQUIRE);
+  size_t count = 0;
+  unsigned requeued = 0;
+  for (; head != tail; head++, count++) {
+    const io_uring_cqe &cqe = cqes_[head & cq_mask_];
+    unsigned index = static_cast<unsigned>(cqe.user_data);
+    pending_t &p = pending_[index];
+    if (cqe.res == -EINTR || cqe.res == -EAGAIN) {
+      queue_locked(index);
+      requeued++;
+      continue;
+    }
+    if (cqe.res > 0) {
+      p.done += static_cast<uint32_t>(cqe.res);
+      if (p.done < p.length) {
+        // Short write, queue the rest
+        queue_locked(index);
+        requeued++;
+        continue;
+      }
+    } else if (!p.sink->error_) {
+      p.sink->error_ = cqe.res < 0 ? -cqe.res : EIO;
+    }
+    p.sink->inflight_--;
+    inflight_--;
+    free_.push_back(index);
+  }
+  __atomic_store_n(cq_head_, head, __ATOMIC_RELEASE);
+  if (requeued) {
+    enter(requeued, 0);
+  }
+  return count;
+}
+} // namespace flv
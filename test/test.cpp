@@ -1,68 +1,3014 @@
-#include <fstream>
-
-#include <flv_stream_builder.hpp>
-
-namespace test {
-class AVFrame {
-public:
-  bool isVideo() const { return true; }
-
-  bool isAudio() const { return true; }
-
-  uint32_t timestamp() const { return 0; }
-
-  const uint8_t *data() const { return nullptr; }
-
-  const uint32_t length() const { return 0; }
-};
-typedef std::vector<AVFrame> AVFrameSource;
-
-static void generate_flv_file(const AVFrameSource &source) {
-  // Create the file stream and write the FLV data to the file
-  std::ofstream ofs;
-  ofs.open("test_flv_data.flv",
-           std::ios_base::binary | std::ios_base::out | std::ios_base::trunc);
-
-  // The FLV builder
-  flv::flv_stream_builder builder(ofs);
-
-  // Create the meta data
-  auto meta = flv::amf::amf_array::create()
-                  ->with_item("duration", (double)0)
-                  ->with_item("width", (double)1920)
-                  ->with_item("height", (double)1080)
-                  ->with_item("videodatarate", (double)520)
-                  ->with_item("framerate", (double)25)
-                  ->with_item("videocodecid", (double)7)
-                  ->with_item("audiosamplerate", (double)44100)
-                  ->with_item("audiosamplesize", (double)16)
-                  ->with_item("stereo", true)
-                  ->with_item("audiocodecid", (double)10)
-                  ->with_item("filesize", (double)0);
-
-  builder
-      .init_stream_header(true, true) // Initialize the FLV stream header
-      .append_meta_tag(meta);         // Append the meta tag
-
-  for (auto &frame : source) {
-    if (frame.isVideo()) {
-      // Append a video tag
-      builder.append_video_tag(frame.timestamp(), frame.data(), frame.length());
-    } else if (frame.isAudio()) {
-      // Append a audio tag
-      builder.append_audio_tag(frame.timestamp(), frame.data(), frame.length());
-    } else {
-    }
-  }
-
-  ofs.close();
-}
-} // namespace test
-
-int main() {
-
-  test::AVFrameSource source;
-
-  // generate flv file stream
-  test::generate_flv_file(source);
-}
+#include <stdio.h>
+#include <stdlib.h>
+
+#include <fstream>
+#include <iostream>
+#include <map>
+#include <sstream>
+#include <thread>
+
+#include <flv_stream_builder.hpp>
+#if !defined(_WIN32)
+#include <flv_mux.hpp>
+#endif
+#if defined(__linux__)
+#include <flv_http_server.hpp>
+#include <flv_uring_sink.hpp>
+#endif
+
+namespace test {
+static std::atomic<uint64_t> allocations(0);
+} // namespace test
+
+// Counts every heap allocation made by the test program.
+void *operator new(size_t size) {
+  test::allocations++;
+  if (void *p = malloc(size ? size : 1)) {
+    return p;
+  }
+  throw std::bad_alloc();
+}
+
+void operator delete(void *p) noexcept { free(p); }
+
+// @cond PRIVATE_ENTITY
+/// <summary>
+/// Reports the failed check and counts it without aborting the run.
+/// </summary>
+// @endcond
+#define TEST_CHECK(cond)                                                       \
+  do {                                                                         \
+    if (!(cond)) {                                                             \
+      std::cerr << __FILE__ << ":" << __LINE__ << ": check failed: " #cond     \
+                << std::endl;                                                  \
+      test::failures++;                                                        \
+    }                                                                          \
+  } while (0)
+
+namespace test {
+static int failures = 0;
+
+class AVFrame {
+public:
+  bool isVideo() const { return true; }
+
+  bool isAudio() const { return true; }
+
+  uint32_t timestamp() const { return 0; }
+
+  const uint8_t *data() const { return nullptr; }
+
+  const uint32_t length() const { return 0; }
+};
+typedef std::vector<AVFrame> AVFrameSource;
+
+static void generate_flv_file(const AVFrameSource &source) {
+  // Create the file stream and write the FLV data to the file
+  std::ofstream ofs;
+  ofs.open("test_flv_data.flv",
+           std::ios_base::binary | std::ios_base::out | std::ios_base::trunc);
+
+  // The FLV builder
+  flv::flv_stream_builder builder(ofs);
+
+  // Create the meta data
+  auto meta = flv::amf::amf_array::create()
+                  ->with_item("duration", (double)0)
+                  ->with_item("width", (double)1920)
+                  ->with_item("height", (double)1080)
+                  ->with_item("videodatarate", (double)520)
+                  ->with_item("framerate", (double)25)
+                  ->with_item("videocodecid", (double)7)
+                  ->with_item("audiosamplerate", (double)44100)
+                  ->with_item("audiosamplesize", (double)16)
+                  ->with_item("stereo", true)
+                  ->with_item("audiocodecid", (double)10)
+                  ->with_item("filesize", (double)0);
+
+  builder
+      .init_stream_header(true, true) // Initialize the FLV stream header
+      .append_meta_tag(meta);         // Append the meta tag
+
+  for (auto &frame : source) {
+    if (frame.isVideo()) {
+      // Append a video tag
+      builder.append_video_tag(frame.timestamp(), frame.data(), frame.length());
+    } else if (frame.isAudio()) {
+      // Append a audio tag
+      builder.append_audio_tag(frame.timestamp(), frame.data(), frame.length());
+    } else {
+    }
+  }
+
+  // Patch the duration and filesize of the meta data in place
+  builder.finalize();
+
+  ofs.close();
+}
+
+static uint32_t read_be32(const uint8_t *p) {
+  return (uint32_t)p[0] << 24 | (uint32_t)p[1] << 16 | (uint32_t)p[2] << 8 |
+         (uint32_t)p[3];
+}
+
+static void build_sample_stream(flv::flv_stream_builder &builder) {
+  static const uint8_t payload[] = {0x17, 0x01, 0x00, 0x00, 0x00,
+                                    0x00, 0x00, 0x00, 0x01, 0x65};
+  builder.init_stream_header(true, true)
+      .append_meta_tag(
+          flv::amf::amf_array::create()->with_item("duration", (double)0))
+      .append_video_tag(0, payload, sizeof(payload))
+      .append_audio_tag(40, payload, 3);
+}
+
+static void test_sinks_produce_identical_output() {
+  std::ostringstream oss;
+  {
+    flv::flv_stream_builder builder(oss);
+    build_sample_stream(builder);
+  }
+
+  std::vector<uint8_t> mem;
+  flv::memory_sink msink(mem);
+  flv::flv_stream_builder builder(msink);
+  build_sample_stream(builder);
+
+  std::string expected = oss.str();
+  TEST_CHECK(mem.size() == expected.size());
+  TEST_CHECK(std::equal(mem.begin(), mem.end(), expected.begin()));
+
+  FILE *f = tmpfile();
+  TEST_CHECK(f != nullptr);
+  if (f) {
+    flv::fd_sink fsink(fileno(f));
+    flv::flv_stream_builder fbuilder(fsink);
+    build_sample_stream(fbuilder);
+    std::vector<uint8_t> content(mem.size() + 1);
+    rewind(f);
+    size_t n = fread(content.data(), 1, content.size(), f);
+    fclose(f);
+    TEST_CHECK(n == mem.size());
+    TEST_CHECK(std::equal(mem.begin(), mem.end(), content.begin()));
+  }
+}
+
+static void test_tag_is_one_gather_write() {
+  std::vector<size_t> writes;
+  std::vector<uint8_t> out;
+  flv::callback_sink sink([&](const flv::io_slice *slices, size_t count) {
+    writes.push_back(count);
+    for (size_t i = 0; i < count; i++) {
+      out.insert(out.end(), slices[i].data, slices[i].data + slices[i].length);
+    }
+  });
+  flv::flv_stream_builder builder(sink);
+  uint8_t payload[100] = {0};
+  builder.init_stream_header(false, true);
+  builder.append_video_tag(0x01020304, payload, sizeof(payload));
+
+  TEST_CHECK(writes.size() == 2);
+  TEST_CHECK(out.size() == 13 + 11 + 100 + 4);
+
+  // Tag header fields, timestamp with the extended byte
+  const uint8_t *tag = out.data() + 13;
+  TEST_CHECK(tag[0] == 0x09);
+  TEST_CHECK(tag[3] == 100);
+  TEST_CHECK(tag[4] == 0x02 && tag[5] == 0x03 && tag[6] == 0x04);
+  TEST_CHECK(tag[7] == 0x01);
+
+  // PreviousTagSize covers the tag header and the data
+  TEST_CHECK(read_be32(tag + 11 + 100) == 11 + 100);
+}
+
+/// <summary>
+/// Represents the sink counting the payload bytes which were copied before
+/// being handed to the sink. Bytes of slices pointing into the watched
+/// buffer are counted as passed through without copy.
+/// </summary>
+class copy_counting_sink : public flv::flv_sink {
+public:
+  copy_counting_sink(const uint8_t *begin, size_t length)
+      : begin_(begin), end_(begin + length), passed_(0), copied_(0),
+        writes_(0) {}
+
+  virtual void write(const flv::io_slice *slices, size_t count) override {
+    writes_++;
+    for (size_t i = 0; i < count; i++) {
+      if (slices[i].data >= begin_ && slices[i].data < end_) {
+        passed_ += slices[i].length;
+      } else {
+        copied_ += slices[i].length;
+      }
+    }
+  }
+
+  uint64_t passed() const { return passed_; }
+  uint64_t copied() const { return copied_; }
+  uint64_t writes() const { return writes_; }
+
+private:
+  const uint8_t *begin_;
+  const uint8_t *end_;
+  uint64_t passed_;
+  uint64_t copied_;
+  uint64_t writes_;
+};
+
+static void test_codec_tags_are_zero_copy() {
+  std::vector<uint8_t> frame(300 * 1024, 0xab);
+  copy_counting_sink sink(frame.data(), frame.size());
+  flv::flv_stream_builder builder(sink);
+  uint32_t length = static_cast<uint32_t>(frame.size());
+
+  uint64_t before = allocations;
+  builder.append_video_tag_with_avc_decoder_config(0, frame.data(), 40);
+  builder.append_video_tag_with_avc_nalu_data(40, frame.data(), length);
+  builder.append_audio_tag_with_aac_specific_config(
+      0, flv::audio_data_sound_rate_t::R44KHZ,
+      flv::audio_data_sound_size_t::S16BIT,
+      flv::audio_data_sound_type_t::STEREO, frame.data(), 2);
+  builder.append_audio_tag_with_aac_frame_data(
+      23, flv::audio_data_sound_rate_t::R44KHZ,
+      flv::audio_data_sound_size_t::S16BIT,
+      flv::audio_data_sound_type_t::STEREO, frame.data(), 512);
+  uint64_t after = allocations;
+
+  // No heap allocation per frame, one gather write per tag
+  TEST_CHECK(after == before);
+  TEST_CHECK(sink.writes() == 4);
+
+  // The whole payload passed through, only the headers were produced
+  TEST_CHECK(sink.passed() == 40 + length + 2 + 512);
+  TEST_CHECK(sink.copied() == 4 * (11 + 4) + 5 + 5 + 2 + 2);
+}
+
+static void test_aac_header_flags() {
+  std::vector<uint8_t> out;
+  flv::memory_sink sink(out);
+  flv::flv_stream_builder builder(sink);
+  static const uint8_t asc[] = {0x12, 0x10};
+  builder.append_audio_tag_with_aac_specific_config(
+      0, flv::audio_data_sound_rate_t::R44KHZ,
+      flv::audio_data_sound_size_t::S16BIT,
+      flv::audio_data_sound_type_t::STEREO, asc, sizeof(asc));
+  TEST_CHECK(out.size() == 11 + 2 + 2 + 4);
+  TEST_CHECK(out[11] == 0xaf);
+  TEST_CHECK(out[12] == 0x00);
+  TEST_CHECK(out[13] == 0x12 && out[14] == 0x10);
+}
+
+static void test_start_code_scanners_agree() {
+  // Pseudo random bytes biased towards zeros and ones
+  std::vector<uint8_t> buf(4096);
+  uint32_t seed = 12345;
+  for (auto &b : buf) {
+    seed = seed * 1103515245 + 12345;
+    uint32_t r = (seed >> 16) & 0x0f;
+    b = r < 6 ? 0 : (r < 9 ? 1 : static_cast<uint8_t>(seed >> 8));
+  }
+
+  for (size_t offset = 0; offset < 64; offset++) {
+    const uint8_t *p = buf.data() + offset;
+    const uint8_t *end = buf.data() + buf.size();
+    while (true) {
+      const uint8_t *a = flv::avc::find_start_code(p, end);
+      const uint8_t *b = flv::avc::find_start_code_scalar(p, end);
+      TEST_CHECK(a == b);
+      if (a != b || a == end) {
+        break;
+      }
+      p = a + 1;
+    }
+  }
+}
+
+static void test_annexb_in_place_conversion() {
+  uint8_t four[] = {0, 0, 0, 1, 0x65, 0xaa, 0xbb, 0, 0, 0, 1, 0x41, 0xcc};
+  TEST_CHECK(flv::avc::annexb_to_avcc_in_place(four, sizeof(four)));
+  static const uint8_t expected[] = {0, 0, 0, 3, 0x65, 0xaa, 0xbb,
+                                     0, 0, 0, 2, 0x41, 0xcc};
+  TEST_CHECK(std::equal(four, four + sizeof(four), expected));
+
+  // 3-byte start codes cannot be rewritten in place
+  uint8_t three[] = {0, 0, 0, 1, 0x65, 0xaa, 0, 0, 1, 0x41, 0xcc};
+  uint8_t copy[sizeof(three)];
+  memcpy(copy, three, sizeof(three));
+  TEST_CHECK(!flv::avc::annexb_to_avcc_in_place(three, sizeof(three)));
+  TEST_CHECK(std::equal(three, three + sizeof(three), copy));
+
+  // Too short for a start code and its length prefix
+  std::vector<uint8_t> zero(1, 0);
+  TEST_CHECK(!flv::avc::annexb_to_avcc_in_place(zero.data(), zero.size()));
+  TEST_CHECK(zero[0] == 0);
+}
+
+// High profile 1280x720 SPS and its PPS
+static const uint8_t TEST_SPS[] = {0x67, 0x64, 0x00, 0x1f, 0xac, 0xd9, 0x40,
+                                   0x50, 0x05, 0xbb, 0x01, 0x10, 0x00, 0x00,
+                                   0x03, 0x00, 0x10, 0x00, 0x00, 0x03, 0x03,
+                                   0xc0, 0xf1, 0x83, 0x19, 0x60};
+static const uint8_t TEST_PPS[] = {0x68, 0xeb, 0xe3, 0xcb, 0x22, 0xc0};
+
+static void test_avc_decoder_config_from_sps_pps() {
+  flv::avc::nalu_view sps = {TEST_SPS, sizeof(TEST_SPS)};
+  flv::avc::nalu_view pps = {TEST_PPS, sizeof(TEST_PPS)};
+  std::vector<uint8_t> record;
+  TEST_CHECK(flv::avc::build_decoder_config(sps, pps, record));
+  TEST_CHECK(record.size() ==
+             6 + 2 + sizeof(TEST_SPS) + 1 + 2 + sizeof(TEST_PPS) + 4);
+  TEST_CHECK(record[0] == 1 && record[1] == 0x64 && record[3] == 0x1f);
+  TEST_CHECK(record[4] == 0xff && record[5] == 0xe1);
+  TEST_CHECK(record[7] == sizeof(TEST_SPS));
+
+  // 4:2:0, 8 bits
+  const uint8_t *ext = record.data() + record.size() - 4;
+  TEST_CHECK(ext[0] == 0xfd && ext[1] == 0xf8 && ext[2] == 0xf8 &&
+             ext[3] == 0);
+}
+
+static void test_annexb_ingest() {
+  std::vector<uint8_t> au;
+  static const uint8_t sc4[] = {0, 0, 0, 1};
+  static const uint8_t sc3[] = {0, 0, 1};
+  static const uint8_t aud[] = {0x09, 0xf0};
+  static const uint8_t idr[] = {0x65, 0x88, 0x84, 0x00, 0x21};
+  au.insert(au.end(), sc4, sc4 + 4);
+  au.insert(au.end(), aud, aud + sizeof(aud));
+  au.insert(au.end(), sc4, sc4 + 4);
+  au.insert(au.end(), TEST_SPS, TEST_SPS + sizeof(TEST_SPS));
+  au.insert(au.end(), sc3, sc3 + 3);
+  au.insert(au.end(), TEST_PPS, TEST_PPS + sizeof(TEST_PPS));
+  au.insert(au.end(), sc3, sc3 + 3);
+  au.insert(au.end(), idr, idr + sizeof(idr));
+
+  std::vector<uint8_t> out;
+  flv::memory_sink sink(out);
+  flv::flv_stream_builder builder(sink);
+  builder.append_video_tag_with_annexb_data(0, au.data(),
+                                            static_cast<uint32_t>(au.size()));
+
+  // The sequence header tag comes first, flagged as key frame
+  TEST_CHECK(out.size() > 11 + 5);
+  TEST_CHECK(out[11] == 0x17 && out[12] == 0x00);
+  uint32_t seq_size = read_be32(out.data()) & 0x00ffffff;
+  const uint8_t *tag = out.data() + 11 + seq_size + 4;
+
+  // Then the IDR frame with the length prefixed NAL unit only
+  TEST_CHECK(tag[0] == 0x09);
+  TEST_CHECK((read_be32(tag) & 0x00ffffff) == 5 + 4 + sizeof(idr));
+  TEST_CHECK(tag[11] == 0x17 && tag[12] == 0x01);
+  TEST_CHECK(read_be32(tag + 16) == sizeof(idr));
+  TEST_CHECK(std::equal(idr, idr + sizeof(idr), tag + 20));
+
+  // Unchanged parameter sets do not produce another sequence header
+  size_t before = out.size();
+  static const uint8_t p_frame[] = {0, 0, 0, 1, 0x41, 0x9a, 0x02};
+  builder.append_video_tag_with_annexb_data(40, p_frame, sizeof(p_frame));
+  builder.append_video_tag_with_annexb_data(0, au.data(),
+                                            static_cast<uint32_t>(au.size()));
+  TEST_CHECK(out[before + 11] == 0x27);
+  TEST_CHECK(out.size() == before + (11 + 5 + 4 + 3 + 4) +
+                               (11 + 5 + 4 + sizeof(idr) + 4));
+}
+
+static flv::amf::amf_array_ref create_sample_meta() {
+  return flv::amf::amf_array::create()
+      ->with_item("duration", (double)12.5)
+      ->with_item("width", (double)1920)
+      ->with_item("stereo", true)
+      ->with_item("encoder", "flv-stream-builder")
+      ->with_item("extra", flv::amf::amf_object::create()
+                               ->with_property("a", (double)1)
+                               ->with_property("b", "x"));
+}
+
+static void test_amf_round_trip() {
+  std::vector<uint8_t> buf;
+  create_sample_meta()->serialize(buf);
+
+  auto meta = flv::amf::amf_array::create();
+  TEST_CHECK(meta->deserialize(buf));
+  auto &items = meta->items();
+  TEST_CHECK(items.size() == 5);
+
+  std::vector<uint8_t> again;
+  meta->serialize(again);
+  TEST_CHECK(again == buf);
+
+  // Type mismatch and truncated data fail
+  auto number = flv::amf::amf_number::create(0);
+  TEST_CHECK(!number->deserialize(buf));
+  TEST_CHECK(!meta->deserialize(buf.data(), buf.size() - 1));
+}
+
+static void test_amf_reader_all_types() {
+  static const uint8_t data[] = {
+      0x05,                                           // Null
+      0x06,                                           // Undefined
+      0x07, 0x00, 0x02,                               // Reference 2
+      0x0b, 0x42, 0x74, 0x00, 0x00, 0x00, 0x00, 0x00, // Date
+      0x00, 0xff, 0xc4,                               // time zone -60
+      0x0c, 0x00, 0x00, 0x00, 0x02, 'h',  'i',        // Long String
+      0x0a, 0x00, 0x00, 0x00, 0x02,                   // Strict Array [2]
+      0x01, 0x01,                                     // true
+      0x02, 0x00, 0x01, 'z',                          // "z"
+      0x03,                                           // Object
+      0x00, 0x01, 'k',  0x00, 0x3f, 0xf0, 0x00, 0x00, // k: 1.0
+      0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x09,       // end
+  };
+  flv::amf::amf_reader reader(data, sizeof(data));
+  flv::amf::amf_item item;
+  static const flv::amf::amf_value_type_t expected[] = {
+      flv::amf::NullType,        flv::amf::UndefinedType,
+      flv::amf::ReferenceType,   flv::amf::DateType,
+      flv::amf::LongStringType,  flv::amf::StrictArrayType,
+      flv::amf::BooleanType,     flv::amf::StringType,
+      flv::amf::ObjectEndType,   flv::amf::ObjectType,
+      flv::amf::NumberType,      flv::amf::ObjectEndType,
+  };
+  for (auto type : expected) {
+    TEST_CHECK(reader.next(item) == flv::amf::amf_read_result::Ok);
+    TEST_CHECK(item.type == type);
+    if (type == flv::amf::ReferenceType) {
+      TEST_CHECK(item.reference == 2);
+    } else if (type == flv::amf::DateType) {
+      TEST_CHECK(item.number == 1374389534720.0 && item.time_zone == -60);
+    } else if (type == flv::amf::LongStringType) {
+      // Strings point into the source buffer
+      TEST_CHECK(item.string.equals("hi"));
+      TEST_CHECK(item.string.data == (const char *)data + 21);
+    } else if (type == flv::amf::NumberType) {
+      TEST_CHECK(item.key.equals("k") && item.number == 1.0);
+    }
+  }
+  TEST_CHECK(reader.next(item) == flv::amf::amf_read_result::End);
+
+  // Unknown markers are rejected
+  static const uint8_t bad[] = {0x04};
+  flv::amf::amf_reader bad_reader(bad, sizeof(bad));
+  TEST_CHECK(bad_reader.next(item) == flv::amf::amf_read_result::Error);
+  for (int marker = 0x12; marker <= 0xff; marker++) {
+    uint8_t out_of_range[] = {static_cast<uint8_t>(marker), 0, 0};
+    flv::amf::amf_reader range_reader(out_of_range, sizeof(out_of_range));
+    TEST_CHECK(range_reader.next(item) == flv::amf::amf_read_result::Error);
+  }
+}
+
+static void test_amf_reader_incremental() {
+  std::vector<uint8_t> buf;
+  flv::amf::amf_string::create("onMetaData")->serialize(buf);
+  create_sample_meta()->serialize(buf);
+
+  // Read everything at once
+  size_t total = 0;
+  {
+    flv::amf::amf_reader reader(buf.data(), buf.size());
+    flv::amf::amf_item item;
+    while (reader.next(item) == flv::amf::amf_read_result::Ok) {
+      total++;
+    }
+  }
+
+  // Feed the stream one byte at a time through a growing copy
+  std::vector<uint8_t> partial;
+  flv::amf::amf_reader reader(partial.data(), 0);
+  flv::amf::amf_item item;
+  size_t count = 0;
+  size_t fed = 0;
+  flv::amf::amf_read_result r = flv::amf::amf_read_result::NeedMoreData;
+  while (fed <= buf.size()) {
+    r = reader.next(item);
+    if (r == flv::amf::amf_read_result::Ok) {
+      count++;
+    } else if (r == flv::amf::amf_read_result::NeedMoreData ||
+               (r == flv::amf::amf_read_result::End && fed < buf.size())) {
+      if (fed == buf.size()) {
+        break;
+      }
+      partial.push_back(buf[fed++]);
+      reader.rebind(partial.data(), partial.size());
+    } else {
+      break;
+    }
+  }
+  TEST_CHECK(r == flv::amf::amf_read_result::End);
+  TEST_CHECK(count == total);
+  TEST_CHECK(count == 2 + 5 + 2 + 2);
+}
+
+static void test_stream_reader() {
+  std::vector<uint8_t> out;
+  flv::memory_sink sink(out);
+  flv::flv_stream_builder builder(sink);
+  static const uint8_t nalu[] = {0, 0, 0, 2, 0x65, 0x88};
+  static const uint8_t aac[] = {0x21, 0x10};
+  builder.init_stream_header(true, true)
+      .append_meta_tag(create_sample_meta())
+      .append_video_tag_with_avc_nalu_data(0x01000010, nalu, sizeof(nalu))
+      .append_audio_tag_with_aac_frame_data(
+          23, flv::audio_data_sound_rate_t::R44KHZ,
+          flv::audio_data_sound_size_t::S16BIT,
+          flv::audio_data_sound_type_t::STEREO, aac, sizeof(aac));
+
+  flv::flv_stream_reader reader(out.data(), out.size());
+  TEST_CHECK(reader.valid() && reader.has_audio() && reader.has_video());
+
+  auto it = reader.begin();
+  TEST_CHECK(it != reader.end() && it->type == flv::tag_type_t::Script);
+  TEST_CHECK(it->offset == 13);
+  TEST_CHECK(it->tag_size_check == flv::tag_size_check_t::Ok);
+
+  ++it;
+  TEST_CHECK(it != reader.end() && it->type == flv::tag_type_t::Video);
+  TEST_CHECK(it->timestamp == 0x01000010);
+  TEST_CHECK(it->codec_id == flv::video_data_codec_id::AVC);
+  TEST_CHECK(it->avc_packet_type == flv::avc_video_packet_type::AvcNALU);
+  TEST_CHECK(it->payload_length == sizeof(nalu));
+  TEST_CHECK(std::equal(nalu, nalu + sizeof(nalu), it->payload));
+
+  ++it;
+  TEST_CHECK(it != reader.end() && it->type == flv::tag_type_t::Audio);
+  TEST_CHECK(it->sound_format == flv::audio_data_sound_format::AAC);
+  TEST_CHECK(it->sound_rate == flv::audio_data_sound_rate_t::R44KHZ);
+  TEST_CHECK(it->aac_packet_type == flv::aac_audio_data_packet_type::AacRaw);
+  TEST_CHECK(it->payload_length == sizeof(aac));
+  TEST_CHECK(it->tag_size_check == flv::tag_size_check_t::Ok);
+
+  ++it;
+  TEST_CHECK(it == reader.end());
+
+  // Older builders wrote the data size only, cut off tags are not visited
+  std::vector<uint8_t> legacy(out.begin(), out.end());
+  size_t trailer = 13 + 11 + (read_be32(legacy.data() + 13) & 0x00ffffff);
+  uint32_t data_size = static_cast<uint32_t>(trailer - 13 - 11);
+  legacy[trailer + 2] = (data_size >> 8) & 0xff;
+  legacy[trailer + 3] = data_size & 0xff;
+  legacy.resize(legacy.size() - 6);
+  flv::flv_stream_reader legacy_reader(legacy.data(), legacy.size());
+  size_t count = 0;
+  for (auto &tag : legacy_reader) {
+    if (!count) {
+      TEST_CHECK(tag.tag_size_check == flv::tag_size_check_t::DataSizeOnly);
+    }
+    count++;
+  }
+  TEST_CHECK(count == 2);
+
+  // A recording cut within the last PreviousTagSize ends at its last tag
+  for (size_t cut = 1; cut <= 4; cut++) {
+    std::vector<uint8_t> truncated(out.begin(), out.end() - cut);
+    flv::flv_stream_reader truncated_reader(truncated.data(),
+                                            truncated.size());
+    std::vector<flv::flv_tag_view> tags(truncated_reader.begin(),
+                                        truncated_reader.end());
+    TEST_CHECK(tags.size() == 3);
+    TEST_CHECK(tags.back().tag_size_check == flv::tag_size_check_t::Missing);
+  }
+
+  // A DataOffset near 4 GB does not wrap past the bounds check
+  std::vector<uint8_t> bad(out.begin(), out.end());
+  for (uint8_t offset = 0xfc; offset; offset++) {
+    bad[5] = bad[6] = bad[7] = 0xff;
+    bad[8] = offset;
+    flv::flv_stream_reader bad_reader(bad.data(), bad.size());
+    TEST_CHECK(!bad_reader.valid());
+    TEST_CHECK(bad_reader.begin() == bad_reader.end());
+  }
+}
+
+static void test_stream_reader_mapped_file() {
+  // The file written by generate_flv_file
+  flv::flv_stream_reader reader("test_flv_data.flv");
+  TEST_CHECK(reader.valid());
+  size_t count = 0;
+  for (auto &tag : reader) {
+    TEST_CHECK(tag.type == flv::tag_type_t::Script);
+    TEST_CHECK(tag.tag_size_check == flv::tag_size_check_t::Ok);
+    count++;
+  }
+  TEST_CHECK(count == 1);
+}
+
+/// <summary>
+/// Finds the keyframes index in the meta tag of the stream.
+/// </summary>
+static bool read_keyframe_index(const flv::flv_stream_reader &reader,
+                                std::vector<double> &times,
+                                std::vector<double> &positions) {
+  auto it = reader.begin();
+  if (it == reader.end() || it->type != flv::tag_type_t::Script) {
+    return false;
+  }
+
+  flv::amf::amf_reader amf(it->data, it->length);
+  flv::amf::amf_item item;
+  std::vector<double> *target = nullptr;
+  flv::amf::amf_read_result r;
+  while ((r = amf.next(item)) == flv::amf::amf_read_result::Ok) {
+    if (item.type == flv::amf::StrictArrayType) {
+      target = item.key.equals("times") ? &times : &positions;
+    } else if (item.type == flv::amf::NumberType && target &&
+               item.key.length == 0) {
+      target->push_back(item.number);
+    } else if (item.type == flv::amf::ObjectEndType) {
+      target = nullptr;
+    }
+  }
+
+  // The whole meta is still valid AMF
+  return r == flv::amf::amf_read_result::End &&
+         times.size() == positions.size();
+}
+
+static void test_keyframe_index() {
+  std::vector<uint8_t> out;
+  flv::memory_sink sink(out);
+  flv::flv_stream_builder builder(sink);
+  uint8_t key[] = {0x17, 0x01, 0, 0, 0, 0xaa};
+  uint8_t inter[] = {0x27, 0x01, 0, 0, 0, 0xbb};
+  builder.enable_keyframe_index(8)
+      .init_stream_header(false, true)
+      .append_meta_tag(create_sample_meta());
+  for (uint32_t i = 0; i < 5; i++) {
+    builder.append_video_tag(i * 2000, key, sizeof(key));
+    builder.append_video_tag(i * 2000 + 40, inter, sizeof(inter));
+  }
+  size_t size = out.size();
+  TEST_CHECK(builder.finalize());
+  TEST_CHECK(out.size() == size);
+
+  flv::flv_stream_reader reader(out.data(), out.size());
+  std::vector<double> times;
+  std::vector<double> positions;
+  TEST_CHECK(read_keyframe_index(reader, times, positions));
+  TEST_CHECK(times.size() == 5);
+
+  // Each position points at the keyframe tag with that time
+  for (size_t i = 0; i < times.size(); i++) {
+    TEST_CHECK(times[i] == i * 2.0);
+    flv::flv_stream_reader::iterator it = reader.begin();
+    while (it != reader.end() && it->offset != (uint64_t)positions[i]) {
+      ++it;
+    }
+    TEST_CHECK(it != reader.end());
+    if (it != reader.end()) {
+      TEST_CHECK(it->frame_type == flv::video_data_frame_type::KEY_FRAME);
+      TEST_CHECK(it->timestamp == i * 2000);
+    }
+  }
+  for (auto &tag : reader) {
+    TEST_CHECK(tag.tag_size_check == flv::tag_size_check_t::Ok);
+  }
+}
+
+static void test_keyframe_index_thinning() {
+  std::ostringstream oss;
+  flv::flv_stream_builder builder(oss);
+  uint8_t key[] = {0x12, 0x00};
+  builder.enable_keyframe_index(4)
+      .init_stream_header(false, true)
+      .append_meta_tag(create_sample_meta());
+  for (uint32_t i = 0; i < 10; i++) {
+    builder.append_video_tag(i * 1000, key, sizeof(key));
+  }
+  TEST_CHECK(builder.finalize());
+
+  std::string out = oss.str();
+  flv::flv_stream_reader reader((const uint8_t *)out.data(), out.size());
+  std::vector<double> times;
+  std::vector<double> positions;
+  TEST_CHECK(read_keyframe_index(reader, times, positions));
+  TEST_CHECK(times.size() == 3);
+  TEST_CHECK(times.size() == 3 && times[0] == 0.0 && times[1] == 4.0 &&
+             times[2] == 8.0);
+
+  // Sinks without positional writes cannot finalize the index
+  flv::callback_sink cb([](const flv::io_slice *, size_t) {});
+  flv::flv_stream_builder streaming(cb);
+  streaming.enable_keyframe_index(4).append_meta_tag(create_sample_meta());
+  TEST_CHECK(!streaming.finalize());
+}
+
+static double read_meta_number(const flv::flv_tag_view &tag, const char *key) {
+  flv::amf::amf_reader reader(tag.data, tag.length);
+  flv::amf::amf_item item;
+  while (reader.next(item) == flv::amf::amf_read_result::Ok) {
+    if (item.type == flv::amf::NumberType && item.key.equals(key)) {
+      return item.number;
+    }
+  }
+  return -1;
+}
+
+static void test_finalize_patches_meta() {
+  std::ostringstream oss;
+  flv::flv_stream_builder builder(oss);
+  auto meta = flv::amf::amf_array::create()
+                  ->with_item("duration", (double)0)
+                  ->with_item("width", (double)1920)
+                  ->with_item("videodatarate", (double)0)
+                  ->with_item("audiodatarate", (double)0)
+                  ->with_item("lastkeyframetimestamp", (double)0)
+                  ->with_item("filesize", (double)0);
+  builder.init_stream_header(true, true).append_meta_tag(meta);
+
+  // 10 seconds of 25 fps 1000 byte video and 50 fps 250 byte audio
+  std::vector<uint8_t> video(1000, 0);
+  std::vector<uint8_t> audio(250, 0);
+  for (uint32_t i = 0; i <= 250; i++) {
+    video[0] = (i % 50) ? 0x22 : 0x12;
+    builder.append_video_tag(i * 40, video.data(), 1000);
+    builder.append_audio_tag(i * 40, audio.data(), 250);
+    builder.append_audio_tag(i * 40 + 20, audio.data(), 250);
+  }
+  TEST_CHECK(builder.finalize());
+
+  std::string out = oss.str();
+  flv::flv_stream_reader reader((const uint8_t *)out.data(), out.size());
+  flv::flv_tag_view tag = *reader.begin();
+  TEST_CHECK(read_meta_number(tag, "duration") == 10.02);
+  TEST_CHECK(read_meta_number(tag, "filesize") == (double)out.size());
+  TEST_CHECK(read_meta_number(tag, "lastkeyframetimestamp") == 10.0);
+  TEST_CHECK(read_meta_number(tag, "width") == 1920);
+  double vrate = read_meta_number(tag, "videodatarate");
+  double arate = read_meta_number(tag, "audiodatarate");
+  TEST_CHECK(vrate > 200 && vrate < 201);
+  TEST_CHECK(arate > 100 && arate < 101);
+}
+
+/// <summary>
+/// Represents the memory sink failing the positional write at one offset.
+/// </summary>
+class failing_patch_sink : public flv::memory_sink {
+public:
+  explicit failing_patch_sink(std::vector<uint8_t> &buf)
+      : flv::memory_sink(buf), fail_at_(0) {}
+
+  virtual bool write_at(uint64_t offset, const uint8_t *data,
+                        size_t length) override {
+    if (offset == fail_at_) {
+      return false;
+    }
+    return flv::memory_sink::write_at(offset, data, length);
+  }
+
+  void fail_at(uint64_t offset) { fail_at_ = offset; }
+
+private:
+  uint64_t fail_at_;
+};
+
+static void test_keyframe_index_limits() {
+  // The index must fit the 24-bit data size of the meta tag
+  std::vector<uint8_t> out;
+  failing_patch_sink sink(out);
+  flv::flv_stream_builder builder(sink);
+  bool thrown = false;
+  try {
+    builder.enable_keyframe_index(flv::MAX_KEYFRAME_INDEX_ENTRIES + 1);
+  } catch (const std::invalid_argument &) {
+    thrown = true;
+  }
+  TEST_CHECK(thrown);
+
+  // A meta too large for the index gets none
+  builder.enable_keyframe_index(flv::MAX_KEYFRAME_INDEX_ENTRIES)
+      .init_stream_header(false, true)
+      .append_meta_tag(flv::amf::amf_array::create()->with_item(
+          "text", std::string(64 * 1024, 'x').c_str()));
+  flv::flv_stream_reader full(out.data(), out.size());
+  TEST_CHECK(full.begin() != full.end() &&
+             full.begin()->tag_size_check == flv::tag_size_check_t::Ok);
+  std::vector<double> times;
+  std::vector<double> positions;
+  TEST_CHECK(read_keyframe_index(full, times, positions) && times.empty());
+
+  // A failed patch fails finalize() even when the index is written
+  out.clear();
+  flv::flv_stream_builder patched(sink);
+  uint8_t key[] = {0x12, 0x00};
+  patched.enable_keyframe_index(4)
+      .init_stream_header(false, true)
+      .append_meta_tag(create_sample_meta())
+      .append_video_tag(1000, key, sizeof(key));
+  TEST_CHECK(patched.finalize());
+  double duration = 0;
+  flv::flv_stream_reader reader(out.data(), out.size());
+  if (reader.begin() != reader.end()) {
+    duration = read_meta_number(*reader.begin(), "duration");
+  }
+  TEST_CHECK(duration == 1.0);
+  sink.fail_at(13 + 11 + 3 + 10 + 5 + 2 + 8 + 1);
+  TEST_CHECK(!patched.finalize());
+}
+
+static std::vector<uint8_t>
+concat_buffers(const std::vector<flv::tag_buffer_ref> &bufs) {
+  std::vector<uint8_t> out;
+  for (auto &b : bufs) {
+    out.insert(out.end(), b->begin(), b->end());
+  }
+  return out;
+}
+
+static void append_live_gop(flv::flv_stream_builder &builder, uint32_t ts) {
+  static const uint8_t nalu[] = {0, 0, 0, 2, 0x65, 0x88};
+  static const uint8_t key[] = {0x17, 0x01, 0, 0, 0, 0, 0, 0, 1, 0x65};
+  static const uint8_t aac[] = {0x21, 0x10};
+  builder.append_video_tag(ts, key, sizeof(key));
+  builder.append_audio_tag_with_aac_frame_data(
+      ts, flv::audio_data_sound_rate_t::R44KHZ,
+      flv::audio_data_sound_size_t::S16BIT,
+      flv::audio_data_sound_type_t::STEREO, aac, sizeof(aac));
+  builder.append_video_tag_with_avc_nalu_data(ts + 40, nalu, sizeof(nalu));
+}
+
+static void test_live_stream_join() {
+  flv::flv_live_stream live;
+  auto early = live.subscribe();
+
+  static const uint8_t avcc[] = {1, 0x64, 0, 0x1f, 0xff, 0xe0, 0};
+  static const uint8_t asc[] = {0x12, 0x10};
+  flv::flv_stream_builder &builder = live.builder();
+  builder.init_stream_header(true, true)
+      .append_meta_tag(create_sample_meta())
+      .append_video_tag_with_avc_decoder_config(0, avcc, sizeof(avcc))
+      .append_audio_tag_with_aac_specific_config(
+          0, flv::audio_data_sound_rate_t::R44KHZ,
+          flv::audio_data_sound_size_t::S16BIT,
+          flv::audio_data_sound_type_t::STEREO, asc, sizeof(asc));
+  append_live_gop(builder, 0);
+  std::vector<flv::tag_buffer_ref> all;
+  while (early->read(all, 3)) {
+  }
+  TEST_CHECK(all.size() == 4 + 3);
+  append_live_gop(builder, 2000);
+
+  // A late subscriber gets the prelude and the current GOP only
+  auto late = live.subscribe();
+  std::vector<flv::tag_buffer_ref> bufs;
+  TEST_CHECK(late->read(bufs, 100) == 4 + 3);
+  TEST_CHECK(bufs.size() == 7);
+  std::vector<uint8_t> joined = concat_buffers(bufs);
+  flv::flv_stream_reader reader(joined.data(), joined.size());
+  static const flv::tag_type_t types[] = {
+      flv::tag_type_t::Script, flv::tag_type_t::Video,
+      flv::tag_type_t::Audio,  flv::tag_type_t::Video,
+      flv::tag_type_t::Audio,  flv::tag_type_t::Video};
+  size_t i = 0;
+  for (auto &tag : reader) {
+    TEST_CHECK(i < 6 && tag.type == types[i]);
+    TEST_CHECK(tag.tag_size_check == flv::tag_size_check_t::Ok);
+    if (i == 3) {
+      TEST_CHECK(tag.frame_type == flv::video_data_frame_type::KEY_FRAME);
+      TEST_CHECK(tag.timestamp == 2000);
+    }
+    i++;
+  }
+  TEST_CHECK(i == 6);
+
+  // Nothing more until the producer appends
+  std::vector<flv::tag_buffer_ref> none;
+  TEST_CHECK(late->read(none, 100) == 0);
+
+  // The early subscriber gets every tag, sharing the same buffers
+  while (early->read(all, 3)) {
+  }
+  TEST_CHECK(all.size() == 4 + 6);
+  TEST_CHECK(early->skipped() == 0);
+  TEST_CHECK(all.back().get() == bufs.back().get());
+  TEST_CHECK(all[1].get() == bufs[1].get());
+  std::vector<uint8_t> whole = concat_buffers(all);
+  flv::flv_stream_reader whole_reader(whole.data(), whole.size());
+  TEST_CHECK(whole_reader.valid());
+}
+
+static void test_live_stream_slow_subscriber() {
+  flv::flv_live_stream live(8);
+  flv::flv_stream_builder &builder = live.builder();
+  builder.init_stream_header(true, true);
+  auto slow = live.subscribe();
+  for (uint32_t i = 0; i < 10; i++) {
+    append_live_gop(builder, i * 1000);
+  }
+
+  // At most the limit is cached, the slow one resumes at the last keyframe
+  TEST_CHECK(live.cached_tags() <= 8);
+  std::vector<flv::tag_buffer_ref> bufs;
+  while (slow->read(bufs, 100)) {
+  }
+  TEST_CHECK(slow->skipped() > 0);
+  TEST_CHECK(bufs.size() == 1 + 3);
+  TEST_CHECK(flv::classify_tag(bufs[0]->data(), bufs[0]->size()) ==
+             flv::tag_class_t::Header);
+  TEST_CHECK(flv::classify_tag(bufs[1]->data(), bufs[1]->size()) ==
+             flv::tag_class_t::VideoKeyframe);
+}
+
+static void test_live_stream_audio_only() {
+  static const uint8_t asc[] = {0x12, 0x10};
+  static const uint8_t aac[] = {0x21, 0x10};
+  flv::flv_live_stream live(4);
+  flv::flv_stream_builder &builder = live.builder();
+  builder.init_stream_header(false, true)
+      .append_meta_tag(create_sample_meta())
+      .append_audio_tag_with_aac_specific_config(
+          0, flv::audio_data_sound_rate_t::R44KHZ,
+          flv::audio_data_sound_size_t::S16BIT,
+          flv::audio_data_sound_type_t::STEREO, asc, sizeof(asc));
+  auto slow = live.subscribe();
+  for (uint32_t i = 0; i < 10; i++) {
+    builder.append_audio_tag_with_aac_frame_data(
+        i * 23, flv::audio_data_sound_rate_t::R44KHZ,
+        flv::audio_data_sound_size_t::S16BIT,
+        flv::audio_data_sound_type_t::STEREO, aac, sizeof(aac));
+  }
+  TEST_CHECK(live.cached_tags() <= 4);
+
+  // The prelude outlives the cache, a late joiner still gets it once
+  auto late = live.subscribe();
+  std::vector<flv::tag_buffer_ref> bufs;
+  while (late->read(bufs, 2)) {
+  }
+  TEST_CHECK(bufs.size() == 3 + 4);
+  static const flv::tag_class_t classes[] = {
+      flv::tag_class_t::Header, flv::tag_class_t::Meta,
+      flv::tag_class_t::AudioConfig};
+  for (size_t i = 0; i < bufs.size(); i++) {
+    flv::tag_class_t c = flv::classify_tag(bufs[i]->data(), bufs[i]->size());
+    TEST_CHECK(c == (i < 3 ? classes[i] : flv::tag_class_t::Audio));
+  }
+  std::vector<uint8_t> joined = concat_buffers(bufs);
+  flv::flv_stream_reader reader(joined.data(), joined.size());
+  TEST_CHECK(reader.valid());
+
+  // So does one which fell behind, without the prelude tags twice
+  std::vector<flv::tag_buffer_ref> behind;
+  while (slow->read(behind, 100)) {
+  }
+  TEST_CHECK(slow->skipped() > 0);
+  TEST_CHECK(behind.size() == 3 + 4);
+  TEST_CHECK(behind[2].get() == bufs[2].get());
+}
+
+static void test_live_stream_evicted_keyframe() {
+  static const uint8_t nalu[] = {0, 0, 0, 2, 0x41, 0x9a};
+  flv::flv_live_stream live(4);
+  flv::flv_stream_builder &builder = live.builder();
+  builder.init_stream_header(true, true);
+  append_live_gop(builder, 0);
+  for (uint32_t i = 0; i < 6; i++) {
+    builder.append_video_tag_with_avc_nalu_data(80 + i * 40, nalu,
+                                                 sizeof(nalu));
+  }
+
+  // The keyframe was evicted, a late joiner waits for the next one
+  auto late = live.subscribe();
+  std::vector<flv::tag_buffer_ref> bufs;
+  while (late->read(bufs, 100)) {
+  }
+  TEST_CHECK(bufs.size() == 1);
+  builder.append_video_tag_with_avc_nalu_data(400, nalu, sizeof(nalu));
+  TEST_CHECK(late->read(bufs, 100) == 0);
+  append_live_gop(builder, 1000);
+  while (late->read(bufs, 100)) {
+  }
+  TEST_CHECK(bufs.size() == 1 + 3);
+  TEST_CHECK(flv::classify_tag(bufs[1]->data(), bufs[1]->size()) ==
+             flv::tag_class_t::VideoKeyframe);
+}
+
+static void test_async_writer_multi_producer() {
+  std::vector<uint8_t> out;
+  flv::memory_sink sink(out);
+  flv::flv_stream_builder builder(sink);
+  builder.init_stream_header(true, false);
+  const uint32_t producers = 4;
+  const uint32_t frames = 500;
+  {
+    flv::flv_async_writer writer(builder, 64, flv::queue_full_policy_t::Block,
+                                 16);
+    std::vector<std::thread> threads;
+    for (uint32_t p = 0; p < producers; p++) {
+      threads.push_back(std::thread([&writer, p, frames]() {
+        for (uint32_t i = 0; i < frames; i++) {
+          uint8_t payload[8] = {(uint8_t)p, (uint8_t)(i >> 8), (uint8_t)i};
+          flv::frame_desc frame = {};
+          frame.track = flv::track_type_t::Audio;
+          frame.dts = frame.pts = i * 23;
+          frame.data = payload;
+          frame.length = 3 + i % 5;
+          TEST_CHECK(writer.push(frame));
+        }
+      }));
+    }
+    for (auto &t : threads) {
+      t.join();
+    }
+    writer.stop();
+    TEST_CHECK(writer.written() == producers * frames);
+    TEST_CHECK(writer.dropped() == 0);
+  }
+
+  // Every frame is intact, each producer's frames keep their order
+  flv::flv_stream_reader reader(out.data(), out.size());
+  TEST_CHECK(reader.valid());
+  std::vector<uint32_t> next(producers, 0);
+  size_t count = 0;
+  for (auto &tag : reader) {
+    TEST_CHECK(tag.type == flv::tag_type_t::Audio);
+    TEST_CHECK(tag.tag_size_check == flv::tag_size_check_t::Ok);
+    TEST_CHECK(tag.length >= 2 + 3);
+    uint32_t p = tag.data[2];
+    uint32_t i = (uint32_t)tag.data[3] << 8 | tag.data[4];
+    TEST_CHECK(p < producers && i == next[p]);
+    TEST_CHECK(tag.length == 2 + 3 + i % 5);
+    TEST_CHECK(tag.timestamp == i * 23);
+    next[p] = i + 1;
+    count++;
+  }
+  TEST_CHECK(count == producers * frames);
+}
+
+static void test_async_writer_full_policies() {
+  static const flv::queue_full_policy_t policies[] = {
+      flv::queue_full_policy_t::Fail, flv::queue_full_policy_t::Drop};
+  for (auto policy : policies) {
+    // The sink blocks until released, so the queue fills up
+    std::atomic<bool> released(false);
+    flv::callback_sink sink([&](const flv::io_slice *, size_t) {
+      while (!released.load()) {
+        std::this_thread::yield();
+      }
+    });
+    flv::flv_stream_builder builder(sink);
+    flv::flv_async_writer writer(builder, 2, policy, 4);
+    uint8_t payload[4] = {0};
+    flv::frame_desc frame = {};
+    frame.track = flv::track_type_t::Audio;
+    frame.data = payload;
+    frame.length = sizeof(payload);
+    uint64_t accepted = 0;
+    for (int i = 0; i < 10; i++) {
+      accepted += writer.push(frame) ? 1 : 0;
+    }
+    TEST_CHECK(accepted >= 1 && accepted <= 2);
+    if (policy == flv::queue_full_policy_t::Drop) {
+      TEST_CHECK(writer.dropped() == 10 - accepted);
+    } else {
+      TEST_CHECK(writer.dropped() == 0);
+    }
+    released = true;
+    writer.stop();
+    TEST_CHECK(writer.written() == accepted);
+  }
+}
+
+static void push_interleaved(flv::flv_interleaver &il, flv::track_type_t track,
+                             uint32_t dts) {
+  static const uint8_t payload[] = {0x65, 0x88, 0x80};
+  flv::frame_desc frame = {};
+  frame.track = track;
+  frame.dts = frame.pts = dts;
+  frame.data = payload;
+  frame.length = sizeof(payload);
+  il.push(frame);
+}
+
+static std::vector<uint32_t> tag_timestamps(const std::vector<uint8_t> &out) {
+  std::vector<uint32_t> ts;
+  flv::flv_stream_reader reader(out.data(), out.size());
+  for (auto &tag : reader) {
+    ts.push_back(tag.timestamp);
+  }
+  return ts;
+}
+
+static void test_interleaver_orders_tracks() {
+  std::vector<uint8_t> out;
+  flv::memory_sink sink(out);
+  flv::flv_stream_builder builder(sink);
+  builder.init_stream_header(true, true);
+  flv::flv_interleaver il(builder, 200, 16);
+
+  // Video runs 100ms ahead of audio
+  uint32_t v = 0;
+  uint32_t a = 0;
+  for (int i = 0; i < 30; i++) {
+    push_interleaved(il, flv::track_type_t::Video, v + 100);
+    v += 40;
+    while (a <= v) {
+      push_interleaved(il, flv::track_type_t::Audio, a);
+      a += 23;
+    }
+  }
+
+  // A frame waits only while the other track has nothing buffered
+  TEST_CHECK(il.buffered() > 0 && il.buffered() < 8);
+  il.flush();
+  TEST_CHECK(il.buffered() == 0);
+  TEST_CHECK(il.late() == 0 && il.dropped() == 0);
+  std::vector<uint32_t> ts = tag_timestamps(out);
+  TEST_CHECK(ts.size() == il.emitted());
+  TEST_CHECK(std::is_sorted(ts.begin(), ts.end()));
+}
+
+static void test_interleaver_late_and_dropped() {
+  std::vector<uint8_t> out;
+  flv::memory_sink sink(out);
+  flv::flv_stream_builder builder(sink);
+  builder.init_stream_header(true, true);
+  flv::flv_interleaver il(builder, 100, 4);
+
+  // Without audio, video waits for the maximum delay only
+  push_interleaved(il, flv::track_type_t::Video, 0);
+  push_interleaved(il, flv::track_type_t::Video, 40);
+  TEST_CHECK(il.emitted() == 0);
+  push_interleaved(il, flv::track_type_t::Video, 120);
+  TEST_CHECK(il.emitted() == 1);
+
+  // Audio older than the delay is late but still in order
+  push_interleaved(il, flv::track_type_t::Audio, 10);
+  TEST_CHECK(il.late() == 1 && il.dropped() == 0);
+
+  // Audio older than what was appended is dropped
+  push_interleaved(il, flv::track_type_t::Audio, 5);
+  TEST_CHECK(il.dropped() == 1);
+
+  // A full heap forces the oldest frame out
+  for (uint32_t t = 200; t < 400; t += 20) {
+    push_interleaved(il, flv::track_type_t::Video, t);
+  }
+  TEST_CHECK(il.buffered() <= 4 + 4);
+  il.flush();
+  std::vector<uint32_t> ts = tag_timestamps(out);
+  TEST_CHECK(ts.size() == il.emitted());
+  TEST_CHECK(ts.size() == 3 + 1 + 10);
+  TEST_CHECK(std::is_sorted(ts.begin(), ts.end()));
+
+  // A frame older than a full track goes out first, not after the oldest
+  std::vector<uint8_t> out2;
+  flv::memory_sink sink2(out2);
+  flv::flv_stream_builder builder2(sink2);
+  builder2.init_stream_header(true, true);
+  flv::flv_interleaver il2(builder2, 1000, 2);
+  push_interleaved(il2, flv::track_type_t::Video, 100);
+  push_interleaved(il2, flv::track_type_t::Video, 200);
+  push_interleaved(il2, flv::track_type_t::Video, 50);
+  TEST_CHECK(il2.emitted() == 1 && il2.dropped() == 0);
+
+  // Then a frame between the appended one and the buffered ones
+  push_interleaved(il2, flv::track_type_t::Video, 70);
+  push_interleaved(il2, flv::track_type_t::Video, 60);
+  TEST_CHECK(il2.emitted() == 2 && il2.dropped() == 1);
+  il2.flush();
+  ts = tag_timestamps(out2);
+  static const uint32_t expected[] = {50, 70, 100, 200};
+  TEST_CHECK(ts == std::vector<uint32_t>(expected, expected + 4));
+}
+
+static void test_append_frames_batch() {
+  // A B-frame GOP in decode order: I0 P3 B1 B2, plus AAC
+  static const uint8_t avcc[] = {1, 0x64, 0, 0x1f, 0xff, 0xe0, 0};
+  static const uint8_t asc[] = {0x12, 0x10};
+  static const uint8_t nalu[] = {0, 0, 0, 2, 0x65, 0x88};
+  static const uint8_t aac[] = {0x21, 0x10, 0x04};
+  flv::frame_desc frames[7] = {};
+  frames[0].track = flv::track_type_t::Video;
+  frames[0].config = true;
+  frames[0].data = avcc;
+  frames[0].length = sizeof(avcc);
+  frames[1].track = flv::track_type_t::Audio;
+  frames[1].config = true;
+  frames[1].data = asc;
+  frames[1].length = sizeof(asc);
+  static const uint32_t pts[] = {80, 200, 120, 160};
+  for (int i = 0; i < 4; i++) {
+    flv::frame_desc &f = frames[2 + i];
+    f.track = flv::track_type_t::Video;
+    f.dts = i * 40;
+    f.pts = pts[i];
+    f.keyframe = i == 0;
+    f.data = nalu;
+    f.length = sizeof(nalu);
+  }
+  frames[6].track = flv::track_type_t::Audio;
+  frames[6].dts = frames[6].pts = 23;
+  frames[6].data = aac;
+  frames[6].length = sizeof(aac);
+
+  std::vector<size_t> writes;
+  std::vector<uint8_t> out;
+  flv::callback_sink sink([&](const flv::io_slice *slices, size_t count) {
+    writes.push_back(count);
+    for (size_t i = 0; i < count; i++) {
+      out.insert(out.end(), slices[i].data, slices[i].data + slices[i].length);
+    }
+  });
+  flv::flv_stream_builder builder(sink);
+  builder.enable_keyframe_index(8)
+      .init_stream_header(true, true)
+      .append_meta_tag(create_sample_meta());
+  size_t header_writes = writes.size();
+
+  writes.reserve(16);
+  out.reserve(4096);
+  builder.append_frames(frames, 7);
+
+  // The arena is reused, no allocation once it is large enough
+  uint64_t before = allocations;
+  builder.append_frames(frames + 2, 5);
+  TEST_CHECK(allocations == before);
+
+  // One gather write per batch: one arena piece and one data piece per frame
+  TEST_CHECK(writes.size() == header_writes + 2);
+  TEST_CHECK(writes[header_writes] == 7 * 2 + 1);
+
+  // The output is the same as the single frame path
+  std::vector<uint8_t> expected;
+  flv::memory_sink expected_sink(expected);
+  flv::flv_stream_builder single(expected_sink);
+  single.enable_keyframe_index(8)
+      .init_stream_header(true, true)
+      .append_meta_tag(create_sample_meta());
+  for (int i = 0; i < 7; i++) {
+    single.append_frame(frames[i]);
+  }
+  for (int i = 2; i < 7; i++) {
+    single.append_frame(frames[i]);
+  }
+  TEST_CHECK(expected == out);
+
+  flv::flv_stream_reader reader(out.data(), out.size());
+  std::vector<flv::flv_tag_view> all(reader.begin(), reader.end());
+  TEST_CHECK(all.size() == 1 + 7 + 5);
+  std::vector<flv::flv_tag_view> tags(all.begin() + 1, all.end());
+  for (auto &tag : tags) {
+    TEST_CHECK(tag.tag_size_check == flv::tag_size_check_t::Ok);
+  }
+  TEST_CHECK(tags[0].frame_type == flv::video_data_frame_type::KEY_FRAME);
+  TEST_CHECK(tags[0].avc_packet_type ==
+             flv::avc_video_packet_type::AvcSequenceHeader);
+  TEST_CHECK(tags[1].data[0] == 0xaf && tags[1].data[1] == 0);
+  TEST_CHECK(tags[6].data[0] == 0xaf && tags[6].data[1] == 1);
+  TEST_CHECK(tags[6].timestamp == 23);
+
+  // Keyframe flags and CTS = pts - dts
+  for (int i = 0; i < 4; i++) {
+    const flv::flv_tag_view &tag = tags[2 + i];
+    TEST_CHECK(tag.timestamp == (uint32_t)i * 40);
+    TEST_CHECK(tag.frame_type ==
+               (i == 0 ? flv::video_data_frame_type::KEY_FRAME
+                       : flv::video_data_frame_type::INTER_FRAME));
+    uint32_t cts = (uint32_t)tag.data[2] << 16 | tag.data[3] << 8 | tag.data[4];
+    TEST_CHECK(cts == pts[i] - i * 40);
+  }
+
+  // Keyframes of both batches are indexed at their tag offsets
+  TEST_CHECK(single.finalize());
+  flv::flv_stream_reader finalized(expected.data(), expected.size());
+  std::vector<double> times;
+  std::vector<double> positions;
+  TEST_CHECK(read_keyframe_index(finalized, times, positions));
+  TEST_CHECK(positions.size() == 2 &&
+             positions[0] == (double)tags[2].offset &&
+             positions[1] == (double)tags[7].offset);
+}
+
+static void test_avc_nalu_data_flags() {
+  std::vector<uint8_t> out;
+  flv::memory_sink sink(out);
+  flv::flv_stream_builder builder(sink);
+  static const uint8_t nalu[] = {0, 0, 0, 2, 0x65, 0x88};
+  builder.append_video_tag_with_avc_nalu_data(1000, nalu, sizeof(nalu), 80,
+                                              true);
+  builder.append_video_tag_with_avc_nalu_data(1040, nalu, sizeof(nalu));
+  TEST_CHECK(out[11] == 0x17 && out[12] == 1);
+  TEST_CHECK(out[13] == 0 && out[14] == 0 && out[15] == 80);
+  const uint8_t *tag = out.data() + 11 + 5 + sizeof(nalu) + 4;
+  TEST_CHECK(tag[11] == 0x27);
+  TEST_CHECK(tag[13] == 0 && tag[14] == 0 && tag[15] == 0);
+}
+
+static void build_sample_tree(flv::amf::amf_tree &tree) {
+  // The keys of create_sample_meta() in the order std::map keeps them
+  tree.begin_array()
+      .with_property("duration", (double)12.5)
+      .with_property("encoder", "flv-stream-builder")
+      .begin_object("extra")
+      .with_property("a", (double)1)
+      .with_property("b", "x")
+      .end()
+      .with_property("stereo", true)
+      .with_property("width", (double)1920)
+      .end();
+}
+
+static void test_amf_tree() {
+  std::vector<uint8_t> expected;
+  create_sample_meta()->serialize(expected);
+
+  flv::amf::amf_tree tree;
+  build_sample_tree(tree);
+  TEST_CHECK(tree.value_type() == flv::amf::ECMAArrayType);
+  std::vector<uint8_t> buf;
+  tree.serialize(buf);
+  TEST_CHECK(buf == expected);
+
+  // Children are flat ranges, found by name
+  const flv::amf::amf_tree::node *root = tree.root();
+  TEST_CHECK(root && root->count == 5);
+  const flv::amf::amf_tree::node *extra = tree.find(*root, "extra");
+  TEST_CHECK(extra && extra->type == flv::amf::ObjectType && extra->count == 2);
+  const flv::amf::amf_tree::node *b = tree.find(*extra, "b");
+  TEST_CHECK(b && tree.string(*b).equals("x"));
+  TEST_CHECK(tree.find(*root, "height") == nullptr);
+
+  // Rebuilding in the same arenas does not allocate
+  std::vector<uint8_t> again;
+  again.reserve(expected.size());
+  uint64_t before = allocations;
+  tree.clear();
+  build_sample_tree(tree);
+  tree.serialize(again);
+  TEST_CHECK(allocations == before);
+  TEST_CHECK(again == expected);
+
+  // Keys keep the insertion order
+  tree.clear();
+  tree.begin_object().with_property("z", 1.0).with_property("a", 2.0).end();
+  const flv::amf::amf_tree::node *first = tree.children(*tree.root());
+  TEST_CHECK(tree.key(first[0]).equals("z") && first[1].number == 2.0);
+
+  // Deserializing a tree serialized by the node classes
+  flv::amf::amf_tree parsed;
+  TEST_CHECK(parsed.deserialize(expected));
+  std::vector<uint8_t> reserialized;
+  parsed.serialize(reserialized);
+  TEST_CHECK(reserialized == expected);
+  TEST_CHECK(!parsed.deserialize(expected.data(), expected.size() - 1));
+  TEST_CHECK(parsed.value_type() == flv::amf::UndefinedType);
+
+  // Misuse is reported
+  bool thrown = false;
+  try {
+    flv::amf::amf_tree bad;
+    bad.with_property("a", 1.0);
+  } catch (const std::logic_error &) {
+    thrown = true;
+  }
+  TEST_CHECK(thrown);
+
+  // The builder takes the tree as the meta
+  std::vector<uint8_t> from_nodes;
+  flv::memory_sink nodes_sink(from_nodes);
+  flv::flv_stream_builder nodes_builder(nodes_sink);
+  nodes_builder.append_meta_tag(create_sample_meta());
+  std::vector<uint8_t> from_tree;
+  flv::memory_sink tree_sink(from_tree);
+  flv::flv_stream_builder tree_builder(tree_sink);
+  build_sample_tree(parsed);
+  tree_builder.append_meta_tag(parsed);
+  TEST_CHECK(from_tree == from_nodes);
+}
+
+FLV_META_KEY(audiocodecid_key, "audiocodecid", NumberType);
+FLV_META_KEY(duration_key, "duration", NumberType);
+FLV_META_KEY(filesize_key, "filesize", NumberType);
+FLV_META_KEY(stereo_key, "stereo", BooleanType);
+FLV_META_KEY(width_key, "width", NumberType);
+typedef flv::meta_template<audiocodecid_key, duration_key, filesize_key,
+                           stereo_key, width_key>
+    sample_meta_template;
+
+// Sizes and offsets are compile-time constants
+static_assert(sample_meta_template::SIZE ==
+                  18 + (2 + 12 + 9) + (2 + 8 + 9) + (2 + 8 + 9) +
+                      (2 + 6 + 2) + (2 + 5 + 9) + 3,
+              "meta template size");
+static_assert(sample_meta_template::offset<duration_key>() ==
+                  18 + (2 + 12 + 9) + 2 + 8 + 1,
+              "meta template offset");
+
+static void test_meta_template() {
+  sample_meta_template meta;
+  meta.set<audiocodecid_key>(10.0)
+      .set<duration_key>(12.5)
+      .set<stereo_key>(true)
+      .set<width_key>(1920.0);
+
+  // The same bytes as the node classes, whose keys are sorted too
+  std::vector<uint8_t> expected;
+  flv::amf::amf_string::create("onMetaData")->serialize(expected);
+  flv::amf::amf_array::create()
+      ->with_item("audiocodecid", (double)10)
+      ->with_item("duration", (double)12.5)
+      ->with_item("filesize", (double)0)
+      ->with_item("stereo", true)
+      ->with_item("width", (double)1920)
+      ->serialize(expected);
+  TEST_CHECK(meta.size() == expected.size());
+  TEST_CHECK(std::equal(expected.begin(), expected.end(), meta.data()));
+
+  const flv::meta_slot_info *slots = sample_meta_template::slots();
+  TEST_CHECK(!strcmp(slots[3].key, "stereo"));
+  TEST_CHECK(slots[3].type == flv::amf::BooleanType);
+  TEST_CHECK(slots[1].offset == sample_meta_template::offset<duration_key>());
+
+  // Appending is the same as appending the tree, with or without the index,
+  // and finalize() patches the schema slots
+  for (int indexed = 0; indexed < 2; indexed++) {
+    std::vector<uint8_t> from_template;
+    flv::memory_sink template_sink(from_template);
+    flv::flv_stream_builder template_builder(template_sink);
+    std::vector<uint8_t> from_tree;
+    flv::memory_sink tree_sink(from_tree);
+    flv::flv_stream_builder tree_builder(tree_sink);
+    if (indexed) {
+      template_builder.enable_keyframe_index(4);
+      tree_builder.enable_keyframe_index(4);
+    }
+    template_builder.init_stream_header(false, true).append_meta_tag(meta);
+    tree_builder.init_stream_header(false, true)
+        .append_meta_tag(flv::amf::amf_array::create()
+                             ->with_item("audiocodecid", (double)10)
+                             ->with_item("duration", (double)12.5)
+                             ->with_item("filesize", (double)0)
+                             ->with_item("stereo", true)
+                             ->with_item("width", (double)1920));
+    uint8_t key[] = {0x12, 0xaa};
+    template_builder.append_video_tag(3000, key, sizeof(key));
+    tree_builder.append_video_tag(3000, key, sizeof(key));
+    TEST_CHECK(template_builder.finalize() && tree_builder.finalize());
+    TEST_CHECK(from_template == from_tree);
+    flv::flv_stream_reader reader(from_template.data(), from_template.size());
+    flv::flv_tag_view tag = *reader.begin();
+    TEST_CHECK(read_meta_number(tag, "duration") == 3.0);
+    TEST_CHECK(read_meta_number(tag, "filesize") ==
+               (double)from_template.size());
+  }
+}
+
+static void test_big_endian_stores() {
+  uint8_t buf[8] = {0};
+  TEST_CHECK(flv::store_be16(buf, 0x0102) == buf + 2);
+  TEST_CHECK(buf[0] == 1 && buf[1] == 2);
+  TEST_CHECK(flv::store_be24(buf + 1, 0xaa030405) == buf + 4);
+  TEST_CHECK(buf[1] == 3 && buf[2] == 4 && buf[3] == 5);
+  TEST_CHECK(flv::store_be32(buf + 3, 0x06070809) == buf + 7);
+  TEST_CHECK(buf[3] == 6 && buf[6] == 9);
+  TEST_CHECK(flv::store_be_f64(buf, 1.0) == buf + 8);
+  static const uint8_t one[8] = {0x3f, 0xf0, 0, 0, 0, 0, 0, 0};
+  TEST_CHECK(std::equal(one, one + 8, buf));
+}
+
+static void test_amf_serialized_size() {
+  flv::amf::amf_array_ref meta = create_sample_meta();
+  std::vector<uint8_t> buf;
+  uint64_t before = allocations;
+  meta->serialize(buf);
+  TEST_CHECK(allocations - before == 1);
+  TEST_CHECK(buf.size() == meta->serialized_size());
+
+  // Appending after existing bytes keeps them
+  std::vector<uint8_t> appended(3, 0xee);
+  flv::amf::amf_number::create(2.5)->serialize(appended);
+  TEST_CHECK(appended.size() == 3 + 9);
+  TEST_CHECK(appended[2] == 0xee && appended[3] == flv::amf::NumberType);
+  TEST_CHECK(appended[4] == 0x40 && appended[5] == 0x04);
+
+  flv::amf::amf_tree tree;
+  build_sample_tree(tree);
+  TEST_CHECK(tree.serialized_size() == buf.size());
+  std::vector<uint8_t> raw(tree.serialized_size());
+  TEST_CHECK(tree.serialize_to(raw.data()) == raw.data() + raw.size());
+  TEST_CHECK(raw == buf);
+}
+
+static void test_builder_stats() {
+  std::vector<uint8_t> out;
+  size_t writes = 0;
+  flv::callback_sink sink([&](const flv::io_slice *slices, size_t count) {
+    // The third write (the first video tag) is slow
+    if (++writes == 3) {
+      std::this_thread::sleep_for(std::chrono::milliseconds(2));
+    }
+    for (size_t i = 0; i < count; i++) {
+      out.insert(out.end(), slices[i].data, slices[i].data + slices[i].length);
+    }
+  });
+  flv::flv_stream_builder builder(sink);
+  builder.init_stream_header(true, true).append_meta_tag(create_sample_meta());
+  uint8_t key[] = {0x17, 0x01, 0, 0, 0, 0xaa};
+  uint8_t inter[] = {0x27, 0x01, 0, 0, 0, 0xbb, 0xcc};
+  uint8_t audio[] = {0xaf, 0x01, 0x11};
+  builder.append_video_tag(0, key, sizeof(key));
+  builder.append_audio_tag(10, audio, sizeof(audio));
+  builder.append_video_tag(40, inter, sizeof(inter));
+  builder.append_video_tag(80, key, sizeof(key));
+  builder.append_audio_tag(33, audio, sizeof(audio));
+
+  flv::flv_builder_stats stats = builder.stats();
+#if defined(FLV_BUILDER_DISABLE_STATS)
+  TEST_CHECK(stats.video.tags == 0 && stats.sink_writes == 0);
+#else
+  TEST_CHECK(stats.video.tags == 3 && stats.audio.tags == 2);
+  TEST_CHECK(stats.script.tags == 1);
+  TEST_CHECK(stats.keyframes == 2);
+  TEST_CHECK(stats.last_video_dts == 80 && stats.last_audio_dts == 33);
+  TEST_CHECK(stats.video.bytes == 3 * 15 + sizeof(key) * 2 + sizeof(inter));
+  TEST_CHECK(stats.audio.bytes + stats.video.bytes + stats.script.bytes ==
+             out.size() - 13);
+  TEST_CHECK(stats.sink_writes == 7);
+
+  // The slow write lands in a bucket of 1 ms or more
+  TEST_CHECK(stats.sink_blocked_ns >= 2000000);
+  uint64_t slow = 0;
+  for (size_t i = 20; i < flv::flv_builder_stats::LATENCY_BUCKETS; i++) {
+    slow += stats.write_latency[i];
+  }
+  TEST_CHECK(slow == 1);
+  TEST_CHECK(stats.write_latency_percentile(1.0) > 2000000);
+  TEST_CHECK(stats.write_latency_percentile(0.5) < 1000000);
+#endif
+  TEST_CHECK(flv::flv_builder_stats::latency_bucket(0) == 0);
+  TEST_CHECK(flv::flv_builder_stats::latency_bucket(1024) == 10);
+  TEST_CHECK(flv::flv_builder_stats::latency_bucket(2047) == 10);
+  TEST_CHECK(flv::flv_builder_stats::latency_bucket(~0ull) ==
+             flv::flv_builder_stats::LATENCY_BUCKETS - 1);
+
+  // Snapshots can be taken while another thread appends
+  std::atomic<bool> done(false);
+  std::thread appender([&]() {
+    for (uint32_t i = 0; i < 1000; i++) {
+      builder.append_audio_tag(100 + i, audio, sizeof(audio));
+    }
+    done = true;
+  });
+  uint64_t last = 0;
+  bool monotonic = true;
+  while (!done) {
+    uint64_t tags = builder.stats().audio.tags;
+    monotonic = monotonic && tags >= last;
+    last = tags;
+  }
+  appender.join();
+  TEST_CHECK(monotonic);
+#if !defined(FLV_BUILDER_DISABLE_STATS)
+  TEST_CHECK(builder.stats().audio.tags == 1002);
+  TEST_CHECK(builder.stats().last_audio_dts == 1099);
+#endif
+}
+
+/// <summary>
+/// Appends an ADTS frame (AAC-LC) to the buffer.
+/// </summary>
+static void push_adts_frame(std::vector<uint8_t> &out, uint8_t sampling_index,
+                            uint8_t channels, uint32_t payload_length,
+                            bool crc = false) {
+  uint32_t header_size = crc ? 9 : 7;
+  uint32_t frame_length = header_size + payload_length;
+  out.push_back(0xff);
+  out.push_back(crc ? 0xf0 : 0xf1);
+  out.push_back(static_cast<uint8_t>(1 << 6 | sampling_index << 2 |
+                                     channels >> 2));
+  out.push_back(static_cast<uint8_t>((channels & 0x03) << 6 |
+                                     frame_length >> 11));
+  out.push_back(static_cast<uint8_t>(frame_length >> 3));
+  out.push_back(static_cast<uint8_t>((frame_length & 0x07) << 5 | 0x1f));
+  out.push_back(0xfc);
+  if (crc) {
+    out.push_back(0x12);
+    out.push_back(0x34);
+  }
+  for (uint32_t i = 0; i < payload_length; i++) {
+    out.push_back(static_cast<uint8_t>(i));
+  }
+}
+
+static void test_adts_ingest() {
+  // 3 frames of 44.1 kHz stereo, garbage, then one 48 kHz mono frame with
+  // CRC and a truncated frame
+  std::vector<uint8_t> adts;
+  push_adts_frame(adts, 4, 2, 100);
+  push_adts_frame(adts, 4, 2, 200);
+  adts.push_back(0x00);
+  adts.push_back(0xff);
+  push_adts_frame(adts, 4, 2, 50);
+  size_t second_config = adts.size();
+  push_adts_frame(adts, 3, 1, 80, true);
+  push_adts_frame(adts, 3, 1, 30);
+  adts.resize(adts.size() - 5);
+
+  const uint8_t *cursor = adts.data();
+  flv::aac::adts_frame frame;
+  std::vector<uint32_t> lengths;
+  while (flv::aac::next_adts_frame(cursor, adts.data() + adts.size(), frame)) {
+    lengths.push_back(frame.length);
+  }
+  TEST_CHECK(lengths.size() == 4);
+  TEST_CHECK(lengths[0] == 100 && lengths[2] == 50 && lengths[3] == 80);
+
+  // A frame of 2 raw data blocks is skipped whole, its blocks counted
+  std::vector<uint8_t> blocks;
+  push_adts_frame(blocks, 4, 2, 40);
+  push_adts_frame(blocks, 4, 2, 60);
+  blocks[40 + 7 + 6] |= 0x01;
+  push_adts_frame(blocks, 4, 2, 20);
+  cursor = blocks.data();
+  lengths.clear();
+  std::vector<uint32_t> skipped;
+  while (flv::aac::next_adts_frame(cursor, blocks.data() + blocks.size(),
+                                   frame)) {
+    lengths.push_back(frame.length);
+    skipped.push_back(frame.skipped_blocks);
+  }
+  TEST_CHECK(lengths.size() == 2);
+  TEST_CHECK(lengths[0] == 40 && lengths[1] == 20);
+  TEST_CHECK(skipped.size() == 2 && skipped[0] == 0 && skipped[1] == 2);
+  TEST_CHECK(frame.skipped_blocks == 0);
+
+  // The frame after them is timed after the 1024 * 3 samples before it
+  {
+    std::vector<uint8_t> timed;
+    flv::memory_sink timed_sink(timed);
+    flv::flv_stream_builder timed_builder(timed_sink);
+    timed_builder.init_stream_header(true, false);
+    timed_builder.append_audio_tag_with_adts_data(
+        1000, blocks.data(), static_cast<uint32_t>(blocks.size()));
+    std::vector<uint32_t> ts = tag_timestamps(timed);
+    TEST_CHECK(ts.size() == 3 && ts[1] == 1000 && ts[2] == 1069);
+  }
+
+  std::vector<const uint8_t *> pieces;
+  std::vector<uint8_t> out;
+  flv::callback_sink sink([&](const flv::io_slice *slices, size_t count) {
+    for (size_t i = 0; i < count; i++) {
+      pieces.push_back(slices[i].data);
+      out.insert(out.end(), slices[i].data, slices[i].data + slices[i].length);
+    }
+  });
+  flv::flv_stream_builder builder(sink);
+  builder.init_stream_header(true, false);
+  builder.append_audio_tag_with_adts_data(
+      1000, adts.data(), static_cast<uint32_t>(second_config));
+  builder.append_audio_tag_with_adts_data(
+      2000, adts.data() + second_config,
+      static_cast<uint32_t>(adts.size() - second_config));
+  // The same config again, no new sequence header
+  std::vector<uint8_t> more;
+  push_adts_frame(more, 3, 1, 10);
+  builder.append_audio_tag_with_adts_data(3000, more.data(),
+                                          static_cast<uint32_t>(more.size()));
+
+  // The raw frames point into the caller's buffer
+  TEST_CHECK(std::find(pieces.begin(), pieces.end(), adts.data() + 7) !=
+             pieces.end());
+
+  flv::flv_stream_reader reader(out.data(), out.size());
+  std::vector<flv::flv_tag_view> tags(reader.begin(), reader.end());
+  TEST_CHECK(tags.size() == 7);
+  if (tags.size() == 7) {
+    // AAC-LC, 44.1 kHz, stereo: 0x12 0x10
+    TEST_CHECK(tags[0].data[0] == 0xaf && tags[0].data[1] == 0x00);
+    TEST_CHECK(tags[0].length == 4);
+    TEST_CHECK(tags[0].data[2] == 0x12 && tags[0].data[3] == 0x10);
+    TEST_CHECK(tags[1].data[1] == 0x01 && tags[1].length == 102);
+    TEST_CHECK(tags[1].timestamp == 1000 && tags[2].timestamp == 1023);
+    TEST_CHECK(tags[3].timestamp == 1046 && tags[3].length == 52);
+    // AAC-LC, 48 kHz, mono: 0x11 0x88
+    TEST_CHECK(tags[4].data[1] == 0x00 && tags[4].timestamp == 2000);
+    TEST_CHECK(tags[4].data[2] == 0x11 && tags[4].data[3] == 0x88);
+    TEST_CHECK(tags[5].length == 82 && tags[5].data[2] == 0);
+    TEST_CHECK(tags[6].timestamp == 3000 && tags[6].length == 12);
+  }
+}
+
+#if !defined(_WIN32)
+/// <summary>
+/// Builds 3 Annex-B access units: an IDR picture with its parameter sets, a
+/// picture of 2 slices and a picture of 1 slice.
+/// </summary>
+static std::vector<uint8_t> build_annexb_units() {
+  static const uint8_t sc4[] = {0, 0, 0, 1};
+  static const uint8_t sc3[] = {0, 0, 1};
+  static const uint8_t aud[] = {0x09, 0xf0};
+  static const uint8_t idr[] = {0x65, 0x88, 0x84, 0x00, 0x21};
+  static const uint8_t first_slice[] = {0x41, 0x9a, 0x02};
+  static const uint8_t second_slice[] = {0x41, 0x12, 0x03};
+  std::vector<uint8_t> es;
+  auto push = [&es](const uint8_t *sc, size_t sc_length, const uint8_t *nalu,
+                    size_t length) {
+    es.insert(es.end(), sc, sc + sc_length);
+    es.insert(es.end(), nalu, nalu + length);
+  };
+  push(sc4, 4, aud, sizeof(aud));
+  push(sc4, 4, TEST_SPS, sizeof(TEST_SPS));
+  push(sc3, 3, TEST_PPS, sizeof(TEST_PPS));
+  push(sc3, 3, idr, sizeof(idr));
+  push(sc4, 4, first_slice, sizeof(first_slice));
+  push(sc3, 3, second_slice, sizeof(second_slice));
+  push(sc4, 4, first_slice, sizeof(first_slice));
+  return es;
+}
+
+static void test_mux_access_units() {
+  std::vector<uint8_t> es = build_annexb_units();
+  mux::access_unit_scanner units(es.data(), es.data() + es.size());
+  const uint8_t *begin = nullptr;
+  const uint8_t *end = nullptr;
+  std::vector<std::vector<uint8_t>> found;
+  while (units.next(begin, end)) {
+    found.push_back(std::vector<uint8_t>(begin, end));
+  }
+  TEST_CHECK(found.size() == 3);
+  if (found.size() == 3) {
+    // The units start at their start code (3 bytes kept of a 4-byte one)
+    TEST_CHECK(found[0].size() == 3 + 2 + 4 + sizeof(TEST_SPS) + 3 +
+                                      sizeof(TEST_PPS) + 3 + 5);
+    TEST_CHECK(found[0][3] == 0x09);
+    TEST_CHECK(found[1].size() == 3 + 3 + 3 + 3);
+    TEST_CHECK(found[2].size() == 3 + 3);
+  }
+  mux::access_unit_scanner empty(nullptr, nullptr);
+  TEST_CHECK(!empty.next(begin, end));
+
+  // slice_type 6 is a B slice, the I and P slices before it are not
+  static const uint8_t b_slice[] = {0, 0, 1, 0x41, 0x9c, 0x02};
+  es.insert(es.end(), b_slice, b_slice + sizeof(b_slice));
+  mux::access_unit_scanner typed(es.data(), es.data() + es.size());
+  std::vector<bool> bidirectional;
+  while (typed.next(begin, end)) {
+    bidirectional.push_back(typed.bidirectional());
+  }
+  TEST_CHECK(bidirectional.size() == 4);
+  TEST_CHECK(bidirectional == std::vector<bool>({false, false, false, true}));
+
+  // An emulation prevention byte inside the codes is skipped
+  static const uint8_t rbsp[] = {0x00, 0x00, 0x03, 0x80, 0x00, 0x40};
+  mux::golomb_reader golomb(rbsp, rbsp + sizeof(rbsp));
+  uint32_t value = 0;
+  TEST_CHECK(golomb.read_ue(value) && value == 65535);
+  TEST_CHECK(golomb.read_ue(value) && value == 0);
+  TEST_CHECK(!golomb.read_ue(value));
+}
+
+/// <summary>
+/// Creates a temporary file holding the data passed in.
+/// </summary>
+static std::string write_temp_file(const std::vector<uint8_t> &data) {
+  char path[] = "/tmp/flv-mux-test-XXXXXX";
+  int fd = ::mkstemp(path);
+  TEST_CHECK(fd >= 0);
+  if (fd >= 0) {
+    TEST_CHECK(::write(fd, data.data(), data.size()) == (ssize_t)data.size());
+    ::close(fd);
+  }
+  return path;
+}
+
+static void test_mux_job() {
+  // 3 pictures at 25 fps and 4 AAC frames at 44.1 kHz
+  std::vector<uint8_t> adts;
+  for (int i = 0; i < 4; i++) {
+    push_adts_frame(adts, 4, 2, 20);
+  }
+  mux::job_t job;
+  job.video = write_temp_file(build_annexb_units());
+  job.audio = write_temp_file(adts);
+  job.output = write_temp_file(std::vector<uint8_t>());
+  mux::options_t options;
+  options.threads = 1;
+  options.fps = 25;
+  options.keyframes = 4;
+  mux::result_t result = mux::result_t();
+  mux::mux_job(job, options, result);
+  TEST_CHECK(result.frames == 3 + 4);
+  TEST_CHECK(result.input_bytes ==
+             build_annexb_units().size() + adts.size());
+
+  flv::flv_stream_reader reader(job.output.c_str());
+  TEST_CHECK(reader.valid() && reader.has_audio() && reader.has_video());
+  TEST_CHECK(result.output_bytes == reader.length());
+  std::vector<flv::flv_tag_view> tags(reader.begin(), reader.end());
+  // Meta, AVC and AAC sequence headers, then the frames in timestamp order
+  static const uint32_t timestamps[] = {0, 0, 0, 0, 0, 23, 40, 46, 69, 80};
+  TEST_CHECK(tags.size() == 10);
+  if (tags.size() == 10) {
+    TEST_CHECK(tags[0].type == flv::tag_type_t::Script);
+    TEST_CHECK(read_meta_number(tags[0], "duration") == 0.08);
+    TEST_CHECK(tags[1].type == flv::tag_type_t::Video &&
+               tags[1].data[1] == 0x00);
+    TEST_CHECK(tags[2].frame_type == flv::video_data_frame_type::KEY_FRAME);
+    TEST_CHECK(tags[3].type == flv::tag_type_t::Audio &&
+               tags[3].data[1] == 0x00);
+    // The 2 slices of the second picture make one tag
+    TEST_CHECK(tags[6].length == 5 + 4 + 3 + 4 + 3);
+    for (size_t i = 0; i < tags.size(); i++) {
+      TEST_CHECK(tags[i].timestamp == timestamps[i]);
+      TEST_CHECK(tags[i].tag_size_check == flv::tag_size_check_t::Ok);
+    }
+  }
+  ::unlink(job.video.c_str());
+  ::unlink(job.audio.c_str());
+
+  // B-frames fail the job
+  std::vector<uint8_t> es = build_annexb_units();
+  static const uint8_t b_slice[] = {0, 0, 1, 0x41, 0x9c, 0x02};
+  es.insert(es.end(), b_slice, b_slice + sizeof(b_slice));
+  job.video = write_temp_file(es);
+  job.audio = "-";
+  result = mux::result_t();
+  bool thrown = false;
+  try {
+    mux::mux_job(job, options, result);
+  } catch (const std::runtime_error &) {
+    thrown = true;
+  }
+  TEST_CHECK(thrown);
+  ::unlink(job.video.c_str());
+
+  // Audio only, the frame after a frame of 2 blocks is 3 frames in
+  adts.clear();
+  push_adts_frame(adts, 4, 2, 20);
+  push_adts_frame(adts, 4, 2, 30);
+  adts[20 + 7 + 6] |= 0x01;
+  push_adts_frame(adts, 4, 2, 20);
+  job.video = "-";
+  job.audio = write_temp_file(adts);
+  result = mux::result_t();
+  mux::mux_job(job, options, result);
+  TEST_CHECK(result.frames == 2 && result.skipped_blocks == 2);
+  flv::flv_stream_reader audio_only(job.output.c_str());
+  std::vector<flv::flv_tag_view> audio_tags(audio_only.begin(),
+                                            audio_only.end());
+  TEST_CHECK(audio_tags.size() == 4);
+  if (audio_tags.size() == 4) {
+    TEST_CHECK(audio_tags[2].timestamp == 0 && audio_tags[3].timestamp == 69);
+  }
+  ::unlink(job.audio.c_str());
+  ::unlink(job.output.c_str());
+}
+#endif
+
+#if defined(__linux__)
+/// <summary>
+/// Writes a recording with frames of varying sizes, some larger than the
+/// buffers of the uring sink tests.
+/// </summary>
+static void build_recording(flv::flv_stream_builder &builder, uint32_t seed) {
+  builder.enable_keyframe_index(16);
+  builder.init_stream_header(true, true).append_meta_tag(create_sample_meta());
+  std::vector<uint8_t> video(12000);
+  uint8_t audio[] = {0xaf, 0x01, 0x21, 0x22, 0x23};
+  for (uint32_t i = 0; i < 60; i++) {
+    size_t length = 2 + (i * 7919 + seed * 104729) % 11000;
+    video[0] = (i % 10) ? 0x22 : 0x12;
+    std::fill(video.begin() + 1, video.begin() + length,
+              static_cast<uint8_t>(i + seed));
+    builder.append_video_tag(i * 40, video.data(),
+                             static_cast<uint32_t>(length));
+    builder.append_audio_tag(i * 40 + 5, audio, sizeof(audio));
+  }
+  builder.finalize();
+}
+
+/// <summary>
+/// Reads the whole content of a file.
+/// </summary>
+static std::vector<uint8_t> read_file(int fd) {
+  std::vector<uint8_t> content(static_cast<size_t>(::lseek(fd, 0, SEEK_END)));
+  TEST_CHECK(::pread(fd, content.data(), content.size(), 0) ==
+             (ssize_t)content.size());
+  return content;
+}
+
+static void test_uring_sink() {
+  for (int use_uring = 0; use_uring < 2; use_uring++) {
+    // 3 streams share 4 small buffers
+    flv::uring_ring ring(4, 4096, use_uring != 0);
+    if (!use_uring) {
+      TEST_CHECK(!ring.available());
+    }
+    FILE *files[3];
+    std::vector<std::vector<uint8_t>> expected(3);
+    for (int i = 0; i < 3; i++) {
+      files[i] = tmpfile();
+      flv::memory_sink msink(expected[i]);
+      flv::flv_stream_builder builder(msink);
+      build_recording(builder, i);
+    }
+    {
+      std::vector<std::thread> threads;
+      for (int i = 0; i < 3; i++) {
+        threads.push_back(std::thread([&, i]() {
+          flv::uring_sink sink(ring, fileno(files[i]));
+          flv::flv_stream_builder builder(sink);
+          build_recording(builder, i);
+        }));
+      }
+      for (auto &t : threads) {
+        t.join();
+      }
+    }
+    for (int i = 0; i < 3; i++) {
+      TEST_CHECK(read_file(fileno(files[i])) == expected[i]);
+      fclose(files[i]);
+    }
+    TEST_CHECK(ring.syscalls() > 0);
+  }
+
+  // Every sink holds a buffer, one more is needed to write
+  {
+    flv::uring_ring ring(2, 4096);
+    FILE *f = tmpfile();
+    flv::uring_sink first(ring, fileno(f));
+    bool thrown = false;
+    try {
+      flv::uring_sink second(ring, fileno(f));
+    } catch (const std::logic_error &) {
+      thrown = true;
+    }
+    TEST_CHECK(thrown);
+    fclose(f);
+  }
+
+  // O_DIRECT sinks may hold two buffers while keeping their last block
+  {
+    flv::uring_ring ring(4, 4096);
+    FILE *f = tmpfile();
+    flv::uring_sink first(ring, fileno(f), 0, true);
+    bool thrown = false;
+    try {
+      flv::uring_sink second(ring, fileno(f), 0, true);
+    } catch (const std::logic_error &) {
+      thrown = true;
+    }
+    TEST_CHECK(thrown);
+    fclose(f);
+  }
+  {
+    flv::uring_ring ring(5, 4096);
+    FILE *files[2] = {tmpfile(), tmpfile()};
+    std::vector<std::thread> threads;
+    for (int i = 0; i < 2; i++) {
+      threads.push_back(std::thread([&, i]() {
+        flv::uring_sink sink(ring, fileno(files[i]), 0, true);
+        flv::flv_stream_builder builder(sink);
+        build_recording(builder, i);
+        sink.finish();
+      }));
+    }
+    for (auto &t : threads) {
+      t.join();
+    }
+    for (int i = 0; i < 2; i++) {
+      std::vector<uint8_t> expected;
+      flv::memory_sink msink(expected);
+      flv::flv_stream_builder builder(msink);
+      build_recording(builder, i);
+      TEST_CHECK(read_file(fileno(files[i])) == expected);
+      fclose(files[i]);
+    }
+  }
+
+  // The kept last block of an idle O_DIRECT sink is written once
+  {
+    flv::uring_ring ring(4, 4096, false);
+    FILE *f = tmpfile();
+    flv::uring_sink sink(ring, fileno(f), 1, true);
+    flv::flv_stream_builder builder(sink);
+    builder.init_stream_header(true, true);
+    uint64_t syscalls = 0;
+    for (int i = 0; i < 200 && !syscalls; i++) {
+      std::this_thread::sleep_for(std::chrono::milliseconds(1));
+      ring.poll();
+      syscalls = ring.syscalls();
+    }
+    TEST_CHECK(syscalls == 1);
+    for (int i = 0; i < 5; i++) {
+      std::this_thread::sleep_for(std::chrono::milliseconds(2));
+      ring.poll();
+    }
+    TEST_CHECK(ring.syscalls() == syscalls);
+    sink.finish();
+    fclose(f);
+  }
+
+  // A partial buffer is submitted by poll() once the deadline expires
+  {
+    flv::uring_ring ring(4, 64 * 1024);
+    FILE *f = tmpfile();
+    FILE *g = tmpfile();
+    flv::uring_sink sink(ring, fileno(f), 1);
+    flv::uring_sink idle(ring, fileno(g), 0);
+    flv::flv_stream_builder builder(sink);
+    flv::flv_stream_builder idle_builder(idle);
+    builder.init_stream_header(true, true);
+    idle_builder.init_stream_header(true, true);
+    struct stat st;
+    bool written = false;
+    for (int i = 0; i < 200 && !written; i++) {
+      std::this_thread::sleep_for(std::chrono::milliseconds(1));
+      ring.poll();
+      written = ::fstat(fileno(f), &st) == 0 && st.st_size == 13;
+    }
+    TEST_CHECK(written);
+    TEST_CHECK(::fstat(fileno(g), &st) == 0 && st.st_size == 0);
+    idle.flush();
+    TEST_CHECK(::fstat(fileno(g), &st) == 0 && st.st_size == 13);
+    fclose(f);
+    fclose(g);
+  }
+
+  // O_DIRECT pads the writes to whole blocks, finish() cuts the padding
+  FILE *f = tmpfile();
+  int flags = ::fcntl(fileno(f), F_GETFL);
+  if (::fcntl(fileno(f), F_SETFL, flags | O_DIRECT) == 0) {
+    std::vector<uint8_t> expected;
+    {
+      flv::memory_sink msink(expected);
+      flv::flv_stream_builder builder(msink);
+      build_recording(builder, 7);
+    }
+    flv::uring_ring ring(4, 8192);
+    {
+      flv::uring_sink sink(ring, fileno(f), 0, true);
+      flv::flv_stream_builder builder(sink);
+      build_recording(builder, 7);
+      sink.finish();
+    }
+    ::fcntl(fileno(f), F_SETFL, flags);
+    TEST_CHECK(read_file(fileno(f)) == expected);
+  }
+  fclose(f);
+}
+#endif
+
+#if !defined(_WIN32)
+/// <summary>
+/// Reads the tags of the segments written by flv_segment_writer.
+/// </summary>
+static std::vector<std::vector<uint8_t>>
+read_segments(const std::vector<FILE *> &files) {
+  std::vector<std::vector<uint8_t>> segments;
+  for (FILE *f : files) {
+    fseek(f, 0, SEEK_END);
+    std::vector<uint8_t> content(static_cast<size_t>(ftell(f)));
+    rewind(f);
+    TEST_CHECK(fread(content.data(), 1, content.size(), f) == content.size());
+    segments.push_back(content);
+    fclose(f);
+  }
+  return segments;
+}
+
+static void test_segment_writer() {
+  std::vector<FILE *> files;
+  auto open_segment = [&](uint32_t index) {
+    TEST_CHECK(index == files.size());
+    files.push_back(tmpfile());
+    return ::dup(fileno(files.back()));
+  };
+
+  // 10 seconds of 25 fps video with a keyframe every second, split every 3
+  {
+    flv::flv_segment_writer writer(open_segment, 3000);
+    writer.set_meta(flv::amf::amf_array::create()
+                        ->with_item("duration", (double)0)
+                        ->with_item("filesize", (double)0));
+    uint8_t video_config[] = {0x17, 0x00, 0, 0, 0, 0x01, 0x64};
+    uint8_t audio_config[] = {0xaf, 0x00, 0x12, 0x10};
+    uint8_t key[] = {0x17, 0x01, 0, 0, 0, 0xaa};
+    uint8_t inter[] = {0x27, 0x01, 0, 0, 0, 0xbb};
+    uint8_t audio[] = {0xaf, 0x01, 0x21};
+    writer.append_video_tag(1000, video_config, sizeof(video_config));
+    writer.append_audio_tag(1000, audio_config, sizeof(audio_config));
+    for (uint32_t i = 0; i < 250; i++) {
+      uint32_t ts = 1000 + i * 40;
+      if (i % 25) {
+        writer.append_video_tag(ts, inter, sizeof(inter));
+      } else {
+        writer.append_video_tag(ts, key, sizeof(key));
+      }
+      writer.append_audio_tag(ts + 10, audio, sizeof(audio));
+    }
+    TEST_CHECK(writer.opened() == 4);
+    writer.close();
+    TEST_CHECK(writer.closed() == 4);
+  }
+
+  std::vector<std::vector<uint8_t>> segments = read_segments(files);
+  TEST_CHECK(segments.size() == 4);
+  const double durations[] = {2.97, 2.97, 2.97, 0.97};
+  for (size_t i = 0; i < segments.size(); i++) {
+    flv::flv_stream_reader reader(segments[i].data(), segments[i].size());
+    std::vector<flv::flv_tag_view> tags(reader.begin(), reader.end());
+    TEST_CHECK(tags.size() > 4);
+    TEST_CHECK(tags[0].type == flv::tag_type_t::Script);
+    TEST_CHECK(read_meta_number(tags[0], "duration") == durations[i]);
+    TEST_CHECK(read_meta_number(tags[0], "filesize") ==
+               (double)segments[i].size());
+
+    // The sequence headers, then a keyframe, all rebased to 0
+    TEST_CHECK(tags[1].type == flv::tag_type_t::Video);
+    TEST_CHECK(tags[1].data[0] == 0x17 && tags[1].data[1] == 0x00);
+    TEST_CHECK(tags[2].type == flv::tag_type_t::Audio);
+    TEST_CHECK(tags[2].data[0] == 0xaf && tags[2].data[1] == 0x00);
+    TEST_CHECK(tags[3].type == flv::tag_type_t::Video);
+    TEST_CHECK(tags[3].data[0] == 0x17 && tags[3].data[1] == 0x01);
+    TEST_CHECK(tags[1].timestamp == 0 && tags[3].timestamp == 0);
+    TEST_CHECK(tags[4].timestamp == 10);
+  }
+
+  // Split by size at frame keyframes, timestamps kept
+  files.clear();
+  {
+    flv::flv_segment_writer writer(open_segment, 0, 4096, false);
+    writer.set_meta(flv::amf::amf_array::create()
+                        ->with_item("duration", (double)0)
+                        ->with_item("videodatarate", (double)0));
+    std::vector<uint8_t> payload(500, 0x11);
+    flv::frame_desc config = flv::frame_desc();
+    config.track = flv::track_type_t::Video;
+    config.config = true;
+    config.data = payload.data();
+    config.length = 10;
+    writer.append_frame(config);
+    for (uint32_t i = 0; i < 40; i++) {
+      flv::frame_desc frame = flv::frame_desc();
+      frame.track = flv::track_type_t::Video;
+      frame.dts = i * 40;
+      frame.pts = frame.dts + 80;
+      frame.keyframe = i % 5 == 0;
+      frame.data = payload.data();
+      frame.length = static_cast<uint32_t>(payload.size());
+      writer.append_frame(frame);
+    }
+  }
+  segments = read_segments(files);
+  TEST_CHECK(segments.size() == 4);
+  uint32_t expected_ts = 0;
+  for (size_t i = 0; i < segments.size(); i++) {
+    flv::flv_stream_reader reader(segments[i].data(), segments[i].size());
+    std::vector<flv::flv_tag_view> tags(reader.begin(), reader.end());
+    TEST_CHECK(tags.size() > 3);
+    TEST_CHECK(tags[1].data[0] == 0x17 && tags[1].data[1] == 0x00);
+    TEST_CHECK(tags[1].length == 15);
+    TEST_CHECK(tags[2].data[0] == 0x17 && tags[2].timestamp == expected_ts);
+    TEST_CHECK(tags[2].data[4] == 80);
+
+    // The duration and rate of the segment, not since the recording start
+    double duration = (tags.back().timestamp - expected_ts) / 1000.0;
+    uint64_t bytes = 0;
+    for (size_t j = 1; j < tags.size(); j++) {
+      bytes += tags[j].length;
+    }
+    TEST_CHECK(read_meta_number(tags[0], "duration") == duration);
+    TEST_CHECK(read_meta_number(tags[0], "videodatarate") ==
+               bytes * 8 / 1000.0 / duration);
+    expected_ts = tags.back().timestamp + 40;
+  }
+  TEST_CHECK(expected_ts == 40 * 40);
+}
+#endif
+
+static void test_output_queue_drop_policy() {
+  // The sink blocks until released, the queue holds up to 8 tags
+  std::atomic<bool> entered(false);
+  std::atomic<bool> released(false);
+  std::vector<uint8_t> out;
+  flv::callback_sink sink([&](const flv::io_slice *slices, size_t count) {
+    entered = true;
+    while (!released.load()) {
+      std::this_thread::yield();
+    }
+    for (size_t i = 0; i < count; i++) {
+      out.insert(out.end(), slices[i].data, slices[i].data + slices[i].length);
+    }
+  });
+  flv::flv_output_queue queue(sink, 8);
+  flv::flv_stream_builder builder(queue);
+  builder.init_stream_header(true, true);
+  while (!entered.load()) {
+    std::this_thread::yield();
+  }
+
+  auto video = [&](uint8_t frame_type, uint8_t packet_type, uint8_t id) {
+    uint8_t body[] = {(uint8_t)(frame_type << 4 | 7), packet_type, 0, 0, 0,
+                      id};
+    builder.append_video_tag(id * 40, body, sizeof(body));
+  };
+  auto audio = [&](uint8_t packet_type, uint8_t id) {
+    uint8_t body[] = {0xaf, packet_type, id};
+    builder.append_audio_tag(id * 23, body, sizeof(body));
+  };
+  builder.append_meta_tag(create_sample_meta());
+  video(1, 0, 0);
+  audio(0, 0);
+  video(1, 1, 0);
+  audio(1, 0);
+  video(2, 1, 1);
+  audio(1, 1);
+  video(2, 1, 2);
+  TEST_CHECK(queue.stats().queued_tags == 8);
+  TEST_CHECK(queue.stats().dropped_frames == 0);
+
+  // Audio takes the place of the newest inter frame, the following inter
+  // frames are dropped until the next keyframe
+  audio(1, 2);
+  video(2, 1, 3);
+  audio(1, 3);
+  // No inter frame left to drop, the audio frame and the keyframe go
+  audio(1, 4);
+  video(1, 1, 5);
+  video(3, 1, 6);
+  flv::output_queue_stats stats = queue.stats();
+  TEST_CHECK(stats.queued_tags == 8);
+  TEST_CHECK(stats.dropped_frames == 6);
+  TEST_CHECK(stats.dropped_bytes == 5 * (11 + 6 + 4) + (11 + 3 + 4));
+
+  // Once drained, the next keyframe resumes the video
+  released = true;
+  while (queue.stats().queued_tags) {
+    std::this_thread::yield();
+  }
+  video(1, 1, 7);
+  video(2, 1, 8);
+  audio(1, 5);
+  queue.stop();
+  stats = queue.stats();
+  TEST_CHECK(stats.dropped_frames == 6);
+  TEST_CHECK(stats.written_tags == 12);
+  TEST_CHECK(stats.written_bytes == out.size());
+  TEST_CHECK(stats.peak_queued_bytes > 0 && stats.queued_bytes == 0);
+
+  // Header, meta, sequence headers, K0 A0 A1 A2 A3 K7 P8 A5
+  static const struct {
+    flv::tag_type_t type;
+    uint8_t id;
+  } expected[] = {
+      {flv::tag_type_t::Script, 0}, {flv::tag_type_t::Video, 0},
+      {flv::tag_type_t::Audio, 0},  {flv::tag_type_t::Video, 0},
+      {flv::tag_type_t::Audio, 0},  {flv::tag_type_t::Audio, 1},
+      {flv::tag_type_t::Audio, 2},  {flv::tag_type_t::Audio, 3},
+      {flv::tag_type_t::Video, 7},  {flv::tag_type_t::Video, 8},
+      {flv::tag_type_t::Audio, 5}};
+  flv::flv_stream_reader reader(out.data(), out.size());
+  TEST_CHECK(reader.valid());
+  size_t i = 0;
+  for (auto &tag : reader) {
+    TEST_CHECK(i < 11 && tag.type == expected[i].type);
+    TEST_CHECK(tag.tag_size_check == flv::tag_size_check_t::Ok);
+    if (i > 0 && i < 11) {
+      TEST_CHECK(tag.data[tag.length - 1] == expected[i].id);
+    }
+    i++;
+  }
+  TEST_CHECK(i == 11);
+
+  bool threw = false;
+  try {
+    audio(1, 6);
+  } catch (const std::logic_error &) {
+    threw = true;
+  }
+  TEST_CHECK(threw);
+}
+
+static void test_enhanced_video_tags() {
+  std::vector<uint8_t> out;
+  flv::memory_sink sink(out);
+  flv::flv_stream_builder builder(sink);
+  static const uint8_t hvcc[] = {1, 0x01, 0x60, 0, 0, 0};
+  static const uint8_t av1c[] = {0x81, 0x08, 0x0c, 0x00};
+  static const uint8_t nalus[] = {0, 0, 0, 2, 0x26, 0x01};
+  static const uint8_t obus[] = {0x12, 0x00, 0x32, 0x01, 0x10};
+  builder.enable_keyframe_index(8)
+      .init_stream_header(false, true)
+      .append_meta_tag(create_sample_meta())
+      .append_video_tag_with_hevc_decoder_config(0, hvcc, sizeof(hvcc))
+      .append_video_tag_with_hevc_nalu_data(0, nalus, sizeof(nalus), 0, true)
+      .append_video_tag_with_hevc_nalu_data(40, nalus, sizeof(nalus), 80)
+      .append_video_tag_with_sequence_end(80, flv::video_fourcc_t::HEVC)
+      .append_video_tag_with_av1_codec_config(1000, av1c, sizeof(av1c))
+      .append_video_tag_with_av1_obu_data(1000, obus, sizeof(obus), true)
+      .append_video_tag_with_av1_obu_data(1040, obus, sizeof(obus));
+  TEST_CHECK(builder.finalize());
+
+  static const struct {
+    uint8_t first;
+    flv::video_fourcc_t fourcc;
+    flv::ex_video_packet_type packet_type;
+    flv::tag_class_t cls;
+    uint32_t header_size;
+    int32_t composition_time;
+  } expected[] = {
+      {0x90, flv::video_fourcc_t::HEVC,
+       flv::ex_video_packet_type::SequenceStart, flv::tag_class_t::VideoConfig,
+       5, 0},
+      {0x93, flv::video_fourcc_t::HEVC,
+       flv::ex_video_packet_type::CodedFramesX,
+       flv::tag_class_t::VideoKeyframe, 5, 0},
+      {0xa1, flv::video_fourcc_t::HEVC, flv::ex_video_packet_type::CodedFrames,
+       flv::tag_class_t::Video, 8, 80},
+      {0x92, flv::video_fourcc_t::HEVC, flv::ex_video_packet_type::SequenceEnd,
+       flv::tag_class_t::Other, 5, 0},
+      {0x90, flv::video_fourcc_t::AV1, flv::ex_video_packet_type::SequenceStart,
+       flv::tag_class_t::VideoConfig, 5, 0},
+      {0x91, flv::video_fourcc_t::AV1, flv::ex_video_packet_type::CodedFrames,
+       flv::tag_class_t::VideoKeyframe, 5, 0},
+      {0xa1, flv::video_fourcc_t::AV1, flv::ex_video_packet_type::CodedFrames,
+       flv::tag_class_t::Video, 5, 0}};
+  static const uint32_t payloads[] = {sizeof(hvcc), sizeof(nalus),
+                                      sizeof(nalus), 0,
+                                      sizeof(av1c), sizeof(obus),
+                                      sizeof(obus)};
+
+  flv::flv_stream_reader reader(out.data(), out.size());
+  TEST_CHECK(reader.valid());
+  size_t i = 0;
+  for (auto &tag : reader) {
+    TEST_CHECK(tag.tag_size_check == flv::tag_size_check_t::Ok);
+    if (tag.type != flv::tag_type_t::Video) {
+      continue;
+    }
+    TEST_CHECK(i < 7);
+    if (i >= 7) {
+      break;
+    }
+    TEST_CHECK(tag.data[0] == expected[i].first);
+    TEST_CHECK(tag.ex_header);
+    TEST_CHECK(tag.fourcc == expected[i].fourcc);
+    TEST_CHECK(tag.ex_packet_type == expected[i].packet_type);
+    TEST_CHECK(tag.composition_time == expected[i].composition_time);
+    TEST_CHECK(tag.length == expected[i].header_size + payloads[i]);
+    TEST_CHECK(tag.payload_length == payloads[i]);
+    TEST_CHECK(flv::classify_tag(out.data() + tag.offset,
+                                 flv::FLV_TAG_HEADER_SIZE + tag.length) ==
+               expected[i].cls);
+    i++;
+  }
+  TEST_CHECK(i == 7);
+
+  // Only the coded keyframes are indexed
+  std::vector<double> times;
+  std::vector<double> positions;
+  TEST_CHECK(read_keyframe_index(reader, times, positions));
+  TEST_CHECK(times.size() == 2 && times[0] == 0.0 && times[1] == 1.0);
+
+  // Legacy headers: an AVC end of sequence is no keyframe, even flagged so
+  static const uint8_t avc_key[] = {0x17, 0x01};
+  static const uint8_t avc_config[] = {0x17, 0x00};
+  static const uint8_t avc_end[] = {0x17, 0x02};
+  static const uint8_t vp6_key[] = {0x14};
+  TEST_CHECK(flv::classify_video_data(avc_key, 2) ==
+             flv::tag_class_t::VideoKeyframe);
+  TEST_CHECK(flv::classify_video_data(avc_config, 2) ==
+             flv::tag_class_t::VideoConfig);
+  TEST_CHECK(flv::classify_video_data(avc_end, 2) == flv::tag_class_t::Other);
+  TEST_CHECK(flv::classify_video_data(avc_key, 1) == flv::tag_class_t::Other);
+  TEST_CHECK(flv::classify_video_data(vp6_key, 1) ==
+             flv::tag_class_t::VideoKeyframe);
+}
+
+#if defined(__linux__)
+static int http_connect(uint16_t port, const char *path) {
+  int fd = ::socket(AF_INET, SOCK_STREAM, 0);
+  timeval tv = {5, 0};
+  ::setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+  sockaddr_in addr;
+  memset(&addr, 0, sizeof(addr));
+  addr.sin_family = AF_INET;
+  addr.sin_port = htons(port);
+  addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+  TEST_CHECK(::connect(fd, (sockaddr *)&addr, sizeof(addr)) == 0);
+  std::string request = std::string("GET ") + path +
+                        " HTTP/1.1\r\nHost: localhost\r\n\r\n";
+  TEST_CHECK(::send(fd, request.data(), request.size(), 0) ==
+             (ssize_t)request.size());
+  return fd;
+}
+
+// Reads the response until the count of chunks is received, the chunk
+// payloads are appended to the body
+static void http_read_chunks(int fd, std::string &head, std::string &raw,
+                             std::vector<uint8_t> &body, size_t &chunks,
+                             size_t count) {
+  while (true) {
+    size_t end = raw.find("\r\n\r\n");
+    if (head.empty() && end != std::string::npos) {
+      head = raw.substr(0, end + 4);
+      raw.erase(0, end + 4);
+    }
+    while (!head.empty()) {
+      size_t line = raw.find("\r\n");
+      if (line == std::string::npos) {
+        break;
+      }
+      size_t size = strtoul(raw.c_str(), nullptr, 16);
+      if (raw.size() < line + 2 + size + 2) {
+        break;
+      }
+      body.insert(body.end(), raw.begin() + line + 2,
+                  raw.begin() + line + 2 + size);
+      TEST_CHECK(raw.compare(line + 2 + size, 2, "\r\n") == 0);
+      raw.erase(0, line + 2 + size + 2);
+      chunks++;
+    }
+    if (chunks >= count && !head.empty()) {
+      return;
+    }
+    char buf[4096];
+    ssize_t r = ::recv(fd, buf, sizeof(buf), 0);
+    if (r <= 0) {
+      return;
+    }
+    raw.append(buf, r);
+  }
+}
+
+static void test_http_flv_server() {
+  flv::flv_live_stream live;
+  flv::http_flv_server server(2);
+  server.add_stream("/live.flv", live);
+  uint16_t port = server.start(0, "127.0.0.1");
+  TEST_CHECK(port != 0);
+
+  static const uint8_t avcc[] = {1, 0x64, 0, 0x1f, 0xff, 0xe0, 0};
+  flv::flv_stream_builder &builder = live.builder();
+  builder.init_stream_header(true, true)
+      .append_meta_tag(create_sample_meta())
+      .append_video_tag_with_avc_decoder_config(0, avcc, sizeof(avcc));
+  append_live_gop(builder, 0);
+
+  // A client joining gets the header, the prelude and the current GOP
+  int fd = http_connect(port, "/live.flv?token=1");
+  std::string head;
+  std::string raw;
+  std::vector<uint8_t> body;
+  size_t chunks = 0;
+  http_read_chunks(fd, head, raw, body, chunks, 6);
+  TEST_CHECK(head.compare(0, 15, "HTTP/1.1 200 OK") == 0);
+  TEST_CHECK(head.find("Transfer-Encoding: chunked\r\n") != std::string::npos);
+  TEST_CHECK(chunks == 6);
+
+  // Then every tag the producer appends, one chunk each
+  for (uint32_t i = 1; i <= 20; i++) {
+    append_live_gop(builder, i * 1000);
+    http_read_chunks(fd, head, raw, body, chunks, 6 + i * 3);
+  }
+  TEST_CHECK(chunks == 6 + 60);
+  flv::flv_stream_reader reader(body.data(), body.size());
+  TEST_CHECK(reader.valid());
+  size_t tags = 0;
+  uint32_t last_video = 0;
+  for (auto &tag : reader) {
+    TEST_CHECK(tag.tag_size_check == flv::tag_size_check_t::Ok);
+    if (tag.type == flv::tag_type_t::Video) {
+      TEST_CHECK(tag.timestamp >= last_video);
+      last_video = tag.timestamp;
+    }
+    tags++;
+  }
+  TEST_CHECK(tags == 5 + 60);
+  TEST_CHECK(last_video == 20 * 1000 + 40);
+
+  // Unknown paths and methods are rejected
+  int missing = http_connect(port, "/other.flv");
+  std::string missing_head;
+  std::string missing_raw;
+  std::vector<uint8_t> missing_body;
+  size_t missing_chunks = 0;
+  http_read_chunks(missing, missing_head, missing_raw, missing_body,
+                   missing_chunks, 1);
+  TEST_CHECK(missing_head.compare(0, 22, "HTTP/1.1 404 Not Found") == 0);
+  TEST_CHECK(missing_chunks == 0);
+  ::close(missing);
+
+  flv::http_server_stats stats = server.stats();
+  TEST_CHECK(stats.accepted == 2);
+  TEST_CHECK(stats.rejected == 1);
+  TEST_CHECK(stats.connections == 1);
+  TEST_CHECK(stats.tags_sent == 6 + 60);
+  TEST_CHECK(stats.skipped_tags == 0);
+
+  // Clients resetting while the stream is pumped to them, so that one batch
+  // of events can close a connection twice
+  for (int round = 0; round < 10; round++) {
+    std::vector<int> clients;
+    for (int i = 0; i < 8; i++) {
+      clients.push_back(http_connect(port, "/live.flv"));
+    }
+    for (int client : clients) {
+      std::string h, r;
+      std::vector<uint8_t> b;
+      size_t n = 0;
+      http_read_chunks(client, h, r, b, n, 1);
+    }
+    for (int client : clients) {
+      linger lg = {1, 0};
+      ::setsockopt(client, SOL_SOCKET, SO_LINGER, &lg, sizeof(lg));
+      ::close(client);
+      append_live_gop(builder, 21000 + round * 100);
+    }
+  }
+  bool drained = false;
+  for (int i = 0; i < 200 && !drained; i++) {
+    drained = server.stats().connections == 1;
+    std::this_thread::sleep_for(std::chrono::milliseconds(5));
+  }
+  TEST_CHECK(drained);
+  ::close(fd);
+  server.stop();
+
+  // The stream outlives the server
+  append_live_gop(builder, 30000);
+}
+#endif
+
+/// <summary>
+/// Represents a message received from an RTMP chunk stream.
+/// </summary>
+struct rtmp_message {
+  uint8_t csid;
+  uint8_t type;
+  uint32_t stream_id;
+  uint32_t timestamp;
+  std::vector<uint8_t> payload;
+};
+
+/// <summary>
+/// Represents the receiving side of an RTMP chunk stream, the way a server
+/// reassembles the messages of a publishing client.
+/// </summary>
+class rtmp_receiver {
+public:
+  rtmp_receiver() : chunk_size_(flv::RTMP_DEFAULT_CHUNK_SIZE), chunks_(0),
+                    extended_(0) {
+    memset(formats_, 0, sizeof(formats_));
+  }
+
+  // Parses the whole chunk stream, false if it is malformed
+  bool parse(const std::vector<uint8_t> &in) {
+    size_t pos = 0;
+    while (pos < in.size()) {
+      uint8_t fmt = in[pos] >> 6;
+      uint8_t csid = in[pos++] & 0x3f;
+      if (csid < 2) {
+        return false;
+      }
+      stream_t &s = streams_[csid];
+      static const size_t sizes[] = {11, 7, 3, 0};
+      if (in.size() - pos < sizes[fmt] || (fmt == 3 && !s.active)) {
+        return false;
+      }
+      const uint8_t *h = in.data() + pos;
+      pos += sizes[fmt];
+      uint32_t field = s.field;
+      if (fmt < 3) {
+        field = (uint32_t)h[0] << 16 | (uint32_t)h[1] << 8 | h[2];
+        s.extended = field == flv::RTMP_EXTENDED_TIMESTAMP;
+      }
+      if (fmt < 2) {
+        s.length = (uint32_t)h[3] << 16 | (uint32_t)h[4] << 8 | h[5];
+        s.type = h[6];
+      }
+      if (fmt == 0) {
+        s.stream_id = (uint32_t)h[10] << 24 | (uint32_t)h[9] << 16 |
+                      (uint32_t)h[8] << 8 | h[7];
+      }
+      if (s.extended) {
+        if (in.size() - pos < 4) {
+          return false;
+        }
+        uint32_t value = read_be32(in.data() + pos);
+        pos += 4;
+        if (fmt == 3 && value != s.field) {
+          return false;
+        }
+        field = value;
+        extended_++;
+      }
+      s.field = field;
+
+      // A header other than type 3 always starts a message
+      if (fmt < 3 || !s.receiving) {
+        if (s.receiving) {
+          return false;
+        }
+        if (fmt == 0) {
+          s.timestamp = field;
+        } else {
+          s.delta = fmt < 3 ? field : s.delta;
+          s.timestamp += s.delta;
+        }
+        s.active = true;
+        s.receiving = true;
+        s.payload.clear();
+        formats_[fmt]++;
+      }
+      size_t m = std::min<size_t>(chunk_size_, s.length - s.payload.size());
+      if (in.size() - pos < m) {
+        return false;
+      }
+      s.payload.insert(s.payload.end(), in.begin() + pos, in.begin() + pos + m);
+      pos += m;
+      chunks_++;
+      if (s.payload.size() == s.length) {
+        s.receiving = false;
+        rtmp_message msg = {csid, s.type, s.stream_id, s.timestamp, s.payload};
+        if (msg.type == 1) {
+          chunk_size_ = read_be32(msg.payload.data());
+        }
+        messages_.push_back(std::move(msg));
+      }
+    }
+    return true;
+  }
+
+  const std::vector<rtmp_message> &messages() const { return messages_; }
+  uint32_t chunk_size() const { return chunk_size_; }
+  size_t chunks() const { return chunks_; }
+  size_t extended() const { return extended_; }
+  size_t format(uint8_t fmt) const { return formats_[fmt]; }
+
+private:
+  struct stream_t {
+    stream_t()
+        : active(false), receiving(false), extended(false), type(0),
+          stream_id(0), timestamp(0), delta(0), field(0), length(0) {}
+    bool active;
+    bool receiving;
+    bool extended;
+    uint8_t type;
+    uint32_t stream_id;
+    uint32_t timestamp;
+    uint32_t delta;
+    uint32_t field;
+    uint32_t length;
+    std::vector<uint8_t> payload;
+  };
+
+  std::map<uint8_t, stream_t> streams_;
+  std::vector<rtmp_message> messages_;
+  uint32_t chunk_size_;
+  size_t chunks_;
+  size_t extended_;
+  size_t formats_[4];
+};
+
+// Builds an A/V stream with wrapping and rewinding timestamps
+static void build_rtmp_sequence(flv::flv_stream_builder &builder,
+                                flv::rtmp_chunk_sink *rtmp) {
+  static const uint8_t avcc[] = {1, 0x64, 0, 0x1f, 0xff, 0xe0, 0};
+  static const uint8_t asc[] = {0x12, 0x10};
+  static std::vector<uint8_t> video(3000, 0x65);
+  static std::vector<uint8_t> aac(372, 0x21);
+  const flv::audio_data_sound_rate_t rate =
+      flv::audio_data_sound_rate_t::R44KHZ;
+  const flv::audio_data_sound_size_t size =
+      flv::audio_data_sound_size_t::S16BIT;
+  const flv::audio_data_sound_type_t stereo =
+      flv::audio_data_sound_type_t::STEREO;
+  builder.init_stream_header(true, true)
+      .append_meta_tag(create_sample_meta())
+      .append_video_tag_with_avc_decoder_config(0, avcc, sizeof(avcc))
+      .append_audio_tag_with_aac_specific_config(0, rate, size, stereo, asc,
+                                                 sizeof(asc));
+  for (uint32_t i = 0; i < 24; i++) {
+    if (rtmp && i == 12) {
+      rtmp->set_chunk_size(1000);
+    }
+    // 23.2 ms frames: the delta is 23 or 24, repeated deltas go type 3
+    builder.append_audio_tag_with_aac_frame_data(i * 1024 * 1000 / 44100, rate,
+                                                 size, stereo, aac.data(), 372);
+    if (i % 2 == 0) {
+      uint32_t length = i % 8 == 0 ? 3000 : 300 + i;
+      builder.append_video_tag_with_avc_nalu_data(i * 20, video.data(), length,
+                                                  0, i % 8 == 0);
+    }
+  }
+
+  // Timestamps beyond the 24 bit field, then going backwards
+  static const uint32_t timestamps[] = {0x1000000 + 440, 0x2000000 + 440,
+                                        0x1800000, 100, 140};
+  for (uint32_t ts : timestamps) {
+    builder.append_video_tag_with_avc_nalu_data(ts, video.data(), 400);
+  }
+
+  // Whole tags batched in one write
+  flv::frame_desc frames[2] = {};
+  frames[0].track = flv::track_type_t::Audio;
+  frames[0].dts = frames[0].pts = 180;
+  frames[0].data = aac.data();
+  frames[0].length = 372;
+  frames[1].track = flv::track_type_t::Video;
+  frames[1].dts = frames[1].pts = 180;
+  frames[1].keyframe = true;
+  frames[1].data = video.data();
+  frames[1].length = 3000;
+  builder.append_frames(frames, 2);
+}
+
+static void test_rtmp_chunk_sink() {
+  std::vector<uint8_t> flv_out;
+  flv::memory_sink flv_sink(flv_out);
+  flv::flv_stream_builder reference(flv_sink);
+  build_rtmp_sequence(reference, nullptr);
+  flv::flv_stream_reader reader(flv_out.data(), flv_out.size());
+  TEST_CHECK(reader.valid());
+
+  static const uint32_t chunk_sizes[] = {128, 60, 4096};
+  for (uint32_t chunk_size : chunk_sizes) {
+    std::vector<uint8_t> wire;
+    flv::memory_sink wire_sink(wire);
+    flv::rtmp_chunk_sink rtmp(wire_sink, chunk_size, 1);
+    flv::flv_stream_builder builder(rtmp);
+    build_rtmp_sequence(builder, &rtmp);
+    TEST_CHECK(rtmp.chunk_size() == 1000);
+
+    rtmp_receiver receiver;
+    TEST_CHECK(receiver.parse(wire));
+    TEST_CHECK(receiver.chunk_size() == 1000);
+    TEST_CHECK(receiver.chunks() == rtmp.chunks());
+    TEST_CHECK(receiver.messages().size() == rtmp.messages());
+
+    // Every tag is a message of the same type, timestamp and body
+    size_t i = 0;
+    size_t set_chunk_size = 0;
+    const std::vector<rtmp_message> &messages = receiver.messages();
+    for (auto &tag : reader) {
+      while (i < messages.size() && messages[i].type == 1) {
+        TEST_CHECK(messages[i].csid == flv::rtmp_chunk_sink::CSID_CONTROL);
+        TEST_CHECK(messages[i].stream_id == 0);
+        set_chunk_size++;
+        i++;
+      }
+      TEST_CHECK(i < messages.size());
+      if (i >= messages.size()) {
+        break;
+      }
+      const rtmp_message &msg = messages[i++];
+      TEST_CHECK(msg.type == static_cast<uint8_t>(tag.type));
+      TEST_CHECK(msg.timestamp == tag.timestamp);
+      TEST_CHECK(msg.stream_id == 1);
+      std::vector<uint8_t> body(flv_out.data() + tag.offset +
+                                    flv::FLV_TAG_HEADER_SIZE,
+                                flv_out.data() + tag.offset +
+                                    flv::FLV_TAG_HEADER_SIZE + tag.length);
+      if (tag.type == flv::tag_type_t::Script) {
+        body.insert(body.begin(), flv::RTMP_SET_DATA_FRAME,
+                    flv::RTMP_SET_DATA_FRAME +
+                        sizeof(flv::RTMP_SET_DATA_FRAME));
+      }
+      TEST_CHECK(msg.payload == body);
+    }
+    TEST_CHECK(i == messages.size());
+    TEST_CHECK(set_chunk_size == (chunk_size == 128 ? 1u : 2u));
+
+    // Every header type shows up, the extended timestamp too
+    for (uint8_t fmt = 0; fmt < 4; fmt++) {
+      TEST_CHECK(receiver.format(fmt) > 0);
+    }
+    TEST_CHECK(receiver.extended() >= 3);
+  }
+
+  // The payload is passed through, only the chunk headers are produced
+  std::vector<uint8_t> frame(64 * 1024, 0xab);
+  copy_counting_sink counting(frame.data(), frame.size());
+  flv::rtmp_chunk_sink rtmp(counting, 4096);
+  flv::flv_stream_builder builder(rtmp);
+  uint32_t length = static_cast<uint32_t>(frame.size());
+  builder.append_video_tag_with_avc_nalu_data(0, frame.data(), length);
+  uint64_t before = allocations;
+  builder.append_video_tag_with_avc_nalu_data(40, frame.data(), length);
+  TEST_CHECK(allocations == before);
+  TEST_CHECK(counting.writes() == 2);
+  TEST_CHECK(counting.passed() == 2ull * length);
+  size_t chunks = (length + 5 + 4095) / 4096;
+  TEST_CHECK(rtmp.chunks() == 1 + 2 * chunks);
+  TEST_CHECK(counting.copied() ==
+             (12 + 4) + (12 + 5 + chunks - 1) + (4 + 5 + chunks - 1));
+
+  // Tags are expected whole
+  static const uint8_t partial[] = {9, 0, 0, 10, 0};
+  flv::io_slice slice = {partial, sizeof(partial)};
+  bool thrown = false;
+  try {
+    rtmp.write(&slice, 1);
+  } catch (const std::logic_error &) {
+    thrown = true;
+  }
+  TEST_CHECK(thrown);
+}
+
+static void test_amf_value_types() {
+  // Strings switch to Long String where the 16-bit length ends
+  std::string big(70000, 'x');
+  auto short_string = flv::amf::amf_string::create(std::string(0xfffe, 'y'));
+  auto long_string = flv::amf::amf_string::create(big.c_str());
+  TEST_CHECK(short_string->value_type() == flv::amf::StringType);
+  TEST_CHECK(short_string->serialized_size() == 1 + 2 + 0xfffe);
+  TEST_CHECK(long_string->value_type() == flv::amf::LongStringType);
+  TEST_CHECK(long_string->serialized_size() == 1 + 4 + big.size());
+
+  auto array = flv::amf::amf_strict_array::create()
+                   ->with_item(1.5)
+                   ->with_item(true)
+                   ->with_item("s")
+                   ->with_item(flv::amf::amf_null::create())
+                   ->with_item(flv::amf::amf_date::create(1374389534720.0, -60))
+                   ->with_item(long_string);
+  std::vector<uint8_t> buf;
+  array->serialize(buf);
+  TEST_CHECK(buf.size() == array->serialized_size());
+  static const uint8_t head[] = {
+      0x0a, 0x00, 0x00, 0x00, 0x06,                   // Strict Array [6]
+      0x00, 0x3f, 0xf8, 0x00, 0x00, 0x00, 0x00, 0x00, // 1.5
+      0x00, 0x01, 0x01,                               // true
+      0x02, 0x00, 0x01, 's',                          // "s"
+      0x05,                                           // Null
+      0x0b, 0x42, 0x74, 0x00, 0x00, 0x00, 0x00, 0x00, // Date
+      0x00, 0xff, 0xc4,                               // time zone -60
+      0x0c, 0x00, 0x01, 0x11, 0x70, 'x',              // Long String
+  };
+  TEST_CHECK(buf.size() > sizeof(head) &&
+             memcmp(buf.data(), head, sizeof(head)) == 0);
+
+  // Mixed items come back as a Strict Array of values
+  flv::amf::amf_reader reader(buf.data(), buf.size());
+  flv::amf::amf_item item;
+  TEST_CHECK(reader.next(item) == flv::amf::amf_read_result::Ok);
+  auto value = flv::amf::create_value(reader, item);
+  auto strict = std::dynamic_pointer_cast<flv::amf::amf_strict_array>(value);
+  TEST_CHECK(strict && strict->items().size() == 6);
+  if (strict && strict->items().size() == 6) {
+    auto &items = strict->items();
+    TEST_CHECK(items[3]->value_type() == flv::amf::NullType);
+    auto date = std::dynamic_pointer_cast<flv::amf::amf_date>(items[4]);
+    TEST_CHECK(date && date->value() == 1374389534720.0 &&
+               date->time_zone() == -60);
+    auto text = std::dynamic_pointer_cast<flv::amf::amf_string>(items[5]);
+    TEST_CHECK(text && text->value() == big &&
+               text->value_type() == flv::amf::LongStringType);
+    std::vector<uint8_t> again;
+    strict->serialize(again);
+    TEST_CHECK(again == buf);
+  }
+  TEST_CHECK(reader.next(item) == flv::amf::amf_read_result::End);
+
+  // Long strings as properties
+  std::vector<uint8_t> meta;
+  flv::amf::amf_object::create()->with_property("long", big.c_str())->serialize(
+      meta);
+  auto object = flv::amf::amf_object::create();
+  TEST_CHECK(object->deserialize(meta));
+  TEST_CHECK(object->serialized_size() == meta.size());
+}
+
+static void test_amf_number_array() {
+#if defined(__SSSE3__) && !defined(FLV_NO_SIMD)
+  // The SSSE3 build runs the shuffles
+  TEST_CHECK(FLV_HAS_SSSE3);
+#endif
+  std::vector<double> values;
+  for (int i = 0; i < 1000; i++) {
+    values.push_back(i * 1.25 - 300 + 1.0 / (i + 1));
+  }
+
+  // Every length across the 16-value blocks matches the generic encoding
+  for (size_t count = 0; count <= 40; count++) {
+    auto numbers = flv::amf::amf_number_array::create(values.data(), count);
+    auto generic = flv::amf::amf_strict_array::create();
+    for (size_t i = 0; i < count; i++) {
+      generic->with_item(values[i]);
+    }
+    std::vector<uint8_t> expected;
+    std::vector<uint8_t> buf;
+    generic->serialize(expected);
+    numbers->serialize(buf);
+    TEST_CHECK(numbers->serialized_size() == expected.size());
+    TEST_CHECK(buf == expected);
+  }
+
+  // Unaligned destination and source
+  std::vector<uint8_t> out(1 + 9 * 999 + 1, 0xee);
+  uint8_t *end =
+      flv::amf::store_numbers(out.data() + 1, values.data() + 1, 999);
+  TEST_CHECK(end == out.data() + out.size() - 1 && out.back() == 0xee);
+  flv::amf::amf_reader reader(out.data() + 1, 9 * 999);
+  flv::amf::amf_item item;
+  size_t n = 0;
+  while (reader.next(item) == flv::amf::amf_read_result::Ok) {
+    TEST_CHECK(item.type == flv::amf::NumberType &&
+               item.number == values[1 + n]);
+    n++;
+  }
+  TEST_CHECK(n == 999);
+
+  // The keyframe index of a finalized file comes back as number arrays
+  std::vector<uint8_t> file;
+  flv::memory_sink sink(file);
+  flv::flv_stream_builder builder(sink);
+  uint8_t key[] = {0x17, 0x01, 0, 0, 0, 0xaa};
+  builder.enable_keyframe_index(64)
+      .init_stream_header(false, true)
+      .append_meta_tag(create_sample_meta());
+  for (uint32_t i = 0; i < 40; i++) {
+    builder.append_video_tag(i * 2000, key, sizeof(key));
+  }
+  TEST_CHECK(builder.finalize());
+  flv::flv_stream_reader tags(file.data(), file.size());
+  std::vector<double> times;
+  std::vector<double> positions;
+  TEST_CHECK(read_keyframe_index(tags, times, positions));
+  auto it = tags.begin();
+  flv::amf::amf_reader meta_reader(it->data, it->length);
+  TEST_CHECK(meta_reader.next(item) == flv::amf::amf_read_result::Ok);
+  TEST_CHECK(meta_reader.next(item) == flv::amf::amf_read_result::Ok);
+  auto meta = std::dynamic_pointer_cast<flv::amf::amf_array>(
+      flv::amf::create_value(meta_reader, item));
+  TEST_CHECK(meta && meta->items().count("keyframes"));
+  if (meta && meta->items().count("keyframes")) {
+    auto keyframes = std::dynamic_pointer_cast<flv::amf::amf_object>(
+        meta->items().at("keyframes"));
+    TEST_CHECK(keyframes && keyframes->properties().count("times"));
+    if (keyframes && keyframes->properties().count("times")) {
+      auto &props = keyframes->properties();
+      auto t = std::dynamic_pointer_cast<flv::amf::amf_number_array>(
+          props.at("times"));
+      auto p = std::dynamic_pointer_cast<flv::amf::amf_number_array>(
+          props.at("filepositions"));
+      TEST_CHECK(t && t->values() == times);
+      TEST_CHECK(p && p->values() == positions);
+    }
+  }
+}
+} // namespace test
+
+int main() {
+
+  test::AVFrameSource source;
+
+  // generate flv file stream
+  test::generate_flv_file(source);
+
+  test::test_sinks_produce_identical_output();
+  test::test_tag_is_one_gather_write();
+  test::test_codec_tags_are_zero_copy();
+  test::test_aac_header_flags();
+  test::test_start_code_scanners_agree();
+  test::test_annexb_in_place_conversion();
+  test::test_avc_decoder_config_from_sps_pps();
+  test::test_annexb_ingest();
+  test::test_amf_round_trip();
+  test::test_amf_reader_all_types();
+  test::test_amf_reader_incremental();
+  test::test_stream_reader();
+  test::test_stream_reader_mapped_file();
+  test::test_keyframe_index();
+  test::test_keyframe_index_thinning();
+  test::test_finalize_patches_meta();
+  test::test_keyframe_index_limits();
+  test::test_live_stream_join();
+  test::test_live_stream_slow_subscriber();
+  test::test_live_stream_audio_only();
+  test::test_live_stream_evicted_keyframe();
+  test::test_async_writer_multi_producer();
+  test::test_async_writer_full_policies();
+  test::test_interleaver_orders_tracks();
+  test::test_interleaver_late_and_dropped();
+  test::test_append_frames_batch();
+  test::test_avc_nalu_data_flags();
+  test::test_amf_tree();
+  test::test_meta_template();
+  test::test_big_endian_stores();
+  test::test_amf_serialized_size();
+  test::test_builder_stats();
+  test::test_adts_ingest();
+#if !defined(_WIN32)
+  test::test_mux_access_units();
+  test::test_mux_job();
+#endif
+#if defined(__linux__)
+  test::test_uring_sink();
+#endif
+#if !defined(_WIN32)
+  test::test_segment_writer();
+#endif
+  test::test_output_queue_drop_policy();
+  test::test_enhanced_video_tags();
+#if defined(__linux__)
+  test::test_http_flv_server();
+#endif
+  test::test_rtmp_chunk_sink();
+  test::test_amf_value_types();
+  test::test_amf_number_array();
+
+  if (test::failures) {
+    std::cerr << test::failures << " check(s) failed" << std::endl;
+    return 1;
+  }
+  return 0;
+}
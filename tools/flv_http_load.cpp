@@ -0,0 +1,253 @@
+/*
+ * flv-http-load: loopback load test of the HTTP-FLV server. A synthetic live
+ * stream is served to many HTTP clients on 127.0.0.1, and the egress and the
+ * CPU time of the server event loops are reported.
+ *
+ * Usage: flv-http-load [-c connections] [-j loops] [-t seconds] [-b mbps]
+ *                      [-f fps] [-w client_threads]
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/resource.h>
+
+#include <iostream>
+
+#include <flv_http_server.hpp>
+
+namespace load {
+typedef std::chrono::steady_clock steady_clock;
+
+// Represents the options of the tool.
+struct options_t {
+  size_t connections;
+  size_t loops;
+  double seconds;
+  double mbps;
+  double fps;
+  size_t client_threads;
+};
+
+// Publishes a synthetic 2 second GOP H.264 + AAC stream at the bit rate.
+static void produce(flv::flv_live_stream &live, const options_t &options,
+                    const std::atomic<bool> &stopping) {
+  static const uint8_t avcc[] = {1, 0x64, 0, 0x28, 0xff, 0xe1, 0, 4,
+                                 0x67, 0x64, 0, 0x28, 1, 0, 4, 0x68,
+                                 0xee, 0x3c, 0x80};
+  static const uint8_t asc[] = {0x12, 0x10};
+  flv::flv_stream_builder &builder = live.builder();
+  builder.init_stream_header(true, true)
+      .append_video_tag_with_avc_decoder_config(0, avcc, sizeof(avcc))
+      .append_audio_tag_with_aac_specific_config(
+          0, flv::audio_data_sound_rate_t::R44KHZ,
+          flv::audio_data_sound_size_t::S16BIT,
+          flv::audio_data_sound_type_t::STEREO, asc, sizeof(asc));
+
+  // Keyframes are 8 times larger than the other frames of the GOP
+  size_t gop = static_cast<size_t>(options.fps * 2);
+  double gop_bytes = options.mbps * 1000000 / 8 * 2;
+  size_t p_size = static_cast<size_t>(gop_bytes / (gop + 7));
+  std::vector<uint8_t> key(p_size * 8, 0x65);
+  std::vector<uint8_t> inter(p_size, 0x41);
+  std::vector<uint8_t> aac(372, 0x21);
+  flv::store_be32(key.data(), static_cast<uint32_t>(key.size() - 4));
+  flv::store_be32(inter.data(), static_cast<uint32_t>(inter.size() - 4));
+
+  auto start = steady_clock::now();
+  uint64_t samples = 0;
+  for (uint64_t i = 0; !stopping.load(std::memory_order_relaxed); i++) {
+    uint32_t ts = static_cast<uint32_t>(i * 1000 / options.fps);
+    while (samples * 1000 / 44100 <= ts) {
+      builder.append_audio_tag_with_aac_frame_data(
+          static_cast<uint32_t>(samples * 1000 / 44100),
+          flv::audio_data_sound_rate_t::R44KHZ,
+          flv::audio_data_sound_size_t::S16BIT,
+          flv::audio_data_sound_type_t::STEREO, aac.data(),
+          static_cast<uint32_t>(aac.size()));
+      samples += 1024;
+    }
+    bool is_key = i % gop == 0;
+    const std::vector<uint8_t> &frame = is_key ? key : inter;
+    builder.append_video_tag_with_avc_nalu_data(
+        ts, frame.data(), static_cast<uint32_t>(frame.size()), 0, is_key);
+    std::this_thread::sleep_until(start + std::chrono::microseconds(
+                                              (uint64_t)((i + 1) * 1000000 /
+                                                         options.fps)));
+  }
+}
+
+// Represents a group of clients served by one thread.
+class client_group {
+public:
+  client_group() : epoll_fd_(::epoll_create1(EPOLL_CLOEXEC)), bytes_(0) {}
+
+  ~client_group() {
+    for (int fd : fds_) {
+      ::close(fd);
+    }
+    ::close(epoll_fd_);
+  }
+
+  bool connect(uint16_t port) {
+    int fd = ::socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (fd < 0) {
+      return false;
+    }
+    sockaddr_in addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(port);
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    static const char request[] =
+        "GET /live.flv HTTP/1.1\r\nHost: 127.0.0.1\r\n\r\n";
+    if (::connect(fd, (sockaddr *)&addr, sizeof(addr)) < 0 ||
+        ::send(fd, request, sizeof(request) - 1, 0) < 0) {
+      ::close(fd);
+      return false;
+    }
+    int flags = ::fcntl(fd, F_GETFL);
+    ::fcntl(fd, F_SETFL, flags | O_NONBLOCK);
+    epoll_event ev;
+    ev.events = EPOLLIN;
+    ev.data.fd = fd;
+    ::epoll_ctl(epoll_fd_, EPOLL_CTL_ADD, fd, &ev);
+    fds_.push_back(fd);
+    return true;
+  }
+
+  void run(const std::atomic<bool> &stopping) {
+    std::vector<char> buf(256 * 1024);
+    epoll_event events[64];
+    while (!stopping.load(std::memory_order_relaxed)) {
+      int n = ::epoll_wait(epoll_fd_, events, 64, 100);
+      for (int i = 0; i < n; i++) {
+        ssize_t r;
+        while ((r = ::recv(events[i].data.fd, buf.data(), buf.size(), 0)) >
+               0) {
+          bytes_.fetch_add(static_cast<uint64_t>(r),
+                           std::memory_order_relaxed);
+        }
+      }
+    }
+  }
+
+  uint64_t bytes() const { return bytes_.load(std::memory_order_relaxed); }
+
+private:
+  int epoll_fd_;
+  std::vector<int> fds_;
+  std::atomic<uint64_t> bytes_;
+};
+
+static uint64_t received(const std::vector<std::unique_ptr<client_group>> &g) {
+  uint64_t bytes = 0;
+  for (auto &group : g) {
+    bytes += group->bytes();
+  }
+  return bytes;
+}
+} // namespace load
+
+int main(int argc, char *argv[]) {
+  load::options_t options;
+  options.connections = 1000;
+  options.loops = 0;
+  options.seconds = 5;
+  options.mbps = 4;
+  options.fps = 30;
+  options.client_threads =
+      std::max(std::thread::hardware_concurrency() / 2, 1u);
+  for (int i = 1; i + 1 < argc; i += 2) {
+    std::string arg = argv[i];
+    const char *value = argv[i + 1];
+    if (arg == "-c") {
+      options.connections = strtoul(value, nullptr, 10);
+    } else if (arg == "-j") {
+      options.loops = strtoul(value, nullptr, 10);
+    } else if (arg == "-t") {
+      options.seconds = strtod(value, nullptr);
+    } else if (arg == "-b") {
+      options.mbps = strtod(value, nullptr);
+    } else if (arg == "-f") {
+      options.fps = strtod(value, nullptr);
+    } else if (arg == "-w") {
+      options.client_threads = strtoul(value, nullptr, 10);
+    } else {
+      argc = 0;
+    }
+  }
+  if (argc % 2 == 0 || !options.connections || !options.client_threads ||
+      !(options.seconds > 0) || !(options.mbps > 0) || !(options.fps > 0)) {
+    std::cerr << "usage: flv-http-load [-c connections] [-j loops] "
+                 "[-t seconds] [-b mbps] [-f fps] [-w client_threads]"
+              << std::endl;
+    return 2;
+  }
+
+  // Two descriptors per connection live in this process
+  rlimit limit;
+  if (::getrlimit(RLIMIT_NOFILE, &limit) == 0) {
+    limit.rlim_cur = limit.rlim_max;
+    ::setrlimit(RLIMIT_NOFILE, &limit);
+  }
+
+  flv::flv_live_stream live;
+  flv::http_flv_server server(options.loops);
+  server.add_stream("/live.flv", live);
+  uint16_t port = server.start(0, "127.0.0.1");
+
+  std::atomic<bool> stopping(false);
+  std::thread producer(load::produce, std::ref(live), std::cref(options),
+                       std::cref(stopping));
+
+  std::vector<std::unique_ptr<load::client_group>> groups;
+  for (size_t i = 0; i < options.client_threads; i++) {
+    groups.emplace_back(new load::client_group());
+  }
+  size_t connected = 0;
+  for (size_t i = 0; i < options.connections; i++) {
+    connected += groups[i % groups.size()]->connect(port) ? 1 : 0;
+  }
+  std::vector<std::thread> clients;
+  for (auto &group : groups) {
+    clients.push_back(
+        std::thread(&load::client_group::run, group.get(),
+                    std::cref(stopping)));
+  }
+
+  // Let every client join, then measure a steady window
+  std::this_thread::sleep_for(std::chrono::seconds(1));
+  flv::http_server_stats before = server.stats();
+  uint64_t received_before = load::received(groups);
+  auto start = load::steady_clock::now();
+  std::this_thread::sleep_for(std::chrono::microseconds(
+      static_cast<uint64_t>(options.seconds * 1000000)));
+  double seconds =
+      std::chrono::duration<double>(load::steady_clock::now() - start).count();
+  flv::http_server_stats after = server.stats();
+  uint64_t received_bytes = load::received(groups) - received_before;
+
+  stopping = true;
+  producer.join();
+  for (auto &t : clients) {
+    t.join();
+  }
+  server.stop();
+
+  uint64_t sent = after.bytes_sent - before.bytes_sent;
+  double cores = (after.cpu_ns - before.cpu_ns) / 1e9 / seconds;
+  double egress_gbps = sent * 8 / seconds / 1e9;
+  printf("connections: %zu of %zu, loops: %zu, stream: %.1f Mbps\n", connected,
+         options.connections, server.loops(), options.mbps);
+  printf("egress: %.3f Gbps (expected %.3f), received: %.3f Gbps\n",
+         egress_gbps, connected * options.mbps / 1000,
+         received_bytes * 8 / seconds / 1e9);
+  printf("server cpu: %.3f cores, %.0f connections per core, %.2f Gbps per "
+         "core\n",
+         cores, cores > 0 ? connected / cores : 0.0,
+         cores > 0 ? egress_gbps / cores : 0.0);
+  printf("tags: %llu sent, %llu skipped by slow clients\n",
+         (unsigned long long)(after.tags_sent - before.tags_sent),
+         (unsigned long long)(after.skipped_tags - before.skipped_tags));
+  return connected == options.connections ? 0 : 1;
+}
@@ -0,0 +1,98 @@
+/*
+ * flv-mux: muxes H.264 (Annex-B) and AAC (ADTS) elementary stream pairs to
+ * FLV files, running the jobs of a manifest on a work-stealing thread pool.
+ *
+ * Usage: flv-mux [-j threads] [-r fps] [-k keyframes] manifest
+ *
+ * Every manifest line is one job: "<video.h264> <audio.aac> <output.flv>",
+ * with "-" for a missing input. Empty lines and lines starting with '#' are
+ * skipped.
+ *
+ * The pictures are timed by the frame rate in decode order, with no
+ * composition time offset, so a job with B-frames fails.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "flv_mux.hpp"
+
+int main(int argc, char *argv[]) {
+  mux::options_t options;
+  options.threads = std::max(std::thread::hardware_concurrency(), 1u);
+  options.fps = 25;
+  options.keyframes = 0;
+  const char *manifest = nullptr;
+  for (int i = 1; i < argc; i++) {
+    std::string arg = argv[i];
+    if (arg == "-j" && i + 1 < argc) {
+      options.threads = static_cast<size_t>(strtoul(argv[++i], nullptr, 10));
+    } else if (arg == "-r" && i + 1 < argc) {
+      options.fps = strtod(argv[++i], nullptr);
+    } else if (arg == "-k" && i + 1 < argc) {
+      options.keyframes =
+          static_cast<uint32_t>(strtoul(argv[++i], nullptr, 10));
+    } else if (!manifest && arg[0] != '-') {
+      manifest = argv[i];
+    } else {
+      manifest = nullptr;
+      break;
+    }
+  }
+  if (!manifest || !options.threads || !(options.fps > 0)) {
+    std::cerr << "usage: flv-mux [-j threads] [-r fps] [-k keyframes] manifest"
+              << std::endl;
+    return 2;
+  }
+
+  std::vector<mux::job_t> jobs;
+  if (!mux::read_manifest(manifest, jobs)) {
+    return 2;
+  }
+
+  std::vector<mux::result_t> results(jobs.size());
+  std::mutex report_lock;
+  auto start = mux::steady_clock::now();
+  mux::work_stealing_pool pool(options.threads);
+  pool.run(jobs.size(), [&](size_t i) {
+    mux::result_t &r = results[i];
+    r = mux::result_t();
+    auto job_start = mux::steady_clock::now();
+    try {
+      mux::mux_job(jobs[i], options, r);
+      r.ok = true;
+    } catch (const std::exception &e) {
+      r.error = e.what();
+    }
+    r.seconds = mux::seconds_since(job_start);
+
+    std::lock_guard<std::mutex> lock(report_lock);
+    if (r.ok) {
+      printf("%s: %llu frames, %llu AAC blocks skipped, %.1f MB in, "
+             "%.1f MB out, %.3f s, %.1f MB/s\n",
+             jobs[i].output.c_str(), (unsigned long long)r.frames,
+             (unsigned long long)r.skipped_blocks, r.input_bytes / 1048576.0,
+             r.output_bytes / 1048576.0, r.seconds,
+             mux::mb_per_second(r.input_bytes, r.seconds));
+    } else {
+      printf("%s: FAILED: %s\n", jobs[i].output.c_str(), r.error.c_str());
+    }
+    fflush(stdout);
+  });
+  double seconds = mux::seconds_since(start);
+
+  size_t failed = 0;
+  uint64_t input_bytes = 0;
+  uint64_t output_bytes = 0;
+  for (auto &r : results) {
+    failed += r.ok ? 0 : 1;
+    input_bytes += r.input_bytes;
+    output_bytes += r.output_bytes;
+  }
+  printf("total: %zu jobs, %zu failed, %zu threads, %.1f MB in, %.1f MB out, "
+         "%.3f s, %.1f MB/s\n",
+         jobs.size(), failed, options.threads, input_bytes / 1048576.0,
+         output_bytes / 1048576.0, seconds,
+         mux::mb_per_second(input_bytes, seconds));
+  return failed ? 1 : 0;
+}
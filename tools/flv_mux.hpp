@@ -0,0 +1,472 @@
+/*
+ * The jobs of flv-mux: muxing H.264 (Annex-B) and AAC (ADTS) elementary
+ * stream pairs to FLV files, and the work-stealing thread pool running them.
+ * See flv_mux.cpp for the command line.
+ */
+
+#pragma once
+#include <deque>
+#include <fstream>
+#include <iostream>
+#include <sstream>
+
+#include <flv_stream_builder.hpp>
+
+namespace mux {
+typedef std::chrono::steady_clock steady_clock;
+
+inline double seconds_since(steady_clock::time_point start) {
+  return std::chrono::duration<double>(steady_clock::now() - start).count();
+}
+
+// Represents a job of the manifest.
+struct job_t {
+  std::string video;
+  std::string audio;
+  std::string output;
+};
+
+// Represents the options of the tool.
+struct options_t {
+  size_t threads;
+  double fps;
+  uint32_t keyframes;
+};
+
+// Represents a read-only mapping of a whole input file, read sequentially.
+class input_file {
+public:
+  explicit input_file(const std::string &path) : data_(nullptr), length_(0) {
+    if (path == "-") {
+      return;
+    }
+    int fd = ::open(path.c_str(), O_RDONLY);
+    if (fd < 0) {
+      throw std::system_error(errno, std::generic_category(), path);
+    }
+    struct stat st;
+    if (::fstat(fd, &st) < 0) {
+      int error = errno;
+      ::close(fd);
+      throw std::system_error(error, std::generic_category(), path);
+    }
+    length_ = static_cast<size_t>(st.st_size);
+    if (length_) {
+      void *p = ::mmap(nullptr, length_, PROT_READ, MAP_PRIVATE, fd, 0);
+      if (p == MAP_FAILED) {
+        int error = errno;
+        ::close(fd);
+        throw std::system_error(error, std::generic_category(), path);
+      }
+      ::madvise(p, length_, MADV_SEQUENTIAL);
+      data_ = static_cast<const uint8_t *>(p);
+    }
+    ::close(fd);
+  }
+
+  ~input_file() {
+    if (data_) {
+      ::munmap(const_cast<uint8_t *>(data_), length_);
+    }
+  }
+
+  const uint8_t *data() const { return data_; }
+
+  const uint8_t *end() const { return data_ + length_; }
+
+  size_t length() const { return length_; }
+
+private:
+  DISALLOW_COPY_AND_ASSIGN(input_file);
+
+  const uint8_t *data_;
+  size_t length_;
+};
+
+// Represents the sink writing a file in large sequential chunks.
+class output_file : public flv::flv_sink {
+public:
+  static const size_t BUFFER_SIZE = 4 * 1024 * 1024;
+
+  explicit output_file(const std::string &path) : path_(path), written_(0) {
+    fd_ = ::open(path.c_str(), O_CREAT | O_TRUNC | O_WRONLY, 0644);
+    if (fd_ < 0) {
+      throw std::system_error(errno, std::generic_category(), path);
+    }
+    buffer_.reserve(BUFFER_SIZE);
+  }
+
+  ~output_file() {
+    if (fd_ >= 0) {
+      ::close(fd_);
+    }
+  }
+
+  virtual void write(const flv::io_slice *slices, size_t count) override {
+    for (size_t i = 0; i < count; i++) {
+      const uint8_t *p = slices[i].data;
+      size_t left = slices[i].length;
+      while (left) {
+        size_t n = std::min(left, BUFFER_SIZE - buffer_.size());
+        buffer_.insert(buffer_.end(), p, p + n);
+        p += n;
+        left -= n;
+        if (buffer_.size() == BUFFER_SIZE) {
+          flush();
+        }
+      }
+    }
+  }
+
+  virtual void flush() override {
+    const uint8_t *p = buffer_.data();
+    size_t left = buffer_.size();
+    while (left) {
+      ssize_t r = ::write(fd_, p, left);
+      if (r < 0) {
+        if (errno == EINTR) {
+          continue;
+        }
+        throw std::system_error(errno, std::generic_category(), path_);
+      }
+      p += r;
+      left -= static_cast<size_t>(r);
+    }
+    written_ += buffer_.size();
+    buffer_.clear();
+  }
+
+  virtual bool write_at(uint64_t offset, const uint8_t *data,
+                        size_t length) override {
+    flush();
+    return ::pwrite(fd_, data, length, static_cast<off_t>(offset)) ==
+           static_cast<ssize_t>(length);
+  }
+
+  void close() {
+    flush();
+    if (::close(fd_)) {
+      fd_ = -1;
+      throw std::system_error(errno, std::generic_category(), path_);
+    }
+    fd_ = -1;
+  }
+
+  uint64_t written() const { return written_; }
+
+private:
+  DISALLOW_COPY_AND_ASSIGN(output_file);
+
+  std::string path_;
+  int fd_;
+  std::vector<uint8_t> buffer_;
+  uint64_t written_;
+};
+
+// Reads the Exp-Golomb codes at the start of an RBSP, skipping the emulation
+// prevention bytes.
+class golomb_reader {
+public:
+  golomb_reader(const uint8_t *data, const uint8_t *end)
+      : data_(data), end_(end), zeros_(0), bit_(8), byte_(0) {}
+
+  // Reads an unsigned code, false if the data ends first.
+  bool read_ue(uint32_t &value) {
+    int leading = 0;
+    uint32_t bit = 0;
+    while (true) {
+      if (!read_bit(bit)) {
+        return false;
+      }
+      if (bit) {
+        break;
+      }
+      if (++leading > 31) {
+        return false;
+      }
+    }
+    value = 0;
+    for (int i = 0; i < leading; i++) {
+      if (!read_bit(bit)) {
+        return false;
+      }
+      value = value << 1 | bit;
+    }
+    value += (1u << leading) - 1;
+    return true;
+  }
+
+private:
+  bool read_bit(uint32_t &bit) {
+    if (bit_ == 8) {
+      if (data_ == end_) {
+        return false;
+      }
+      byte_ = *data_++;
+      if (zeros_ >= 2 && byte_ == 0x03) {
+        if (data_ == end_) {
+          return false;
+        }
+        byte_ = *data_++;
+      }
+      zeros_ = byte_ ? 0 : zeros_ + 1;
+      bit_ = 0;
+    }
+    bit = byte_ >> (7 - bit_++) & 0x01;
+    return true;
+  }
+
+  const uint8_t *data_;
+  const uint8_t *end_;
+  int zeros_;
+  int bit_;
+  uint8_t byte_;
+};
+
+// Splits an Annex-B byte stream into access units: a new access unit starts
+// at an AUD, SPS, PPS or SEI after a slice, or at a slice whose
+// first_mb_in_slice is 0. B slices are flagged, their pictures need a
+// composition time offset the scanner cannot tell.
+class access_unit_scanner {
+public:
+  access_unit_scanner(const uint8_t *data, const uint8_t *end)
+      : cursor_(data), end_(end), bidirectional_(false) {
+    has_next_ = data && flv::avc::next_nalu(cursor_, end_, next_);
+  }
+
+  bool next(const uint8_t *&begin, const uint8_t *&end) {
+    if (!has_next_) {
+      return false;
+    }
+    begin = next_.data - 3;
+    bidirectional_ = false;
+    bool has_slice = false;
+    while (has_next_) {
+      uint8_t type = next_.type();
+      bool slice = type == 1 || type == 5;
+      if (has_slice &&
+          ((slice && next_.length > 1 && (next_.data[1] & 0x80)) ||
+           type == 6 || type == 7 || type == 8 || type == 9)) {
+        break;
+      }
+      has_slice = has_slice || slice;
+      if (slice) {
+        // first_mb_in_slice, then slice_type: 1 and 6 are B
+        golomb_reader header(next_.data + 1, next_.data + next_.length);
+        uint32_t first_mb = 0;
+        uint32_t slice_type = 0;
+        if (header.read_ue(first_mb) && header.read_ue(slice_type) &&
+            slice_type % 5 == 1) {
+          bidirectional_ = true;
+        }
+      }
+      end = next_.data + next_.length;
+      has_next_ = flv::avc::next_nalu(cursor_, end_, next_);
+    }
+    return true;
+  }
+
+  // Whether the last access unit has a B slice.
+  bool bidirectional() const { return bidirectional_; }
+
+private:
+  const uint8_t *cursor_;
+  const uint8_t *end_;
+  flv::avc::nalu_view next_;
+  bool has_next_;
+  bool bidirectional_;
+};
+
+// Represents the result of a job.
+struct result_t {
+  bool ok;
+  std::string error;
+  uint64_t input_bytes;
+  uint64_t output_bytes;
+  uint64_t frames;
+  uint64_t skipped_blocks;
+  double seconds;
+};
+
+// Muxes one job, interleaving the video and audio frames by timestamp.
+inline void mux_job(const job_t &job, const options_t &options,
+                    result_t &result) {
+  input_file video(job.video);
+  input_file audio(job.audio);
+  output_file output(job.output);
+  result.input_bytes = video.length() + audio.length();
+
+  flv::flv_stream_builder builder(output);
+  if (options.keyframes) {
+    builder.enable_keyframe_index(options.keyframes);
+  }
+  auto meta = flv::amf::amf_array::create()
+                  ->with_item("duration", (double)0)
+                  ->with_item("filesize", (double)0)
+                  ->with_item("lastkeyframetimestamp", (double)0);
+  if (video.length()) {
+    meta->with_item("videocodecid", (double)7)
+        ->with_item("framerate", options.fps)
+        ->with_item("videodatarate", (double)0);
+  }
+
+  // The audio properties come from the first ADTS header
+  const uint8_t *audio_cursor = audio.data();
+  flv::aac::adts_frame first;
+  const uint8_t *probe = audio.data();
+  if (audio.length() && flv::aac::next_adts_frame(probe, audio.end(), first)) {
+    meta->with_item("audiocodecid", (double)10)
+        ->with_item("audiosamplerate",
+                    (double)flv::aac::sampling_frequency(first.sampling_index))
+        ->with_item("stereo", first.channel_config != 1)
+        ->with_item("audiodatarate", (double)0);
+  }
+  builder.init_stream_header(audio.length() != 0, video.length() != 0)
+      .append_meta_tag(meta);
+
+  access_unit_scanner units(video.data(), video.end());
+  const uint8_t *unit_begin = nullptr;
+  const uint8_t *unit_end = nullptr;
+  bool has_unit = units.next(unit_begin, unit_end);
+  uint64_t unit_index = 0;
+
+  const uint8_t *frame_begin = audio_cursor;
+  flv::aac::adts_frame frame;
+  bool has_frame = audio_cursor &&
+                   flv::aac::next_adts_frame(audio_cursor, audio.end(), frame);
+  // The samples before frame_begin; the multi-block frames skipped between
+  // frame_begin and the frame are timed again by the builder
+  uint64_t samples = 0;
+
+  while (has_unit || has_frame) {
+    uint32_t video_ts =
+        static_cast<uint32_t>(unit_index * 1000 / options.fps + 0.5);
+    uint32_t chunk_ts = 0;
+    uint32_t audio_ts = 0;
+    if (has_frame) {
+      uint32_t frequency = flv::aac::sampling_frequency(frame.sampling_index);
+      uint64_t skipped =
+          uint64_t(frame.skipped_blocks) * flv::aac::SAMPLES_PER_FRAME;
+      chunk_ts = static_cast<uint32_t>(samples * 1000 / frequency);
+      audio_ts = static_cast<uint32_t>((samples + skipped) * 1000 / frequency);
+    }
+    if (has_unit && (!has_frame || video_ts <= audio_ts)) {
+      if (units.bidirectional()) {
+        // Every picture gets its decode time, B-frames would be misplaced
+        throw std::runtime_error("B-frames are not supported in " +
+                                 job.video);
+      }
+      builder.append_video_tag_with_annexb_data(
+          video_ts, unit_begin, static_cast<uint32_t>(unit_end - unit_begin));
+      unit_index++;
+      has_unit = units.next(unit_begin, unit_end);
+    } else {
+      builder.append_audio_tag_with_adts_data(
+          chunk_ts, frame_begin,
+          static_cast<uint32_t>(audio_cursor - frame_begin));
+      samples += uint64_t(frame.skipped_blocks + 1) *
+                 flv::aac::SAMPLES_PER_FRAME;
+      result.skipped_blocks += frame.skipped_blocks;
+      frame_begin = audio_cursor;
+      has_frame = flv::aac::next_adts_frame(audio_cursor, audio.end(), frame);
+    }
+    result.frames++;
+  }
+  if (audio_cursor) {
+    // The multi-block frames after the last frame
+    result.skipped_blocks += frame.skipped_blocks;
+  }
+
+  if (!builder.finalize()) {
+    throw std::runtime_error("cannot finalize " + job.output);
+  }
+  output.close();
+  result.output_bytes = output.written();
+}
+
+// Represents the thread pool running a fixed set of jobs. Every worker
+// takes jobs from the back of its own queue and, once it is empty, steals
+// from the front of the others.
+class work_stealing_pool {
+public:
+  explicit work_stealing_pool(size_t threads)
+      : queues_(std::max<size_t>(threads, 1)) {}
+
+  void run(size_t jobs, const std::function<void(size_t)> &fn) {
+    for (size_t i = 0; i < jobs; i++) {
+      queues_[i % queues_.size()].jobs.push_back(i);
+    }
+    std::vector<std::thread> threads;
+    for (size_t w = 0; w < queues_.size(); w++) {
+      threads.push_back(std::thread([this, w, &fn]() {
+        size_t job = 0;
+        while (take(w, job)) {
+          fn(job);
+        }
+      }));
+    }
+    for (auto &t : threads) {
+      t.join();
+    }
+  }
+
+private:
+  struct queue_t {
+    std::mutex lock;
+    std::deque<size_t> jobs;
+  };
+
+  bool take(size_t worker, size_t &job) {
+    {
+      queue_t &own = queues_[worker];
+      std::lock_guard<std::mutex> lock(own.lock);
+      if (!own.jobs.empty()) {
+        job = own.jobs.back();
+        own.jobs.pop_back();
+        return true;
+      }
+    }
+    for (size_t i = 1; i < queues_.size(); i++) {
+      queue_t &victim = queues_[(worker + i) % queues_.size()];
+      std::lock_guard<std::mutex> lock(victim.lock);
+      if (!victim.jobs.empty()) {
+        job = victim.jobs.front();
+        victim.jobs.pop_front();
+        return true;
+      }
+    }
+    return false;
+  }
+
+  std::vector<queue_t> queues_;
+};
+
+inline bool read_manifest(const char *path, std::vector<job_t> &jobs) {
+  std::ifstream ifs(path);
+  if (!ifs) {
+    std::cerr << "flv-mux: cannot open " << path << std::endl;
+    return false;
+  }
+  std::string line;
+  size_t number = 0;
+  while (std::getline(ifs, line)) {
+    number++;
+    std::istringstream fields(line);
+    job_t job;
+    if (!(fields >> job.video) || job.video[0] == '#') {
+      continue;
+    }
+    if (!(fields >> job.audio >> job.output)) {
+      std::cerr << "flv-mux: " << path << ":" << number
+                << ": expected <video> <audio> <output>" << std::endl;
+      return false;
+    }
+    jobs.push_back(job);
+  }
+  return true;
+}
+
+inline double mb_per_second(uint64_t bytes, double seconds) {
+  return seconds > 0 ? bytes / seconds / (1024 * 1024) : 0;
+}
+} // namespace mux